@@ -0,0 +1,37 @@
+#!/bin/sh
+# Run each benchmark with the given aspic executables (default: ./aspic)
+# and print the elapsed time in milliseconds.
+#
+# Compare dispatch modes:
+#     make clean && make COMPUTED_GOTO=0 && cp aspic aspic-switch
+#     make clean && make COMPUTED_GOTO=1 && cp aspic aspic-goto
+#     ./bench.sh ./aspic-switch ./aspic-goto
+
+if [ $# -eq 0 ]; then
+    set -- ./aspic
+fi
+
+printf "%-24s" "benchmark"
+for exe in "$@"; do
+    printf "%16s" "$(basename $exe)"
+done
+printf "\n"
+
+result=0
+
+for i in $(find ./bench -name "*.ac" -type f | sort); do
+    printf "%-24s" "$(basename $i)"
+    for exe in "$@"; do
+        start=$(date +%s%N)
+        if $exe $i > /dev/null; then
+            stop=$(date +%s%N)
+            printf "%14dms" $(((stop - start) / 1000000))
+        else
+            printf "%16s" "FAIL"
+            result=1
+        fi
+    done
+    printf "\n"
+done
+
+exit $result
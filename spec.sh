@@ -9,7 +9,7 @@ result=0
 for i in $(find ./tests -name "*.ac" -type f | sort); do
     # Hide valgrind output
     # Trigger an error if valgrind detected an error (regardless of the test result)
-    if valgrind --leak-check=full --show-leak-kinds=all --error-exitcode=1 --exit-on-first-error=yes ./aspic $i > /dev/null 2>&1; then
+    if valgrind --leak-check=full --show-leak-kinds=all --error-exitcode=1 --exit-on-first-error=yes ./aspic "$@" $i > /dev/null 2>&1; then
         echo ${C_GREEN} PASS ${C_NONE} $i
     else
         echo ${C_RED} FAIL ${C_NONE} $i
@@ -17,4 +17,32 @@ for i in $(find ./tests -name "*.ac" -type f | sort); do
     fi
 done
 
+# Round trips through the bytecode cache and an image: the bytecode written
+# must load and pass the verifier. A cache file which does not is replaced by
+# the source, with a VerifyError on stderr.
+image=/tmp/aspic_spec_$$.aci
+for i in $(find ./tests -name "*.ac" -type f | sort); do
+    cache="${i%.ac}.acb"
+    if ./aspic "$@" --compile $cache $i > /dev/null 2>&1 \
+        && [ -z "$(./aspic $i 2>&1 > /dev/null)" ] \
+        && ./aspic "$@" --image $image $i > /dev/null 2>&1 \
+        && ./aspic $image > /dev/null 2>&1; then
+        echo ${C_GREEN} PASS ${C_NONE} $i "(cache, image)"
+    else
+        echo ${C_RED} FAIL ${C_NONE} $i "(cache, image)"
+        result=1
+    fi
+    rm -f $cache
+done
+rm -f $image
+
+# REPL: the value of the last expression statement of each line is printed
+repl_output=$(printf '1 + 2;\n42;\n"ab" + "cd";\nlet x = 5;\nx;\n' | ./aspic "$@" 2> /dev/null | grep -v '^>>\|^ \|^Aspic')
+if [ "$repl_output" = "$(printf '3\n42\n"abcd"\n5')" ]; then
+    echo ${C_GREEN} PASS ${C_NONE} repl
+else
+    echo ${C_RED} FAIL ${C_NONE} repl
+    result=1
+fi
+
 exit $result
@@ -0,0 +1,461 @@
+#include "aot.h"
+#include "parser.h"
+#include "utils.h"
+
+#include <stdlib.h>
+
+typedef struct {
+    ObjectFunction** functions;
+    int count;
+    int capacity;
+} FunctionList;
+
+typedef struct {
+    const ObjectFunction* function;
+    // Stack depth before each instruction, indexed by bytecode offset
+    int* depths;
+    // Instructions targeted by a jump
+    bool* labels;
+    // Offsets of the reached instructions left to visit
+    int* pending;
+    int pending_count;
+    bool uses_constants;
+} FunctionInfo;
+
+/**
+ * List a function, then the functions defined in its constants (depth-first).
+ * Generated C functions are indexed in this order.
+ */
+static void collect_functions(FunctionList* list, ObjectFunction* function)
+{
+    if (list->capacity < list->count + 1) {
+        list->capacity = list->capacity < 8 ? 8 : list->capacity * 2;
+        list->functions = realloc_array(list->functions, sizeof(ObjectFunction*), list->capacity);
+    }
+    list->functions[list->count++] = function;
+
+    const ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; ++i) {
+        Value constant = constants->values[i];
+        if (is_object(constant) && as_object(constant)->type == OBJECT_FUNCTION) {
+            collect_functions(list, (ObjectFunction*)as_object(constant));
+        }
+    }
+}
+
+// Analysis
+//------------------------------------------------------------------------------
+
+static int jump_offset(const uint8_t* ip)
+{
+    return ip[1] << 8 | ip[2];
+}
+
+// Record the stack depth on entry of an instruction, and visit it if not
+// reached yet
+static bool reach(FunctionInfo* info, int offset, int depth)
+{
+    if (offset < 0 || offset >= info->function->chunk.count) {
+        return false;
+    }
+    if (info->depths[offset] == -1) {
+        info->depths[offset] = depth;
+        info->pending[info->pending_count++] = offset;
+    }
+    return info->depths[offset] == depth;
+}
+
+static bool record_jump(FunctionInfo* info, int target, int depth)
+{
+    if (!reach(info, target, depth)) {
+        return false;
+    }
+    info->labels[target] = true;
+    return true;
+}
+
+/**
+ * Compute the stack depth before each instruction, and the jump targets,
+ * following the control flow: the blocks of -O2 are not always reached in
+ * bytecode order
+ * @return false if the stack depth is not consistent
+ */
+static bool analyze(FunctionInfo* info)
+{
+    const Chunk* chunk = &info->function->chunk;
+    // Stack window of the frame: callee, then arguments
+    bool success = reach(info, 0, info->function->arity + 1);
+    while (success && info->pending_count > 0) {
+        int offset = info->pending[--info->pending_count];
+        const uint8_t* ip = chunk->code + offset;
+        int depth = info->depths[offset];
+        int next = offset + op_length(ip[0]);
+        bool falls_through = true;
+
+        switch (ip[0]) {
+        case OP_RETURN:
+            falls_through = false;
+            break;
+        case OP_JUMP:
+            success = record_jump(info, next + jump_offset(ip), depth);
+            falls_through = false;
+            break;
+        case OP_JUMP_BACK:
+            success = record_jump(info, next - jump_offset(ip), depth);
+            falls_through = false;
+            break;
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE:
+            success = record_jump(info, next + jump_offset(ip), depth);
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+            success = record_jump(info, next + jump_offset(ip), depth - 2);
+            break;
+        case OP_CONSTANT:
+        case OP_CONSTANT_16:
+        case OP_GET_LOCAL_CONSTANT:
+        case OP_ADD_LOCAL_CONST:
+            info->uses_constants = true;
+            break;
+        }
+
+        depth += op_stack_effect(ip);
+        if (depth < 0) {
+            return false;
+        }
+        if (success && falls_through) {
+            success = reach(info, next, depth);
+        }
+    }
+    return success;
+}
+
+// Code generation
+//------------------------------------------------------------------------------
+
+/**
+ * Emit the C statements of an instruction
+ * @param depth: stack depth before the instruction
+ * @return false if the instruction is not supported
+ */
+static bool emit_instruction(FILE* out, const uint8_t* ip, int depth, int next)
+{
+    // Operands of binary operators: slots[a] and slots[a + 1]
+    int a = depth - 2;
+    switch (ip[0]) {
+    case OP_RETURN:
+        fprintf(out, "    AOT_RETURN(%d);\n", depth);
+        return true;
+    case OP_POP:
+        return true;
+
+    // Jumps
+    case OP_JUMP:
+        fprintf(out, "    goto L%d;\n", next + jump_offset(ip));
+        return true;
+    case OP_JUMP_BACK:
+        fprintf(out, "    goto L%d;\n", next - jump_offset(ip));
+        return true;
+    case OP_JUMP_IF_TRUE:
+        fprintf(out, "    if (value_truthy(slots[%d])) goto L%d;\n", depth - 1, next + jump_offset(ip));
+        return true;
+    case OP_JUMP_IF_FALSE:
+        fprintf(out, "    if (!value_truthy(slots[%d])) goto L%d;\n", depth - 1, next + jump_offset(ip));
+        return true;
+
+    // Global variables
+    case OP_DECL_GLOBAL:
+    case OP_DECL_GLOBAL_CONST:
+        fprintf(out, "    AOT_CHECK_RESULT(vm_decl_global(%d, slots[%d], %s), %d, %d);\n",
+            ip[1], depth - 1, ip[0] == OP_DECL_GLOBAL_CONST ? "true" : "false", depth, next);
+        return true;
+    case OP_DECL_GLOBAL_16:
+    case OP_DECL_GLOBAL_CONST_16:
+        fprintf(out, "    AOT_CHECK_RESULT(vm_decl_global(%d, slots[%d], %s), %d, %d);\n",
+            ip[1] << 8 | ip[2], depth - 1, ip[0] == OP_DECL_GLOBAL_CONST_16 ? "true" : "false", depth, next);
+        return true;
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_16:
+        fprintf(out, "    slots[%d] = vm_get_global(%d);\n", depth, ip[0] == OP_GET_GLOBAL ? ip[1] : ip[1] << 8 | ip[2]);
+        fprintf(out, "    AOT_CHECK_ERROR(%d, %d);\n", depth + 1, next);
+        return true;
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+    case OP_SET_GLOBAL_16:
+        fprintf(out, "    AOT_CHECK_RESULT(vm_set_global(%d, slots[%d]), %d, %d);\n",
+            ip[0] == OP_SET_GLOBAL_16 ? ip[1] << 8 | ip[2] : ip[1], depth - 1, depth, next);
+        return true;
+
+    // Local variables
+    case OP_GET_LOCAL:
+        fprintf(out, "    slots[%d] = slots[%d];\n", depth, ip[1]);
+        return true;
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+        fprintf(out, "    slots[%d] = slots[%d];\n", ip[1], depth - 1);
+        return true;
+
+    // Literals
+    case OP_CONSTANT:
+        fprintf(out, "    slots[%d] = constants[%d];\n", depth, ip[1]);
+        return true;
+    case OP_CONSTANT_16:
+        fprintf(out, "    slots[%d] = constants[%d];\n", depth, ip[1] << 8 | ip[2]);
+        return true;
+    case OP_ZERO:
+        fprintf(out, "    slots[%d] = make_number(0);\n", depth);
+        return true;
+    case OP_ONE:
+        fprintf(out, "    slots[%d] = make_number(1);\n", depth);
+        return true;
+    case OP_TRUE:
+        fprintf(out, "    slots[%d] = make_bool(true);\n", depth);
+        return true;
+    case OP_FALSE:
+        fprintf(out, "    slots[%d] = make_bool(false);\n", depth);
+        return true;
+    case OP_NULL:
+        fprintf(out, "    slots[%d] = make_null();\n", depth);
+        return true;
+
+    // Unary operators
+    case OP_NOT:
+        fprintf(out, "    slots[%d] = op_not(slots[%d]);\n", depth - 1, depth - 1);
+        return true;
+    case OP_POSITIVE:
+    case OP_NEGATIVE:
+        fprintf(out, "    slots[%d] = %s(slots[%d]);\n",
+            depth - 1, ip[0] == OP_POSITIVE ? "op_positive" : "op_negative", depth - 1);
+        fprintf(out, "    AOT_CHECK_ERROR(%d, %d);\n", depth, next);
+        return true;
+
+    // Binary operators
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+        fprintf(out, "    AOT_BINARY_OP(%d, +, op_add, %d);\n", a, next);
+        return true;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+        fprintf(out, "    AOT_BINARY_OP(%d, -, op_subtract, %d);\n", a, next);
+        return true;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+        fprintf(out, "    AOT_BINARY_OP(%d, *, op_multiply, %d);\n", a, next);
+        return true;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+        fprintf(out, "    AOT_BINARY_CALL(%d, op_divide, %d);\n", a, next);
+        return true;
+    case OP_MODULO:
+        fprintf(out, "    AOT_BINARY_CALL(%d, op_modulo, %d);\n", a, next);
+        return true;
+
+    // Comparators
+    case OP_EQUAL:
+        fprintf(out, "    slots[%d] = make_bool(value_equal(slots[%d], slots[%d]));\n", a, a + 1, a);
+        return true;
+    case OP_NOT_EQUAL:
+        fprintf(out, "    slots[%d] = make_bool(!value_equal(slots[%d], slots[%d]));\n", a, a + 1, a);
+        return true;
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+        fprintf(out, "    AOT_COMPARE(%d, >, op_greater(slots[%d], slots[%d]), %d);\n", a, a + 1, a, next);
+        return true;
+    case OP_GREATER_EQUAL:
+    case OP_GREATER_EQUAL_NUM:
+        fprintf(out, "    AOT_COMPARE(%d, >=, op_greater_equal(slots[%d], slots[%d]), %d);\n", a, a + 1, a, next);
+        return true;
+    case OP_LESS:
+    case OP_LESS_NUM:
+        fprintf(out, "    AOT_COMPARE(%d, <, op_greater(slots[%d], slots[%d]), %d);\n", a, a, a + 1, next);
+        return true;
+    case OP_LESS_EQUAL:
+    case OP_LESS_EQUAL_NUM:
+        fprintf(out, "    AOT_COMPARE(%d, <=, op_greater_equal(slots[%d], slots[%d]), %d);\n", a, a, a + 1, next);
+        return true;
+
+    // Subscript operator
+    case OP_SUBSCRIPT_GET:
+        fprintf(out, "    slots[%d] = op_subscript_get(slots[%d], slots[%d]);\n", a, a, a + 1);
+        fprintf(out, "    AOT_CHECK_ERROR(%d, %d);\n", a + 1, next);
+        fprintf(out, "    AOT_GC_SAFEPOINT(%d);\n", a + 1);
+        return true;
+    case OP_SUBSCRIPT_SET:
+        fprintf(out, "    AOT_SUBSCRIPT_SET(%d, %d);\n", depth - 3, next);
+        return true;
+
+    // Function call
+    case OP_CALL:
+        fprintf(out, "    AOT_CALL(%d, %d, %d);\n", depth, ip[1], next);
+        return true;
+    case OP_TAIL_CALL:
+        fprintf(out, "    AOT_TAIL_CALL(%d, %d, %d);\n", depth, ip[1], next);
+        fprintf(out, "    AOT_CALL(%d, %d, %d);\n", depth, ip[1], next);
+        return true;
+
+    // Array expression
+    case OP_ARRAY:
+        fprintf(out, "    slots[%d] = make_array(slots + %d, %d);\n", depth - ip[1], depth - ip[1], ip[1]);
+        fprintf(out, "    AOT_GC_SAFEPOINT(%d);\n", depth - ip[1] + 1);
+        return true;
+
+    // Superinstructions
+    case OP_GET_LOCAL_2:
+        fprintf(out, "    slots[%d] = slots[%d];\n", depth, ip[1]);
+        fprintf(out, "    slots[%d] = slots[%d];\n", depth + 1, ip[2]);
+        return true;
+    case OP_GET_LOCAL_CONSTANT:
+        fprintf(out, "    slots[%d] = slots[%d];\n", depth, ip[1]);
+        fprintf(out, "    slots[%d] = constants[%d];\n", depth + 1, ip[2]);
+        return true;
+    case OP_ADD_LOCALS:
+        fprintf(out, "    slots[%d] = slots[%d];\n", depth, ip[1]);
+        fprintf(out, "    slots[%d] = slots[%d];\n", depth + 1, ip[2]);
+        fprintf(out, "    AOT_BINARY_OP(%d, +, op_add, %d);\n", depth, next);
+        return true;
+    case OP_ADD_IMM:
+        fprintf(out, "    slots[%d] = make_number(%d);\n", depth, (int8_t)ip[1]);
+        fprintf(out, "    AOT_BINARY_OP(%d, +, op_add, %d);\n", depth - 1, next);
+        return true;
+    case OP_INC_LOCAL:
+        fprintf(out, "    AOT_ADD_TO_LOCAL(%d, make_number(1), %d, %d);\n", ip[1], depth, next);
+        return true;
+    case OP_ADD_LOCAL_CONST:
+        fprintf(out, "    AOT_ADD_TO_LOCAL(%d, constants[%d], %d, %d);\n", ip[1], ip[2], depth, next);
+        return true;
+
+    // Compare and branch
+    case OP_JUMP_IF_NOT_LESS:
+        fprintf(out, "    AOT_COMPARE_JUMP(%d, <, op_greater(slots[%d], slots[%d]), L%d, %d);\n",
+            a, a, a + 1, next + jump_offset(ip), next);
+        return true;
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+        fprintf(out, "    AOT_COMPARE_JUMP(%d, <=, op_greater_equal(slots[%d], slots[%d]), L%d, %d);\n",
+            a, a, a + 1, next + jump_offset(ip), next);
+        return true;
+    case OP_JUMP_IF_NOT_GREATER:
+        fprintf(out, "    AOT_COMPARE_JUMP(%d, >, op_greater(slots[%d], slots[%d]), L%d, %d);\n",
+            a, a + 1, a, next + jump_offset(ip), next);
+        return true;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        fprintf(out, "    AOT_COMPARE_JUMP(%d, >=, op_greater_equal(slots[%d], slots[%d]), L%d, %d);\n",
+            a, a + 1, a, next + jump_offset(ip), next);
+        return true;
+    case OP_JUMP_IF_NOT_EQUAL:
+        fprintf(out, "    if (!value_equal(slots[%d], slots[%d])) goto L%d;\n", a, a + 1, next + jump_offset(ip));
+        return true;
+    case OP_JUMP_IF_EQUAL:
+        fprintf(out, "    if (value_equal(slots[%d], slots[%d])) goto L%d;\n", a, a + 1, next + jump_offset(ip));
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static bool emit_function(FILE* out, const ObjectFunction* function, int index)
+{
+    const Chunk* chunk = &function->chunk;
+    FunctionInfo info = { 0 };
+    info.function = function;
+    info.depths = malloc(sizeof(int) * chunk->count);
+    info.labels = calloc(chunk->count, sizeof(bool));
+    info.pending = malloc(sizeof(int) * chunk->count);
+    for (int i = 0; i < chunk->count; ++i) {
+        info.depths[i] = -1;
+    }
+
+    bool success = analyze(&info);
+    if (success) {
+        fprintf(out, "// %s()\n", function->name == NULL ? "__main__" : function->name->chars);
+        fprintf(out, "static VmResult function_%d(CallFrame* frame)\n{\n", index);
+        fprintf(out, "    Value* slots = frame->slots;\n");
+        if (info.uses_constants) {
+            fprintf(out, "    const Value* constants = frame->function->chunk.constants.values;\n");
+        }
+        fprintf(out, "\n");
+
+        for (int offset = 0; success && offset < chunk->count; offset += op_length(chunk->code[offset])) {
+            if (info.labels[offset]) {
+                fprintf(out, "L%d:\n", offset);
+            }
+            // Not reached by the control flow: no code
+            if (info.depths[offset] == -1) {
+                continue;
+            }
+            int next = offset + op_length(chunk->code[offset]);
+            success = emit_instruction(out, chunk->code + offset, info.depths[offset], next);
+        }
+        fprintf(out, "}\n\n");
+    }
+
+    free(info.depths);
+    free(info.labels);
+    free(info.pending);
+    return success;
+}
+
+bool aot_emit(FILE* out, ObjectFunction* script, const char* source)
+{
+    FunctionList list = { 0 };
+    collect_functions(&list, script);
+
+    fprintf(out, "// Generated by aspic --emit-c, link with the interpreter objects\n");
+#ifdef ASPIC_NAN_BOXING
+    fprintf(out, "#define ASPIC_NAN_BOXING\n");
+#endif
+    fprintf(out, "#include \"aot.h\"\n\n");
+
+    // The source is compiled again at startup, to build the constants
+    fprintf(out, "static const unsigned char source[] = {");
+    for (size_t i = 0; source[i] != '\0'; ++i) {
+        fprintf(out, i % 16 == 0 ? "\n    %d," : " %d,", (unsigned char)source[i]);
+    }
+    fprintf(out, "\n    0,\n};\n\n");
+
+    bool success = true;
+    for (int i = 0; success && i < list.count; ++i) {
+        success = emit_function(out, list.functions[i], i);
+    }
+
+    fprintf(out, "static const NativeFunction functions[] = {\n");
+    for (int i = 0; i < list.count; ++i) {
+        fprintf(out, "    function_%d,\n", i);
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "int main()\n{\n");
+    fprintf(out, "    return aot_main((const char*)source, functions, %d, %d);\n}\n", list.count, parser_get_optimization());
+
+    free(list.functions);
+    return success;
+}
+
+int aot_main(const char* source, const NativeFunction* functions, int count, int optimization)
+{
+    vm_init();
+    // Same bytecode as the one translated
+    parser_set_optimization(optimization);
+    VmResult result = VM_COMPILE_ERROR;
+    ObjectFunction* script = vm_compile(source);
+    if (script != NULL) {
+        FunctionList list = { 0 };
+        collect_functions(&list, script);
+        if (list.count == count) {
+            for (int i = 0; i < count; ++i) {
+                vm_set_native(list.functions[i], functions[i]);
+            }
+            result = vm_execute(script);
+        } else {
+            fprintf(stderr, "aspic: generated code does not match the program\n");
+        }
+        free(list.functions);
+    }
+    vm_free();
+    return result == VM_OK ? 0 : 1;
+}
@@ -0,0 +1,191 @@
+#ifndef ASPIC_AOT_H
+#define ASPIC_AOT_H
+
+#include "gc.h"
+#include "op_code.h"
+#include "shared.h"
+#include "vm.h"
+
+#include <stdio.h>
+
+/**
+ * Ahead-of-time translation to C (aspic --emit-c)
+ *
+ * Each function of a program is translated into a C function, linked with the
+ * interpreter objects into a standalone executable. The stack depth of each
+ * instruction is known at compile time, so the operands of the stack machine
+ * become fixed slots of the frame (slots[depth]) instead of a moving stack
+ * pointer: they stay visible to the garbage collector, which scans the VM
+ * stack.
+ *
+ * The generated program embeds its source code: at startup, the source is
+ * compiled again to build the functions and their constants, then the C
+ * functions are attached to them with vm_set_native().
+ */
+
+/**
+ * Translate a compiled program into a C translation unit
+ * @return false if a function cannot be translated
+ */
+bool aot_emit(FILE* out, ObjectFunction* script, const char* source);
+
+/**
+ * Entry point of generated programs: compile the source at the optimization
+ * level of aot_emit, attach the C functions (in the order of aot_emit), then
+ * run the main function
+ * @return exit status
+ */
+int aot_main(const char* source, const NativeFunction* functions, int count, int optimization);
+
+// Runtime support for generated code. Macros use the variables frame and
+// slots of the C function. <depth> is a stack depth, relative to slots, and
+// <next> the bytecode offset of the next instruction.
+
+extern VM vm;
+
+// Write back the stack top and the instruction pointer, before calling the
+// runtime
+#define AOT_SYNC(depth, next) \
+    (vm.stack_top = slots + (depth), frame->ip = frame->function->chunk.code + (next))
+
+// Report the error in slots[depth - 1]
+#define AOT_THROW(depth, next)   \
+    do {                         \
+        AOT_SYNC(depth, next);   \
+        vm_runtime_error();      \
+        return VM_RUNTIME_ERROR; \
+    } while (0)
+
+#define AOT_CHECK_ERROR(depth, next)                        \
+    do {                                                    \
+        if (ASPIC_UNLIKELY(is_error(slots[(depth) - 1]))) { \
+            AOT_THROW(depth, next);                         \
+        }                                                   \
+    } while (0)
+
+// Push <result> and report it, if this is an error
+#define AOT_CHECK_RESULT(result, depth, next)    \
+    do {                                         \
+        Value result_ = (result);                \
+        if (ASPIC_UNLIKELY(is_error(result_))) { \
+            slots[depth] = result_;              \
+            AOT_THROW((depth) + 1, next);        \
+        }                                        \
+    } while (0)
+
+#define AOT_GC_SAFEPOINT(depth)             \
+    do {                                    \
+        if (gc_should_collect()) {          \
+            vm.stack_top = slots + (depth); \
+            gc_collect();                   \
+        }                                   \
+    } while (0)
+
+// slots[a] = slots[a] <operator> slots[a + 1]: inline on numbers, otherwise
+// with the generic function
+#define AOT_BINARY_OP(a, operator, function, next)                                          \
+    do {                                                                                    \
+        if (is_number(slots[a]) && is_number(slots[(a) + 1])) {                             \
+            slots[a] = make_number(as_number(slots[a]) operator as_number(slots[(a) + 1])); \
+        } else {                                                                            \
+            slots[a] = function(slots[(a) + 1], slots[a]);                                  \
+            AOT_CHECK_ERROR((a) + 1, next);                                                 \
+            AOT_GC_SAFEPOINT((a) + 1);                                                      \
+        }                                                                                   \
+    } while (0)
+
+// slots[a] = function(slots[a + 1], slots[a])
+#define AOT_BINARY_CALL(a, function, next)             \
+    do {                                               \
+        slots[a] = function(slots[(a) + 1], slots[a]); \
+        AOT_CHECK_ERROR((a) + 1, next);                \
+        AOT_GC_SAFEPOINT((a) + 1);                     \
+    } while (0)
+
+// slots[a] = slots[a] <operator> slots[a + 1]: inline on numbers, otherwise
+// <generic_result>
+#define AOT_COMPARE(a, operator, generic_result, next)                                    \
+    do {                                                                                  \
+        if (is_number(slots[a]) && is_number(slots[(a) + 1])) {                           \
+            slots[a] = make_bool(as_number(slots[a]) operator as_number(slots[(a) + 1])); \
+        } else {                                                                          \
+            slots[a] = generic_result;                                                    \
+            AOT_CHECK_ERROR((a) + 1, next);                                               \
+        }                                                                                 \
+    } while (0)
+
+// Jump to <label> if slots[a] <operator> slots[a + 1] is false
+#define AOT_COMPARE_JUMP(a, operator, generic_result, label, next)            \
+    do {                                                                      \
+        bool result_;                                                         \
+        if (is_number(slots[a]) && is_number(slots[(a) + 1])) {               \
+            result_ = as_number(slots[a]) operator as_number(slots[(a) + 1]); \
+        } else {                                                              \
+            Value value_ = generic_result;                                    \
+            if (ASPIC_UNLIKELY(is_error(value_))) {                           \
+                slots[a] = value_;                                            \
+                AOT_THROW((a) + 1, next);                                     \
+            }                                                                 \
+            result_ = as_bool(value_);                                        \
+        }                                                                     \
+        if (!result_) {                                                       \
+            goto label;                                                       \
+        }                                                                     \
+    } while (0)
+
+// slots[slot] = slots[slot] + operand
+#define AOT_ADD_TO_LOCAL(slot, operand, depth, next)                                 \
+    do {                                                                             \
+        Value operand_ = (operand);                                                  \
+        if (is_number(slots[slot]) && is_number(operand_)) {                         \
+            slots[slot] = make_number(as_number(slots[slot]) + as_number(operand_)); \
+        } else {                                                                     \
+            slots[depth] = op_add(operand_, slots[slot]);                            \
+            AOT_CHECK_ERROR((depth) + 1, next);                                      \
+            slots[slot] = slots[depth];                                              \
+            AOT_GC_SAFEPOINT(depth);                                                 \
+        }                                                                            \
+    } while (0)
+
+// slots[a][slots[a + 1]] = slots[a + 2]
+#define AOT_SUBSCRIPT_SET(a, next)                                                \
+    do {                                                                          \
+        Value collection_ = slots[a];                                             \
+        slots[a] = op_subscript_set(collection_, slots[(a) + 1], slots[(a) + 2]); \
+        AOT_CHECK_ERROR((a) + 1, next);                                           \
+        gc_write_barrier(as_object(collection_), slots[(a) + 2]);                 \
+    } while (0)
+
+// Call the callee below the <argc> arguments on top of the stack, then reload
+// the frame and its slots, which may have moved
+#define AOT_CALL(depth, argc, next)             \
+    do {                                        \
+        AOT_SYNC(depth, next);                  \
+        if (vm_call(argc) != VM_OK) {           \
+            return VM_RUNTIME_ERROR;            \
+        }                                       \
+        frame = &vm.frames[vm.frame_count - 1]; \
+        slots = frame->slots;                   \
+    } while (0)
+
+// Replace the frame with a call to the callee below the <argc> arguments, if
+// this is a function: the caller runs the frame (see vm_run_native).
+// Otherwise, fall back to AOT_CALL.
+#define AOT_TAIL_CALL(depth, argc, next)  \
+    do {                                  \
+        AOT_SYNC(depth, next);            \
+        if (vm_tail_call(argc) != NULL) { \
+            return VM_TAIL_CALL;          \
+        }                                 \
+    } while (0)
+
+// Replace the frame with the result
+#define AOT_RETURN(depth)              \
+    do {                               \
+        slots[0] = slots[(depth) - 1]; \
+        vm.stack_top = slots + 1;      \
+        vm.frame_count--;              \
+        return VM_OK;                  \
+    } while (0)
+
+#endif
@@ -0,0 +1,443 @@
+#include "cache.h"
+#include "utils.h"
+#include "verifier.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+extern VM vm;
+
+static const char CACHE_MAGIC[4] = { 'A', 'C', 'B', '\0' };
+
+// Max nesting of functions in a cache file
+#define CACHE_MAX_DEPTH 256
+
+typedef enum {
+    CONSTANT_NULL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+} ConstantTag;
+
+// Identity of the source file a cache file was compiled from
+typedef struct {
+    int64_t mtime;
+    uint64_t size;
+    uint32_t hash;
+} SourceStamp;
+
+static bool source_stamp(SourceStamp* stamp, const char* source_path, const char* source)
+{
+    struct stat info;
+    if (stat(source_path, &info) != 0) {
+        return false;
+    }
+    stamp->mtime = info.st_mtime;
+    stamp->size = strlen(source);
+
+    // FNV-1a hash function
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < stamp->size; ++i) {
+        hash ^= (uint8_t)source[i];
+        hash *= 16777619;
+    }
+    stamp->hash = hash;
+    return true;
+}
+
+// Writer
+//------------------------------------------------------------------------------
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+    // Cleared when a constant cannot be stored
+    bool ok;
+} Writer;
+
+static void write_bytes(Writer* writer, const void* data, size_t size)
+{
+    if (writer->capacity < writer->count + size) {
+        size_t capacity = writer->capacity < 256 ? 256 : writer->capacity;
+        while (capacity < writer->count + size) {
+            capacity *= 2;
+        }
+        writer->bytes = realloc_array(writer->bytes, sizeof(uint8_t), capacity);
+        writer->capacity = capacity;
+    }
+    memcpy(writer->bytes + writer->count, data, size);
+    writer->count += size;
+}
+
+static void write_u8(Writer* writer, uint8_t value)
+{
+    write_bytes(writer, &value, 1);
+}
+
+static void write_u32(Writer* writer, uint32_t value)
+{
+    uint8_t bytes[4];
+    for (int i = 0; i < 4; ++i) {
+        bytes[i] = value >> (i * 8);
+    }
+    write_bytes(writer, bytes, 4);
+}
+
+static void write_u64(Writer* writer, uint64_t value)
+{
+    write_u32(writer, value & 0xffffffff);
+    write_u32(writer, value >> 32);
+}
+
+static void write_string(Writer* writer, const ObjectString* string)
+{
+    write_u32(writer, string->length);
+    write_bytes(writer, string->chars, string->length);
+}
+
+static void write_function(Writer* writer, const ObjectFunction* function)
+{
+    if (function->lazy_source != NULL) {
+        // Not compiled yet
+        writer->ok = false;
+    }
+    write_u8(writer, function->name != NULL);
+    if (function->name != NULL) {
+        write_string(writer, function->name);
+    }
+    write_u32(writer, function->arity);
+    write_u32(writer, function->max_stack);
+
+    const Chunk* chunk = &function->chunk;
+    write_u32(writer, chunk->count);
+    write_bytes(writer, chunk->code, chunk->count);
+    write_u32(writer, chunk->lines.count);
+    for (int i = 0; i < chunk->lines.count; ++i) {
+        write_u32(writer, chunk->lines.values[i]);
+    }
+
+    write_u32(writer, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; ++i) {
+        Value value = chunk->constants.values[i];
+        if (is_null(value)) {
+            write_u8(writer, CONSTANT_NULL);
+        } else if (is_bool(value)) {
+            write_u8(writer, as_bool(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+        } else if (is_number(value)) {
+            double number = as_number(value);
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            write_u8(writer, CONSTANT_NUMBER);
+            write_u64(writer, bits);
+        } else if (is_string(value)) {
+            write_u8(writer, CONSTANT_STRING);
+            write_string(writer, (const ObjectString*)as_object(value));
+        } else if (is_object(value) && as_object(value)->type == OBJECT_FUNCTION) {
+            write_u8(writer, CONSTANT_FUNCTION);
+            write_function(writer, (const ObjectFunction*)as_object(value));
+        } else {
+            // Not produced by the parser
+            writer->ok = false;
+        }
+    }
+}
+
+// Reader
+//------------------------------------------------------------------------------
+
+typedef struct {
+    const uint8_t* bytes;
+    size_t count;
+    size_t position;
+    // Cleared when the content is truncated or invalid
+    bool ok;
+    // Slots of the global variables, indexed by the slots in the file
+    int* globals;
+    int global_count;
+} Reader;
+
+// Get the next <size> bytes, or NULL if truncated
+static const uint8_t* read_bytes(Reader* reader, size_t size)
+{
+    if (!reader->ok || reader->count - reader->position < size) {
+        reader->ok = false;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->bytes + reader->position;
+    reader->position += size;
+    return bytes;
+}
+
+static uint8_t read_u8(Reader* reader)
+{
+    const uint8_t* bytes = read_bytes(reader, 1);
+    return bytes == NULL ? 0 : bytes[0];
+}
+
+static uint32_t read_u32(Reader* reader)
+{
+    const uint8_t* bytes = read_bytes(reader, 4);
+    if (bytes == NULL) {
+        return 0;
+    }
+    return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static uint64_t read_u64(Reader* reader)
+{
+    uint64_t low = read_u32(reader);
+    return low | (uint64_t)read_u32(reader) << 32;
+}
+
+// Read a number of items, each stored on at least <item_size> bytes
+static uint32_t read_count(Reader* reader, size_t item_size)
+{
+    uint32_t count = read_u32(reader);
+    if (count > (reader->count - reader->position) / item_size) {
+        reader->ok = false;
+        return 0;
+    }
+    return count;
+}
+
+static const ObjectString* read_string(Reader* reader)
+{
+    uint32_t length = read_count(reader, 1);
+    const uint8_t* chars = read_bytes(reader, length);
+    return chars == NULL ? NULL : string_new((const char*)chars, length);
+}
+
+// Rewrite the global operands with the slots resolved when loading
+static bool relocate_globals(const Reader* reader, Chunk* chunk)
+{
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t* ip = chunk->code + offset;
+        // OP_JUMP_IF_EQUAL is the last OpCode
+        if (ip[0] > OP_JUMP_IF_EQUAL || offset + op_length(ip[0]) > chunk->count) {
+            return false;
+        }
+        switch (ip[0]) {
+        case OP_DECL_GLOBAL:
+        case OP_DECL_GLOBAL_CONST:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP: {
+            if (ip[1] >= reader->global_count || reader->globals[ip[1]] > UINT8_MAX) {
+                return false;
+            }
+            ip[1] = reader->globals[ip[1]];
+            break;
+        }
+        case OP_DECL_GLOBAL_16:
+        case OP_DECL_GLOBAL_CONST_16:
+        case OP_GET_GLOBAL_16:
+        case OP_SET_GLOBAL_16: {
+            int slot = ip[1] << 8 | ip[2];
+            if (slot >= reader->global_count || reader->globals[slot] > UINT16_MAX) {
+                return false;
+            }
+            slot = reader->globals[slot];
+            ip[1] = (slot >> 8) & 0xff;
+            ip[2] = slot & 0xff;
+            break;
+        }
+        }
+        offset += op_length(ip[0]);
+    }
+    return true;
+}
+
+static ObjectFunction* read_function(Reader* reader, int depth)
+{
+    if (depth > CACHE_MAX_DEPTH) {
+        reader->ok = false;
+        return NULL;
+    }
+    // Not reachable from the GC roots yet, but collections only happen while
+    // the VM is running
+    ObjectFunction* function = function_new();
+    if (read_u8(reader)) {
+        function->name = read_string(reader);
+    }
+    uint32_t arity = read_u32(reader);
+    uint32_t max_stack = read_u32(reader);
+    if (arity > UINT8_MAX || max_stack > VM_STACK_MAX) {
+        reader->ok = false;
+        return NULL;
+    }
+    function->arity = arity;
+    function->max_stack = max_stack;
+
+    Chunk* chunk = &function->chunk;
+    uint32_t count = read_count(reader, 1);
+    const uint8_t* code = read_bytes(reader, count);
+    if (code != NULL && count > 0) {
+        chunk->code = realloc_array(NULL, sizeof(uint8_t), count);
+        memcpy(chunk->code, code, count);
+        chunk->count = chunk->capacity = count;
+    }
+    uint32_t line_count = read_count(reader, 4);
+    if (line_count % 2 != 0) {
+        reader->ok = false;
+    } else if (line_count > 0) {
+        chunk->lines.values = realloc_array(NULL, sizeof(int), line_count);
+        for (uint32_t i = 0; i < line_count; ++i) {
+            chunk->lines.values[i] = read_u32(reader);
+        }
+        chunk->lines.count = chunk->lines.capacity = line_count;
+    }
+    // Each byte of code has a line number
+    int64_t line_total = 0;
+    for (int i = 0; i < chunk->lines.count; i += 2) {
+        line_total += chunk->lines.values[i] > 0 ? chunk->lines.values[i] : -1;
+    }
+    if (line_total != chunk->count) {
+        reader->ok = false;
+    }
+
+    uint32_t constant_count = read_count(reader, 1);
+    for (uint32_t i = 0; reader->ok && i < constant_count; ++i) {
+        Value value = make_null();
+        switch (read_u8(reader)) {
+        case CONSTANT_NULL:
+            break;
+        case CONSTANT_FALSE:
+            value = make_bool(false);
+            break;
+        case CONSTANT_TRUE:
+            value = make_bool(true);
+            break;
+        case CONSTANT_NUMBER: {
+            uint64_t bits = read_u64(reader);
+            double number;
+            memcpy(&number, &bits, sizeof(number));
+            value = make_number(number);
+            break;
+        }
+        case CONSTANT_STRING: {
+            const ObjectString* string = read_string(reader);
+            if (string != NULL) {
+                value = make_object((Object*)string);
+            }
+            break;
+        }
+        case CONSTANT_FUNCTION: {
+            ObjectFunction* nested = read_function(reader, depth + 1);
+            if (nested != NULL) {
+                value = make_object((Object*)nested);
+            }
+            break;
+        }
+        default:
+            reader->ok = false;
+        }
+        value_array_push(&chunk->constants, value);
+    }
+
+    if (reader->ok && !relocate_globals(reader, chunk)) {
+        reader->ok = false;
+    }
+    return reader->ok ? function : NULL;
+}
+
+// Cache files
+//------------------------------------------------------------------------------
+
+char* cache_path(const char* source_path)
+{
+    size_t length = strlen(source_path);
+    if (length > 3 && strcmp(source_path + length - 3, ".ac") == 0) {
+        length -= 3;
+    }
+    char* path = alloc_string(length + 4);
+    memcpy(path, source_path, length);
+    memcpy(path + length, ".acb", 4);
+    return path;
+}
+
+bool cache_write(const char* path, const ObjectFunction* function, const char* source_path, const char* source)
+{
+    SourceStamp stamp;
+    if (!source_stamp(&stamp, source_path, source)) {
+        return false;
+    }
+
+    Writer writer = { NULL, 0, 0, true };
+    write_bytes(&writer, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    write_u32(&writer, CACHE_VERSION);
+    write_u32(&writer, OP_JUMP_IF_EQUAL + 1);
+    write_u64(&writer, stamp.mtime);
+    write_u64(&writer, stamp.size);
+    write_u32(&writer, stamp.hash);
+
+    write_u32(&writer, vm.global_count);
+    for (int i = 0; i < vm.global_count; ++i) {
+        write_string(&writer, vm_global_name(i));
+    }
+    write_function(&writer, function);
+
+    bool success = false;
+    FILE* file = writer.ok ? fopen(path, "wb") : NULL;
+    if (file != NULL) {
+        success = fwrite(writer.bytes, sizeof(uint8_t), writer.count, file) == writer.count;
+        success = fclose(file) == 0 && success;
+    }
+    free(writer.bytes);
+    return success;
+}
+
+ObjectFunction* cache_load(const char* path, const char* source_path, const char* source)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0L, SEEK_END);
+    long file_size = ftell(file);
+    rewind(file);
+    uint8_t* bytes = file_size > 0 ? malloc(file_size) : NULL;
+    size_t read_size = bytes != NULL ? fread(bytes, sizeof(uint8_t), file_size, file) : 0;
+    fclose(file);
+
+    Reader reader = { bytes, read_size, 0, true, NULL, 0 };
+    SourceStamp stamp;
+    const uint8_t* magic = read_bytes(&reader, sizeof(CACHE_MAGIC));
+    if (magic == NULL || memcmp(magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+        || read_u32(&reader) != CACHE_VERSION
+        || read_u32(&reader) != OP_JUMP_IF_EQUAL + 1
+        || !source_stamp(&stamp, source_path, source)
+        || read_u64(&reader) != (uint64_t)stamp.mtime
+        || read_u64(&reader) != stamp.size
+        || read_u32(&reader) != stamp.hash) {
+        free(bytes);
+        return NULL;
+    }
+
+    // Resolve the global variables by name: the slots may differ from the
+    // compilation
+    reader.global_count = read_count(&reader, 4);
+    reader.globals = malloc(sizeof(int) * (reader.global_count + 1));
+    for (int i = 0; reader.ok && i < reader.global_count; ++i) {
+        const ObjectString* name = read_string(&reader);
+        reader.globals[i] = name == NULL ? 0 : vm_resolve_global(name);
+    }
+
+    ObjectFunction* function = read_function(&reader, 0);
+    if (function != NULL && (reader.position != reader.count || !verifier_check(function))) {
+        function = NULL;
+    }
+    free(reader.globals);
+    free(bytes);
+
+    if (function != NULL) {
+        vm.source = source;
+    }
+    return function;
+}
@@ -0,0 +1,47 @@
+#ifndef ASPIC_CACHE_H
+#define ASPIC_CACHE_H
+
+#include "object.h"
+
+/**
+ * Bytecode cache files (.acb)
+ *
+ * A cache file stores the functions compiled from a source file, to skip the
+ * parser on the next runs:
+ * - header: magic, format version, number of opcodes, and the identity of the
+ *   source (modification time, size and hash)
+ * - names of the global variables: slots are resolved again by name when
+ *   loading, and the global operands of the instructions rewritten
+ * - the main function, then each nested function found in the constants:
+ *   arity, max stack depth, name, code, line numbers (run-length encoded, as
+ *   in Chunk.lines), and constants (numbers, booleans, null, strings and
+ *   functions)
+ *
+ * Integers are stored in little-endian. A cache file whose format or source
+ * does not match is ignored, and the loaded bytecode goes through the
+ * verifier (see verifier.h) before running.
+ */
+
+// Increment when the format or the instruction set changes
+#define CACHE_VERSION 1
+
+/**
+ * Get the cache file used for a source file: .ac extension replaced with .acb
+ * @return new string buffer
+ */
+char* cache_path(const char* source_path);
+
+/**
+ * Write the functions compiled from a source file to a cache file
+ * @return true if success
+ */
+bool cache_write(const char* path, const ObjectFunction* function, const char* source_path, const char* source);
+
+/**
+ * Load the functions of a cache file, and set up the VM to run them
+ * @return main function, or NULL if the cache file is missing, invalid, or was
+ * compiled from another version of the source
+ */
+ObjectFunction* cache_load(const char* path, const char* source_path, const char* source);
+
+#endif
@@ -1,6 +1,7 @@
 #include "chunk.h"
 #include "utils.h"
 
+#include <assert.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -82,6 +83,24 @@ void chunk_write(Chunk* chunk, uint8_t byte, int lineno)
     }
 }
 
+void chunk_truncate(Chunk* chunk, int count)
+{
+    assert(count >= 0 && count <= chunk->count);
+    int removed = chunk->count - count;
+    chunk->count = count;
+
+    // Shrink the line numbers, starting from the last pair (count, lineno)
+    while (removed > 0) {
+        int* line_count = &chunk->lines.values[chunk->lines.count - 2];
+        if (*line_count > removed) {
+            *line_count -= removed;
+            break;
+        }
+        removed -= *line_count;
+        chunk->lines.count -= 2;
+    }
+}
+
 bool chunk_write_constant(Chunk* chunk, unsigned int index, int lineno)
 {
     if (index <= UINT8_MAX) {
@@ -124,3 +143,64 @@ int chunk_get_line(const Chunk* chunk, size_t offset)
     }
     return 0;
 }
+
+int chunk_max_stack(const Chunk* chunk, int entry_depth)
+{
+    // Stack depth before each instruction (-1: not reached yet), and offsets
+    // of the reached instructions left to visit
+    int* depths = malloc(sizeof(int) * (chunk->count + 1));
+    int* pending = malloc(sizeof(int) * (chunk->count + 1));
+    for (int i = 0; i <= chunk->count; ++i) {
+        depths[i] = -1;
+    }
+    int pending_count = 0;
+    int max_stack = entry_depth;
+    if (chunk->count > 0) {
+        depths[0] = entry_depth;
+        pending[pending_count++] = 0;
+    }
+
+    while (pending_count > 0) {
+        int offset = pending[--pending_count];
+        const uint8_t* ip = chunk->code + offset;
+        int next = offset + op_length(ip[0]);
+        int depth = depths[offset] + op_stack_effect(ip);
+        if (depth > max_stack) {
+            max_stack = depth;
+        }
+
+        // Successors: the next instruction and the jump target
+        int successors[2] = { next, -1 };
+        switch (ip[0]) {
+        case OP_RETURN:
+            successors[0] = -1;
+            break;
+        case OP_JUMP:
+            successors[0] = next + (ip[1] << 8 | ip[2]);
+            break;
+        case OP_JUMP_BACK:
+            successors[0] = next - (ip[1] << 8 | ip[2]);
+            break;
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+            successors[1] = next + (ip[1] << 8 | ip[2]);
+            break;
+        }
+        for (int i = 0; i < 2; ++i) {
+            int successor = successors[i];
+            if (successor >= 0 && successor < chunk->count && depths[successor] == -1) {
+                depths[successor] = depth;
+                pending[pending_count++] = successor;
+            }
+        }
+    }
+    free(depths);
+    free(pending);
+    return max_stack;
+}
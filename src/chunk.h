@@ -41,6 +41,11 @@ void chunk_free(Chunk* chunk);
  */
 void chunk_write(Chunk* chunk, uint8_t byte, int lineno);
 
+/**
+ * Remove the bytes at the end of the chunk, from offset <count>
+ */
+void chunk_truncate(Chunk* chunk, int count);
+
 /**
  * Write the OpCode to load a constant, followed by the index value of the constant.
  * If index fits on 1 byte, write OP_CONSTANT.
@@ -62,4 +67,11 @@ unsigned int chunk_register_constant(Chunk*, Value value);
  */
 int chunk_get_line(const Chunk* chunk, size_t offset);
 
+/**
+ * Compute the max number of values on the stack while running the chunk,
+ * following every path through the bytecode
+ * @param entry_depth: number of values on entry (callee and arguments)
+ */
+int chunk_max_stack(const Chunk* chunk, int entry_depth);
+
 #endif
@@ -1,4 +1,5 @@
 #include "debug.h"
+#include "vm.h"
 
 #include <stdio.h>
 
@@ -11,6 +12,11 @@ void chunk_dump(const Chunk* chunk, const char* name)
         printf("\n");
     }
 
+    chunk_dump_code(chunk, name);
+}
+
+void chunk_dump_code(const Chunk* chunk, const char* name)
+{
     printf("== %s::bytecode ==\n", name);
     for (int offset = 0; offset < chunk->count;) {
         offset = instruction_dump(chunk, offset);
@@ -30,6 +36,32 @@ static int instruction_byte(const char* name, const Chunk* chunk, int offset)
     return offset + 2;
 }
 
+static int instruction_immediate(const char* name, const Chunk* chunk, int offset)
+{
+    int8_t immediate = chunk->code[offset + 1];
+    printf("%-16s %4d\n", name, immediate);
+    return offset + 2;
+}
+
+static int instruction_byte_2(const char* name, const Chunk* chunk, int offset)
+{
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+    printf("%-16s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
+
+static int instruction_local_constant(const char* name, const Chunk* chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t constant_idx = chunk->code[offset + 2];
+    printf("%-16s %4d %4d -> ", name, slot, constant_idx);
+    value_repr(chunk->constants.values[constant_idx]);
+    printf("\n");
+
+    return offset + 3; // 1 byte op code + 2 bytes operand (slot, constant index)
+}
+
 static int instruction_with_constant(const char* name, const Chunk* chunk, int offset)
 {
     uint8_t constant_idx = chunk->code[offset + 1];
@@ -50,6 +82,22 @@ static int instruction_with_constant_16(const char* name, const Chunk* chunk, in
     return offset + 3; // 1 byte op code + 2 bytes operand (constant index)
 }
 
+static int instruction_global(const char* name, const Chunk* chunk, int offset)
+{
+    uint8_t slot = chunk->code[offset + 1];
+    printf("%-16s %4d -> %s\n", name, slot, vm_global_name(slot)->chars);
+
+    return offset + 2; // 1 byte op code + 1 byte operand (global slot)
+}
+
+static int instruction_global_16(const char* name, const Chunk* chunk, int offset)
+{
+    uint16_t slot = chunk->code[offset + 1] << 8 | chunk->code[offset + 2];
+    printf("%-16s %4d -> %s\n", name, slot, vm_global_name(slot)->chars);
+
+    return offset + 3; // 1 byte op code + 2 bytes operand (global slot)
+}
+
 static int instruction_jump(const char* name, int sign, const Chunk* chunk, int offset)
 {
     uint16_t jump = chunk->code[offset + 1] << 8 | chunk->code[offset + 2];
@@ -91,12 +139,12 @@ int instruction_dump(const Chunk* chunk, int offset)
     case OP_DECL_GLOBAL_CONST:
     case OP_GET_GLOBAL:
     case OP_SET_GLOBAL:
-        return instruction_with_constant(desc, chunk, offset);
+        return instruction_global(desc, chunk, offset);
     case OP_DECL_GLOBAL_16:
     case OP_DECL_GLOBAL_CONST_16:
     case OP_GET_GLOBAL_16:
     case OP_SET_GLOBAL_16:
-        return instruction_with_constant_16(desc, chunk, offset);
+        return instruction_global_16(desc, chunk, offset);
 
     // Local variables
     case OP_GET_LOCAL:
@@ -144,10 +192,47 @@ int instruction_dump(const Chunk* chunk, int offset)
 
     // Call operator ()
     case OP_CALL:
+    case OP_TAIL_CALL:
     // Array expression []
     case OP_ARRAY:
         return instruction_byte(desc, chunk, offset);
 
+    // Quickened instructions
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_GREATER_NUM:
+    case OP_GREATER_EQUAL_NUM:
+    case OP_LESS_NUM:
+    case OP_LESS_EQUAL_NUM:
+        return instruction_noarg(desc, offset);
+
+    // Superinstructions
+    case OP_GET_LOCAL_2:
+    case OP_ADD_LOCALS:
+        return instruction_byte_2(desc, chunk, offset);
+    case OP_GET_LOCAL_CONSTANT:
+        return instruction_local_constant(desc, chunk, offset);
+    case OP_SET_LOCAL_POP:
+        return instruction_byte(desc, chunk, offset);
+    case OP_SET_GLOBAL_POP:
+        return instruction_global(desc, chunk, offset);
+    case OP_ADD_IMM:
+        return instruction_immediate(desc, chunk, offset);
+    case OP_INC_LOCAL:
+        return instruction_byte(desc, chunk, offset);
+    case OP_ADD_LOCAL_CONST:
+        return instruction_local_constant(desc, chunk, offset);
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        return instruction_jump(desc, 1, chunk, offset);
+
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
@@ -5,6 +5,9 @@
 
 void chunk_dump(const Chunk* chunk, const char* name);
 
+// Only print the instructions, without the constants
+void chunk_dump_code(const Chunk* chunk, const char* name);
+
 int instruction_dump(const Chunk* chunk, int offset);
 
 #endif
@@ -0,0 +1,627 @@
+// clock_gettime is not part of ISO C
+#define _POSIX_C_SOURCE 199309L
+
+#include "gc.h"
+#include "utils.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define GC_INITIAL_THRESHOLD (1024 * 1024)
+#define GC_GROW_FACTOR 2
+
+#define GC_NURSERY_SIZE (256 * 1024)
+// Keep some room at the end of the nursery for objects allocated between
+// two safepoints
+#define GC_NURSERY_SLACK (16 * 1024)
+// Objects larger than this are allocated directly in the old generation
+#define GC_LARGE_OBJECT_SIZE (4 * 1024)
+
+// Objects in the nursery are aligned on 8 bytes
+#define GC_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+#define GC_DEFAULT_PAUSE_BUDGET_US 1000
+// Bytes allocated in the old generation between two slices of a major collection
+#define GC_SLICE_BYTES (256 * 1024)
+// Bytes allocated in the nursery between two slices of a major collection
+#define GC_SLICE_NURSERY_BYTES (32 * 1024)
+// Number of objects marked or swept between two checks of the pause budget
+#define GC_SLICE_STEP 32
+
+extern VM vm;
+
+void gc_init(Gc* gc)
+{
+    gc->state = GC_IDLE;
+    gc->pause_budget_us = GC_DEFAULT_PAUSE_BUDGET_US;
+    gc->bytes_allocated = 0;
+    gc->next_gc = GC_INITIAL_THRESHOLD;
+
+    gc->nursery.start = malloc(GC_NURSERY_SIZE);
+    if (gc->nursery.start == NULL) {
+        fprintf(stderr, "Cannot allocate nursery of size %d", GC_NURSERY_SIZE);
+        exit(1);
+    }
+    gc->nursery.top = gc->nursery.start;
+    gc->nursery.limit = gc->nursery.start + GC_NURSERY_SIZE - GC_NURSERY_SLACK;
+    gc->nursery.end = gc->nursery.start + GC_NURSERY_SIZE;
+    gc->nursery_enabled = false;
+
+    gc->remembered_count = gc->remembered_capacity = 0;
+    gc->remembered = NULL;
+    gc->globals_dirty = false;
+
+    gc->gray_count = gc->gray_capacity = 0;
+    gc->gray_stack = NULL;
+
+    gc->sweep_head = NULL;
+    gc->survivors_head = gc->survivors_tail = NULL;
+
+    memset(&gc->stats, 0, sizeof(GcStats));
+}
+
+// Young objects are not in the vm.objects_head list: find them by walking
+// the nursery
+#define NURSERY_FOREACH(object)                         \
+    for (Object* object = (Object*)vm.gc.nursery.start; \
+         (uint8_t*)object < vm.gc.nursery.top;          \
+         object = (Object*)((uint8_t*)object + GC_ALIGN(object_size(object))))
+
+static bool sweep(const struct timespec* start);
+
+void gc_free(Gc* gc)
+{
+    // Give back the objects of an unfinished sweep to vm.objects_head
+    if (gc->state == GC_SWEEPING) {
+        sweep(NULL);
+    }
+
+    // Free buffers owned by young objects
+    NURSERY_FOREACH(object)
+    {
+        if (object->next == NULL) {
+            object_finalize(object);
+        }
+    }
+    free(gc->nursery.start);
+    free(gc->remembered);
+    free(gc->gray_stack);
+}
+
+static void push_gray(Object* object)
+{
+    Gc* gc = &vm.gc;
+    if (gc->gray_capacity < gc->gray_count + 1) {
+        gc->gray_capacity = gc->gray_capacity < 64 ? 64 : gc->gray_capacity * 2;
+        gc->gray_stack = realloc_array(gc->gray_stack, sizeof(Object*), gc->gray_capacity);
+    }
+    gc->gray_stack[gc->gray_count++] = object;
+}
+
+static Object* allocate_old(size_t size)
+{
+    Object* object = malloc(size);
+    if (object == NULL) {
+        fprintf(stderr, "Cannot allocate object of size %zu", size);
+        exit(1);
+    }
+    object->young = false;
+    object->remembered = false;
+    object->marked = false;
+
+    // Register for GC (linked list vm.objects_head)
+    vm_register_object(object);
+    vm.gc.bytes_allocated += size;
+    return object;
+}
+
+Object* gc_allocate(ObjectType type, size_t size)
+{
+    Nursery* nursery = &vm.gc.nursery;
+    size_t aligned_size = GC_ALIGN(size);
+    if (vm.gc.nursery_enabled
+        && size <= GC_LARGE_OBJECT_SIZE
+        && nursery->top + aligned_size <= nursery->end) {
+        // Bump allocation
+        Object* object = (Object*)nursery->top;
+        nursery->top += aligned_size;
+        object->type = type;
+        object->young = true;
+        object->remembered = false;
+        object->marked = false;
+        // For young objects, next is the forwarding pointer, set on promotion
+        object->next = NULL;
+        return object;
+    }
+    // When the nursery is full, allocate in the old generation until the
+    // next safepoint
+    Object* object = allocate_old(size);
+    object->type = type;
+    if (vm.gc.state == GC_MARKING) {
+        // Allocate gray: references will be stored before the next slice
+        object->marked = true;
+        if (type != OBJECT_STRING) {
+            push_gray(object);
+        }
+    }
+    return object;
+}
+
+void gc_cancel_allocation(Object* object)
+{
+    if (object->young) {
+        // Last allocated object is at the top of the nursery
+        vm.gc.nursery.top = (uint8_t*)object;
+    } else {
+        // Last allocated object is the head of the objects list
+        vm.objects_head = object->next;
+        vm.gc.bytes_allocated -= object_size(object);
+        free(object);
+    }
+}
+
+bool gc_should_collect()
+{
+#ifdef ASPIC_GC_STRESS
+    // Collect at every safepoint following an allocation, and run a slice at
+    // every safepoint during a major collection
+    return vm.gc.nursery.top != vm.gc.nursery.start
+        || vm.gc.bytes_allocated != vm.gc.next_gc
+        || vm.gc.state != GC_IDLE;
+#else
+    return vm.gc.nursery.top > vm.gc.nursery.limit
+        || vm.gc.bytes_allocated > vm.gc.next_gc;
+#endif
+}
+
+void gc_remember(Object* owner)
+{
+    if (owner->remembered) {
+        return;
+    }
+    owner->remembered = true;
+
+    Gc* gc = &vm.gc;
+    if (gc->remembered_capacity < gc->remembered_count + 1) {
+        gc->remembered_capacity = gc->remembered_capacity < 64 ? 64 : gc->remembered_capacity * 2;
+        gc->remembered = realloc_array(gc->remembered, sizeof(Object*), gc->remembered_capacity);
+    }
+    gc->remembered[gc->remembered_count++] = owner;
+}
+
+void gc_write_barrier_globals(Value value)
+{
+    if (is_object(value) && as_object(value)->young) {
+        vm.gc.globals_dirty = true;
+    }
+}
+
+void gc_set_pause_budget(long microseconds)
+{
+    vm.gc.pause_budget_us = microseconds;
+}
+
+// Minor collection
+//------------------------------------------------------------------------------
+
+/**
+ * Copy a young object to the old generation, if not already done
+ * @return the promoted object
+ */
+static Object* promote_object(Object* object)
+{
+    if (object->next != NULL) {
+        // Already promoted: follow the forwarding pointer
+        return object->next;
+    }
+
+    size_t size = object_size(object);
+    Object* promoted = allocate_old(size);
+    Object* next = promoted->next;
+    memcpy(promoted, object, size);
+    promoted->young = false;
+    promoted->next = next;
+    if (promoted->type == OBJECT_STRING && size > sizeof(ObjectString)) {
+        // Chars are stored right after the object
+        ObjectString* string = (ObjectString*)promoted;
+        string->chars = (char*)(string + 1);
+    }
+
+    object->next = promoted;
+    // Promoted objects are gray during marking: they may reference old
+    // objects not marked yet
+    promoted->marked = vm.gc.state == GC_MARKING;
+    // Promoted object may reference other young objects
+    if (promoted->type != OBJECT_STRING) {
+        push_gray(promoted);
+    }
+    return promoted;
+}
+
+static void promote_value(Value* value)
+{
+    if (is_object(*value) && as_object(*value)->young) {
+        *value = make_object(promote_object(as_object(*value)));
+    }
+}
+
+static void promote_value_array(ValueArray* array)
+{
+    for (int i = 0; i < array->count; ++i) {
+        promote_value(&array->values[i]);
+    }
+}
+
+/**
+ * Promote all young objects referenced by a promoted object
+ */
+static void promote_references(Object* object)
+{
+    switch (object->type) {
+    case OBJECT_ARRAY:
+        promote_value_array(&((ObjectArray*)object)->array);
+        break;
+    case OBJECT_FUNCTION: {
+        ObjectFunction* function = (ObjectFunction*)object;
+        if (function->name != NULL && function->name->object.young) {
+            function->name = (const ObjectString*)promote_object((Object*)function->name);
+        }
+        promote_value_array(&function->chunk.constants);
+        break;
+    }
+    case OBJECT_STRING:
+        break;
+    }
+}
+
+static void collect_young()
+{
+    Gc* gc = &vm.gc;
+    // Promoted objects are pushed on top of the gray stack
+    int gray_base = gc->gray_count;
+    size_t bytes_before = gc->bytes_allocated;
+
+    // Roots: VM stack
+    for (Value* slot = vm.stack; slot < vm.stack_top; ++slot) {
+        promote_value(slot);
+    }
+
+    // Roots: global variables (the names are never young: the nursery is
+    // emptied before the parser runs)
+    if (gc->globals_dirty) {
+        for (int i = 0; i < vm.global_count; ++i) {
+            promote_value(&vm.globals[i].value);
+        }
+        gc->globals_dirty = false;
+    }
+
+    // Roots: remembered set (old arrays)
+    for (int i = 0; i < gc->remembered_count; ++i) {
+        Object* owner = gc->remembered[i];
+        owner->remembered = false;
+        promote_references(owner);
+    }
+    gc->remembered_count = 0;
+
+    // Transitively promote objects referenced by promoted objects. The gray
+    // stack may grow while iterating.
+    for (int i = gray_base; i < gc->gray_count; ++i) {
+        promote_references(gc->gray_stack[i]);
+    }
+    if (gc->state != GC_MARKING) {
+        // Promoted objects only needed to be gray for the minor collection
+        gc->gray_count = gray_base;
+    }
+
+    // Free buffers owned by dead young objects, then reset the nursery
+    NURSERY_FOREACH(object)
+    {
+        if (object->type == OBJECT_STRING) {
+            // Update references to promoted strings in the string pool, and
+            // forget the dead ones
+            stringset_forward(&vm.string_pool, (ObjectString*)object, (ObjectString*)object->next);
+        } else if (object->next == NULL) {
+            object_finalize(object);
+        }
+    }
+    gc->nursery.top = gc->nursery.start;
+    gc->stats.minor_count++;
+
+#ifdef ASPIC_DEBUG
+    printf("== gc::minor == promoted %zu bytes\n", gc->bytes_allocated - bytes_before);
+#else
+    (void)bytes_before;
+#endif
+}
+
+// Major collection
+//------------------------------------------------------------------------------
+
+static long elapsed_us(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000L + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/**
+ * Check if the current slice must give control back to the program
+ * @param start: beginning of the pause, NULL for no limit
+ */
+static bool slice_expired(const struct timespec* start)
+{
+    if (start == NULL) {
+        return false;
+    }
+#ifdef ASPIC_GC_STRESS
+    // Smallest slices, to interleave the collector with the program as much as possible
+    return true;
+#else
+    return vm.gc.pause_budget_us > 0 && elapsed_us(start) >= vm.gc.pause_budget_us;
+#endif
+}
+
+static void mark_object(Object* object)
+{
+    if (object == NULL || object->marked) {
+        return;
+    }
+    object->marked = true;
+
+    // Strings do not reference other objects: no need to trace them
+    if (object->type != OBJECT_STRING) {
+        // References will be traced later
+        push_gray(object);
+    }
+}
+
+void gc_shade(Object* object)
+{
+    if (vm.gc.state == GC_MARKING) {
+        mark_object(object);
+    }
+}
+
+void gc_keep_alive(Object* object)
+{
+    if (vm.gc.state == GC_SWEEPING && !object->young) {
+        // May be a survivor already swept: its mark will only be reset by
+        // the next collection
+        object->marked = true;
+    }
+}
+
+static void mark_value(Value value)
+{
+    if (is_object(value)) {
+        mark_object(as_object(value));
+    }
+}
+
+static void mark_value_array(const ValueArray* array)
+{
+    for (int i = 0; i < array->count; ++i) {
+        mark_value(array->values[i]);
+    }
+}
+
+static void mark_roots()
+{
+    // Values on the VM stack: locals and temporaries
+    for (const Value* slot = vm.stack; slot < vm.stack_top; ++slot) {
+        mark_value(*slot);
+    }
+
+    // Functions of the ongoing calls
+    for (int i = 0; i < vm.frame_count; ++i) {
+        mark_object((Object*)vm.frames[i].function);
+    }
+
+    // Global variables: names and values
+    for (int i = 0; i < vm.global_count; ++i) {
+        mark_object((Object*)vm.globals[i].name);
+        mark_value(vm.globals[i].value);
+    }
+}
+
+/**
+ * Mark all objects referenced by a gray object
+ */
+static void blacken_object(Object* object)
+{
+    switch (object->type) {
+    case OBJECT_ARRAY:
+        mark_value_array(&((ObjectArray*)object)->array);
+        break;
+    case OBJECT_FUNCTION: {
+        ObjectFunction* function = (ObjectFunction*)object;
+        mark_object((Object*)function->name);
+        mark_value_array(&function->chunk.constants);
+        break;
+    }
+    case OBJECT_STRING:
+        break;
+    }
+}
+
+/**
+ * Blacken gray objects until none is left, or the slice is expired
+ * @return true if marking is complete
+ */
+static bool trace_references(const struct timespec* start)
+{
+    Gc* gc = &vm.gc;
+    while (gc->gray_count > 0) {
+        for (int i = 0; i < GC_SLICE_STEP && gc->gray_count > 0; ++i) {
+            blacken_object(gc->gray_stack[--gc->gray_count]);
+        }
+        if (slice_expired(start)) {
+            return gc->gray_count == 0;
+        }
+    }
+    return true;
+}
+
+static void start_sweep()
+{
+    Gc* gc = &vm.gc;
+    // Roots were not protected by write barriers: scan them again, and finish
+    // marking in this slice
+    mark_roots();
+    trace_references(NULL);
+
+    // Objects allocated from now on are kept in vm.objects_head, and won't be
+    // swept in this collection
+    gc->sweep_head = vm.objects_head;
+    vm.objects_head = NULL;
+    gc->survivors_head = gc->survivors_tail = NULL;
+    gc->state = GC_SWEEPING;
+}
+
+/**
+ * Free unmarked objects until all objects are swept, or the slice is expired
+ * @return true if sweeping is complete
+ */
+static bool sweep(const struct timespec* start)
+{
+    Gc* gc = &vm.gc;
+    while (gc->sweep_head != NULL) {
+        for (int i = 0; i < GC_SLICE_STEP && gc->sweep_head != NULL; ++i) {
+            Object* object = gc->sweep_head;
+            gc->sweep_head = object->next;
+            if (object->marked) {
+                // Reachable: reset the mark for the next collection
+                object->marked = false;
+                object->next = gc->survivors_head;
+                gc->survivors_head = object;
+                if (gc->survivors_tail == NULL) {
+                    gc->survivors_tail = object;
+                }
+            } else {
+                // Unreachable. The string pool only holds weak references.
+                if (object->type == OBJECT_STRING) {
+                    stringset_forward(&vm.string_pool, (ObjectString*)object, NULL);
+                }
+                gc->bytes_allocated -= object_size(object);
+                object_free(object);
+            }
+        }
+        if (slice_expired(start)) {
+            return false;
+        }
+    }
+
+    // Link survivors back into vm.objects_head
+    if (gc->survivors_tail != NULL) {
+        gc->survivors_tail->next = vm.objects_head;
+        vm.objects_head = gc->survivors_head;
+        gc->survivors_head = gc->survivors_tail = NULL;
+    }
+    gc->state = GC_IDLE;
+    return true;
+}
+
+static void finish_collection()
+{
+    Gc* gc = &vm.gc;
+#ifdef ASPIC_GC_STRESS
+    gc->next_gc = gc->bytes_allocated;
+#else
+    gc->next_gc = gc->bytes_allocated * GC_GROW_FACTOR;
+    if (gc->next_gc < GC_INITIAL_THRESHOLD) {
+        gc->next_gc = GC_INITIAL_THRESHOLD;
+    }
+#endif
+    gc->stats.major_count++;
+
+#ifdef ASPIC_DEBUG
+    printf("== gc::major == %zu bytes, next at %zu\n", gc->bytes_allocated, gc->next_gc);
+#endif
+}
+
+/**
+ * Run a slice of the major collection, starting a new one if needed
+ */
+static void collect_old(const struct timespec* start)
+{
+    Gc* gc = &vm.gc;
+    if (gc->state == GC_IDLE) {
+#ifndef ASPIC_GC_STRESS
+        if (gc->bytes_allocated <= gc->next_gc) {
+            return;
+        }
+#endif
+        gc->state = GC_MARKING;
+        mark_roots();
+        // Run slices more often than minor collections
+        gc->nursery.limit = gc->nursery.start + GC_SLICE_NURSERY_BYTES;
+    }
+
+    if (gc->state == GC_MARKING && trace_references(start)) {
+        start_sweep();
+    }
+    if (gc->state == GC_SWEEPING && sweep(start)) {
+        gc->nursery.limit = gc->nursery.end - GC_NURSERY_SLACK;
+        finish_collection();
+        return;
+    }
+
+    // Collection is still in progress: run the next slice once the program
+    // has allocated enough
+    gc->next_gc = gc->bytes_allocated + GC_SLICE_BYTES;
+}
+
+static void record_pause(long microseconds)
+{
+    GcStats* stats = &vm.gc.stats;
+    int bucket = 0;
+    while (microseconds >> bucket && bucket < GC_HISTOGRAM_SIZE - 1) {
+        ++bucket;
+    }
+    stats->pause_histogram[bucket]++;
+    stats->pause_count++;
+    if (microseconds > stats->pause_max_us) {
+        stats->pause_max_us = microseconds;
+    }
+}
+
+void gc_collect()
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Empty the nursery first: the major collection only deals with old objects
+    collect_young();
+
+    // Pause budget only applies to the major collection: a minor collection
+    // cannot be interrupted
+    struct timespec slice_start;
+    clock_gettime(CLOCK_MONOTONIC, &slice_start);
+    collect_old(vm.gc.pause_budget_us > 0 ? &slice_start : NULL);
+
+    record_pause(elapsed_us(&start));
+}
+
+void gc_collect_young()
+{
+    if (vm.gc.nursery.top != vm.gc.nursery.start) {
+        collect_young();
+    }
+}
+
+void gc_print_stats()
+{
+    const GcStats* stats = &vm.gc.stats;
+    printf("== gc::stats ==\n");
+    printf("minor collections: %zu\n", stats->minor_count);
+    printf("major collections: %zu\n", stats->major_count);
+    printf("pauses: %zu, max %ld us\n", stats->pause_count, stats->pause_max_us);
+    for (int i = 0; i < GC_HISTOGRAM_SIZE; ++i) {
+        if (stats->pause_histogram[i] > 0) {
+            long low = i == 0 ? 0 : 1L << (i - 1);
+            printf("  [%ld, %ld) us: %zu\n", low, 1L << i, stats->pause_histogram[i]);
+        }
+    }
+}
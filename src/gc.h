@@ -0,0 +1,186 @@
+#ifndef ASPIC_GC_H
+#define ASPIC_GC_H
+
+#include "object.h"
+
+/**
+ * Generational garbage collector.
+ *
+ * Young generation: objects allocated while the VM is running are
+ * bump-allocated in a fixed size nursery. A minor collection copies the
+ * reachable young objects to the old generation ("promotion"), then resets
+ * the nursery. Strings are allocated with their chars, and most objects die
+ * young: allocating and collecting them costs no malloc/free.
+ * Roots of a minor collection are the VM stack, and the old objects which
+ * may reference young objects: the remembered set. Stores of a value into an
+ * old object must go through gc_write_barrier() to maintain this set.
+ *
+ * Old generation: precise mark-and-sweep over the linked list of old objects.
+ * Roots are the VM stack, the CallFrame functions and the global variables.
+ * Functions constants are reached through the functions themselves.
+ * Collection is incremental: marking and sweeping are split in slices
+ * interleaved with the program execution, each slice running for at most
+ * the configured pause budget. Marking follows the tri-color invariant: a
+ * marked object whose references were traced (black) never references an
+ * unmarked object (white). Objects allocated during marking are marked and
+ * traced (gray), and stores into a black object shade the stored value with
+ * gc_write_barrier(). Roots are scanned again when no gray object is left,
+ * before sweeping.
+ *
+ * The string pool holds weak references: unreachable strings are removed from
+ * the pool when swept. Strings found in the pool during sweeping are kept alive.
+ *
+ * Collections only happen at safepoints in vm_run, between instructions,
+ * when every live value is reachable from the roots. C code (stdlib, parser)
+ * can allocate objects without having to protect them.
+ */
+
+typedef struct {
+    uint8_t* start;
+    // Next free byte
+    uint8_t* top;
+    // A minor collection is requested once top goes over limit
+    uint8_t* limit;
+    uint8_t* end;
+} Nursery;
+
+typedef enum {
+    GC_IDLE,     // No major collection in progress
+    GC_MARKING,  // Tracing references from roots
+    GC_SWEEPING, // Freeing unmarked objects
+} GcState;
+
+// Pause times histogram: bucket i counts pauses in [2^(i-1), 2^i) µs
+#define GC_HISTOGRAM_SIZE 24
+
+typedef struct {
+    // Number of minor collections
+    size_t minor_count;
+    // Number of completed major collections
+    size_t major_count;
+    // Number of pauses (one per safepoint where the collector ran)
+    size_t pause_count;
+    long pause_max_us;
+    size_t pause_histogram[GC_HISTOGRAM_SIZE];
+} GcStats;
+
+typedef struct {
+    GcState state;
+    // Max duration of a pause, in microseconds (0: no limit)
+    long pause_budget_us;
+
+    // Bytes currently allocated for old objects
+    size_t bytes_allocated;
+    // Idle: threshold for starting the next major collection
+    // Marking or sweeping: threshold for running the next slice
+    size_t next_gc;
+
+    // Young generation
+    Nursery nursery;
+    // Allocate objects in the nursery (only while the VM is running)
+    bool nursery_enabled;
+
+    // Old arrays which may reference young objects
+    int remembered_count;
+    int remembered_capacity;
+    Object** remembered;
+    // Global variables may reference young objects
+    bool globals_dirty;
+
+    // Worklist of marked (or promoted) objects, whose references are not traced yet
+    int gray_count;
+    int gray_capacity;
+    Object** gray_stack;
+
+    // Sweeping: objects not swept yet, and objects which survived
+    Object* sweep_head;
+    Object* survivors_head;
+    Object* survivors_tail;
+
+    GcStats stats;
+} Gc;
+
+// Ctor
+void gc_init(Gc* gc);
+
+// Dtor
+void gc_free(Gc* gc);
+
+/**
+ * Allocate memory for a new object, in the nursery if possible
+ */
+Object* gc_allocate(ObjectType type, size_t size);
+
+/**
+ * Cancel the allocation of the last allocated object
+ */
+void gc_cancel_allocation(Object* object);
+
+/**
+ * Check if a collection is needed: nursery is full, or the allocation
+ * threshold of the old generation was reached since the last collection
+ */
+bool gc_should_collect();
+
+/**
+ * Run a minor collection, then a slice of major collection if needed
+ */
+void gc_collect();
+
+/**
+ * Run a minor collection only, if the nursery is not empty. Must be called
+ * before the parser runs: objects it creates are old, and must not reference
+ * young strings found in the string pool.
+ */
+void gc_collect_young();
+
+/**
+ * Set the max duration of a collector pause, in microseconds
+ * @param microseconds: 0 to collect the old generation in a single pause
+ */
+void gc_set_pause_budget(long microseconds);
+
+/**
+ * Print collector statistics and pause times histogram to stdout
+ */
+void gc_print_stats();
+
+/**
+ * Remember an old object which now references a young object
+ */
+void gc_remember(Object* owner);
+
+/**
+ * Mark an old object as reachable during an incremental marking
+ */
+void gc_shade(Object* object);
+
+/**
+ * Prevent the ongoing sweep from freeing an unmarked object, found through a
+ * weak reference
+ */
+void gc_keep_alive(Object* object);
+
+/**
+ * Write barrier: must be called when storing value into an object
+ */
+static inline void gc_write_barrier(Object* owner, Value value)
+{
+    if (is_object(value)) {
+        Object* object = as_object(value);
+        if (object->young) {
+            if (!owner->young) {
+                gc_remember(owner);
+            }
+        } else if (owner->marked && !object->marked) {
+            gc_shade(object);
+        }
+    }
+}
+
+/**
+ * Write barrier: must be called when storing value into a global variable
+ */
+void gc_write_barrier_globals(Value value);
+
+#endif
@@ -18,7 +18,7 @@ static Entry* find_entry(Entry* entries, size_t capacity, const ObjectString* ke
         // Entry is available
         if (entry->key == NULL) {
             // Check if really empty, or a tombstone
-            if (entry->value.type == TYPE_NULL) {
+            if (is_null(entry->value)) {
                 // Empty entry found
                 return tombstone != NULL ? tombstone : entry;
             } else if (tombstone == NULL) {
@@ -107,7 +107,7 @@ bool hashtable_set(Hashtable* table, const ObjectString* key, Value value, bool
         table->count++;
         // Increase count_with_tombstones only if the bucket was not already
         // used as a tombstone
-        if (entry->value.type == TYPE_NULL) {
+        if (is_null(entry->value)) {
             table->count_with_tombstones++;
         }
     }
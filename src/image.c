@@ -0,0 +1,462 @@
+#include "image.h"
+#include "hashtable.h"
+#include "utils.h"
+#include "verifier.h"
+#include "vm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern VM vm;
+
+static const char IMAGE_MAGIC[4] = { 'A', 'C', 'I', '\0' };
+
+// Integers are stored in the byte order of the writer
+#define IMAGE_BYTE_ORDER 0x01020304
+
+// Offset of each section is a multiple of 8 bytes
+#define IMAGE_ALIGN(offset) (((offset) + 7) & ~(size_t)7)
+
+// Line numbers are mapped as the int array of Chunk.lines
+_Static_assert(sizeof(int) == sizeof(uint32_t), "Line numbers must be 32 bits integers");
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t opcode_count;
+    // Size of the image, in bytes
+    uint32_t size;
+    // Sections: offset and number of items
+    uint32_t functions;
+    uint32_t function_count;
+    uint32_t strings;
+    uint32_t string_count;
+    uint32_t globals;
+    uint32_t global_count;
+    uint32_t source;
+    uint32_t source_length;
+} ImageHeader;
+
+typedef struct {
+    // Offset of the null-terminated chars
+    uint32_t chars;
+    uint32_t length;
+} ImageString;
+
+typedef struct {
+    // Index in the string table, or UINT32_MAX for the main function
+    uint32_t name;
+    uint32_t arity;
+    uint32_t max_stack;
+    uint32_t code;
+    uint32_t code_count;
+    uint32_t lines;
+    uint32_t line_count;
+    uint32_t constants;
+    uint32_t constant_count;
+} ImageFunction;
+
+typedef enum {
+    IMAGE_NULL,
+    IMAGE_FALSE,
+    IMAGE_TRUE,
+    IMAGE_NUMBER,
+    IMAGE_STRING,
+    IMAGE_FUNCTION,
+} ImageConstantTag;
+
+typedef struct {
+    uint32_t tag;
+    // Index in the string table or in the function table
+    uint32_t index;
+    double number;
+} ImageConstant;
+
+// Writer
+//------------------------------------------------------------------------------
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+
+    // Functions in preorder
+    const ObjectFunction** functions;
+    int function_count;
+    int function_capacity;
+
+    // String table, and the index of each string in it
+    const ObjectString** strings;
+    int string_count;
+    int string_capacity;
+    Hashtable string_indexes;
+
+    // Cleared when a constant cannot be stored
+    bool ok;
+} ImageWriter;
+
+// Append a section, or zeros if data is NULL
+// @return offset of the section
+static uint32_t append_section(ImageWriter* writer, const void* data, size_t size)
+{
+    size_t offset = IMAGE_ALIGN(writer->count);
+    if (writer->capacity < offset + size) {
+        size_t capacity = writer->capacity < 1024 ? 1024 : writer->capacity;
+        while (capacity < offset + size) {
+            capacity *= 2;
+        }
+        writer->bytes = realloc_array(writer->bytes, sizeof(uint8_t), capacity);
+        writer->capacity = capacity;
+    }
+    memset(writer->bytes + writer->count, 0, offset - writer->count);
+    if (data != NULL) {
+        memcpy(writer->bytes + offset, data, size);
+    } else {
+        memset(writer->bytes + offset, 0, size);
+    }
+    writer->count = offset + size;
+    if (writer->count > UINT32_MAX) {
+        writer->ok = false;
+    }
+    return offset;
+}
+
+static uint32_t add_string(ImageWriter* writer, const ObjectString* string)
+{
+    Value* index = hashtable_get(&writer->string_indexes, string);
+    if (index != NULL) {
+        return as_number(*index);
+    }
+    if (writer->string_capacity < writer->string_count + 1) {
+        writer->string_capacity = writer->string_capacity < 64 ? 64 : writer->string_capacity * 2;
+        writer->strings = realloc_array(writer->strings, sizeof(ObjectString*), writer->string_capacity);
+    }
+    writer->strings[writer->string_count] = string;
+    hashtable_set(&writer->string_indexes, string, make_number(writer->string_count), false);
+    return writer->string_count++;
+}
+
+static void add_function(ImageWriter* writer, const ObjectFunction* function)
+{
+    if (writer->function_capacity < writer->function_count + 1) {
+        writer->function_capacity = writer->function_capacity < 16 ? 16 : writer->function_capacity * 2;
+        writer->functions = realloc_array(writer->functions, sizeof(ObjectFunction*), writer->function_capacity);
+    }
+    writer->functions[writer->function_count++] = function;
+
+    const ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; ++i) {
+        Value constant = constants->values[i];
+        if (is_object(constant) && as_object(constant)->type == OBJECT_FUNCTION) {
+            add_function(writer, (const ObjectFunction*)as_object(constant));
+        }
+    }
+}
+
+static uint32_t function_index(const ImageWriter* writer, const ObjectFunction* function)
+{
+    for (int i = 0; i < writer->function_count; ++i) {
+        if (writer->functions[i] == function) {
+            return i;
+        }
+    }
+    return UINT32_MAX;
+}
+
+static ImageFunction write_function(ImageWriter* writer, const ObjectFunction* function)
+{
+    const Chunk* chunk = &function->chunk;
+    if (function->lazy_source != NULL) {
+        // Not compiled yet
+        writer->ok = false;
+    }
+    ImageFunction record;
+    record.name = function->name == NULL ? UINT32_MAX : add_string(writer, function->name);
+    record.arity = function->arity;
+    record.max_stack = function->max_stack;
+
+    record.constant_count = chunk->constants.count;
+    ImageConstant* constants = calloc(chunk->constants.count + 1, sizeof(ImageConstant));
+    for (int i = 0; i < chunk->constants.count; ++i) {
+        Value value = chunk->constants.values[i];
+        ImageConstant* constant = &constants[i];
+        if (is_null(value)) {
+            constant->tag = IMAGE_NULL;
+        } else if (is_bool(value)) {
+            constant->tag = as_bool(value) ? IMAGE_TRUE : IMAGE_FALSE;
+        } else if (is_number(value)) {
+            constant->tag = IMAGE_NUMBER;
+            constant->number = as_number(value);
+        } else if (is_string(value)) {
+            constant->tag = IMAGE_STRING;
+            constant->index = add_string(writer, (const ObjectString*)as_object(value));
+        } else if (is_object(value) && as_object(value)->type == OBJECT_FUNCTION) {
+            constant->tag = IMAGE_FUNCTION;
+            constant->index = function_index(writer, (const ObjectFunction*)as_object(value));
+        } else {
+            // Not produced by the parser
+            writer->ok = false;
+        }
+    }
+    record.constants = append_section(writer, constants, sizeof(ImageConstant) * chunk->constants.count);
+    free(constants);
+
+    record.line_count = chunk->lines.count;
+    record.lines = append_section(writer, chunk->lines.values, sizeof(int) * chunk->lines.count);
+    record.code_count = chunk->count;
+    record.code = append_section(writer, chunk->code, chunk->count);
+    return record;
+}
+
+bool image_write(const char* path, const ObjectFunction* function, const char* source)
+{
+    ImageWriter writer;
+    memset(&writer, 0, sizeof(writer));
+    writer.ok = true;
+    hashtable_init(&writer.string_indexes);
+    add_function(&writer, function);
+
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    header.version = IMAGE_VERSION;
+    header.byte_order = IMAGE_BYTE_ORDER;
+    // OP_JUMP_IF_EQUAL is the last OpCode
+    header.opcode_count = OP_JUMP_IF_EQUAL + 1;
+    append_section(&writer, NULL, sizeof(ImageHeader));
+
+    header.function_count = writer.function_count;
+    header.functions = append_section(&writer, NULL, sizeof(ImageFunction) * writer.function_count);
+    for (int i = 0; i < writer.function_count; ++i) {
+        ImageFunction record = write_function(&writer, writer.functions[i]);
+        memcpy(writer.bytes + header.functions + sizeof(ImageFunction) * i, &record, sizeof(record));
+    }
+
+    header.global_count = vm.global_count;
+    uint32_t* globals = calloc(vm.global_count + 1, sizeof(uint32_t));
+    for (int i = 0; i < vm.global_count; ++i) {
+        globals[i] = add_string(&writer, vm_global_name(i));
+    }
+    header.globals = append_section(&writer, globals, sizeof(uint32_t) * vm.global_count);
+    free(globals);
+
+    // All the strings are known: write the chars, then the string table
+    header.string_count = writer.string_count;
+    ImageString* strings = calloc(writer.string_count + 1, sizeof(ImageString));
+    for (int i = 0; i < writer.string_count; ++i) {
+        const ObjectString* string = writer.strings[i];
+        strings[i].length = string->length;
+        strings[i].chars = append_section(&writer, string->chars, string->length + 1);
+    }
+    header.strings = append_section(&writer, strings, sizeof(ImageString) * writer.string_count);
+    free(strings);
+
+    header.source_length = strlen(source);
+    header.source = append_section(&writer, source, header.source_length + 1);
+    header.size = writer.count;
+    memcpy(writer.bytes, &header, sizeof(header));
+
+    bool success = false;
+    FILE* file = writer.ok ? fopen(path, "wb") : NULL;
+    if (file != NULL) {
+        success = fwrite(writer.bytes, sizeof(uint8_t), writer.count, file) == writer.count;
+        success = fclose(file) == 0 && success;
+    }
+    hashtable_free(&writer.string_indexes);
+    free(writer.functions);
+    free(writer.strings);
+    free(writer.bytes);
+    return success;
+}
+
+// Loader
+//------------------------------------------------------------------------------
+
+// Check that <size> bytes at offset are inside the image, and aligned
+static bool in_image(uint32_t offset, uint64_t size, size_t alignment)
+{
+    return offset % alignment == 0 && offset <= vm.image_size && size <= vm.image_size - offset;
+}
+
+static bool check_header(const ImageHeader* header)
+{
+    return memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0
+        && header->version == IMAGE_VERSION
+        && header->byte_order == IMAGE_BYTE_ORDER
+        && header->opcode_count == OP_JUMP_IF_EQUAL + 1
+        && header->size == vm.image_size
+        && header->function_count > 0
+        && in_image(header->functions, (uint64_t)sizeof(ImageFunction) * header->function_count, 8)
+        && in_image(header->strings, (uint64_t)sizeof(ImageString) * header->string_count, 8)
+        && in_image(header->globals, (uint64_t)sizeof(uint32_t) * header->global_count, 8)
+        && in_image(header->source, (uint64_t)header->source_length + 1, 1)
+        && vm.image[header->source + header->source_length] == '\0';
+}
+
+// Check that the code of a function has no specialized instruction: code in
+// the image cannot be deoptimized
+static bool check_generic_code(const Chunk* chunk)
+{
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t op = chunk->code[offset];
+        // OP_JUMP_IF_EQUAL is the last OpCode
+        if (op > OP_JUMP_IF_EQUAL || (op >= OP_ADD_NUM && op <= OP_LESS_EQUAL_NUM)) {
+            return false;
+        }
+        offset += op_length(op);
+    }
+    return true;
+}
+
+// Set up a function from its record. Nested functions come after their parent.
+static bool load_function(const ImageHeader* header, int index, ObjectFunction** functions, const ObjectString** strings)
+{
+    const ImageFunction* record = (const ImageFunction*)(vm.image + header->functions) + index;
+    if ((record->name != UINT32_MAX && record->name >= header->string_count)
+        || record->arity > UINT8_MAX
+        || record->max_stack > VM_STACK_MAX
+        || !in_image(record->code, record->code_count, 1)
+        || !in_image(record->lines, (uint64_t)sizeof(int) * record->line_count, sizeof(int))
+        || record->line_count % 2 != 0
+        || !in_image(record->constants, (uint64_t)sizeof(ImageConstant) * record->constant_count, 8)) {
+        return false;
+    }
+
+    ObjectFunction* function = functions[index];
+    function->name = record->name == UINT32_MAX ? NULL : strings[record->name];
+    function->arity = record->arity;
+    function->max_stack = record->max_stack;
+
+    // Code and line numbers stay in the image: capacity 0, not owned by the
+    // chunk
+    Chunk* chunk = &function->chunk;
+    chunk->code = (uint8_t*)vm.image + record->code;
+    chunk->count = record->code_count;
+    chunk->lines.values = (int*)(vm.image + record->lines);
+    chunk->lines.count = record->line_count;
+    int64_t line_total = 0;
+    for (int i = 0; i < chunk->lines.count; i += 2) {
+        line_total += chunk->lines.values[i] > 0 ? chunk->lines.values[i] : -1;
+    }
+    if (line_total != chunk->count || !check_generic_code(chunk)) {
+        return false;
+    }
+
+    const ImageConstant* constants = (const ImageConstant*)(vm.image + record->constants);
+    value_array_reserve(&chunk->constants, record->constant_count);
+    for (uint32_t i = 0; i < record->constant_count; ++i) {
+        const ImageConstant* constant = &constants[i];
+        Value value;
+        switch (constant->tag) {
+        case IMAGE_NULL:
+            value = make_null();
+            break;
+        case IMAGE_FALSE:
+            value = make_bool(false);
+            break;
+        case IMAGE_TRUE:
+            value = make_bool(true);
+            break;
+        case IMAGE_NUMBER:
+            value = make_number(constant->number);
+            break;
+        case IMAGE_STRING:
+            if (constant->index >= header->string_count) {
+                return false;
+            }
+            value = make_object((Object*)strings[constant->index]);
+            break;
+        case IMAGE_FUNCTION:
+            // Only nested functions: no cycle
+            if (constant->index <= (uint32_t)index || constant->index >= header->function_count) {
+                return false;
+            }
+            value = make_object((Object*)functions[constant->index]);
+            break;
+        default:
+            return false;
+        }
+        value_array_push(&chunk->constants, value);
+    }
+    return true;
+}
+
+ObjectFunction* image_load(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat info;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(ImageHeader) && info.st_size <= UINT32_MAX) {
+        data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    // Mapped until image_unload(): strings loaded from the image refer to it
+    vm.image = data;
+    vm.image_size = info.st_size;
+
+    const ImageHeader* header = data;
+    if (!check_header(header)) {
+        return NULL;
+    }
+
+    // Strings: the chars stay in the image
+    bool valid = true;
+    const ImageString* image_strings = (const ImageString*)(vm.image + header->strings);
+    const ObjectString** strings = malloc(sizeof(ObjectString*) * (header->string_count + 1));
+    for (uint32_t i = 0; valid && i < header->string_count; ++i) {
+        const ImageString* string = &image_strings[i];
+        valid = string->length <= INT32_MAX
+            && in_image(string->chars, (uint64_t)string->length + 1, 1)
+            && vm.image[string->chars + string->length] == '\0';
+        if (valid) {
+            strings[i] = string_new_mapped((const char*)vm.image + string->chars, string->length);
+        }
+    }
+
+    // Globals: the global operands are used as is, slots must match
+    const uint32_t* globals = (const uint32_t*)(vm.image + header->globals);
+    for (uint32_t i = 0; valid && i < header->global_count; ++i) {
+        valid = globals[i] < header->string_count
+            && vm_resolve_global(strings[globals[i]]) == (int)i;
+    }
+
+    ObjectFunction* function = NULL;
+    if (valid) {
+        ObjectFunction** functions = malloc(sizeof(ObjectFunction*) * header->function_count);
+        for (uint32_t i = 0; i < header->function_count; ++i) {
+            functions[i] = function_new();
+        }
+        for (uint32_t i = 0; valid && i < header->function_count; ++i) {
+            valid = load_function(header, i, functions, strings);
+        }
+        if (valid && verifier_check(functions[0])) {
+            function = functions[0];
+            vm.source = (const char*)vm.image + header->source;
+        }
+        free(functions);
+    }
+    free(strings);
+    return function;
+}
+
+void image_unload()
+{
+    if (vm.image != NULL) {
+        munmap((void*)vm.image, vm.image_size);
+        vm.image = NULL;
+        vm.image_size = 0;
+    }
+}
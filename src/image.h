@@ -0,0 +1,50 @@
+#ifndef ASPIC_IMAGE_H
+#define ASPIC_IMAGE_H
+
+#include "object.h"
+
+/**
+ * Bytecode images (.aci)
+ *
+ * An image holds a compiled program in position-independent sections, which
+ * refer to each other by offset from the start of the file. Processes map
+ * the image read-only and run the bytecode in place: the code and the line
+ * numbers of the functions, and the chars of the strings, are shared through
+ * the page cache, without a per-process copy.
+ * - header: magic, format version, byte order, number of opcodes, and the
+ *   offset and size of each section
+ * - function table, in preorder: nested functions come after their parent
+ * - string table: function names, string constants and global names
+ * - global table: name of the global variable at each slot
+ * - per function: constants, line numbers (as in Chunk.lines) and code
+ * - chars of the strings, then the source of the program (for stack traces)
+ *
+ * Loading only allocates the function and string objects, and the constant
+ * arrays. Code in the image is never rewritten: instructions are not
+ * quickened, but hot functions are still optimized into private bytecode.
+ * The global operands are not relocated: images are loaded by the binary
+ * which wrote them, where the global slots of the standard library match.
+ */
+
+// Increment when the format or the instruction set changes
+#define IMAGE_VERSION 1
+
+/**
+ * Write the functions compiled from a program to an image file
+ * @return true if success
+ */
+bool image_write(const char* path, const ObjectFunction* function, const char* source);
+
+/**
+ * Map an image file read-only, and set up the VM to run it
+ * @return main function, or NULL if the image is invalid or does not match
+ * this binary
+ */
+ObjectFunction* image_load(const char* path);
+
+/**
+ * Unmap the image, once the VM is freed
+ */
+void image_unload();
+
+#endif
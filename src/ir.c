@@ -0,0 +1,2216 @@
+#include "ir.h"
+#include "gc.h"
+#include "utils.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Max number of values held in frame slots, rows of the interference matrix
+#define IR_MAX_VARIABLES 4096
+
+// Operations of the IR which are not instructions, numbered after OpCode
+enum {
+    // Frame slot on entry: callee or argument (a: slot)
+    IR_PARAM = 256,
+    // Frame slot merged from the predecessors of a block: one operand per
+    // predecessor, in the order of IrBlock.preds
+    IR_PHI,
+};
+
+typedef enum {
+    TERM_JUMP,   // go to succs[0]
+    TERM_BRANCH, // go to succs[0] if operand is truthy, else to succs[1]
+    TERM_RETURN, // return operand
+} Terminator;
+
+typedef struct {
+    int op;
+    // Block computing the value, -1 for constants: they are loaded by each
+    // instruction using them
+    int block;
+    int line;
+    IntArray operands;
+    // Constant index (-1 if not in the chunk yet), global slot or param slot
+    int a;
+    Value constant;
+    // Value replacing this one, -1 if none
+    int replacement;
+    bool removed;
+    // Always a number when computed
+    bool number;
+
+    // Code generation
+    int use_count;
+    // Block of the last use, and whether a phi uses the value
+    int user_block;
+    bool phi_use;
+    // Pushed by the instruction and popped by its only use, without a slot.
+    // The computation of such a value starts at the instruction <start> of
+    // the block, with its own operands.
+    bool on_stack;
+    int position;
+    int start;
+    // Row in the interference matrix, -1 if the value is not held in a slot
+    int variable;
+    int slot;
+} IrValue;
+
+typedef struct {
+    // Instructions of the block in the parser bytecode: [start, end)
+    int start;
+    int end;
+    // Values computed by the block, phis first
+    IntArray values;
+    IntArray preds;
+    int succs[2];
+    int succ_count;
+    Terminator terminator;
+    // Branch condition or returned value
+    int operand;
+    int line;
+    // Index in the code layout, -1 if the block is unreachable
+    int rpo;
+    // Immediate dominator
+    int idom;
+    // Frame slots on entry, and their values on exit
+    int depth;
+    int* exit_state;
+    int exit_depth;
+    // Offset of the generated code
+    int code_offset;
+} IrBlock;
+
+typedef struct {
+    ObjectFunction* function;
+    IrValue* values;
+    int value_count;
+    int value_capacity;
+    IrBlock* blocks;
+    int block_count;
+    int block_capacity;
+    // Reachable blocks, in reverse postorder: the code layout
+    IntArray order;
+    // Line number of each bytecode offset
+    int* lines;
+    // Values of the constants: per index, per OP_ZERO..OP_NULL, and for
+    // OP_ADD_IMM operands not found in the constants
+    int* constants;
+    int predefined[OP_NULL - OP_ZERO + 1];
+    IntArray immediates;
+} Ir;
+
+// Abstract stack of values, while translating the bytecode of a block
+typedef struct {
+    int* slots;
+    int depth;
+    int capacity;
+    bool valid;
+} Stack;
+
+typedef uint64_t Bits;
+
+typedef struct {
+    Ir* ir;
+    Chunk chunk;
+    // Jumps to a block: operand offset and target block, by pairs
+    IntArray patches;
+    // False edges of the branches: jump operand offset, block, and whether
+    // the condition is popped
+    IntArray stubs;
+    // Last emitted instruction, and the value it pushed (-1 if none)
+    int last_instruction;
+    int last_value;
+    bool valid;
+} Generator;
+
+// Operand loaded before the computation of the next operand kept on the stack
+typedef struct {
+    // Position of the first instruction of this computation
+    int start;
+    // Position of the instruction using the operand, and operand index
+    int user;
+    int index;
+    int value;
+} Preload;
+
+static bool dump_graph = false;
+
+static void list_push(IntArray* list, int value)
+{
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity < 4 ? 4 : list->capacity * 2;
+        list->values = realloc_array(list->values, sizeof(int), list->capacity);
+    }
+    list->values[list->count++] = value;
+}
+
+static int list_find(const IntArray* list, int value)
+{
+    for (int i = 0; i < list->count; ++i) {
+        if (list->values[i] == value) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Graph
+//------------------------------------------------------------------------------
+
+static int new_value(Ir* ir, int op, int line)
+{
+    if (ir->value_count == ir->value_capacity) {
+        ir->value_capacity = ir->value_capacity < 64 ? 64 : ir->value_capacity * 2;
+        ir->values = realloc_array(ir->values, sizeof(IrValue), ir->value_capacity);
+    }
+    IrValue* value = &ir->values[ir->value_count];
+    memset(value, 0, sizeof(IrValue));
+    value->op = op;
+    value->block = -1;
+    value->line = line;
+    value->constant = make_null();
+    value->replacement = -1;
+    value->user_block = -1;
+    value->variable = -1;
+    value->slot = -1;
+    return ir->value_count++;
+}
+
+static int new_block(Ir* ir, int start, int line)
+{
+    if (ir->block_count == ir->block_capacity) {
+        ir->block_capacity = ir->block_capacity < 16 ? 16 : ir->block_capacity * 2;
+        ir->blocks = realloc_array(ir->blocks, sizeof(IrBlock), ir->block_capacity);
+    }
+    IrBlock* block = &ir->blocks[ir->block_count];
+    memset(block, 0, sizeof(IrBlock));
+    block->start = start;
+    block->end = start;
+    block->terminator = TERM_JUMP;
+    block->operand = -1;
+    block->line = line;
+    block->rpo = -1;
+    block->idom = -1;
+    return ir->block_count++;
+}
+
+// Append an instruction to a block
+static int add_instruction(Ir* ir, int block, int op, int line)
+{
+    int value = new_value(ir, op, line);
+    ir->values[value].block = block;
+    list_push(&ir->blocks[block].values, value);
+    return value;
+}
+
+static int add_unary(Ir* ir, int block, int op, int line, int a)
+{
+    int value = add_instruction(ir, block, op, line);
+    list_push(&ir->values[value].operands, a);
+    return value;
+}
+
+static int add_binary(Ir* ir, int block, int op, int line, int a, int b)
+{
+    int value = add_unary(ir, block, op, line, a);
+    list_push(&ir->values[value].operands, b);
+    return value;
+}
+
+static bool is_constant(const IrValue* value)
+{
+    return value->block == -1;
+}
+
+static int constant_at(Ir* ir, int index)
+{
+    if (ir->constants[index] == -1) {
+        int value = new_value(ir, OP_CONSTANT, 0);
+        ir->values[value].a = index;
+        ir->values[value].constant = ir->function->chunk.constants.values[index];
+        ir->constants[index] = value;
+    }
+    return ir->constants[index];
+}
+
+static int predefined_constant(Ir* ir, uint8_t op)
+{
+    int* value = &ir->predefined[op - OP_ZERO];
+    if (*value == -1) {
+        *value = new_value(ir, op, 0);
+        switch (op) {
+        case OP_ZERO: ir->values[*value].constant = make_number(0); break;
+        case OP_ONE: ir->values[*value].constant = make_number(1); break;
+        case OP_TRUE: ir->values[*value].constant = make_bool(true); break;
+        case OP_FALSE: ir->values[*value].constant = make_bool(false); break;
+        }
+    }
+    return *value;
+}
+
+// Operand of OP_ADD_IMM
+static int immediate_constant(Ir* ir, int immediate)
+{
+    if (immediate == 0 || immediate == 1) {
+        return predefined_constant(ir, immediate == 0 ? OP_ZERO : OP_ONE);
+    }
+    Value number = make_number(immediate);
+    int index = value_array_find(&ir->function->chunk.constants, number);
+    if (index >= 0) {
+        return constant_at(ir, index);
+    }
+    for (int i = 0; i < ir->immediates.count; ++i) {
+        int value = ir->immediates.values[i];
+        if (as_number(ir->values[value].constant) == immediate) {
+            return value;
+        }
+    }
+    // Registered in the chunk if still used after the passes
+    int value = new_value(ir, OP_CONSTANT, 0);
+    ir->values[value].a = -1;
+    ir->values[value].constant = number;
+    list_push(&ir->immediates, value);
+    return value;
+}
+
+static int resolve(const Ir* ir, int value)
+{
+    while (ir->values[value].replacement != -1) {
+        value = ir->values[value].replacement;
+    }
+    return value;
+}
+
+// Rewrite the operands of the values replaced by a pass, and remove these
+// values from the blocks
+static void apply_replacements(Ir* ir)
+{
+    for (int i = 0; i < ir->order.count; ++i) {
+        IrBlock* block = &ir->blocks[ir->order.values[i]];
+        int kept = 0;
+        for (int j = 0; j < block->values.count; ++j) {
+            IrValue* value = &ir->values[block->values.values[j]];
+            if (value->removed) {
+                continue;
+            }
+            for (int k = 0; k < value->operands.count; ++k) {
+                value->operands.values[k] = resolve(ir, value->operands.values[k]);
+            }
+            block->values.values[kept++] = block->values.values[j];
+        }
+        block->values.count = kept;
+        if (block->operand != -1) {
+            block->operand = resolve(ir, block->operand);
+        }
+    }
+}
+
+static void ir_free(Ir* ir)
+{
+    for (int i = 0; i < ir->value_count; ++i) {
+        free(ir->values[i].operands.values);
+    }
+    for (int i = 0; i < ir->block_count; ++i) {
+        free(ir->blocks[i].values.values);
+        free(ir->blocks[i].preds.values);
+        free(ir->blocks[i].exit_state);
+    }
+    free(ir->values);
+    free(ir->blocks);
+    free(ir->order.values);
+    free(ir->lines);
+    free(ir->constants);
+    free(ir->immediates.values);
+}
+
+// Construction
+//------------------------------------------------------------------------------
+
+// Instructions emitted by the parser. Quickened instructions are rewritten
+// at runtime only: their presence means the chunk is not a parser output.
+static bool is_supported(uint8_t op)
+{
+    return op <= OP_JUMP_IF_EQUAL && (op < OP_ADD_NUM || op > OP_LESS_EQUAL_NUM);
+}
+
+static bool is_jump(uint8_t op)
+{
+    switch (op) {
+    case OP_JUMP:
+    case OP_JUMP_BACK:
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static int jump_target(const uint8_t* code, int offset)
+{
+    int distance = code[offset + 1] << 8 | code[offset + 2];
+    return code[offset] == OP_JUMP_BACK ? offset + 3 - distance : offset + 3 + distance;
+}
+
+// Comparison tested by a compare and branch instruction: the branch is taken
+// when it is false
+static int compare_condition(uint8_t op)
+{
+    switch (op) {
+    case OP_JUMP_IF_NOT_LESS: return OP_LESS;
+    case OP_JUMP_IF_NOT_LESS_EQUAL: return OP_LESS_EQUAL;
+    case OP_JUMP_IF_NOT_GREATER: return OP_GREATER;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL: return OP_GREATER_EQUAL;
+    case OP_JUMP_IF_NOT_EQUAL: return OP_EQUAL;
+    case OP_JUMP_IF_EQUAL: return OP_NOT_EQUAL;
+    default: return -1;
+    }
+}
+
+// Compare and branch instruction testing a comparison, 0 if none
+static uint8_t compare_jump_for(int op)
+{
+    switch (op) {
+    case OP_LESS: return OP_JUMP_IF_NOT_LESS;
+    case OP_LESS_EQUAL: return OP_JUMP_IF_NOT_LESS_EQUAL;
+    case OP_GREATER: return OP_JUMP_IF_NOT_GREATER;
+    case OP_GREATER_EQUAL: return OP_JUMP_IF_NOT_GREATER_EQUAL;
+    case OP_EQUAL: return OP_JUMP_IF_NOT_EQUAL;
+    case OP_NOT_EQUAL: return OP_JUMP_IF_EQUAL;
+    default: return 0;
+    }
+}
+
+// Set the successors of a block from its last instruction
+static bool set_terminator(Ir* ir, int index, int last, const int* block_at)
+{
+    const Chunk* chunk = &ir->function->chunk;
+    IrBlock* block = &ir->blocks[index];
+    int fallthrough = block->end < chunk->count ? block_at[block->end] : -1;
+    int target = is_jump(chunk->code[last]) ? block_at[jump_target(chunk->code, last)] : -1;
+    block->line = ir->lines[last];
+
+    switch (chunk->code[last]) {
+    case OP_RETURN:
+        block->terminator = TERM_RETURN;
+        return true;
+    case OP_JUMP:
+    case OP_JUMP_BACK:
+        block->succs[block->succ_count++] = target;
+        return true;
+    case OP_JUMP_IF_TRUE:
+        block->terminator = TERM_BRANCH;
+        block->succs[block->succ_count++] = target;
+        block->succs[block->succ_count++] = fallthrough;
+        break;
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        block->terminator = TERM_BRANCH;
+        block->succs[block->succ_count++] = fallthrough;
+        block->succs[block->succ_count++] = target;
+        break;
+    default:
+        block->succs[block->succ_count++] = fallthrough;
+        break;
+    }
+    if (fallthrough == -1) {
+        // Runs past the end of the chunk
+        return false;
+    }
+    if (block->succ_count == 2 && block->succs[0] == block->succs[1]) {
+        // The condition is still computed, but not tested
+        block->terminator = TERM_JUMP;
+        block->succ_count = 1;
+    }
+    return true;
+}
+
+// Split the bytecode into basic blocks. Block 0 is the entry of the function,
+// defining the params.
+static bool build_blocks(Ir* ir)
+{
+    const Chunk* chunk = &ir->function->chunk;
+    int count = chunk->count;
+    ir->lines = malloc(sizeof(int) * count);
+    int offset = 0;
+    for (int i = 0; i < chunk->lines.count; i += 2) {
+        for (int j = 0; j < chunk->lines.values[i] && offset < count; ++j) {
+            ir->lines[offset++] = chunk->lines.values[i + 1];
+        }
+    }
+    while (offset < count) {
+        ir->lines[offset++] = 0;
+    }
+
+    bool* boundaries = calloc(count + 1, sizeof(bool));
+    bool* leaders = calloc(count + 1, sizeof(bool));
+    bool valid = true;
+    leaders[0] = true;
+    for (offset = 0; valid && offset < count;) {
+        uint8_t op = chunk->code[offset];
+        if (!is_supported(op) || offset + op_length(op) > count) {
+            valid = false;
+            break;
+        }
+        boundaries[offset] = true;
+        int next = offset + op_length(op);
+        if (is_jump(op)) {
+            int target = jump_target(chunk->code, offset);
+            if (target < 0 || target >= count) {
+                valid = false;
+            } else {
+                leaders[target] = true;
+            }
+            leaders[next] = true;
+        } else if (op == OP_RETURN) {
+            leaders[next] = true;
+        }
+        offset = next;
+    }
+    for (offset = 0; valid && offset < count; ++offset) {
+        // Jump inside an instruction
+        valid = !leaders[offset] || boundaries[offset];
+    }
+
+    if (valid) {
+        int* block_at = malloc(sizeof(int) * count);
+        new_block(ir, 0, ir->lines[0]);
+        for (offset = 0; offset < count; ++offset) {
+            if (leaders[offset]) {
+                if (ir->block_count > 1) {
+                    ir->blocks[ir->block_count - 1].end = offset;
+                }
+                block_at[offset] = new_block(ir, offset, ir->lines[offset]);
+            }
+        }
+        ir->blocks[ir->block_count - 1].end = count;
+        ir->blocks[0].succs[0] = 1;
+        ir->blocks[0].succ_count = 1;
+
+        for (int i = 1; valid && i < ir->block_count; ++i) {
+            int last = ir->blocks[i].start;
+            for (int offset = last; offset < ir->blocks[i].end; offset += op_length(chunk->code[offset])) {
+                last = offset;
+            }
+            valid = set_terminator(ir, i, last, block_at);
+        }
+        free(block_at);
+    }
+    free(boundaries);
+    free(leaders);
+    return valid;
+}
+
+// Order the blocks reachable from the entry in reverse postorder
+static void order_blocks(Ir* ir)
+{
+    int count = ir->block_count;
+    bool* visited = calloc(count, sizeof(bool));
+    int* next_succ = calloc(count, sizeof(int));
+    int* stack = malloc(sizeof(int) * count);
+    int* postorder = malloc(sizeof(int) * count);
+    int depth = 0;
+    int visit_count = 0;
+    stack[depth++] = 0;
+    visited[0] = true;
+    while (depth > 0) {
+        int index = stack[depth - 1];
+        const IrBlock* block = &ir->blocks[index];
+        if (next_succ[index] < block->succ_count) {
+            // Visit the successors backward, so that the first one is laid
+            // out right after the block
+            int succ = block->succs[block->succ_count - 1 - next_succ[index]++];
+            if (!visited[succ]) {
+                visited[succ] = true;
+                stack[depth++] = succ;
+            }
+        } else {
+            postorder[visit_count++] = index;
+            --depth;
+        }
+    }
+
+    ir->order.count = 0;
+    for (int i = 0; i < count; ++i) {
+        ir->blocks[i].rpo = -1;
+    }
+    for (int i = visit_count - 1; i >= 0; --i) {
+        ir->blocks[postorder[i]].rpo = ir->order.count;
+        list_push(&ir->order, postorder[i]);
+    }
+    free(visited);
+    free(next_succ);
+    free(stack);
+    free(postorder);
+}
+
+// Order the blocks, and record the predecessors of the reachable ones
+static void compute_order(Ir* ir)
+{
+    order_blocks(ir);
+    for (int i = 0; i < ir->order.count; ++i) {
+        const IrBlock* block = &ir->blocks[ir->order.values[i]];
+        for (int j = 0; j < block->succ_count; ++j) {
+            list_push(&ir->blocks[block->succs[j]].preds, ir->order.values[i]);
+        }
+    }
+}
+
+static void push(Stack* stack, int value)
+{
+    if (stack->depth == stack->capacity) {
+        stack->valid = false;
+        return;
+    }
+    stack->slots[stack->depth++] = value;
+}
+
+static int pop(Stack* stack)
+{
+    if (stack->depth == 0) {
+        stack->valid = false;
+        return 0;
+    }
+    return stack->slots[--stack->depth];
+}
+
+static int peek(Stack* stack)
+{
+    if (stack->depth == 0) {
+        stack->valid = false;
+        return 0;
+    }
+    return stack->slots[stack->depth - 1];
+}
+
+static int get_local(Stack* stack, int slot)
+{
+    if (slot >= stack->depth) {
+        stack->valid = false;
+        return 0;
+    }
+    return stack->slots[slot];
+}
+
+static void set_local(Stack* stack, int slot, int value)
+{
+    if (slot >= stack->depth) {
+        stack->valid = false;
+        return;
+    }
+    stack->slots[slot] = value;
+}
+
+static int get_constant(Ir* ir, Stack* stack, int index)
+{
+    if (index >= ir->function->chunk.constants.count) {
+        stack->valid = false;
+        return 0;
+    }
+    return constant_at(ir, index);
+}
+
+// Pop the operands of an instruction reading <count> values
+static int add_nary(Ir* ir, Stack* stack, int block, int op, int line, int count)
+{
+    if (stack->depth < count) {
+        stack->valid = false;
+        return 0;
+    }
+    int value = add_instruction(ir, block, op, line);
+    stack->depth -= count;
+    for (int i = 0; i < count; ++i) {
+        list_push(&ir->values[value].operands, stack->slots[stack->depth + i]);
+    }
+    return value;
+}
+
+// Translate the instructions of a block into values, from the frame slots
+// and the stack on entry
+static bool translate_block(Ir* ir, int index, Stack* stack)
+{
+    const Chunk* chunk = &ir->function->chunk;
+    IrBlock* block = &ir->blocks[index];
+    for (int offset = block->start; stack->valid && offset < block->end; offset += op_length(chunk->code[offset])) {
+        const uint8_t* ip = chunk->code + offset;
+        int line = ir->lines[offset];
+        int value;
+        switch (ip[0]) {
+        case OP_RETURN:
+            block->operand = pop(stack);
+            break;
+        case OP_POP:
+            pop(stack);
+            break;
+        case OP_JUMP:
+        case OP_JUMP_BACK:
+            break;
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE:
+            block->operand = peek(stack);
+            break;
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+            block->operand = add_nary(ir, stack, index, compare_condition(ip[0]), line, 2);
+            break;
+        case OP_DECL_GLOBAL:
+        case OP_DECL_GLOBAL_CONST:
+            value = add_nary(ir, stack, index, ip[0], line, 1);
+            ir->values[value].a = ip[1];
+            break;
+        case OP_DECL_GLOBAL_16:
+        case OP_DECL_GLOBAL_CONST_16:
+            value = add_nary(ir, stack, index, ip[0] == OP_DECL_GLOBAL_16 ? OP_DECL_GLOBAL : OP_DECL_GLOBAL_CONST, line, 1);
+            ir->values[value].a = ip[1] << 8 | ip[2];
+            break;
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_16:
+            value = add_instruction(ir, index, OP_GET_GLOBAL, line);
+            ir->values[value].a = ip[0] == OP_GET_GLOBAL ? ip[1] : ip[1] << 8 | ip[2];
+            push(stack, value);
+            break;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_16:
+        case OP_SET_GLOBAL_POP:
+            // The assigned value, also pushed back by the instruction
+            value = add_nary(ir, stack, index, OP_SET_GLOBAL, line, 1);
+            ir->values[value].a = ip[0] == OP_SET_GLOBAL_16 ? ip[1] << 8 | ip[2] : ip[1];
+            if (ip[0] != OP_SET_GLOBAL_POP) {
+                push(stack, value);
+            }
+            break;
+        case OP_GET_LOCAL:
+            push(stack, get_local(stack, ip[1]));
+            break;
+        case OP_SET_LOCAL:
+            value = peek(stack);
+            set_local(stack, ip[1], value);
+            break;
+        case OP_SET_LOCAL_POP:
+            value = pop(stack);
+            set_local(stack, ip[1], value);
+            break;
+        case OP_CONSTANT:
+            push(stack, get_constant(ir, stack, ip[1]));
+            break;
+        case OP_CONSTANT_16:
+            push(stack, get_constant(ir, stack, ip[1] << 8 | ip[2]));
+            break;
+        case OP_ZERO:
+        case OP_ONE:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NULL:
+            push(stack, predefined_constant(ir, ip[0]));
+            break;
+        case OP_NOT:
+        case OP_POSITIVE:
+        case OP_NEGATIVE:
+            push(stack, add_nary(ir, stack, index, ip[0], line, 1));
+            break;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_MODULO:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_SUBSCRIPT_GET:
+            push(stack, add_nary(ir, stack, index, ip[0], line, 2));
+            break;
+        case OP_SUBSCRIPT_SET:
+            push(stack, add_nary(ir, stack, index, ip[0], line, 3));
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            // The code generator emits the tail calls again
+            push(stack, add_nary(ir, stack, index, OP_CALL, line, ip[1] + 1));
+            break;
+        case OP_ARRAY:
+            push(stack, add_nary(ir, stack, index, OP_ARRAY, line, ip[1]));
+            break;
+
+        // Superinstructions are expanded
+        case OP_GET_LOCAL_2:
+            push(stack, get_local(stack, ip[1]));
+            push(stack, get_local(stack, ip[2]));
+            break;
+        case OP_GET_LOCAL_CONSTANT:
+            push(stack, get_local(stack, ip[1]));
+            push(stack, get_constant(ir, stack, ip[2]));
+            break;
+        case OP_ADD_LOCALS:
+            value = get_local(stack, ip[1]);
+            push(stack, add_binary(ir, index, OP_ADD, line, value, get_local(stack, ip[2])));
+            break;
+        case OP_ADD_IMM:
+            value = pop(stack);
+            push(stack, add_binary(ir, index, OP_ADD, line, value, immediate_constant(ir, (int8_t)ip[1])));
+            break;
+        case OP_INC_LOCAL:
+            value = get_local(stack, ip[1]);
+            set_local(stack, ip[1], add_binary(ir, index, OP_ADD, line, value, predefined_constant(ir, OP_ONE)));
+            break;
+        case OP_ADD_LOCAL_CONST:
+            value = get_local(stack, ip[1]);
+            value = add_binary(ir, index, OP_ADD, line, value, get_constant(ir, stack, ip[2]));
+            set_local(stack, ip[1], value);
+            break;
+        default:
+            stack->valid = false;
+            break;
+        }
+    }
+    return stack->valid;
+}
+
+// Translate the blocks in reverse postorder: a block with one predecessor
+// starts from its state on exit, a block where the control flow joins starts
+// with a phi per slot
+static bool build_values(Ir* ir)
+{
+    ObjectFunction* function = ir->function;
+    Stack stack;
+    stack.capacity = chunk_max_stack(&function->chunk, function->arity + 1);
+    if (stack.capacity < function->arity + 1) {
+        stack.capacity = function->arity + 1;
+    }
+    stack.slots = malloc(sizeof(int) * stack.capacity);
+    stack.valid = true;
+
+    for (int i = 0; stack.valid && i < ir->order.count; ++i) {
+        int index = ir->order.values[i];
+        IrBlock* block = &ir->blocks[index];
+        if (index == 0) {
+            stack.depth = function->arity + 1;
+            for (int slot = 0; slot < stack.depth; ++slot) {
+                stack.slots[slot] = add_instruction(ir, 0, IR_PARAM, block->line);
+                ir->values[stack.slots[slot]].a = slot;
+            }
+        } else if (block->preds.count == 1) {
+            const IrBlock* pred = &ir->blocks[block->preds.values[0]];
+            stack.depth = pred->exit_depth;
+            memcpy(stack.slots, pred->exit_state, sizeof(int) * stack.depth);
+        } else {
+            // The first predecessor comes before the block in reverse postorder
+            stack.depth = ir->blocks[block->preds.values[0]].exit_depth;
+            for (int slot = 0; slot < stack.depth; ++slot) {
+                stack.slots[slot] = add_instruction(ir, index, IR_PHI, block->line);
+            }
+        }
+        block->depth = stack.depth;
+        if (translate_block(ir, index, &stack)) {
+            block->exit_depth = stack.depth;
+            block->exit_state = malloc(sizeof(int) * (stack.depth + 1));
+            memcpy(block->exit_state, stack.slots, sizeof(int) * stack.depth);
+        }
+    }
+    free(stack.slots);
+
+    // Operands of the phis
+    for (int i = 0; stack.valid && i < ir->order.count; ++i) {
+        const IrBlock* block = &ir->blocks[ir->order.values[i]];
+        if (block->preds.count < 2) {
+            continue;
+        }
+        for (int j = 0; j < block->preds.count; ++j) {
+            const IrBlock* pred = &ir->blocks[block->preds.values[j]];
+            if (pred->exit_depth != block->depth) {
+                stack.valid = false;
+                break;
+            }
+            for (int slot = 0; slot < block->depth; ++slot) {
+                list_push(&ir->values[block->values.values[slot]].operands, pred->exit_state[slot]);
+            }
+        }
+    }
+    return stack.valid;
+}
+
+// Analysis
+//------------------------------------------------------------------------------
+
+static int intersect(const Ir* ir, int a, int b)
+{
+    while (a != b) {
+        while (ir->blocks[a].rpo > ir->blocks[b].rpo) {
+            a = ir->blocks[a].idom;
+        }
+        while (ir->blocks[b].rpo > ir->blocks[a].rpo) {
+            b = ir->blocks[b].idom;
+        }
+    }
+    return a;
+}
+
+// Immediate dominators, from "A Simple, Fast Dominance Algorithm" (Cooper,
+// Harvey, Kennedy)
+static void compute_dominators(Ir* ir)
+{
+    ir->blocks[0].idom = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 1; i < ir->order.count; ++i) {
+            IrBlock* block = &ir->blocks[ir->order.values[i]];
+            int idom = -1;
+            for (int j = 0; j < block->preds.count; ++j) {
+                int pred = block->preds.values[j];
+                if (ir->blocks[pred].idom != -1) {
+                    idom = idom == -1 ? pred : intersect(ir, pred, idom);
+                }
+            }
+            if (block->idom != idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool dominates(const Ir* ir, int a, int b)
+{
+    while (b != a && b != 0) {
+        b = ir->blocks[b].idom;
+    }
+    return a == b;
+}
+
+// Operations without side effects, whose result only depends on the operands
+static bool is_pure(int op)
+{
+    switch (op) {
+    case OP_NOT:
+    case OP_POSITIVE:
+    case OP_NEGATIVE:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool has_result(int op)
+{
+    return op != OP_DECL_GLOBAL && op != OP_DECL_GLOBAL_CONST;
+}
+
+static bool is_number_operand(const Ir* ir, const IrValue* value, int i)
+{
+    return ir->values[value->operands.values[i]].number;
+}
+
+// A pure operation which never raises an error, given what is known of its
+// operands
+static bool cannot_fail(const Ir* ir, const IrValue* value)
+{
+    switch (value->op) {
+    case OP_NOT:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+        return true;
+    case OP_POSITIVE:
+    case OP_NEGATIVE:
+        return is_number_operand(ir, value, 0);
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+        return is_number_operand(ir, value, 0) && is_number_operand(ir, value, 1);
+    case OP_DIVIDE: {
+        const IrValue* divisor = &ir->values[value->operands.values[1]];
+        return is_number_operand(ir, value, 0) && is_constant(divisor)
+            && is_number(divisor->constant) && as_number(divisor->constant) != 0;
+    }
+    default:
+        // Modulo converts its operands to integers, and checks the divisor
+        return false;
+    }
+}
+
+static bool operation_is_number(const Ir* ir, const IrValue* value)
+{
+    switch (value->op) {
+    case IR_PHI:
+        for (int i = 0; i < value->operands.count; ++i) {
+            if (!is_number_operand(ir, value, i)) {
+                return false;
+            }
+        }
+        return true;
+    case OP_SET_GLOBAL:
+        return is_number_operand(ir, value, 0);
+    case OP_ADD:
+        return is_number_operand(ir, value, 0) && is_number_operand(ir, value, 1);
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_POSITIVE:
+    case OP_NEGATIVE:
+        // Either a number or a runtime error (strings are only multiplied
+        // when an operand is a string)
+        return value->op != OP_MULTIPLY
+            || (is_number_operand(ir, value, 0) && is_number_operand(ir, value, 1));
+    default:
+        return false;
+    }
+}
+
+// Find the values which are always numbers. Values are assumed to be numbers
+// until an operand is not, so that loop counters are numbers.
+static void infer_numbers(Ir* ir)
+{
+    for (int i = 0; i < ir->value_count; ++i) {
+        IrValue* value = &ir->values[i];
+        value->number = !is_constant(value) || is_number(value->constant);
+    }
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < ir->order.count; ++i) {
+            const IrBlock* block = &ir->blocks[ir->order.values[i]];
+            for (int j = 0; j < block->values.count; ++j) {
+                IrValue* value = &ir->values[block->values.values[j]];
+                bool number = operation_is_number(ir, value);
+                if (value->number != number) {
+                    value->number = number;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+// Passes
+//------------------------------------------------------------------------------
+
+// Remove the edge between two blocks: the predecessor, and the operands of
+// the phis for this predecessor
+static void remove_edge(Ir* ir, int from, int to)
+{
+    IrBlock* block = &ir->blocks[to];
+    int pred = list_find(&block->preds, from);
+    int tail = block->preds.count - pred - 1;
+    memmove(block->preds.values + pred, block->preds.values + pred + 1, sizeof(int) * tail);
+    block->preds.count--;
+    for (int i = 0; i < block->values.count; ++i) {
+        IrValue* phi = &ir->values[block->values.values[i]];
+        if (phi->op != IR_PHI) {
+            break;
+        }
+        memmove(phi->operands.values + pred, phi->operands.values + pred + 1, sizeof(int) * tail);
+        phi->operands.count--;
+    }
+}
+
+// Branch folding: a branch on a constant becomes a jump, and the blocks which
+// are no longer reachable are removed
+// @return true if a branch has been folded
+static bool fold_branches(Ir* ir)
+{
+    bool changed = false;
+    for (int i = 0; i < ir->order.count; ++i) {
+        int index = ir->order.values[i];
+        IrBlock* block = &ir->blocks[index];
+        if (block->terminator == TERM_BRANCH && is_constant(&ir->values[block->operand])) {
+            bool truthy = value_truthy(ir->values[block->operand].constant);
+            remove_edge(ir, index, block->succs[truthy ? 1 : 0]);
+            block->succs[0] = block->succs[truthy ? 0 : 1];
+            block->succ_count = 1;
+            block->terminator = TERM_JUMP;
+            changed = true;
+        }
+    }
+    if (changed) {
+        IntArray previous = ir->order;
+        memset(&ir->order, 0, sizeof(IntArray));
+        order_blocks(ir);
+        for (int i = 0; i < previous.count; ++i) {
+            const IrBlock* block = &ir->blocks[previous.values[i]];
+            for (int j = 0; block->rpo == -1 && j < block->succ_count; ++j) {
+                if (ir->blocks[block->succs[j]].rpo != -1) {
+                    remove_edge(ir, previous.values[i], block->succs[j]);
+                }
+            }
+        }
+        free(previous.values);
+    }
+    return changed;
+}
+
+// Copy propagation: replace the phis merging a single value (and themselves,
+// in loops) with this value
+static void propagate_copies(Ir* ir)
+{
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < ir->value_count; ++i) {
+            IrValue* value = &ir->values[i];
+            if (value->op != IR_PHI || value->removed) {
+                continue;
+            }
+            int same = -1;
+            bool trivial = true;
+            for (int j = 0; trivial && j < value->operands.count; ++j) {
+                int operand = resolve(ir, value->operands.values[j]);
+                if (operand != i && operand != same) {
+                    trivial = same == -1;
+                    same = operand;
+                }
+            }
+            if (trivial && same != -1) {
+                value->replacement = same;
+                value->removed = true;
+                changed = true;
+            }
+        }
+    }
+    apply_replacements(ir);
+}
+
+static unsigned hash_operation(const IrValue* value)
+{
+    unsigned hash = (unsigned)value->op;
+    for (int i = 0; i < value->operands.count; ++i) {
+        hash = hash * 31 + (unsigned)value->operands.values[i];
+    }
+    return hash;
+}
+
+static bool same_operation(const IrValue* a, const IrValue* b)
+{
+    if (a->op != b->op || a->operands.count != b->operands.count) {
+        return false;
+    }
+    for (int i = 0; i < a->operands.count; ++i) {
+        if (a->operands.values[i] != b->operands.values[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Common subexpression elimination: replace a pure operation with the same
+// operation on the same values, computed by a dominating instruction. Blocks
+// are visited in reverse postorder, so that operands are already replaced.
+static void eliminate_common_subexpressions(Ir* ir)
+{
+    int size = 64;
+    while (size < ir->value_count * 2) {
+        size *= 2;
+    }
+    int* heads = malloc(sizeof(int) * size);
+    int* next = malloc(sizeof(int) * ir->value_count);
+    for (int i = 0; i < size; ++i) {
+        heads[i] = -1;
+    }
+
+    for (int i = 0; i < ir->order.count; ++i) {
+        const IrBlock* block = &ir->blocks[ir->order.values[i]];
+        for (int j = 0; j < block->values.count; ++j) {
+            int index = block->values.values[j];
+            IrValue* value = &ir->values[index];
+            if (!is_pure(value->op)) {
+                continue;
+            }
+            for (int k = 0; k < value->operands.count; ++k) {
+                value->operands.values[k] = resolve(ir, value->operands.values[k]);
+            }
+            unsigned bucket = hash_operation(value) & (size - 1);
+            int found = heads[bucket];
+            while (found != -1
+                && !(same_operation(&ir->values[found], value) && dominates(ir, ir->values[found].block, value->block))) {
+                found = next[found];
+            }
+            if (found != -1) {
+                value->replacement = found;
+                value->removed = true;
+            } else {
+                next[index] = heads[bucket];
+                heads[bucket] = index;
+            }
+        }
+    }
+    free(heads);
+    free(next);
+    apply_replacements(ir);
+}
+
+// Natural loop of a header: blocks reaching a back edge without going through
+// the header
+// @return number of blocks in the loop, 0 if the block is not a loop header
+static int find_loop(const Ir* ir, int header, bool* in_loop, int* worklist)
+{
+    int count = 0;
+    int size = 0;
+    const IrBlock* block = &ir->blocks[header];
+    for (int i = 0; i < block->preds.count; ++i) {
+        int pred = block->preds.values[i];
+        if (dominates(ir, header, pred) && !in_loop[pred]) {
+            in_loop[pred] = true;
+            worklist[count++] = pred;
+            ++size;
+        }
+    }
+    if (count == 0) {
+        return 0;
+    }
+    if (!in_loop[header]) {
+        in_loop[header] = true;
+        ++size;
+    }
+    while (count > 0) {
+        int index = worklist[--count];
+        if (index == header) {
+            continue;
+        }
+        const IrBlock* member = &ir->blocks[index];
+        for (int i = 0; i < member->preds.count; ++i) {
+            int pred = member->preds.values[i];
+            if (!in_loop[pred]) {
+                in_loop[pred] = true;
+                worklist[count++] = pred;
+                ++size;
+            }
+        }
+    }
+    return size;
+}
+
+// Block running right before a loop, created on the edge entering the loop if
+// its source has other successors
+// @return -1 if the loop has several entries
+static int find_preheader(Ir* ir, int header, const bool* in_loop)
+{
+    int entry = -1;
+    const IrBlock* block = &ir->blocks[header];
+    for (int i = 0; i < block->preds.count; ++i) {
+        int pred = block->preds.values[i];
+        if (!in_loop[pred]) {
+            if (entry != -1) {
+                return -1;
+            }
+            entry = pred;
+        }
+    }
+    if (entry == -1 || ir->blocks[entry].succ_count == 1) {
+        return entry;
+    }
+
+    int preheader = new_block(ir, -1, ir->blocks[header].line);
+    IrBlock* split = &ir->blocks[preheader];
+    split->succs[split->succ_count++] = header;
+    list_push(&split->preds, entry);
+    split->idom = entry;
+    IrBlock* source = &ir->blocks[entry];
+    for (int i = 0; i < source->succ_count; ++i) {
+        if (source->succs[i] == header) {
+            source->succs[i] = preheader;
+        }
+    }
+    IrBlock* target = &ir->blocks[header];
+    target->preds.values[list_find(&target->preds, entry)] = preheader;
+    target->idom = preheader;
+
+    // Laid out right before the loop
+    int position = target->rpo;
+    list_push(&ir->order, 0);
+    memmove(ir->order.values + position + 1, ir->order.values + position, sizeof(int) * (ir->order.count - position - 1));
+    ir->order.values[position] = preheader;
+    for (int i = position; i < ir->order.count; ++i) {
+        ir->blocks[ir->order.values[i]].rpo = i;
+    }
+    return preheader;
+}
+
+static bool is_invariant(const Ir* ir, const IrValue* value, const bool* in_loop, int loop_size)
+{
+    for (int i = 0; i < value->operands.count; ++i) {
+        int block = ir->values[value->operands.values[i]].block;
+        if (block != -1 && block < loop_size && in_loop[block]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Move the invariant operations of a loop block to the preheader. Operations
+// which may fail are only moved from the start of the header, which always
+// runs when the loop is entered: an error is then raised with the same
+// effects already done.
+static void hoist_block(Ir* ir, int index, int header, int preheader, const bool* in_loop, int loop_size)
+{
+    IrBlock* block = &ir->blocks[index];
+    bool prefix = index == header;
+    int kept = 0;
+    for (int i = 0; i < block->values.count; ++i) {
+        int v = block->values.values[i];
+        IrValue* value = &ir->values[v];
+        bool safe = is_pure(value->op) && cannot_fail(ir, value);
+        if (is_pure(value->op) && (safe || prefix) && is_invariant(ir, value, in_loop, loop_size)) {
+            value->block = preheader;
+            list_push(&ir->blocks[preheader].values, v);
+            continue;
+        }
+        if (value->op != IR_PHI && !safe) {
+            prefix = false;
+        }
+        block->values.values[kept++] = v;
+    }
+    block->values.count = kept;
+}
+
+typedef struct {
+    int header;
+    int size;
+} Loop;
+
+static int compare_loops(const void* a, const void* b)
+{
+    return ((const Loop*)a)->size - ((const Loop*)b)->size;
+}
+
+// Loop-invariant code motion, from the inner loops to the outer ones
+static void hoist_loop_invariants(Ir* ir)
+{
+    Loop* loops = malloc(sizeof(Loop) * ir->order.count);
+    int loop_count = 0;
+    bool* in_loop = malloc(sizeof(bool) * ir->block_count);
+    int* worklist = malloc(sizeof(int) * ir->block_count);
+    memset(in_loop, 0, sizeof(bool) * ir->block_count);
+    for (int i = 0; i < ir->order.count; ++i) {
+        int size = find_loop(ir, ir->order.values[i], in_loop, worklist);
+        if (size > 0) {
+            loops[loop_count].header = ir->order.values[i];
+            loops[loop_count++].size = size;
+            memset(in_loop, 0, sizeof(bool) * ir->block_count);
+        }
+    }
+    qsort(loops, loop_count, sizeof(Loop), compare_loops);
+
+    for (int i = 0; i < loop_count; ++i) {
+        // Blocks may have been added by the previous loops: find the loop again
+        int header = loops[i].header;
+        int loop_size = ir->block_count;
+        in_loop = realloc_array(in_loop, sizeof(bool), loop_size);
+        worklist = realloc_array(worklist, sizeof(int), loop_size);
+        memset(in_loop, 0, sizeof(bool) * loop_size);
+        find_loop(ir, header, in_loop, worklist);
+        int preheader = find_preheader(ir, header, in_loop);
+        if (preheader == -1) {
+            continue;
+        }
+        for (int j = 0; j < ir->order.count; ++j) {
+            int index = ir->order.values[j];
+            if (index < loop_size && in_loop[index]) {
+                hoist_block(ir, index, header, preheader, in_loop, loop_size);
+            }
+        }
+    }
+    free(loops);
+    free(in_loop);
+    free(worklist);
+}
+
+static bool is_removable(const Ir* ir, const IrValue* value)
+{
+    return value->op == IR_PHI || (is_pure(value->op) && cannot_fail(ir, value));
+}
+
+static void mark_live(bool* live, int* worklist, int* count, int value)
+{
+    if (!live[value]) {
+        live[value] = true;
+        worklist[(*count)++] = value;
+    }
+}
+
+// Dead store elimination: remove the phis and the operations without effect
+// whose value is never used. Other operations are still run, and their result
+// is popped.
+static void eliminate_dead_values(Ir* ir)
+{
+    bool* live = calloc(ir->value_count, sizeof(bool));
+    int* worklist = malloc(sizeof(int) * ir->value_count);
+    int count = 0;
+    for (int i = 0; i < ir->order.count; ++i) {
+        const IrBlock* block = &ir->blocks[ir->order.values[i]];
+        for (int j = 0; j < block->values.count; ++j) {
+            int value = block->values.values[j];
+            if (!is_removable(ir, &ir->values[value])) {
+                mark_live(live, worklist, &count, value);
+            }
+        }
+        if (block->terminator != TERM_JUMP) {
+            mark_live(live, worklist, &count, block->operand);
+        }
+    }
+    while (count > 0) {
+        const IrValue* value = &ir->values[worklist[--count]];
+        for (int i = 0; i < value->operands.count; ++i) {
+            mark_live(live, worklist, &count, value->operands.values[i]);
+        }
+    }
+
+    for (int i = 0; i < ir->value_count; ++i) {
+        if (!live[i] && ir->values[i].block != -1) {
+            ir->values[i].removed = true;
+        }
+    }
+    apply_replacements(ir);
+    free(live);
+    free(worklist);
+}
+
+// Code generation
+//------------------------------------------------------------------------------
+
+static void add_use(Ir* ir, int value, int block, bool phi)
+{
+    IrValue* used = &ir->values[value];
+    used->use_count++;
+    used->user_block = block;
+    used->phi_use |= phi;
+}
+
+static void count_uses(Ir* ir)
+{
+    for (int i = 0; i < ir->value_count; ++i) {
+        ir->values[i].use_count = 0;
+    }
+    for (int i = 0; i < ir->order.count; ++i) {
+        int index = ir->order.values[i];
+        const IrBlock* block = &ir->blocks[index];
+        for (int j = 0; j < block->values.count; ++j) {
+            const IrValue* value = &ir->values[block->values.values[j]];
+            for (int k = 0; k < value->operands.count; ++k) {
+                add_use(ir, value->operands.values[k], index, value->op == IR_PHI);
+            }
+        }
+        if (block->terminator != TERM_JUMP) {
+            add_use(ir, block->operand, index, false);
+        }
+    }
+}
+
+// Position of the instruction computing a value in a block, -1 if the value
+// is known on entry of the block
+static int definition_position(const Ir* ir, int index, int block)
+{
+    const IrValue* value = &ir->values[index];
+    return value->block == block && value->op != IR_PHI ? value->position : -1;
+}
+
+// Pop the operands of an instruction from the simulated stack. Operands kept
+// on the stack must be on top, in order. The other operands are loaded by
+// the instruction, or at the start of the computation of the next operand
+// kept on the stack: they must be defined before.
+// @param start: start of the computation of the operands
+// @return true if an operand has been moved to a frame slot
+static bool consume(Ir* ir, int block, int* pending, int* count, const IntArray* operands, int* start)
+{
+    int top = *count;
+    int next = -1;
+    for (int i = operands->count - 1; i >= 0; --i) {
+        IrValue* operand = &ir->values[operands->values[i]];
+        if (operand->on_stack) {
+            if (top == 0 || pending[--top] != operands->values[i]) {
+                operand->on_stack = false;
+                return true;
+            }
+            next = operands->values[i];
+        } else if (next != -1 && definition_position(ir, operands->values[i], block) >= ir->values[next].start) {
+            ir->values[next].on_stack = false;
+            return true;
+        }
+    }
+    *count = top;
+    *start = next == -1 ? -1 : ir->values[next].start;
+    return false;
+}
+
+// @return true if a value of the block has been moved to a frame slot
+static bool simulate_block(Ir* ir, int index, int* pending)
+{
+    IrBlock* block = &ir->blocks[index];
+    int count = 0;
+    for (int i = 0; i < block->values.count; ++i) {
+        int value = block->values.values[i];
+        IrValue* instruction = &ir->values[value];
+        int start;
+        if (consume(ir, index, pending, &count, &instruction->operands, &start)) {
+            return true;
+        }
+        if (instruction->on_stack) {
+            instruction->start = start == -1 ? i : start;
+            pending[count++] = value;
+        }
+    }
+    if (block->terminator == TERM_JUMP) {
+        return false;
+    }
+    IntArray operand = { 1, 1, &block->operand };
+    int start;
+    return consume(ir, index, pending, &count, &operand, &start);
+}
+
+// Operations whose operands can be swapped
+static bool is_commutative(const Ir* ir, const IrValue* value)
+{
+    switch (value->op) {
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+        return true;
+    case OP_ADD:
+    case OP_MULTIPLY:
+        return is_number_operand(ir, value, 0) && is_number_operand(ir, value, 1);
+    default:
+        return false;
+    }
+}
+
+// Keep on the stack the values used once, by an instruction of the same block
+static void place_on_stack(Ir* ir)
+{
+    for (int i = 0; i < ir->value_count; ++i) {
+        IrValue* value = &ir->values[i];
+        value->on_stack = !is_constant(value) && !value->removed
+            && value->op != IR_PARAM && value->op != IR_PHI && has_result(value->op)
+            && value->use_count == 1 && !value->phi_use && value->user_block == value->block;
+    }
+    // Computed operand first: it stays on the stack while the other is loaded
+    for (int i = 0; i < ir->value_count; ++i) {
+        IrValue* value = &ir->values[i];
+        if (!value->removed && !is_constant(value) && is_commutative(ir, value)
+            && !ir->values[value->operands.values[0]].on_stack && ir->values[value->operands.values[1]].on_stack) {
+            int operand = value->operands.values[0];
+            value->operands.values[0] = value->operands.values[1];
+            value->operands.values[1] = operand;
+        }
+    }
+    int* pending = malloc(sizeof(int) * ir->value_count);
+    for (int i = 0; i < ir->order.count; ++i) {
+        const IrBlock* block = &ir->blocks[ir->order.values[i]];
+        for (int j = 0; j < block->values.count; ++j) {
+            ir->values[block->values.values[j]].position = j;
+        }
+        while (simulate_block(ir, ir->order.values[i], pending)) {
+        }
+    }
+    free(pending);
+}
+
+static void set_bit(Bits* bits, int i)
+{
+    bits[i >> 6] |= (Bits)1 << (i & 63);
+}
+
+static void clear_bit(Bits* bits, int i)
+{
+    bits[i >> 6] &= ~((Bits)1 << (i & 63));
+}
+
+static bool test_bit(const Bits* bits, int i)
+{
+    return (bits[i >> 6] >> (i & 63)) & 1;
+}
+
+static void add_live(const Ir* ir, Bits* live, int value)
+{
+    if (ir->values[value].variable != -1) {
+        set_bit(live, ir->values[value].variable);
+    }
+}
+
+// Variables live on exit of a block: live on entry of its successors, and
+// read by their phis on the edge from this block
+static void live_out(const Ir* ir, int index, const Bits* live_in, int words, Bits* live)
+{
+    memset(live, 0, sizeof(Bits) * words);
+    const IrBlock* block = &ir->blocks[index];
+    for (int i = 0; i < block->succ_count; ++i) {
+        int succ = block->succs[i];
+        const IrBlock* target = &ir->blocks[succ];
+        for (int w = 0; w < words; ++w) {
+            live[w] |= live_in[succ * words + w];
+        }
+        int pred = list_find(&target->preds, index);
+        for (int j = 0; j < target->values.count; ++j) {
+            const IrValue* phi = &ir->values[target->values.values[j]];
+            if (phi->op != IR_PHI) {
+                break;
+            }
+            add_live(ir, live, phi->operands.values[pred]);
+        }
+    }
+}
+
+static void interfere(Bits* matrix, int words, int a, int b)
+{
+    if (a != b) {
+        set_bit(matrix + a * words, b);
+        set_bit(matrix + b * words, a);
+    }
+}
+
+static void interfere_live(Bits* matrix, int words, int variable, const Bits* live)
+{
+    for (int w = 0; w < words; ++w) {
+        for (Bits bits = live[w]; bits != 0; bits &= bits - 1) {
+            interfere(matrix, words, variable, w * 64 + __builtin_ctzll(bits));
+        }
+    }
+}
+
+// Walk a block backward from the variables live on exit. With a matrix,
+// record the interferences: a value interferes with the values live where it
+// is defined, phis with the values live on entry and with each other.
+static void walk_block(const Ir* ir, int index, Bits* live, Bits* matrix, int words)
+{
+    const IrBlock* block = &ir->blocks[index];
+    if (block->terminator != TERM_JUMP) {
+        add_live(ir, live, block->operand);
+    }
+    int phi_count = 0;
+    for (int i = block->values.count - 1; i >= 0; --i) {
+        const IrValue* value = &ir->values[block->values.values[i]];
+        if (value->op == IR_PHI) {
+            phi_count = i + 1;
+            break;
+        }
+        if (value->variable != -1) {
+            clear_bit(live, value->variable);
+            if (matrix != NULL) {
+                interfere_live(matrix, words, value->variable, live);
+            }
+        }
+        for (int j = 0; j < value->operands.count; ++j) {
+            add_live(ir, live, value->operands.values[j]);
+        }
+    }
+    for (int i = 0; i < phi_count; ++i) {
+        const IrValue* phi = &ir->values[block->values.values[i]];
+        if (phi->variable == -1) {
+            continue;
+        }
+        clear_bit(live, phi->variable);
+        if (matrix != NULL) {
+            interfere_live(matrix, words, phi->variable, live);
+            for (int j = 0; j < phi_count; ++j) {
+                const IrValue* other = &ir->values[block->values.values[j]];
+                if (other->variable != -1) {
+                    interfere(matrix, words, phi->variable, other->variable);
+                }
+            }
+        }
+    }
+}
+
+// Give a frame slot to each value not kept on the stack. Values interfering
+// with each other get distinct slots, and a phi gets the slot of an operand
+// when possible, to save the copy on the edge.
+static bool allocate_slots(Ir* ir, int* slot_count)
+{
+    int* variables = malloc(sizeof(int) * ir->value_count);
+    int variable_count = 0;
+    for (int i = 0; i < ir->order.count; ++i) {
+        const IrBlock* block = &ir->blocks[ir->order.values[i]];
+        for (int j = 0; j < block->values.count; ++j) {
+            int v = block->values.values[j];
+            IrValue* value = &ir->values[v];
+            value->variable = -1;
+            value->slot = -1;
+            if (has_result(value->op) && value->use_count > 0 && !value->on_stack) {
+                value->variable = variable_count;
+                variables[variable_count++] = v;
+            }
+        }
+    }
+    if (variable_count > IR_MAX_VARIABLES) {
+        free(variables);
+        return false;
+    }
+
+    // Liveness, until a fixpoint
+    int words = variable_count / 64 + 1;
+    Bits* live_in = calloc(ir->block_count * words, sizeof(Bits));
+    Bits* live = malloc(sizeof(Bits) * words);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = ir->order.count - 1; i >= 0; --i) {
+            int index = ir->order.values[i];
+            live_out(ir, index, live_in, words, live);
+            walk_block(ir, index, live, NULL, words);
+            if (memcmp(live, live_in + index * words, sizeof(Bits) * words) != 0) {
+                memcpy(live_in + index * words, live, sizeof(Bits) * words);
+                changed = true;
+            }
+        }
+    }
+    Bits* matrix = calloc(variable_count * words, sizeof(Bits));
+    for (int i = 0; i < ir->order.count; ++i) {
+        live_out(ir, ir->order.values[i], live_in, words, live);
+        walk_block(ir, ir->order.values[i], live, matrix, words);
+    }
+
+    // Copy related values: phis and their operands
+    IntArray* related = calloc(variable_count, sizeof(IntArray));
+    for (int i = 0; i < variable_count; ++i) {
+        const IrValue* phi = &ir->values[variables[i]];
+        for (int j = 0; phi->op == IR_PHI && j < phi->operands.count; ++j) {
+            int operand = ir->values[phi->operands.values[j]].variable;
+            if (operand != -1) {
+                list_push(&related[i], operand);
+                list_push(&related[operand], i);
+            }
+        }
+    }
+
+    bool valid = true;
+    *slot_count = ir->function->arity + 1;
+    for (int i = 0; valid && i < variable_count; ++i) {
+        IrValue* value = &ir->values[variables[i]];
+        int slot = -1;
+        if (value->op == IR_PARAM) {
+            slot = value->a;
+        } else {
+            bool used[UINT8_MAX + 1] = { false };
+            const Bits* neighbors = matrix + i * words;
+            for (int j = 0; j < variable_count; ++j) {
+                if (test_bit(neighbors, j) && ir->values[variables[j]].slot != -1) {
+                    used[ir->values[variables[j]].slot] = true;
+                }
+            }
+            for (int j = 0; slot == -1 && j < related[i].count; ++j) {
+                int preferred = ir->values[variables[related[i].values[j]]].slot;
+                if (preferred != -1 && !used[preferred]) {
+                    slot = preferred;
+                }
+            }
+            for (int j = 0; slot == -1 && j <= UINT8_MAX; ++j) {
+                if (!used[j]) {
+                    slot = j;
+                }
+            }
+            valid = slot != -1;
+        }
+        value->slot = slot;
+        if (slot >= *slot_count) {
+            *slot_count = slot + 1;
+        }
+    }
+
+    for (int i = 0; i < variable_count; ++i) {
+        free(related[i].values);
+    }
+    free(related);
+    free(matrix);
+    free(live);
+    free(live_in);
+    free(variables);
+    return valid;
+}
+
+static void gen_op(Generator* gen, uint8_t op, int line)
+{
+    gen->last_instruction = gen->chunk.count;
+    gen->last_value = -1;
+    chunk_write(&gen->chunk, op, line);
+}
+
+static void gen_op_byte(Generator* gen, uint8_t op, uint8_t operand, int line)
+{
+    gen_op(gen, op, line);
+    chunk_write(&gen->chunk, operand, line);
+}
+
+// Instructions on globals: 1 byte or 2 bytes variant
+static void gen_global(Generator* gen, uint8_t op, int slot, int line)
+{
+    if (slot <= UINT8_MAX) {
+        gen_op_byte(gen, op, slot, line);
+        return;
+    }
+    switch (op) {
+    case OP_DECL_GLOBAL: gen_op(gen, OP_DECL_GLOBAL_16, line); break;
+    case OP_DECL_GLOBAL_CONST: gen_op(gen, OP_DECL_GLOBAL_CONST_16, line); break;
+    case OP_GET_GLOBAL: gen_op(gen, OP_GET_GLOBAL_16, line); break;
+    default: gen_op(gen, OP_SET_GLOBAL_16, line); break;
+    }
+    chunk_write(&gen->chunk, slot >> 8, line);
+    chunk_write(&gen->chunk, slot & 0xff, line);
+}
+
+// Load an operand which is not on the stack
+static void gen_operand(Generator* gen, int index, int line)
+{
+    IrValue* value = &gen->ir->values[index];
+    if (value->on_stack) {
+        return;
+    }
+    if (!is_constant(value)) {
+        gen_op_byte(gen, OP_GET_LOCAL, value->slot, line);
+        return;
+    }
+    if (value->op != OP_CONSTANT) {
+        gen_op(gen, value->op, line);
+        return;
+    }
+    if (value->a == -1) {
+        ValueArray* constants = &gen->ir->function->chunk.constants;
+        value->a = value_array_find(constants, value->constant);
+        if (value->a == -1) {
+            gc_write_barrier(&gen->ir->function->object, value->constant);
+            value_array_push(constants, value->constant);
+            value->a = constants->count - 1;
+        }
+    }
+    if (value->a > UINT16_MAX) {
+        gen->valid = false;
+        return;
+    }
+    gen->last_instruction = gen->chunk.count;
+    gen->last_value = -1;
+    chunk_write_constant(&gen->chunk, value->a, line);
+}
+
+static void gen_value(Generator* gen, int index)
+{
+    IrValue* value = &gen->ir->values[index];
+    int line = value->line;
+    if (value->op == IR_PARAM || value->op == IR_PHI) {
+        return;
+    }
+    // Operands before the last one kept on the stack are already loaded
+    int loaded = 0;
+    for (int i = 0; i < value->operands.count; ++i) {
+        if (gen->ir->values[value->operands.values[i]].on_stack) {
+            loaded = i + 1;
+        }
+    }
+    for (int i = loaded; i < value->operands.count; ++i) {
+        gen_operand(gen, value->operands.values[i], line);
+    }
+
+    switch (value->op) {
+    case OP_DECL_GLOBAL:
+    case OP_DECL_GLOBAL_CONST:
+    case OP_GET_GLOBAL:
+        gen_global(gen, value->op, value->a, line);
+        break;
+    case OP_SET_GLOBAL:
+        if (value->use_count == 0 && value->a <= UINT8_MAX) {
+            gen_op_byte(gen, OP_SET_GLOBAL_POP, value->a, line);
+            return;
+        }
+        gen_global(gen, OP_SET_GLOBAL, value->a, line);
+        break;
+    case OP_CALL:
+        gen_op_byte(gen, OP_CALL, value->operands.count - 1, line);
+        break;
+    case OP_ARRAY:
+        gen_op_byte(gen, OP_ARRAY, value->operands.count, line);
+        break;
+    default:
+        gen_op(gen, value->op, line);
+        break;
+    }
+    gen->last_value = index;
+
+    if (!has_result(value->op) || value->on_stack) {
+        return;
+    }
+    if (value->use_count == 0) {
+        gen_op(gen, OP_POP, line);
+    } else {
+        gen_op_byte(gen, OP_SET_LOCAL_POP, value->slot, line);
+    }
+}
+
+static bool needs_copy(const Ir* ir, const IrValue* phi, int source)
+{
+    return phi->variable != -1 && ir->values[source].slot != phi->slot;
+}
+
+static bool has_copies(const Ir* ir, int from, int to)
+{
+    const IrBlock* block = &ir->blocks[to];
+    int pred = list_find(&block->preds, from);
+    for (int i = 0; i < block->values.count; ++i) {
+        const IrValue* phi = &ir->values[block->values.values[i]];
+        if (phi->op != IR_PHI) {
+            break;
+        }
+        if (needs_copy(ir, phi, phi->operands.values[pred])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Copy the values merged by the phis of a block, on the edge from a
+// predecessor. All the values are loaded before the first store.
+static void gen_copies(Generator* gen, int from, int to, int line)
+{
+    const Ir* ir = gen->ir;
+    const IrBlock* block = &ir->blocks[to];
+    int pred = list_find(&block->preds, from);
+    for (int i = 0; i < block->values.count; ++i) {
+        const IrValue* phi = &ir->values[block->values.values[i]];
+        if (phi->op != IR_PHI) {
+            break;
+        }
+        if (needs_copy(ir, phi, phi->operands.values[pred])) {
+            gen_operand(gen, phi->operands.values[pred], line);
+        }
+    }
+    for (int i = block->values.count - 1; i >= 0; --i) {
+        const IrValue* phi = &ir->values[block->values.values[i]];
+        if (phi->op == IR_PHI && needs_copy(ir, phi, phi->operands.values[pred])) {
+            gen_op_byte(gen, OP_SET_LOCAL_POP, phi->slot, line);
+        }
+    }
+}
+
+static int gen_jump(Generator* gen, uint8_t op, int line)
+{
+    gen_op(gen, op, line);
+    chunk_write(&gen->chunk, 0xff, line);
+    chunk_write(&gen->chunk, 0xff, line);
+    return gen->chunk.count - 2;
+}
+
+// Jump to a block, patched once all the blocks are generated
+static void gen_jump_to(Generator* gen, uint8_t op, int target, int line)
+{
+    list_push(&gen->patches, gen_jump(gen, op, line));
+    list_push(&gen->patches, target);
+}
+
+static void patch_jump(Generator* gen, int operand)
+{
+    int distance = gen->chunk.count - operand - 2;
+    if (distance > UINT16_MAX) {
+        gen->valid = false;
+    }
+    gen->chunk.code[operand] = (distance >> 8) & 0xff;
+    gen->chunk.code[operand + 1] = distance & 0xff;
+}
+
+// Go to a successor, after the copies of its phis
+static void gen_edge(Generator* gen, int from, int to, bool falls_through, int line)
+{
+    gen_copies(gen, from, to, line);
+    if (!falls_through || gen->ir->blocks[to].rpo != gen->ir->blocks[from].rpo + 1) {
+        gen_jump_to(gen, OP_JUMP, to, line);
+    }
+}
+
+static void gen_terminator(Generator* gen, int index)
+{
+    Ir* ir = gen->ir;
+    const IrBlock* block = &ir->blocks[index];
+    int line = block->line;
+    if (block->terminator == TERM_RETURN) {
+        gen_operand(gen, block->operand, line);
+        if (gen->last_value == block->operand && ir->values[block->operand].op == OP_CALL) {
+            gen->chunk.code[gen->last_instruction] = OP_TAIL_CALL;
+        }
+        gen_op(gen, OP_RETURN, line);
+        return;
+    }
+    if (block->terminator == TERM_JUMP) {
+        gen_edge(gen, index, block->succs[0], true, line);
+        return;
+    }
+
+    // The true edge falls through, the false edge is generated after all the
+    // blocks: the condition, copies of the phis, then a jump to the block
+    int on_true = block->succs[0];
+    int on_false = block->succs[1];
+    uint8_t compare_jump = compare_jump_for(ir->values[block->operand].op);
+    bool pop = true;
+    if (compare_jump != 0 && gen->last_value == block->operand && ir->values[block->operand].on_stack) {
+        // Fuse the comparison and the branch. Without copies, jump to the
+        // false block directly if it is laid out after this one.
+        chunk_truncate(&gen->chunk, gen->last_instruction);
+        if (!has_copies(ir, index, on_false) && ir->blocks[on_false].rpo > block->rpo) {
+            gen_jump_to(gen, compare_jump, on_false, line);
+            gen_edge(gen, index, on_true, true, line);
+            return;
+        }
+        pop = false;
+    } else {
+        gen_operand(gen, block->operand, line);
+        compare_jump = OP_JUMP_IF_FALSE;
+    }
+    list_push(&gen->stubs, gen_jump(gen, compare_jump, line));
+    list_push(&gen->stubs, index);
+    list_push(&gen->stubs, pop);
+    if (pop) {
+        gen_op(gen, OP_POP, line);
+    }
+    gen_edge(gen, index, on_true, true, line);
+}
+
+static int compare_preloads(const void* a, const void* b)
+{
+    const Preload* x = (const Preload*)a;
+    const Preload* y = (const Preload*)b;
+    if (x->start != y->start) {
+        return x->start - y->start;
+    }
+    // Operands of the outer instruction first: it runs last
+    return x->user != y->user ? y->user - x->user : x->index - y->index;
+}
+
+// Operands of the instructions of a block loaded early, sorted by position
+static int find_preloads(const Ir* ir, const IrBlock* block, Preload** preloads, int* capacity)
+{
+    int count = 0;
+    for (int i = 0; i < block->values.count; ++i) {
+        const IrValue* value = &ir->values[block->values.values[i]];
+        int start = -1;
+        for (int j = value->operands.count - 1; j >= 0; --j) {
+            const IrValue* operand = &ir->values[value->operands.values[j]];
+            if (operand->on_stack) {
+                start = operand->start;
+            } else if (start != -1) {
+                if (count == *capacity) {
+                    *capacity = *capacity < 16 ? 16 : *capacity * 2;
+                    *preloads = realloc_array(*preloads, sizeof(Preload), *capacity);
+                }
+                Preload* preload = &(*preloads)[count++];
+                preload->start = start;
+                preload->user = i;
+                preload->index = j;
+                preload->value = value->operands.values[j];
+            }
+        }
+    }
+    if (count > 0) {
+        qsort(*preloads, count, sizeof(Preload), compare_preloads);
+    }
+    return count;
+}
+
+// Lower the graph to bytecode, replacing the code of the function
+static bool generate_code(Ir* ir)
+{
+    count_uses(ir);
+    place_on_stack(ir);
+    int slot_count;
+    if (!allocate_slots(ir, &slot_count)) {
+        return false;
+    }
+
+    Generator gen = { 0 };
+    gen.ir = ir;
+    gen.valid = true;
+    gen.last_value = -1;
+    chunk_init(&gen.chunk);
+    // Locals are held in the frame slots above the arguments
+    for (int slot = ir->function->arity + 1; slot < slot_count; ++slot) {
+        gen_op(&gen, OP_NULL, ir->blocks[0].line);
+    }
+    Preload* preloads = NULL;
+    int capacity = 0;
+    for (int i = 0; i < ir->order.count; ++i) {
+        IrBlock* block = &ir->blocks[ir->order.values[i]];
+        block->code_offset = gen.chunk.count;
+        gen.last_value = -1;
+        int preload_count = find_preloads(ir, block, &preloads, &capacity);
+        for (int j = 0, k = 0; j < block->values.count; ++j) {
+            for (; k < preload_count && preloads[k].start == j; ++k) {
+                gen_operand(&gen, preloads[k].value, ir->values[block->values.values[j]].line);
+            }
+            gen_value(&gen, block->values.values[j]);
+        }
+        gen_terminator(&gen, ir->order.values[i]);
+    }
+    free(preloads);
+    for (int i = 0; i < gen.stubs.count; i += 3) {
+        const IrBlock* block = &ir->blocks[gen.stubs.values[i + 1]];
+        patch_jump(&gen, gen.stubs.values[i]);
+        if (gen.stubs.values[i + 2]) {
+            gen_op(&gen, OP_POP, block->line);
+        }
+        gen_edge(&gen, gen.stubs.values[i + 1], block->succs[1], false, block->line);
+    }
+    free(gen.stubs.values);
+
+    for (int i = 0; i < gen.patches.count; i += 2) {
+        int operand = gen.patches.values[i];
+        int target = ir->blocks[gen.patches.values[i + 1]].code_offset;
+        int distance = target - (operand + 2);
+        if (distance < 0) {
+            // Only unconditional jumps go back to a block
+            gen.chunk.code[operand - 1] = OP_JUMP_BACK;
+            distance = -distance;
+        }
+        if (distance > UINT16_MAX) {
+            gen.valid = false;
+        }
+        gen.chunk.code[operand] = (distance >> 8) & 0xff;
+        gen.chunk.code[operand + 1] = distance & 0xff;
+    }
+    free(gen.patches.values);
+
+    if (gen.valid) {
+        // Replace the code and the line numbers, and keep the constants
+        gen.chunk.constants = ir->function->chunk.constants;
+        value_array_init(&ir->function->chunk.constants);
+        chunk_free(&ir->function->chunk);
+        ir->function->chunk = gen.chunk;
+    } else {
+        chunk_free(&gen.chunk);
+    }
+    return gen.valid;
+}
+
+// Dump
+//------------------------------------------------------------------------------
+
+static void dump_operand(const Ir* ir, int index)
+{
+    const IrValue* value = &ir->values[index];
+    if (is_constant(value)) {
+        value_repr(value->constant);
+    } else {
+        printf("v%d", index);
+    }
+}
+
+static void dump(const Ir* ir)
+{
+    const ObjectFunction* function = ir->function;
+    printf("== %s::ir ==\n", function->name == NULL ? "__main__" : function->name->chars);
+    for (int i = 0; i < ir->order.count; ++i) {
+        int index = ir->order.values[i];
+        const IrBlock* block = &ir->blocks[index];
+        printf("block %d", index);
+        for (int j = 0; j < block->preds.count; ++j) {
+            printf(j == 0 ? " <- %d" : ", %d", block->preds.values[j]);
+        }
+        printf("\n");
+        for (int j = 0; j < block->values.count; ++j) {
+            int v = block->values.values[j];
+            const IrValue* value = &ir->values[v];
+            printf("  v%d = ", v);
+            if (value->op == IR_PARAM) {
+                printf("param %d", value->a);
+            } else if (value->op == IR_PHI) {
+                printf("phi");
+            } else {
+                printf("%s", op2str(value->op));
+            }
+            if (value->op == OP_DECL_GLOBAL || value->op == OP_DECL_GLOBAL_CONST
+                || value->op == OP_GET_GLOBAL || value->op == OP_SET_GLOBAL) {
+                printf(" @%d", value->a);
+            }
+            for (int k = 0; k < value->operands.count; ++k) {
+                printf(k == 0 ? " " : ", ");
+                dump_operand(ir, value->operands.values[k]);
+            }
+            printf("\n");
+        }
+        switch (block->terminator) {
+        case TERM_JUMP:
+            printf("  jump %d\n", block->succs[0]);
+            break;
+        case TERM_BRANCH:
+            printf("  branch ");
+            dump_operand(ir, block->operand);
+            printf(" ? %d : %d\n", block->succs[0], block->succs[1]);
+            break;
+        case TERM_RETURN:
+            printf("  return ");
+            dump_operand(ir, block->operand);
+            printf("\n");
+            break;
+        }
+    }
+}
+
+bool ir_optimize(ObjectFunction* function)
+{
+    if (function->chunk.count == 0) {
+        return false;
+    }
+
+    Ir ir = { 0 };
+    ir.function = function;
+    ir.constants = malloc(sizeof(int) * (function->chunk.constants.count + 1));
+    for (int i = 0; i < function->chunk.constants.count; ++i) {
+        ir.constants[i] = -1;
+    }
+    for (int i = 0; i <= OP_NULL - OP_ZERO; ++i) {
+        ir.predefined[i] = -1;
+    }
+
+    bool optimized = build_blocks(&ir);
+    if (optimized) {
+        compute_order(&ir);
+        optimized = build_values(&ir);
+    }
+    if (optimized) {
+        propagate_copies(&ir);
+        while (fold_branches(&ir)) {
+            propagate_copies(&ir);
+        }
+        compute_dominators(&ir);
+        eliminate_common_subexpressions(&ir);
+        infer_numbers(&ir);
+        hoist_loop_invariants(&ir);
+        eliminate_dead_values(&ir);
+        if (dump_graph) {
+            dump(&ir);
+        }
+        optimized = generate_code(&ir);
+    }
+    ir_free(&ir);
+    return optimized;
+}
+
+void ir_dump_graph(bool enabled)
+{
+    dump_graph = enabled;
+}
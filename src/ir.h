@@ -0,0 +1,43 @@
+#ifndef ASPIC_IR_H
+#define ASPIC_IR_H
+
+#include "object.h"
+
+/**
+ * Mid-level IR, compilation pipeline of -O2
+ *
+ * The bytecode emitted by the parser for a function is translated into a
+ * control flow graph of basic blocks in SSA form: local variables and stack
+ * temporaries become values, merged by phis where the control flow joins.
+ * Passes then run on the graph:
+ * - branch folding: branches on a constant become jumps, and the blocks no
+ *   longer reachable are removed
+ * - copy propagation: phis merging a single value are replaced by it
+ * - common subexpression elimination: pure operations computed again on the
+ *   same values are replaced by the result of the dominating one
+ * - loop-invariant code motion: pure operations on values defined outside a
+ *   loop are hoisted before the loop, when this cannot raise an error which
+ *   the loop would not have raised
+ * - dead store elimination: values stored in locals but never read are not
+ *   stored, and not computed if this has no effect
+ *
+ * The code generator then lowers the graph back to bytecode: values used
+ * once by the next instruction stay on the stack, the other ones are given
+ * a frame slot, shared by values which are never live at the same time.
+ * The result uses the same instruction set as the parser output, and goes
+ * through the peephole optimizer afterwards.
+ */
+
+/**
+ * Rewrite the bytecode of a function compiled by the parser, through the IR
+ * @return true if the bytecode has been replaced, false if the function uses
+ * a construct the IR does not handle (the bytecode is then left unchanged)
+ */
+bool ir_optimize(ObjectFunction* function);
+
+/**
+ * Print the IR graph of each function to stdout, after the passes
+ */
+void ir_dump_graph(bool enabled);
+
+#endif
@@ -0,0 +1,1005 @@
+// MAP_ANONYMOUS is not part of POSIX
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+
+#ifdef ASPIC_JIT
+
+#include "gc.h"
+#include "op_code.h"
+#include "utils.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// x86-64 general purpose registers
+typedef enum {
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15,
+} Register;
+
+// SSE registers
+#define XMM0 0
+#define XMM1 1
+
+// Interpreter state, in callee-saved registers
+#define REG_SP RBX    // Value*: stack top
+#define REG_SLOTS R12 // Value*: slots of the frame
+#define REG_FRAME R13 // CallFrame*
+
+// Condition codes of conditional jumps (jcc)
+typedef enum {
+    CC_B = 0x2,
+    CC_AE = 0x3,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A = 0x7,
+    CC_S = 0x8,
+} Condition;
+
+// SSE2 scalar double instructions (prefix, opcode)
+#define SSE_MOVSD_LOAD 0xf2, 0x10
+#define SSE_MOVSD_STORE 0xf2, 0x11
+#define SSE_ADDSD 0xf2, 0x58
+#define SSE_MULSD 0xf2, 0x59
+#define SSE_SUBSD 0xf2, 0x5c
+#define SSE_UCOMISD 0x66, 0x2e
+
+#define VALUE_SIZE ((int)sizeof(Value))
+// Offset of sp[-1 - distance] from the stack top
+#define PEEK(distance) (-VALUE_SIZE * ((distance) + 1))
+// Offset of slots[slot] from the frame slots
+#define SLOT(slot) (VALUE_SIZE * (slot))
+
+#ifdef ASPIC_NAN_BOXING
+#define NUMBER_OFFSET 0
+#else
+#define NUMBER_OFFSET ((int)offsetof(Value, as))
+#endif
+
+typedef struct {
+    // Position of the rel32 operand in the machine code
+    int position;
+    // Bytecode offset of the jump target, or -1 for the error exit
+    int target;
+} Fixup;
+
+typedef struct {
+    // Machine code
+    uint8_t* code;
+    int count;
+    int capacity;
+
+    const ObjectFunction* function;
+    // Machine code offset of each instruction, indexed by bytecode offset
+    int* offsets;
+    // Jumps to patch, once all the instructions are emitted
+    Fixup* fixups;
+    int fixup_count;
+    int fixup_capacity;
+    // Bytecode offset of the next instruction, written back to frame->ip
+    int next_ip;
+} Assembler;
+
+extern VM vm;
+
+static bool enabled = true;
+static size_t compiled_count = 0;
+
+// Encoding
+//------------------------------------------------------------------------------
+
+static void emit8(Assembler* as, uint8_t byte)
+{
+    if (as->capacity < as->count + 1) {
+        as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        as->code = realloc_array(as->code, sizeof(uint8_t), as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler* as, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        emit8(as, (value >> (i * 8)) & 0xff);
+    }
+}
+
+static void emit64(Assembler* as, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i) {
+        emit8(as, (value >> (i * 8)) & 0xff);
+    }
+}
+
+static void patch32(Assembler* as, int position, int32_t value)
+{
+    for (int i = 0; i < 4; ++i) {
+        as->code[position + i] = ((uint32_t)value >> (i * 8)) & 0xff;
+    }
+}
+
+// REX prefix: W for 64 bits operands, R and B extend ModRM.reg and ModRM.rm
+static void emit_rex(Assembler* as, bool wide, int reg, int rm)
+{
+    uint8_t rex = 0x40 | wide << 3 | (reg >> 3) << 2 | rm >> 3;
+    if (rex != 0x40) {
+        emit8(as, rex);
+    }
+}
+
+// ModRM for a [base + disp32] memory operand
+static void emit_mem(Assembler* as, int reg, Register base, int32_t disp)
+{
+    emit8(as, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) {
+        // rsp and r12 as base require a SIB byte
+        emit8(as, 0x24);
+    }
+    emit32(as, disp);
+}
+
+// ModRM for a register operand
+static void emit_modrm_reg(Assembler* as, int reg, int rm)
+{
+    emit8(as, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// Instructions
+//------------------------------------------------------------------------------
+
+// mov dst, [base + disp]
+static void emit_load(Assembler* as, Register dst, Register base, int32_t disp)
+{
+    emit_rex(as, true, dst, base);
+    emit8(as, 0x8b);
+    emit_mem(as, dst, base, disp);
+}
+
+// mov [base + disp], src
+static void emit_store(Assembler* as, Register base, int32_t disp, Register src)
+{
+    emit_rex(as, true, src, base);
+    emit8(as, 0x89);
+    emit_mem(as, src, base, disp);
+}
+
+// mov dst, imm64
+static void emit_mov_imm64(Assembler* as, Register dst, uint64_t imm)
+{
+    emit_rex(as, true, 0, dst);
+    emit8(as, 0xb8 + (dst & 7));
+    emit64(as, imm);
+}
+
+// mov dst32, imm32
+static void emit_mov_imm32(Assembler* as, Register dst, uint32_t imm)
+{
+    emit_rex(as, false, 0, dst);
+    emit8(as, 0xb8 + (dst & 7));
+    emit32(as, imm);
+}
+
+// mov dst, src
+static void emit_mov(Assembler* as, Register dst, Register src)
+{
+    emit_rex(as, true, src, dst);
+    emit8(as, 0x89);
+    emit_modrm_reg(as, src, dst);
+}
+
+// lea dst, [base + disp]
+static void emit_lea(Assembler* as, Register dst, Register base, int32_t disp)
+{
+    emit_rex(as, true, dst, base);
+    emit8(as, 0x8d);
+    emit_mem(as, dst, base, disp);
+}
+
+// add reg, imm32
+static void emit_add_imm(Assembler* as, Register reg, int32_t imm)
+{
+    emit_rex(as, true, 0, reg);
+    emit8(as, 0x81);
+    emit_modrm_reg(as, 0, reg);
+    emit32(as, imm);
+}
+
+// SSE2 instruction on a memory operand: op xmm, [base + disp]
+static void emit_sse(Assembler* as, uint8_t prefix, uint8_t opcode, int xmm, Register base, int32_t disp)
+{
+    emit8(as, prefix);
+    emit_rex(as, false, xmm, base);
+    emit8(as, 0x0f);
+    emit8(as, opcode);
+    emit_mem(as, xmm, base, disp);
+}
+
+// Load a double constant: xmm = imm
+static void emit_load_double(Assembler* as, int xmm, double imm)
+{
+    uint64_t bits;
+    memcpy(&bits, &imm, sizeof(bits));
+    emit_mov_imm64(as, RAX, bits);
+    // movq xmm, rax
+    emit8(as, 0x66);
+    emit_rex(as, true, xmm, RAX);
+    emit8(as, 0x0f);
+    emit8(as, 0x6e);
+    emit_modrm_reg(as, xmm, RAX);
+}
+
+// addsd dst, src
+static void emit_addsd_reg(Assembler* as, int dst, int src)
+{
+    emit8(as, 0xf2);
+    emit8(as, 0x0f);
+    emit8(as, 0x58);
+    emit_modrm_reg(as, dst, src);
+}
+
+// call function (absolute address)
+static void emit_call(Assembler* as, uintptr_t function)
+{
+    emit_mov_imm64(as, RAX, function);
+    // call rax
+    emit8(as, 0xff);
+    emit8(as, 0xd0);
+}
+
+// Conditional jump, with a rel32 offset to patch
+// @return position of the offset
+static int emit_jcc(Assembler* as, Condition condition)
+{
+    emit8(as, 0x0f);
+    emit8(as, 0x80 | condition);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+// Unconditional jump, with a rel32 offset to patch
+// @return position of the offset
+static int emit_jmp(Assembler* as)
+{
+    emit8(as, 0xe9);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+// Make a forward jump land at the current position
+static void patch_here(Assembler* as, int position)
+{
+    patch32(as, position, as->count - (position + 4));
+}
+
+// Make a jump land on an instruction (bytecode offset), or on the error exit
+static void add_fixup(Assembler* as, int position, int target)
+{
+    if (as->fixup_capacity < as->fixup_count + 1) {
+        as->fixup_capacity = as->fixup_capacity < 16 ? 16 : as->fixup_capacity * 2;
+        as->fixups = realloc_array(as->fixups, sizeof(Fixup), as->fixup_capacity);
+    }
+    as->fixups[as->fixup_count++] = (Fixup) { position, target };
+}
+
+static void emit_epilogue(Assembler* as)
+{
+    // pop r13; pop r12; pop rbx; ret
+    emit8(as, 0x41);
+    emit8(as, 0x5d);
+    emit8(as, 0x41);
+    emit8(as, 0x5c);
+    emit8(as, 0x5b);
+    emit8(as, 0xc3);
+}
+
+// Value templates
+//------------------------------------------------------------------------------
+
+// Copy a Value from [src + src_disp] to [dst + dst_disp]
+static void emit_copy_value(Assembler* as, Register dst, int32_t dst_disp, Register src, int32_t src_disp)
+{
+    for (int i = 0; i < VALUE_SIZE; i += 8) {
+        emit_load(as, RAX, src, src_disp + i);
+        emit_store(as, dst, dst_disp + i, RAX);
+    }
+}
+
+// Store a Value known at compile time to [base + disp]
+static void emit_store_value(Assembler* as, Register base, int32_t disp, Value value)
+{
+    uint64_t words[sizeof(Value) / 8];
+    memcpy(words, &value, sizeof(Value));
+    for (int i = 0; i < VALUE_SIZE / 8; ++i) {
+        emit_mov_imm64(as, RAX, words[i]);
+        emit_store(as, base, disp + i * 8, RAX);
+    }
+}
+
+// Jump if the Value at [base + disp] is not a number
+// @return position of the jump offset, to patch
+static int emit_jump_if_not_number(Assembler* as, Register base, int32_t disp)
+{
+#ifdef ASPIC_NAN_BOXING
+    emit_load(as, RAX, base, disp);
+    emit_mov_imm64(as, RCX, NAN_QNAN);
+    // and rax, rcx; cmp rax, rcx
+    emit_rex(as, true, RCX, RAX);
+    emit8(as, 0x21);
+    emit_modrm_reg(as, RCX, RAX);
+    emit_rex(as, true, RCX, RAX);
+    emit8(as, 0x39);
+    emit_modrm_reg(as, RCX, RAX);
+    return emit_jcc(as, CC_E);
+#else
+    // cmp dword [base + disp + type], TYPE_NUMBER
+    emit_rex(as, false, 0, base);
+    emit8(as, 0x81);
+    emit_mem(as, 7, base, disp + (int)offsetof(Value, type));
+    emit32(as, TYPE_NUMBER);
+    return emit_jcc(as, CC_NE);
+#endif
+}
+
+static void emit_push_value(Assembler* as, Value value)
+{
+    emit_store_value(as, REG_SP, 0, value);
+    emit_add_imm(as, REG_SP, VALUE_SIZE);
+}
+
+static void emit_pop(Assembler* as)
+{
+    emit_add_imm(as, REG_SP, -VALUE_SIZE);
+}
+
+static void emit_get_local(Assembler* as, int slot)
+{
+    emit_copy_value(as, REG_SP, 0, REG_SLOTS, SLOT(slot));
+    emit_add_imm(as, REG_SP, VALUE_SIZE);
+}
+
+static void emit_set_local(Assembler* as, int slot)
+{
+    emit_copy_value(as, REG_SLOTS, SLOT(slot), REG_SP, PEEK(0));
+}
+
+static void emit_push_constant(Assembler* as, int index)
+{
+    emit_mov_imm64(as, RDX, (uintptr_t)&as->function->chunk.constants.values[index]);
+    emit_copy_value(as, REG_SP, 0, RDX, 0);
+    emit_add_imm(as, REG_SP, VALUE_SIZE);
+}
+
+// Runtime calls
+//------------------------------------------------------------------------------
+
+/*
+ * Runtime functions operate on vm.stack_top, like the interpreter. They
+ * report runtime errors themselves, and return false (or -1) on error: the
+ * machine code then exits with VM_RUNTIME_ERROR.
+ */
+
+// Push the result of an operation, and report it if this is an error
+static bool push_result(Value value)
+{
+    *vm.stack_top++ = value;
+    if (is_error(value)) {
+        vm_runtime_error();
+        return false;
+    }
+    if (gc_should_collect()) {
+        gc_collect();
+    }
+    return true;
+}
+
+static bool rt_decl_global(int slot, int read_only)
+{
+    Value error = vm_decl_global(slot, vm.stack_top[-1], read_only);
+    if (is_error(error)) {
+        return push_result(error);
+    }
+    vm.stack_top--;
+    return true;
+}
+
+static bool rt_get_global(int slot)
+{
+    return push_result(vm_get_global(slot));
+}
+
+static bool rt_set_global(int slot)
+{
+    Value error = vm_set_global(slot, vm.stack_top[-1]);
+    return is_error(error) ? push_result(error) : true;
+}
+
+static bool rt_unary(int op)
+{
+    Value value = *--vm.stack_top;
+    switch (op) {
+    case OP_NOT: return push_result(op_not(value));
+    case OP_POSITIVE: return push_result(op_positive(value));
+    default: return push_result(op_negative(value));
+    }
+}
+
+static bool rt_binary(int op)
+{
+    Value b = *--vm.stack_top;
+    Value a = *--vm.stack_top;
+    switch (op) {
+    case OP_ADD: return push_result(op_add(b, a));
+    case OP_SUBTRACT: return push_result(op_subtract(b, a));
+    case OP_MULTIPLY: return push_result(op_multiply(b, a));
+    case OP_DIVIDE: return push_result(op_divide(b, a));
+    case OP_MODULO: return push_result(op_modulo(b, a));
+    case OP_EQUAL: return push_result(make_bool(value_equal(b, a)));
+    case OP_NOT_EQUAL: return push_result(make_bool(!value_equal(b, a)));
+    case OP_GREATER: return push_result(op_greater(b, a));
+    case OP_GREATER_EQUAL: return push_result(op_greater_equal(b, a));
+    case OP_LESS: return push_result(op_greater(a, b));
+    default: return push_result(op_greater_equal(a, b));
+    }
+}
+
+// Pop two operands, and evaluate the condition of a compare and branch
+// instruction
+// @return 1 if the condition is true (no jump), 0 if false, -1 on error
+static int rt_compare(int op)
+{
+    Value b = *--vm.stack_top;
+    Value a = *--vm.stack_top;
+    Value result;
+    switch (op) {
+    case OP_JUMP_IF_NOT_LESS: result = op_greater(a, b); break;
+    case OP_JUMP_IF_NOT_LESS_EQUAL: result = op_greater_equal(a, b); break;
+    case OP_JUMP_IF_NOT_GREATER: result = op_greater(b, a); break;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL: result = op_greater_equal(b, a); break;
+    case OP_JUMP_IF_NOT_EQUAL: return value_equal(b, a);
+    default: return !value_equal(b, a);
+    }
+    if (is_error(result)) {
+        push_result(result);
+        return -1;
+    }
+    return as_bool(result);
+}
+
+static bool rt_truthy()
+{
+    return value_truthy(vm.stack_top[-1]);
+}
+
+static bool rt_subscript_get()
+{
+    Value index = *--vm.stack_top;
+    Value collection = *--vm.stack_top;
+    return push_result(op_subscript_get(collection, index));
+}
+
+static bool rt_subscript_set()
+{
+    Value value = *--vm.stack_top;
+    Value index = *--vm.stack_top;
+    Value collection = *--vm.stack_top;
+    Value result = op_subscript_set(collection, index, value);
+    if (!is_error(result)) {
+        gc_write_barrier(as_object(collection), value);
+    }
+    return push_result(result);
+}
+
+// The stacks may be reallocated by the call
+// @return current frame, or NULL on error
+static CallFrame* rt_call(int argc)
+{
+    return vm_call(argc) == VM_OK ? &vm.frames[vm.frame_count - 1] : NULL;
+}
+
+static bool rt_tail_call(int argc)
+{
+    return vm_tail_call(argc) != NULL;
+}
+
+static bool rt_array(int item_count)
+{
+    Value array = make_array(vm.stack_top - item_count, item_count);
+    vm.stack_top -= item_count;
+    return push_result(array);
+}
+
+// Write back the stack top and the instruction pointer, then call a runtime
+// function with up to 2 integer arguments. The result is in rax.
+static void emit_runtime_call(Assembler* as, uintptr_t function, int arg0, int arg1)
+{
+    emit_mov_imm64(as, RCX, (uintptr_t)&vm.stack_top);
+    emit_store(as, RCX, 0, REG_SP);
+    emit_mov_imm64(as, RCX, (uintptr_t)(as->function->chunk.code + as->next_ip));
+    emit_store(as, REG_FRAME, offsetof(CallFrame, ip), RCX);
+
+    emit_mov_imm32(as, RDI, arg0);
+    emit_mov_imm32(as, RSI, arg1);
+    emit_call(as, function);
+
+    // Reload the stack top, preserving rax
+    emit_mov_imm64(as, RCX, (uintptr_t)&vm.stack_top);
+    emit_load(as, REG_SP, RCX, 0);
+}
+
+// Call a runtime function returning false on error
+static void emit_checked_call(Assembler* as, uintptr_t function, int arg0, int arg1)
+{
+    emit_runtime_call(as, function, arg0, arg1);
+    // test al, al
+    emit8(as, 0x84);
+    emit8(as, 0xc0);
+    add_fixup(as, emit_jcc(as, CC_E), -1);
+}
+
+// Instruction templates
+//------------------------------------------------------------------------------
+
+// Call the callee below the <argc> arguments on top of the stack, then reload
+// the frame and its slots, which may have moved
+static void emit_function_call(Assembler* as, int argc)
+{
+    emit_runtime_call(as, (uintptr_t)rt_call, argc, 0);
+    // test rax, rax
+    emit8(as, 0x48);
+    emit8(as, 0x85);
+    emit8(as, 0xc0);
+    add_fixup(as, emit_jcc(as, CC_E), -1);
+    emit_mov(as, REG_FRAME, RAX);
+    emit_load(as, REG_SLOTS, REG_FRAME, offsetof(CallFrame, slots));
+}
+
+// Binary operator on the two values on top of the stack: inline on numbers,
+// otherwise through op_add, op_subtract, ...
+static void emit_arithmetic(Assembler* as, uint8_t sse_prefix, uint8_t sse_opcode, OpCode generic_op)
+{
+    int not_number_a = emit_jump_if_not_number(as, REG_SP, PEEK(1));
+    int not_number_b = emit_jump_if_not_number(as, REG_SP, PEEK(0));
+    emit_sse(as, SSE_MOVSD_LOAD, XMM0, REG_SP, PEEK(1) + NUMBER_OFFSET);
+    emit_sse(as, sse_prefix, sse_opcode, XMM0, REG_SP, PEEK(0) + NUMBER_OFFSET);
+    emit_sse(as, SSE_MOVSD_STORE, XMM0, REG_SP, PEEK(1) + NUMBER_OFFSET);
+    emit_pop(as);
+    int done = emit_jmp(as);
+
+    patch_here(as, not_number_a);
+    patch_here(as, not_number_b);
+    emit_checked_call(as, (uintptr_t)rt_binary, generic_op, 0);
+    patch_here(as, done);
+}
+
+// Add a number to a local variable in place: slots[slot] += *operand
+static void emit_add_to_local(Assembler* as, int slot, const Value* operand)
+{
+    int not_number = emit_jump_if_not_number(as, REG_SLOTS, SLOT(slot));
+    emit_sse(as, SSE_MOVSD_LOAD, XMM0, REG_SLOTS, SLOT(slot) + NUMBER_OFFSET);
+    if (operand == NULL) {
+        emit_load_double(as, XMM1, 1);
+        emit_addsd_reg(as, XMM0, XMM1);
+    } else {
+        emit_mov_imm64(as, RDX, (uintptr_t)operand);
+        emit_sse(as, SSE_ADDSD, XMM0, RDX, NUMBER_OFFSET);
+    }
+    emit_sse(as, SSE_MOVSD_STORE, XMM0, REG_SLOTS, SLOT(slot) + NUMBER_OFFSET);
+    int done = emit_jmp(as);
+
+    // Other types: slots[slot] = slots[slot] + operand
+    patch_here(as, not_number);
+    emit_get_local(as, slot);
+    if (operand == NULL) {
+        emit_push_value(as, make_number(1));
+    } else {
+        emit_mov_imm64(as, RDX, (uintptr_t)operand);
+        emit_copy_value(as, REG_SP, 0, RDX, 0);
+        emit_add_imm(as, REG_SP, VALUE_SIZE);
+    }
+    emit_checked_call(as, (uintptr_t)rt_binary, OP_ADD, 0);
+    emit_set_local(as, slot);
+    emit_pop(as);
+    patch_here(as, done);
+}
+
+// Pop two values, and jump to <target> if the comparison is false
+static void emit_compare_jump(Assembler* as, OpCode op, int target)
+{
+    int done = -1;
+    if (op != OP_JUMP_IF_NOT_EQUAL && op != OP_JUMP_IF_EQUAL) {
+        int not_number_a = emit_jump_if_not_number(as, REG_SP, PEEK(1));
+        int not_number_b = emit_jump_if_not_number(as, REG_SP, PEEK(0));
+        emit_pop(as);
+        emit_pop(as);
+        // Operands: a at [sp], b at [sp + VALUE_SIZE]. NaN operands set the
+        // carry and zero flags, so the comparisons are written as "above".
+        int a = NUMBER_OFFSET;
+        int b = VALUE_SIZE + NUMBER_OFFSET;
+        bool strict = op == OP_JUMP_IF_NOT_LESS || op == OP_JUMP_IF_NOT_GREATER;
+        if (op == OP_JUMP_IF_NOT_LESS || op == OP_JUMP_IF_NOT_LESS_EQUAL) {
+            // a < b is b > a
+            emit_sse(as, SSE_MOVSD_LOAD, XMM0, REG_SP, b);
+            emit_sse(as, SSE_UCOMISD, XMM0, REG_SP, a);
+        } else {
+            emit_sse(as, SSE_MOVSD_LOAD, XMM0, REG_SP, a);
+            emit_sse(as, SSE_UCOMISD, XMM0, REG_SP, b);
+        }
+        add_fixup(as, emit_jcc(as, strict ? CC_BE : CC_B), target);
+        done = emit_jmp(as);
+        patch_here(as, not_number_a);
+        patch_here(as, not_number_b);
+    }
+
+    emit_runtime_call(as, (uintptr_t)rt_compare, op, 0);
+    // test eax, eax
+    emit8(as, 0x85);
+    emit8(as, 0xc0);
+    add_fixup(as, emit_jcc(as, CC_S), -1);
+    add_fixup(as, emit_jcc(as, CC_E), target);
+    if (done != -1) {
+        patch_here(as, done);
+    }
+}
+
+static void emit_get_global(Assembler* as, int slot)
+{
+    // vm.globals may be reallocated when new code is compiled
+    emit_mov_imm64(as, RDX, (uintptr_t)&vm.globals);
+    emit_load(as, RDX, RDX, 0);
+    int32_t global = slot * (int32_t)sizeof(Global);
+    // cmp byte [rdx + defined], 0
+    emit8(as, 0x80);
+    emit_mem(as, 7, RDX, global + offsetof(Global, defined));
+    emit8(as, 0);
+    int undefined = emit_jcc(as, CC_E);
+    emit_copy_value(as, REG_SP, 0, RDX, global + offsetof(Global, value));
+    emit_add_imm(as, REG_SP, VALUE_SIZE);
+    int done = emit_jmp(as);
+
+    // Report the error
+    patch_here(as, undefined);
+    emit_checked_call(as, (uintptr_t)rt_get_global, slot, 0);
+    patch_here(as, done);
+}
+
+static void emit_return(Assembler* as)
+{
+    // Replace the frame with the result
+    emit_copy_value(as, REG_SLOTS, 0, REG_SP, PEEK(0));
+    emit_lea(as, RAX, REG_SLOTS, VALUE_SIZE);
+    emit_mov_imm64(as, RCX, (uintptr_t)&vm.stack_top);
+    emit_store(as, RCX, 0, RAX);
+    // sub dword [vm.frame_count], 1
+    emit_mov_imm64(as, RCX, (uintptr_t)&vm.frame_count);
+    emit8(as, 0x83);
+    emit_mem(as, 5, RCX, 0);
+    emit8(as, 1);
+
+    emit_mov_imm32(as, RAX, VM_OK);
+    emit_epilogue(as);
+}
+
+// Return VM_TAIL_CALL once the frame is replaced, to let the caller run it.
+// Otherwise, regular call followed by OP_RETURN.
+static void emit_tail_call(Assembler* as, int argc)
+{
+    emit_runtime_call(as, (uintptr_t)rt_tail_call, argc, 0);
+    // test al, al
+    emit8(as, 0x84);
+    emit8(as, 0xc0);
+    int regular_call = emit_jcc(as, CC_E);
+    emit_mov_imm32(as, RAX, VM_TAIL_CALL);
+    emit_epilogue(as);
+
+    patch_here(as, regular_call);
+    emit_function_call(as, argc);
+}
+
+static bool emit_instruction(Assembler* as, const uint8_t* ip)
+{
+    int next_ip = as->next_ip;
+    switch (ip[0]) {
+    case OP_RETURN:
+        emit_return(as);
+        return true;
+    case OP_POP:
+        emit_pop(as);
+        return true;
+
+    // Jumps
+    case OP_JUMP:
+        add_fixup(as, emit_jmp(as), next_ip + (ip[1] << 8 | ip[2]));
+        return true;
+    case OP_JUMP_BACK:
+        add_fixup(as, emit_jmp(as), next_ip - (ip[1] << 8 | ip[2]));
+        return true;
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_FALSE:
+        emit_runtime_call(as, (uintptr_t)rt_truthy, 0, 0);
+        // test al, al
+        emit8(as, 0x84);
+        emit8(as, 0xc0);
+        add_fixup(as, emit_jcc(as, ip[0] == OP_JUMP_IF_TRUE ? CC_NE : CC_E), next_ip + (ip[1] << 8 | ip[2]));
+        return true;
+
+    // Global variables
+    case OP_DECL_GLOBAL:
+    case OP_DECL_GLOBAL_CONST:
+        emit_checked_call(as, (uintptr_t)rt_decl_global, ip[1], ip[0] == OP_DECL_GLOBAL_CONST);
+        return true;
+    case OP_DECL_GLOBAL_16:
+    case OP_DECL_GLOBAL_CONST_16:
+        emit_checked_call(as, (uintptr_t)rt_decl_global, ip[1] << 8 | ip[2], ip[0] == OP_DECL_GLOBAL_CONST_16);
+        return true;
+    case OP_GET_GLOBAL:
+        emit_get_global(as, ip[1]);
+        return true;
+    case OP_GET_GLOBAL_16:
+        emit_get_global(as, ip[1] << 8 | ip[2]);
+        return true;
+    case OP_SET_GLOBAL:
+        emit_checked_call(as, (uintptr_t)rt_set_global, ip[1], 0);
+        return true;
+    case OP_SET_GLOBAL_16:
+        emit_checked_call(as, (uintptr_t)rt_set_global, ip[1] << 8 | ip[2], 0);
+        return true;
+
+    // Local variables
+    case OP_GET_LOCAL:
+        emit_get_local(as, ip[1]);
+        return true;
+    case OP_SET_LOCAL:
+        emit_set_local(as, ip[1]);
+        return true;
+
+    // Literals
+    case OP_CONSTANT:
+        emit_push_constant(as, ip[1]);
+        return true;
+    case OP_CONSTANT_16:
+        emit_push_constant(as, ip[1] << 8 | ip[2]);
+        return true;
+    case OP_ZERO:
+        emit_push_value(as, make_number(0));
+        return true;
+    case OP_ONE:
+        emit_push_value(as, make_number(1));
+        return true;
+    case OP_TRUE:
+        emit_push_value(as, make_bool(true));
+        return true;
+    case OP_FALSE:
+        emit_push_value(as, make_bool(false));
+        return true;
+    case OP_NULL:
+        emit_push_value(as, make_null());
+        return true;
+
+    // Operators
+    case OP_NOT:
+    case OP_POSITIVE:
+    case OP_NEGATIVE:
+        emit_checked_call(as, (uintptr_t)rt_unary, ip[0], 0);
+        return true;
+    case OP_ADD:
+    case OP_ADD_NUM:
+        emit_arithmetic(as, SSE_ADDSD, OP_ADD);
+        return true;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+        emit_arithmetic(as, SSE_SUBSD, OP_SUBTRACT);
+        return true;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+        emit_arithmetic(as, SSE_MULSD, OP_MULTIPLY);
+        return true;
+    case OP_ADD_STR:
+        emit_checked_call(as, (uintptr_t)rt_binary, OP_ADD, 0);
+        return true;
+    case OP_DIVIDE_NUM:
+        emit_checked_call(as, (uintptr_t)rt_binary, OP_DIVIDE, 0);
+        return true;
+    case OP_GREATER_NUM:
+        emit_checked_call(as, (uintptr_t)rt_binary, OP_GREATER, 0);
+        return true;
+    case OP_GREATER_EQUAL_NUM:
+        emit_checked_call(as, (uintptr_t)rt_binary, OP_GREATER_EQUAL, 0);
+        return true;
+    case OP_LESS_NUM:
+        emit_checked_call(as, (uintptr_t)rt_binary, OP_LESS, 0);
+        return true;
+    case OP_LESS_EQUAL_NUM:
+        emit_checked_call(as, (uintptr_t)rt_binary, OP_LESS_EQUAL, 0);
+        return true;
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+        emit_checked_call(as, (uintptr_t)rt_binary, ip[0], 0);
+        return true;
+
+    case OP_SUBSCRIPT_GET:
+        emit_checked_call(as, (uintptr_t)rt_subscript_get, 0, 0);
+        return true;
+    case OP_SUBSCRIPT_SET:
+        emit_checked_call(as, (uintptr_t)rt_subscript_set, 0, 0);
+        return true;
+    case OP_CALL:
+        emit_function_call(as, ip[1]);
+        return true;
+    case OP_TAIL_CALL:
+        emit_tail_call(as, ip[1]);
+        return true;
+    case OP_ARRAY:
+        emit_checked_call(as, (uintptr_t)rt_array, ip[1], 0);
+        return true;
+
+    // Superinstructions
+    case OP_GET_LOCAL_2:
+        emit_get_local(as, ip[1]);
+        emit_get_local(as, ip[2]);
+        return true;
+    case OP_GET_LOCAL_CONSTANT:
+        emit_get_local(as, ip[1]);
+        emit_push_constant(as, ip[2]);
+        return true;
+    case OP_ADD_LOCALS:
+        emit_get_local(as, ip[1]);
+        emit_get_local(as, ip[2]);
+        emit_arithmetic(as, SSE_ADDSD, OP_ADD);
+        return true;
+    case OP_SET_LOCAL_POP:
+        emit_set_local(as, ip[1]);
+        emit_pop(as);
+        return true;
+    case OP_SET_GLOBAL_POP:
+        emit_checked_call(as, (uintptr_t)rt_set_global, ip[1], 0);
+        emit_pop(as);
+        return true;
+    case OP_ADD_IMM:
+        emit_push_value(as, make_number((int8_t)ip[1]));
+        emit_arithmetic(as, SSE_ADDSD, OP_ADD);
+        return true;
+    case OP_INC_LOCAL:
+        emit_add_to_local(as, ip[1], NULL);
+        return true;
+    case OP_ADD_LOCAL_CONST:
+        emit_add_to_local(as, ip[1], &as->function->chunk.constants.values[ip[2]]);
+        return true;
+
+    // Compare and branch
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        emit_compare_jump(as, ip[0], next_ip + (ip[1] << 8 | ip[2]));
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+// Compile the whole function into as->code
+static bool assemble(Assembler* as)
+{
+    const Chunk* chunk = &as->function->chunk;
+
+    // Prologue: push rbx; push r12; push r13 (the stack is then 16 bytes
+    // aligned for calls)
+    emit8(as, 0x53);
+    emit8(as, 0x41);
+    emit8(as, 0x54);
+    emit8(as, 0x41);
+    emit8(as, 0x55);
+    emit_mov(as, REG_FRAME, RDI);
+    emit_load(as, REG_SLOTS, REG_FRAME, offsetof(CallFrame, slots));
+    emit_mov_imm64(as, RCX, (uintptr_t)&vm.stack_top);
+    emit_load(as, REG_SP, RCX, 0);
+
+    for (int offset = 0; offset < chunk->count;) {
+        as->offsets[offset] = as->count;
+        as->next_ip = offset + op_length(chunk->code[offset]);
+        if (!emit_instruction(as, chunk->code + offset)) {
+            return false;
+        }
+        offset = as->next_ip;
+    }
+
+    // Error exit: the error has already been reported
+    int error_exit = as->count;
+    emit_mov_imm32(as, RAX, VM_RUNTIME_ERROR);
+    emit_epilogue(as);
+
+    for (int i = 0; i < as->fixup_count; ++i) {
+        const Fixup* fixup = &as->fixups[i];
+        int target = error_exit;
+        if (fixup->target != -1) {
+            if (fixup->target < 0 || fixup->target >= chunk->count || as->offsets[fixup->target] == -1) {
+                return false;
+            }
+            target = as->offsets[fixup->target];
+        }
+        patch32(as, fixup->position, target - (fixup->position + 4));
+    }
+    return true;
+}
+
+bool jit_compile(ObjectFunction* function)
+{
+    if (!enabled) {
+        return false;
+    }
+
+    Assembler as = { 0 };
+    as.function = function;
+    as.offsets = malloc(sizeof(int) * (function->chunk.count + 1));
+    for (int i = 0; i <= function->chunk.count; ++i) {
+        as.offsets[i] = -1;
+    }
+
+    bool success = assemble(&as);
+    if (success) {
+        // Copy the code into executable memory
+        void* memory = mmap(NULL, as.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED) {
+            success = false;
+        } else {
+            memcpy(memory, as.code, as.count);
+            mprotect(memory, as.count, PROT_READ | PROT_EXEC);
+            function->native_code = memory;
+            function->native_size = as.count;
+            compiled_count++;
+        }
+    }
+
+    free(as.code);
+    free(as.offsets);
+    free(as.fixups);
+    return success;
+}
+
+void jit_release(ObjectFunction* function)
+{
+    // Native code attached with vm_set_native() is not owned by the function
+    if (function->native_size != 0) {
+        munmap(function->native_code, function->native_size);
+        function->native_code = NULL;
+    }
+}
+
+void jit_set_enabled(bool value)
+{
+    enabled = value;
+}
+
+void jit_print_stats()
+{
+    printf("jit compiled functions: %zu\n", compiled_count);
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef ASPIC_JIT_H
+#define ASPIC_JIT_H
+
+#include "object.h"
+#include "vm.h"
+
+/**
+ * Baseline JIT compiler (make JIT=1), for x86-64 Linux only
+ *
+ * Functions called JIT_CALL_THRESHOLD times are compiled into machine code.
+ * Each instruction is translated with a fixed template: operations on numbers
+ * are inlined, the other types go through the same runtime functions as the
+ * interpreter (op_add, op_subscript_get, ...).
+ *
+ * Machine code keeps the stack top, the frame slots and the CallFrame in
+ * callee-saved registers. Like vm_run, it writes back the stack top and the
+ * instruction pointer before calling the runtime.
+ */
+
+#if defined(ASPIC_JIT) && !(defined(__x86_64__) && defined(__linux__))
+#undef ASPIC_JIT
+#endif
+
+#ifdef ASPIC_JIT
+
+#ifndef JIT_CALL_THRESHOLD
+#define JIT_CALL_THRESHOLD 100
+#endif
+
+/**
+ * Compile a function into machine code (function->native_code)
+ * @return false if the JIT is disabled, or the function cannot be compiled
+ */
+bool jit_compile(ObjectFunction* function);
+
+/**
+ * Release the machine code of a function
+ */
+void jit_release(ObjectFunction* function);
+
+/**
+ * Enable or disable the compilation of hot functions (default: enabled)
+ */
+void jit_set_enabled(bool enabled);
+
+/**
+ * Print JIT statistics to stdout
+ */
+void jit_print_stats();
+
+/**
+ * Count a call to the function, and compile it once hot
+ * @return true if the function has machine code
+ */
+static inline bool jit_ready(ObjectFunction* function)
+{
+    return function->native_code != NULL
+        || (++function->call_count == JIT_CALL_THRESHOLD && jit_compile(function));
+}
+
+#endif
+
+#endif
@@ -1,3 +1,10 @@
+#include "aot.h"
+#include "cache.h"
+#include "image.h"
+#include "ir.h"
+#include "jit.h"
+#include "optimizer.h"
+#include "parser.h"
 #include "repl.h"
 #include "vm.h"
 
@@ -42,35 +49,203 @@ static char* read_file(const char* path)
     return buffer;
 }
 
+static void print_usage(const char* program)
+{
+    fprintf(stderr, "Usage: %s [options] <path>\n", program);
+    fprintf(stderr, "       %s [options] -c <command>\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --compile <file>   compile the program to a bytecode cache file, without running it\n");
+    fprintf(stderr, "  --dump             print the bytecode of each compiled function\n");
+    fprintf(stderr, "  --emit-c           translate the program to C, printed to stdout\n");
+    fprintf(stderr, "  --gc-pause-us=<n>  max duration of a garbage collector pause (0: no limit)\n");
+    fprintf(stderr, "  --image <file>     compile the program to a bytecode image, without running it\n");
+    fprintf(stderr, "  --lazy             compile the body of the functions on their first call\n");
+    fprintf(stderr, "  --no-cache         ignore the bytecode cache file of the program\n");
+    fprintf(stderr, "  --no-jit           disable the JIT compiler\n");
+    fprintf(stderr, "  --no-opt           disable the peephole optimizer of the compiled bytecode (-O0)\n");
+    fprintf(stderr, "  --stats            print VM and garbage collector statistics on exit\n");
+    fprintf(stderr, "  -O0, -O1, -O2      optimization level: none, peephole (default), IR passes and peephole\n");
+}
+
+/**
+ * Translate a program to C, and print it to stdout
+ */
+static VmResult emit_c_program(const char* source)
+{
+    ObjectFunction* function = vm_compile(source);
+    if (function == NULL) {
+        return VM_COMPILE_ERROR;
+    }
+    if (!aot_emit(stdout, function, source)) {
+        fprintf(stderr, "aspic: Cannot translate the program to C\n");
+        return VM_COMPILE_ERROR;
+    }
+    return VM_OK;
+}
+
+/**
+ * Compile a program, and write it to a bytecode cache file
+ */
+static VmResult compile_program(const char* cache, const char* path, const char* source)
+{
+    ObjectFunction* function = vm_compile(source);
+    if (function == NULL) {
+        return VM_COMPILE_ERROR;
+    }
+    if (!cache_write(cache, function, path, source)) {
+        fprintf(stderr, "aspic: Cannot write %s\n", cache);
+        return VM_COMPILE_ERROR;
+    }
+    return VM_OK;
+}
+
+/**
+ * Compile a program, and write it to a bytecode image
+ */
+static VmResult build_image(const char* image, const char* source)
+{
+    ObjectFunction* function = vm_compile(source);
+    if (function == NULL) {
+        return VM_COMPILE_ERROR;
+    }
+    if (!image_write(image, function, source)) {
+        fprintf(stderr, "aspic: Cannot write %s\n", image);
+        return VM_COMPILE_ERROR;
+    }
+    return VM_OK;
+}
+
+/**
+ * Run a program from a bytecode image, mapped in memory
+ */
+static VmResult run_image(const char* path)
+{
+    ObjectFunction* function = image_load(path);
+    if (function == NULL) {
+        fprintf(stderr, "aspic: Cannot load image %s\n", path);
+        return VM_COMPILE_ERROR;
+    }
+    return vm_execute(function);
+}
+
+// Check if a path ends with the given extension
+static bool has_extension(const char* path, const char* extension)
+{
+    size_t length = strlen(path);
+    size_t extension_length = strlen(extension);
+    return length > extension_length && strcmp(path + length - extension_length, extension) == 0;
+}
+
+/**
+ * Run a program, from its bytecode cache file if up to date
+ */
+static VmResult run_program(const char* path, const char* source)
+{
+    char* cache = cache_path(path);
+    ObjectFunction* function = cache_load(cache, path, source);
+    free(cache);
+    if (function == NULL) {
+        return vm_interpret(source);
+    }
+    return vm_execute(function);
+}
+
 int main(int argc, const char* argv[])
 {
     vm_init();
+
+    // Parse options
+    bool print_stats = false;
+    bool emit_c = false;
+    bool use_cache = true;
+    bool lazy = false;
+    const char* compile_path = NULL;
+    const char* image_path = NULL;
+    int i = 1;
+    for (; i < argc && (strncmp(argv[i], "--", 2) == 0 || strncmp(argv[i], "-O", 2) == 0); ++i) {
+        if (strncmp(argv[i], "--gc-pause-us=", 14) == 0) {
+            gc_set_pause_budget(strtol(argv[i] + 14, NULL, 10));
+        } else if (strcmp(argv[i], "--compile") == 0 && i + 1 < argc) {
+            compile_path = argv[++i];
+        } else if (strcmp(argv[i], "--dump") == 0) {
+            // The parser does not run on cached bytecode
+            use_cache = false;
+            parser_dump_bytecode(true);
+            optimizer_dump_bytecode(true);
+            ir_dump_graph(true);
+        } else if (strcmp(argv[i], "--emit-c") == 0) {
+            emit_c = true;
+        } else if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image_path = argv[++i];
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            lazy = true;
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            use_cache = false;
+        } else if (strcmp(argv[i], "--no-jit") == 0) {
+#ifdef ASPIC_JIT
+            jit_set_enabled(false);
+#endif
+        } else if (strcmp(argv[i], "--no-opt") == 0) {
+            // Cached bytecode has been optimized when compiled
+            use_cache = false;
+            parser_set_optimization(0);
+        } else if (strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0 || strcmp(argv[i], "-O2") == 0) {
+            // Cached bytecode may have been compiled at another level
+            use_cache = false;
+            parser_set_optimization(argv[i][2] - '0');
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            print_stats = true;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            print_usage(argv[0]);
+            vm_free();
+            return 1;
+        }
+    }
+
     VmResult result = VM_OK;
-    if (argc == 1) {
+    if (i == argc) {
         // No argument: start interactive prompt
         repl();
-    } else if (argc == 2 && argv[1][0] != '-') {
+    } else if (argc == i + 1 && has_extension(argv[i], ".aci")) {
+        // Bytecode image
+        result = run_image(argv[i]);
+    } else if (argc == i + 1 && argv[i][0] != '-') {
         // Source passed as filename
-        char* source = read_file(argv[1]);
-        result = vm_interpret(source);
+        char* source = read_file(argv[i]);
+        if (emit_c) {
+            result = emit_c_program(source);
+        } else if (image_path != NULL) {
+            result = build_image(image_path, source);
+        } else if (compile_path != NULL) {
+            result = compile_program(compile_path, argv[i], source);
+        } else {
+            // Compiled programs are written or translated whole: only lazy
+            // when running
+            parser_set_lazy(lazy);
+            result = use_cache ? run_program(argv[i], source) : vm_interpret(source);
+        }
         free(source);
-    } else if (strcmp(argv[1], "-c") == 0) {
+    } else if (strcmp(argv[i], "-c") == 0) {
         // Source passed as command argument
-        if (argc > 2) {
-            result = vm_interpret(argv[2]);
+        if (argc > i + 1) {
+            result = vm_interpret(argv[i + 1]);
         } else {
             fprintf(stderr, "Missing argument for -c\n");
         }
-    } else if (strcmp(argv[1], "-v") == 0) {
+    } else if (strcmp(argv[i], "-v") == 0) {
         // Print version
         printf("Aspic " ASPIC_VERSION_STRING " (Built " __DATE__ ", " __TIME__ ")\n");
     } else {
         // Print usage
-        fprintf(stderr, "Unknown option %s\n", argv[1]);
-        fprintf(stderr, "Usage: %s <path> ", argv[0]);
-        fprintf(stderr, "Usage: %s -c <command>", argv[0]);
+        fprintf(stderr, "Unknown option %s\n", argv[i]);
+        print_usage(argv[0]);
     }
 
+    if (print_stats) {
+        vm_print_stats();
+    }
     vm_free();
+    image_unload();
     return result == VM_OK ? 0 : 1;
 }
@@ -1,9 +1,12 @@
 #include "object.h"
+#include "gc.h"
+#include "jit.h"
 #include "utils.h"
 #include "value_array.h"
 #include "vm.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 // Object
@@ -11,26 +14,22 @@
 
 static void* object_new(ObjectType type, size_t size)
 {
-    Object* object = malloc(size);
-    if (object == NULL) {
-        fprintf(stderr, "Cannot allocate object of size %zu", size);
-        exit(1);
-    }
-    object->type = type;
-
-    // Register for GC (linked list vm.objects_head)
-    object->next = NULL;
-    vm_register_object(object);
-    return object;
+    // Memory is owned by the garbage collector
+    return gc_allocate(type, size);
 }
 
 void object_free(Object* object)
+{
+    object_finalize(object);
+    free(object);
+}
+
+void object_finalize(Object* object)
 {
     switch (object->type) {
     case OBJECT_ARRAY: {
         ObjectArray* array = (ObjectArray*)object;
         value_array_free(&array->array);
-        free(array);
         break;
     }
     case OBJECT_FUNCTION: {
@@ -39,20 +38,39 @@ void object_free(Object* object)
         ObjectFunction* function = (ObjectFunction*)object;
         // Destroy the chunk
         chunk_free(&function->chunk);
-
-        free(function);
+        if (function->baseline != NULL) {
+            chunk_free(function->baseline);
+            free(function->baseline);
+        }
+#ifdef ASPIC_JIT
+        jit_release(function);
+#endif
         break;
     }
-    case OBJECT_STRING: {
-        ObjectString* string = (ObjectString*)object;
-        // Destroy the allocated string buffer
-        free(string->chars);
-        string->chars = NULL;
-
-        free(string);
+    case OBJECT_STRING:
+        // Chars buffer is part of the object
         break;
     }
+}
+
+size_t object_size(const Object* object)
+{
+    switch (object->type) {
+    case OBJECT_ARRAY:
+        return sizeof(ObjectArray);
+    case OBJECT_FUNCTION:
+        return sizeof(ObjectFunction);
+    case OBJECT_STRING: {
+        // Object + chars buffer (with null terminator), unless the chars are
+        // mapped from an image
+        const ObjectString* string = (const ObjectString*)object;
+        if (string->chars != (const char*)(string + 1)) {
+            return sizeof(ObjectString);
+        }
+        return sizeof(ObjectString) + string->length + 1;
+    }
     }
+    return 0;
 }
 
 bool object_equal(const Object* a, const Object* b)
@@ -88,6 +106,16 @@ static uint32_t hash_string(const char* str, size_t length)
     return hash;
 }
 
+// Allocate a new string object, with room for `length` chars
+static ObjectString* string_allocate(size_t length)
+{
+    ObjectString* string = object_new(OBJECT_STRING, sizeof(ObjectString) + length + 1);
+    string->length = length;
+    string->chars = (char*)(string + 1);
+    string->chars[length] = '\0';
+    return string;
+}
+
 const ObjectString* string_new(const char* chars, size_t length)
 {
     uint32_t hash = hash_string(chars, length);
@@ -99,60 +127,66 @@ const ObjectString* string_new(const char* chars, size_t length)
     }
 
     // Allocate new string object and copy string
-    ObjectString* string = object_new(OBJECT_STRING, sizeof(ObjectString));
-    string->chars = alloc_string(length);
+    ObjectString* string = string_allocate(length);
     memcpy(string->chars, chars, length);
-    string->length = length;
     string->hash = hash;
 
     return vm_intern_string(string);
 }
 
-static const ObjectString* string_ctor(char* chars, size_t length, uint32_t hash)
+const ObjectString* string_new_mapped(const char* chars, size_t length)
 {
-    // Check if string was already interned in the VM
+    uint32_t hash = hash_string(chars, length);
     const ObjectString* interned = vm_find_string(chars, length, hash);
     if (interned) {
-        // Destroy buffer and return interned string instead
-        free(chars);
         return interned;
     }
 
-    // Allocate new ObjectString and set attributes
+    // Only the object is allocated: chars stay in place
     ObjectString* string = object_new(OBJECT_STRING, sizeof(ObjectString));
-    string->chars = chars;
     string->length = length;
+    string->chars = (char*)chars;
     string->hash = hash;
 
+    return vm_intern_string(string);
+}
+
+// Intern a new string, whose chars were written in place
+static const ObjectString* string_intern(ObjectString* string)
+{
+    string->hash = hash_string(string->chars, string->length);
+
+    // Check if string was already interned in the VM
+    const ObjectString* interned = vm_find_string(string->chars, string->length, string->hash);
+    if (interned) {
+        // Destroy new string and return interned string instead
+        gc_cancel_allocation((Object*)string);
+        return interned;
+    }
+
     // Ensure string is interned by the VM
     return vm_intern_string(string);
 }
 
 const ObjectString* string_concat(const ObjectString* a, const ObjectString* b)
 {
-    size_t length = a->length + b->length;
-
-    // Concat a + b into buffer
-    char* buffer = alloc_string(length);
-    memcpy(buffer, a->chars, a->length);
-    memcpy(buffer + a->length, b->chars, b->length);
-    uint32_t hash = hash_string(buffer, length);
+    // Concat a + b into the new string
+    ObjectString* string = string_allocate(a->length + b->length);
+    memcpy(string->chars, a->chars, a->length);
+    memcpy(string->chars + a->length, b->chars, b->length);
 
-    return string_ctor(buffer, length, hash);
+    return string_intern(string);
 }
 
 const ObjectString* string_multiply(const ObjectString* source, size_t n)
 {
-    size_t length = source->length * n;
-
-    // Build buffer with new source * n
-    char* buffer = alloc_string(length);
+    // Build source * n into the new string
+    ObjectString* string = string_allocate(source->length * n);
     for (size_t i = 0; i < n; ++i) {
-        memcpy(buffer + i * source->length, source->chars, source->length);
+        memcpy(string->chars + i * source->length, source->chars, source->length);
     }
-    uint32_t hash = hash_string(buffer, length);
 
-    return string_ctor(buffer, length, hash);
+    return string_intern(string);
 }
 
 bool string_equal(const ObjectString* a, const ObjectString* b)
@@ -174,11 +208,29 @@ ObjectFunction* function_new()
 {
     ObjectFunction* function = object_new(OBJECT_FUNCTION, sizeof(ObjectFunction));
     function->arity = 0;
+    function->max_stack = 0;
     function->name = NULL;
+    function->lazy_source = NULL;
+    function->lazy_line = 0;
     chunk_init(&function->chunk);
+    function->call_count = 0;
+    function->hotness = 0;
+    function->baseline = NULL;
+    function->native_code = NULL;
+    function->native_size = 0;
     return function;
 }
 
+const Chunk* function_chunk(const ObjectFunction* function, const uint8_t* ip)
+{
+    // ip points after the current instruction
+    const Chunk* baseline = function->baseline;
+    if (baseline != NULL && ip > baseline->code && ip <= baseline->code + baseline->count) {
+        return baseline;
+    }
+    return &function->chunk;
+}
+
 // ObjectArray
 //------------------------------------------------------------------------------
 
@@ -12,7 +12,14 @@ typedef enum {
 
 struct Object {
     ObjectType type;
-    // Each object is a node of the linked list of all allocated objects
+    // Set by the garbage collector when the object is reachable
+    bool marked;
+    // Allocated in the nursery (young generation)
+    bool young;
+    // Old object registered in the remembered set of the garbage collector
+    bool remembered;
+    // Old objects: each object is a node of the linked list of all old objects
+    // Young objects: forwarding pointer to the promoted object, or NULL
     struct Object* next;
 };
 
@@ -23,6 +30,16 @@ typedef struct Object Object;
  */
 void object_free(Object* object);
 
+/**
+ * Release the memory owned by an object, without releasing the object itself
+ */
+void object_finalize(Object* object);
+
+/**
+ * Get the number of bytes allocated for this object
+ */
+size_t object_size(const Object* object);
+
 /**
  * Compare two objects for equality
  */
@@ -36,14 +53,29 @@ bool object_equal(const Object* a, const Object* b);
 struct ObjectString {
     Object object;
     int length;
+    // Chars are allocated along with the object, right after it
     char* chars;
     uint32_t hash;
 };
 
+/**
+ * Check if value is an OBJECT_STRING
+ */
+static inline bool is_string(Value value)
+{
+    return is_object(value) && as_object(value)->type == OBJECT_STRING;
+}
+
 /**
  * ObjectString ctor
  */
 const ObjectString* string_new(const char* chars, size_t length);
+
+/**
+ * ObjectString ctor, without copying the chars: they must be null terminated,
+ * and outlive the string (bytecode image mapped in memory, see image.h)
+ */
+const ObjectString* string_new_mapped(const char* chars, size_t length);
 const ObjectString* string_concat(const ObjectString* a, const ObjectString* b);
 const ObjectString* string_multiply(const ObjectString* source, size_t n);
 
@@ -64,8 +96,29 @@ int string_compare(const ObjectString* a, const ObjectString* b);
 struct ObjectFunction {
     Object object;
     int arity;
+    // Max number of values on the stack during a call, including the callee
+    // and the arguments (computed by the parser)
+    int max_stack;
     Chunk chunk;
     const ObjectString* name;
+    // Lazy compilation (see parser_set_lazy): parameters and body in the
+    // source, not compiled yet, or NULL
+    const char* lazy_source;
+    int lazy_line;
+
+    // Number of calls, until the function is compiled by the JIT
+    unsigned int call_count;
+    // Number of calls and loop iterations, until the bytecode is optimized
+    // (see optimizer.h)
+    unsigned int hotness;
+    // Bytecode before optimization, still run by the ongoing calls, or NULL.
+    // Constants are only stored in chunk.
+    Chunk* baseline;
+    // Native code compiled by the JIT (see jit.h) or translated to C (see
+    // aot.h), or NULL. native_size is 0 if the code is not owned by the
+    // function.
+    void* native_code;
+    size_t native_size;
 };
 
 /**
@@ -73,6 +126,12 @@ struct ObjectFunction {
  */
 ObjectFunction* function_new();
 
+/**
+ * Get the chunk holding an instruction pointer of the function: chunk, or
+ * baseline for frames started before the optimization
+ */
+const Chunk* function_chunk(const ObjectFunction* function, const uint8_t* ip);
+
 // ObjectArray
 //------------------------------------------------------------------------------
 
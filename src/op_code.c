@@ -2,6 +2,7 @@
 #include "object.h"
 #include "utils.h"
 
+#include <math.h>
 #include <stdlib.h>
 
 #define STROP(x) \
@@ -51,11 +52,156 @@ const char* op2str(OpCode opcode)
         STROP(OP_SUBSCRIPT_GET)
         STROP(OP_SUBSCRIPT_SET)
         STROP(OP_CALL)
+        STROP(OP_TAIL_CALL)
         STROP(OP_ARRAY)
+        STROP(OP_ADD_NUM)
+        STROP(OP_ADD_STR)
+        STROP(OP_SUBTRACT_NUM)
+        STROP(OP_MULTIPLY_NUM)
+        STROP(OP_DIVIDE_NUM)
+        STROP(OP_GREATER_NUM)
+        STROP(OP_GREATER_EQUAL_NUM)
+        STROP(OP_LESS_NUM)
+        STROP(OP_LESS_EQUAL_NUM)
+        STROP(OP_GET_LOCAL_2)
+        STROP(OP_GET_LOCAL_CONSTANT)
+        STROP(OP_ADD_LOCALS)
+        STROP(OP_SET_LOCAL_POP)
+        STROP(OP_SET_GLOBAL_POP)
+        STROP(OP_ADD_IMM)
+        STROP(OP_INC_LOCAL)
+        STROP(OP_ADD_LOCAL_CONST)
+        STROP(OP_JUMP_IF_NOT_LESS)
+        STROP(OP_JUMP_IF_NOT_LESS_EQUAL)
+        STROP(OP_JUMP_IF_NOT_GREATER)
+        STROP(OP_JUMP_IF_NOT_GREATER_EQUAL)
+        STROP(OP_JUMP_IF_NOT_EQUAL)
+        STROP(OP_JUMP_IF_EQUAL)
     }
     return NULL;
 }
 
+int op_length(OpCode opcode)
+{
+    switch (opcode) {
+    case OP_JUMP:
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_BACK:
+    case OP_DECL_GLOBAL_16:
+    case OP_DECL_GLOBAL_CONST_16:
+    case OP_GET_GLOBAL_16:
+    case OP_SET_GLOBAL_16:
+    case OP_CONSTANT_16:
+    case OP_GET_LOCAL_2:
+    case OP_GET_LOCAL_CONSTANT:
+    case OP_ADD_LOCALS:
+    case OP_ADD_LOCAL_CONST:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        return 3;
+    case OP_DECL_GLOBAL:
+    case OP_DECL_GLOBAL_CONST:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_CONSTANT:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_ARRAY:
+    case OP_SET_LOCAL_POP:
+    case OP_SET_GLOBAL_POP:
+    case OP_ADD_IMM:
+    case OP_INC_LOCAL:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+int op_stack_effect(const uint8_t* instruction)
+{
+    switch (instruction[0]) {
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_16:
+    case OP_GET_LOCAL:
+    case OP_CONSTANT:
+    case OP_CONSTANT_16:
+    case OP_ZERO:
+    case OP_ONE:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NULL:
+    case OP_ADD_LOCALS:
+        return 1;
+    case OP_GET_LOCAL_2:
+    case OP_GET_LOCAL_CONSTANT:
+        return 2;
+    case OP_RETURN:
+    case OP_POP:
+    case OP_DECL_GLOBAL:
+    case OP_DECL_GLOBAL_CONST:
+    case OP_DECL_GLOBAL_16:
+    case OP_DECL_GLOBAL_CONST_16:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_MODULO:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_SUBSCRIPT_GET:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_GREATER_NUM:
+    case OP_GREATER_EQUAL_NUM:
+    case OP_LESS_NUM:
+    case OP_LESS_EQUAL_NUM:
+    case OP_SET_LOCAL_POP:
+    case OP_SET_GLOBAL_POP:
+        return -1;
+    case OP_SUBSCRIPT_SET:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        return -2;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        // Callee and arguments are replaced with the result
+        return -instruction[1];
+    case OP_ARRAY:
+        // Items are replaced with the array
+        return 1 - instruction[1];
+    default:
+        return 0;
+    }
+}
+
+bool op_is_immediate(Value value)
+{
+    if (!is_number(value)) {
+        return false;
+    }
+    double number = as_number(value);
+    // Not -0: -0 + -0 is -0, but -0 + 0 is 0
+    return number >= INT8_MIN && number <= INT8_MAX && number == (int8_t)number && !signbit(number);
+}
+
 static Value binary_op_error(OpCode op, Value a, Value b)
 {
     return make_error("Unsupported operator %s for types <%s> and <%s>",
@@ -80,9 +226,9 @@ static Value comparison_error(Value a, Value b)
 
 Value op_not(Value value)
 {
-    switch (value.type) {
+    switch (value_get_type(value)) {
     case TYPE_BOOL:
-        return make_bool(!value.as.boolean);
+        return make_bool(!as_bool(value));
     case TYPE_NULL:
         return make_bool(true);
     default:
@@ -92,7 +238,7 @@ Value op_not(Value value)
 
 Value op_positive(Value value)
 {
-    switch (value.type) {
+    switch (value_get_type(value)) {
     case TYPE_NUMBER:
         return value; // NOOP
     default:
@@ -102,9 +248,9 @@ Value op_positive(Value value)
 
 Value op_negative(Value value)
 {
-    switch (value.type) {
+    switch (value_get_type(value)) {
     case TYPE_NUMBER:
-        return make_number(-value.as.number);
+        return make_number(-as_number(value));
     default:
         return unary_op_error(OP_NEGATIVE, value);
     }
@@ -112,24 +258,24 @@ Value op_negative(Value value)
 
 Value op_add(Value b, Value a)
 {
-    if (a.type == TYPE_NUMBER && b.type == TYPE_NUMBER) {
-        return make_number(a.as.number + b.as.number);
+    if (is_number(a) && is_number(b)) {
+        return make_number(as_number(a) + as_number(b));
     }
 
-    if (a.type == TYPE_OBJECT
-        && b.type == TYPE_OBJECT
-        && a.as.object->type == OBJECT_STRING
-        && b.as.object->type == OBJECT_STRING) {
+    if (is_object(a)
+        && is_object(b)
+        && as_object(a)->type == OBJECT_STRING
+        && as_object(b)->type == OBJECT_STRING) {
         return make_string(
-            string_concat((const ObjectString*)a.as.object, (const ObjectString*)b.as.object));
+            string_concat((const ObjectString*)as_object(a), (const ObjectString*)as_object(b)));
     }
     return binary_op_error(OP_ADD, a, b);
 }
 
 Value op_subtract(Value b, Value a)
 {
-    if (a.type == TYPE_NUMBER && b.type == TYPE_NUMBER) {
-        return make_number(a.as.number - b.as.number);
+    if (is_number(a) && is_number(b)) {
+        return make_number(as_number(a) - as_number(b));
     }
     return binary_op_error(OP_SUBTRACT, a, b);
 }
@@ -137,20 +283,20 @@ Value op_subtract(Value b, Value a)
 Value op_multiply(Value b, Value a)
 {
     // <number> * <number>
-    if (a.type == TYPE_NUMBER && b.type == TYPE_NUMBER) {
-        return make_number(a.as.number * b.as.number);
+    if (is_number(a) && is_number(b)) {
+        return make_number(as_number(a) * as_number(b));
     }
 
     // <string> * <number>
-    if (a.type == TYPE_OBJECT && b.type == TYPE_NUMBER && a.as.object->type == OBJECT_STRING) {
+    if (is_object(a) && is_number(b) && as_object(a)->type == OBJECT_STRING) {
         return make_string(
-            string_multiply((const ObjectString*)a.as.object, b.as.number));
+            string_multiply((const ObjectString*)as_object(a), as_number(b)));
     }
 
     // <number> * <string>
-    if (a.type == TYPE_NUMBER && b.type == TYPE_OBJECT && b.as.object->type == OBJECT_STRING) {
+    if (is_number(a) && is_object(b) && as_object(b)->type == OBJECT_STRING) {
         return make_string(
-            string_multiply((const ObjectString*)b.as.object, a.as.number));
+            string_multiply((const ObjectString*)as_object(b), as_number(a)));
     }
 
     return binary_op_error(OP_MULTIPLY, a, b);
@@ -158,34 +304,34 @@ Value op_multiply(Value b, Value a)
 
 Value op_divide(Value b, Value a)
 {
-    if (a.type == TYPE_NUMBER && b.type == TYPE_NUMBER) {
-        if (b.as.number == 0) {
+    if (is_number(a) && is_number(b)) {
+        if (as_number(b) == 0) {
             return make_error("Cannot divide by 0");
         }
-        return make_number(a.as.number / b.as.number);
+        return make_number(as_number(a) / as_number(b));
     }
     return binary_op_error(OP_DIVIDE, a, b);
 }
 
 Value op_modulo(Value b, Value a)
 {
-    if (a.type == TYPE_NUMBER && b.type == TYPE_NUMBER) {
-        return make_number((int)a.as.number % (int)b.as.number);
+    if (is_number(a) && is_number(b)) {
+        return make_number((int)as_number(a) % (int)as_number(b));
     }
     return binary_op_error(OP_MODULO, a, b);
 }
 
 Value op_greater(Value b, Value a)
 {
-    if (a.type == b.type) {
-        switch (a.type) {
+    if (value_get_type(a) == value_get_type(b)) {
+        switch (value_get_type(a)) {
         case TYPE_NUMBER:
-            return make_bool(a.as.number > b.as.number);
+            return make_bool(as_number(a) > as_number(b));
         case TYPE_OBJECT:
-            if (a.as.object->type == OBJECT_STRING && b.as.object->type == OBJECT_STRING) {
+            if (as_object(a)->type == OBJECT_STRING && as_object(b)->type == OBJECT_STRING) {
                 return make_bool(
                     string_compare(
-                        (const ObjectString*)a.as.object, (const ObjectString*)b.as.object)
+                        (const ObjectString*)as_object(a), (const ObjectString*)as_object(b))
                     > 0);
             }
         default:
@@ -197,15 +343,15 @@ Value op_greater(Value b, Value a)
 
 Value op_greater_equal(Value b, Value a)
 {
-    if (a.type == b.type) {
-        switch (a.type) {
+    if (value_get_type(a) == value_get_type(b)) {
+        switch (value_get_type(a)) {
         case TYPE_NUMBER:
-            return make_bool(a.as.number >= b.as.number);
+            return make_bool(as_number(a) >= as_number(b));
         case TYPE_OBJECT:
-            if (a.as.object->type == OBJECT_STRING && b.as.object->type == OBJECT_STRING) {
+            if (as_object(a)->type == OBJECT_STRING && as_object(b)->type == OBJECT_STRING) {
                 return make_bool(
                     string_compare(
-                        (const ObjectString*)a.as.object, (const ObjectString*)b.as.object)
+                        (const ObjectString*)as_object(a), (const ObjectString*)as_object(b))
                     >= 0);
             }
         default:
@@ -217,10 +363,10 @@ Value op_greater_equal(Value b, Value a)
 
 Value op_subscript_get(Value collection, Value index)
 {
-    if (collection.type == TYPE_OBJECT && index.type == TYPE_NUMBER) {
-        int i = (int)index.as.number;
-        if (collection.as.object->type == OBJECT_STRING) {
-            const ObjectString* string = (const ObjectString*)collection.as.object;
+    if (is_object(collection) && is_number(index)) {
+        int i = (int)as_number(index);
+        if (as_object(collection)->type == OBJECT_STRING) {
+            const ObjectString* string = (const ObjectString*)as_object(collection);
             if (i >= -string->length && i < string->length) {
                 if (i < 0) {
                     i += string->length;
@@ -232,8 +378,8 @@ Value op_subscript_get(Value collection, Value index)
                 i, -string->length, string->length - 1);
         }
 
-        if (collection.as.object->type == OBJECT_ARRAY) {
-            const ObjectArray* object = (const ObjectArray*)collection.as.object;
+        if (as_object(collection)->type == OBJECT_ARRAY) {
+            const ObjectArray* object = (const ObjectArray*)as_object(collection);
             if (i >= -object->array.count && i < object->array.count) {
                 if (i < 0) {
                     i += object->array.count;
@@ -250,13 +396,13 @@ Value op_subscript_get(Value collection, Value index)
 
 Value op_subscript_set(Value collection, Value index, Value value)
 {
-    if (collection.type == TYPE_OBJECT && collection.as.object->type == OBJECT_ARRAY) {
-        if (index.type != TYPE_NUMBER) {
+    if (is_object(collection) && as_object(collection)->type == OBJECT_ARRAY) {
+        if (!is_number(index)) {
             return make_error("index must be an integer, not '%s'", value_type(index));
         }
 
-        ObjectArray* object = (ObjectArray*)collection.as.object;
-        int i = (int)index.as.number;
+        ObjectArray* object = (ObjectArray*)as_object(collection);
+        int i = (int)as_number(index);
         if (i >= -object->array.count && i < object->array.count) {
             if (i < 0) {
                 i += object->array.count;
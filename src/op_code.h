@@ -14,13 +14,13 @@ typedef enum {
     OP_JUMP_IF_FALSE,
     OP_JUMP_BACK,
 
-    // Global variables (1 byte operand: constant index)
+    // Global variables (1 byte operand: vm.globals slot index)
     OP_DECL_GLOBAL,
     OP_DECL_GLOBAL_CONST,
     OP_GET_GLOBAL,
     OP_SET_GLOBAL,
 
-    // Global variables (2 bytes operand: constant index)
+    // Global variables (2 bytes operand: vm.globals slot index)
     OP_DECL_GLOBAL_16,
     OP_DECL_GLOBAL_CONST_16,
     OP_GET_GLOBAL_16,
@@ -65,16 +65,62 @@ typedef enum {
     OP_SUBSCRIPT_GET,
     OP_SUBSCRIPT_SET,
 
-    // Function call ()
+    // Function call () (1 byte operand: argument count)
     OP_CALL,
+    // Function call in a return statement, followed by OP_RETURN: replace the
+    // current frame with the called function
+    OP_TAIL_CALL,
 
     // Array expression [] (1 byte operand: item count)
     OP_ARRAY,
+
+    // Quickened instructions, never emitted by the parser: the VM rewrites
+    // generic instructions into these specialized forms once it has observed
+    // the operand types, and back to the generic form if a guard fails
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_GREATER_EQUAL_NUM,
+    OP_LESS_NUM,
+    OP_LESS_EQUAL_NUM,
+
+    // Superinstructions, emitted by the parser in place of a sequence of
+    // instructions commonly found together
+    OP_GET_LOCAL_2,         // GET_LOCAL a, GET_LOCAL b (2 bytes operand: slots)
+    OP_GET_LOCAL_CONSTANT,  // GET_LOCAL, CONSTANT (2 bytes operand: slot, constant index)
+    OP_ADD_LOCALS,          // GET_LOCAL a, GET_LOCAL b, ADD (2 bytes operand: slots)
+    OP_SET_LOCAL_POP,       // SET_LOCAL, POP (1 byte operand: slot)
+    OP_SET_GLOBAL_POP,      // SET_GLOBAL, POP (1 byte operand: slot)
+    OP_ADD_IMM,             // ONE or CONSTANT, ADD (1 byte operand: signed integer)
+    OP_INC_LOCAL,           // local = local + 1 (1 byte operand: slot)
+    OP_ADD_LOCAL_CONST,     // local = local + constant (2 bytes operand: slot, constant index)
+
+    // Compare and branch: pop two values, and jump if the comparison is false
+    // (2 bytes operand: offset). Emitted for conditions of if and while
+    // statements, in place of a comparison followed by OP_JUMP_IF_FALSE.
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_NOT_LESS_EQUAL,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_NOT_GREATER_EQUAL,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_EQUAL,
 } OpCode;
 
 // Convert enum to string, for debug purpose
 const char* op2str(OpCode);
 
+// Size of an instruction in bytes: opcode and operands
+int op_length(OpCode);
+
+// Number of values pushed minus number of values popped by an instruction
+int op_stack_effect(const uint8_t* instruction);
+
+// Constant fitting in the signed byte operand of OP_ADD_IMM
+bool op_is_immediate(Value value);
+
 // OP_NOT: !value
 Value op_not(Value value);
 
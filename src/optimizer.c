@@ -0,0 +1,921 @@
+#include "optimizer.h"
+#include "debug.h"
+#include "gc.h"
+#include "utils.h"
+#include "verifier.h"
+#include "vm.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Each round runs all the passes, until a round changes nothing
+#define OPTIMIZER_MAX_ROUNDS 8
+// Max length of a chain of jumps followed by jump threading
+#define OPTIMIZER_MAX_HOPS 16
+
+extern VM vm;
+
+/**
+ * Decoded instruction. Instructions with a 1 or 2 bytes variant are decoded
+ * into the 1 byte form (OP_CONSTANT, OP_GET_GLOBAL, ...), and OP_JUMP_BACK
+ * into OP_JUMP: the encoder selects the variant from the operand.
+ */
+typedef struct {
+    uint8_t op;
+    // Operands: slots, constant or global index, count
+    int a;
+    int b;
+    // Jumps: index of the target instruction
+    int target;
+    int line;
+    bool removed;
+} Instruction;
+
+typedef struct {
+    ObjectFunction* function;
+    Instruction* code;
+    int count;
+    // Number of jumps to each instruction
+    int* targeted;
+} Optimizer;
+
+typedef bool (*Pass)(Optimizer* opt);
+
+static bool dump_bytecode = false;
+
+static bool is_jump(uint8_t op)
+{
+    switch (op) {
+    case OP_JUMP:
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Instructions pushing a value without side effect
+static bool is_pure_push(uint8_t op)
+{
+    switch (op) {
+    case OP_GET_LOCAL:
+    case OP_CONSTANT:
+    case OP_ZERO:
+    case OP_ONE:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NULL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Comparison evaluated by a compare and branch instruction
+static uint8_t compare_jump_condition(uint8_t op)
+{
+    switch (op) {
+    case OP_JUMP_IF_NOT_LESS: return OP_LESS;
+    case OP_JUMP_IF_NOT_LESS_EQUAL: return OP_LESS_EQUAL;
+    case OP_JUMP_IF_NOT_GREATER: return OP_GREATER;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL: return OP_GREATER_EQUAL;
+    case OP_JUMP_IF_NOT_EQUAL: return OP_EQUAL;
+    case OP_JUMP_IF_EQUAL: return OP_NOT_EQUAL;
+    default: return OP_RETURN;
+    }
+}
+
+// Compare and branch instruction for a comparison (generic or quickened)
+static uint8_t compare_jump_for(uint8_t op)
+{
+    switch (op) {
+    case OP_LESS:
+    case OP_LESS_NUM:
+        return OP_JUMP_IF_NOT_LESS;
+    case OP_LESS_EQUAL:
+    case OP_LESS_EQUAL_NUM:
+        return OP_JUMP_IF_NOT_LESS_EQUAL;
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+        return OP_JUMP_IF_NOT_GREATER;
+    case OP_GREATER_EQUAL:
+    case OP_GREATER_EQUAL_NUM:
+        return OP_JUMP_IF_NOT_GREATER_EQUAL;
+    case OP_EQUAL:
+        return OP_JUMP_IF_NOT_EQUAL;
+    case OP_NOT_EQUAL:
+        return OP_JUMP_IF_EQUAL;
+    default:
+        return OP_RETURN;
+    }
+}
+
+// Variant with a 2 bytes operand
+static uint8_t wide_op(uint8_t op)
+{
+    switch (op) {
+    case OP_CONSTANT: return OP_CONSTANT_16;
+    case OP_DECL_GLOBAL: return OP_DECL_GLOBAL_16;
+    case OP_DECL_GLOBAL_CONST: return OP_DECL_GLOBAL_CONST_16;
+    case OP_GET_GLOBAL: return OP_GET_GLOBAL_16;
+    case OP_SET_GLOBAL: return OP_SET_GLOBAL_16;
+    default: return OP_RETURN;
+    }
+}
+
+// Decoding and encoding
+//------------------------------------------------------------------------------
+
+static bool decode(Optimizer* opt)
+{
+    const Chunk* chunk = &opt->function->chunk;
+    // Instruction index at each offset, -1 for operands
+    int* indexes = malloc(sizeof(int) * chunk->count);
+    int* lines = malloc(sizeof(int) * chunk->count);
+    opt->code = malloc(sizeof(Instruction) * chunk->count);
+
+    // Expand line numbers, stored as pairs (count, lineno)
+    int offset = 0;
+    for (int i = 0; i < chunk->lines.count; i += 2) {
+        for (int j = 0; j < chunk->lines.values[i]; ++j) {
+            lines[offset++] = chunk->lines.values[i + 1];
+        }
+    }
+
+    for (offset = 0; offset < chunk->count; ++offset) {
+        indexes[offset] = -1;
+    }
+    opt->count = 0;
+    for (offset = 0; offset < chunk->count;) {
+        const uint8_t* ip = chunk->code + offset;
+        int length = op_length(ip[0]);
+        int next = offset + length;
+        Instruction* in = &opt->code[opt->count];
+        indexes[offset] = opt->count++;
+        in->op = ip[0];
+        in->a = in->b = 0;
+        in->target = -1;
+        in->line = lines[offset];
+        in->removed = false;
+
+        switch (ip[0]) {
+        case OP_CONSTANT_16: in->op = OP_CONSTANT; break;
+        case OP_DECL_GLOBAL_16: in->op = OP_DECL_GLOBAL; break;
+        case OP_DECL_GLOBAL_CONST_16: in->op = OP_DECL_GLOBAL_CONST; break;
+        case OP_GET_GLOBAL_16: in->op = OP_GET_GLOBAL; break;
+        case OP_SET_GLOBAL_16: in->op = OP_SET_GLOBAL; break;
+        case OP_JUMP_BACK: in->op = OP_JUMP; break;
+        }
+
+        if (is_jump(in->op)) {
+            // Bytecode offset for now, resolved below
+            int jump = ip[1] << 8 | ip[2];
+            in->target = ip[0] == OP_JUMP_BACK ? next - jump : next + jump;
+        } else if (length == 3 && in->op != ip[0]) {
+            in->a = ip[1] << 8 | ip[2];
+        } else if (length == 3) {
+            in->a = ip[1];
+            in->b = ip[2];
+        } else if (length == 2) {
+            in->a = ip[1];
+        }
+        offset = next;
+    }
+
+    bool success = true;
+    for (int i = 0; i < opt->count; ++i) {
+        Instruction* in = &opt->code[i];
+        if (in->target != -1) {
+            if (in->target < 0 || in->target >= chunk->count || indexes[in->target] == -1) {
+                success = false;
+                break;
+            }
+            in->target = indexes[in->target];
+        }
+    }
+    free(indexes);
+    free(lines);
+    return success;
+}
+
+static int encoded_length(const Instruction* in)
+{
+    if (is_jump(in->op)) {
+        return 3;
+    }
+    if (wide_op(in->op) != OP_RETURN) {
+        return in->a > UINT8_MAX ? 3 : 2;
+    }
+    return op_length(in->op);
+}
+
+static bool encode(const Optimizer* opt, Chunk* chunk)
+{
+    int* offsets = malloc(sizeof(int) * opt->count);
+    int offset = 0;
+    for (int i = 0; i < opt->count; ++i) {
+        offsets[i] = offset;
+        offset += encoded_length(&opt->code[i]);
+    }
+
+    bool success = true;
+    for (int i = 0; success && i < opt->count; ++i) {
+        const Instruction* in = &opt->code[i];
+        int length = encoded_length(in);
+        uint8_t op = in->op;
+        int operand = in->a;
+
+        if (is_jump(op)) {
+            if (in->target < 0 || in->target >= opt->count) {
+                success = false;
+                break;
+            }
+            int next = offsets[i] + length;
+            operand = offsets[in->target] - next;
+            if (operand < 0 && op == OP_JUMP) {
+                op = OP_JUMP_BACK;
+                operand = -operand;
+            }
+            // Conditional jumps can only jump forward
+            success = operand >= 0 && operand <= UINT16_MAX;
+        } else if (length == 3 && wide_op(op) != OP_RETURN) {
+            op = wide_op(op);
+        }
+
+        chunk_write(chunk, op, in->line);
+        if (length == 3 && (is_jump(in->op) || op != in->op)) {
+            chunk_write(chunk, (operand >> 8) & 0xff, in->line);
+            chunk_write(chunk, operand & 0xff, in->line);
+        } else if (length == 3) {
+            chunk_write(chunk, in->a, in->line);
+            chunk_write(chunk, in->b, in->line);
+        } else if (length == 2) {
+            chunk_write(chunk, in->a, in->line);
+        }
+    }
+    free(offsets);
+    return success;
+}
+
+static void count_targets(Optimizer* opt)
+{
+    memset(opt->targeted, 0, sizeof(int) * opt->count);
+    for (int i = 0; i < opt->count; ++i) {
+        if (is_jump(opt->code[i].op)) {
+            opt->targeted[opt->code[i].target]++;
+        }
+    }
+}
+
+/**
+ * Drop the removed instructions. Jumps to a removed instruction land on the
+ * next one: passes only remove jump targets when this is equivalent.
+ */
+static void compact(Optimizer* opt)
+{
+    int* remap = malloc(sizeof(int) * (opt->count + 1));
+    int count = 0;
+    for (int i = 0; i < opt->count; ++i) {
+        remap[i] = count;
+        if (!opt->code[i].removed) {
+            opt->code[count++] = opt->code[i];
+        }
+    }
+    remap[opt->count] = count;
+    for (int i = 0; i < count; ++i) {
+        if (is_jump(opt->code[i].op)) {
+            opt->code[i].target = remap[opt->code[i].target];
+        }
+    }
+    opt->count = count;
+    free(remap);
+}
+
+// Constants
+//------------------------------------------------------------------------------
+
+/**
+ * Add a constant to the function
+ * @return constant index, or -1 if the constant table is full
+ */
+static int add_constant(Optimizer* opt, Value value)
+{
+    ValueArray* constants = &opt->function->chunk.constants;
+    // Other objects are compared by content, but must keep their identity
+    if (!is_object(value) || is_string(value)) {
+        int index = value_array_find(constants, value);
+        if (index >= 0) {
+            return index;
+        }
+    }
+    if (constants->count > UINT16_MAX) {
+        return -1;
+    }
+    gc_write_barrier(&opt->function->object, value);
+    value_array_push(constants, value);
+    return constants->count - 1;
+}
+
+// Value pushed by an instruction loading a constant
+static bool constant_value(const Optimizer* opt, const Instruction* in, Value* value)
+{
+    switch (in->op) {
+    case OP_CONSTANT: *value = opt->function->chunk.constants.values[in->a]; return true;
+    case OP_ZERO: *value = make_number(0); return true;
+    case OP_ONE: *value = make_number(1); return true;
+    case OP_TRUE: *value = make_bool(true); return true;
+    case OP_FALSE: *value = make_bool(false); return true;
+    case OP_NULL: *value = make_null(); return true;
+    default: return false;
+    }
+}
+
+// Rewrite an instruction to load a constant value
+static bool load_constant(Optimizer* opt, Instruction* in, Value value)
+{
+    if (is_number(value) && as_number(value) == 0 && !signbit(as_number(value))) {
+        in->op = OP_ZERO;
+    } else if (is_number(value) && as_number(value) == 1) {
+        in->op = OP_ONE;
+    } else if (is_bool(value)) {
+        in->op = as_bool(value) ? OP_TRUE : OP_FALSE;
+    } else if (is_null(value)) {
+        in->op = OP_NULL;
+    } else {
+        int index = add_constant(opt, value);
+        if (index < 0) {
+            return false;
+        }
+        in->op = OP_CONSTANT;
+        in->a = index;
+    }
+    return true;
+}
+
+/**
+ * Evaluate a binary operator on two constant numbers
+ * @return false if the operator cannot be folded
+ */
+static bool fold_binary(uint8_t op, Value a, Value b, Value* result)
+{
+    // Other types may allocate (strings) or fail at runtime
+    if (!is_number(a) || !is_number(b)) {
+        return false;
+    }
+    switch (op) {
+    case OP_ADD:
+    case OP_ADD_NUM: *result = op_add(b, a); break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM: *result = op_subtract(b, a); break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM: *result = op_multiply(b, a); break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM: *result = op_divide(b, a); break;
+    case OP_MODULO: *result = op_modulo(b, a); break;
+    case OP_EQUAL: *result = make_bool(value_equal(b, a)); break;
+    case OP_NOT_EQUAL: *result = make_bool(!value_equal(b, a)); break;
+    case OP_GREATER:
+    case OP_GREATER_NUM: *result = op_greater(b, a); break;
+    case OP_GREATER_EQUAL:
+    case OP_GREATER_EQUAL_NUM: *result = op_greater_equal(b, a); break;
+    case OP_LESS:
+    case OP_LESS_NUM: *result = op_greater(a, b); break;
+    case OP_LESS_EQUAL:
+    case OP_LESS_EQUAL_NUM: *result = op_greater_equal(a, b); break;
+    default: return false;
+    }
+    if (is_error(*result)) {
+        // Left to the runtime, which reports the error
+        free((char*)as_error(*result));
+        return false;
+    }
+    return true;
+}
+
+// Passes
+//------------------------------------------------------------------------------
+
+/**
+ * Read-only globals cannot change once declared: load their value as a
+ * constant
+ */
+static bool propagate_constants(Optimizer* opt)
+{
+    bool changed = false;
+    for (int i = 0; i < opt->count; ++i) {
+        Instruction* in = &opt->code[i];
+        if (in->op != OP_GET_GLOBAL) {
+            continue;
+        }
+        const Global* global = &vm.globals[in->a];
+        if (global->defined && global->read_only && load_constant(opt, in, global->value)) {
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/**
+ * Evaluate operators and conditional jumps on constants
+ */
+static bool fold_constants(Optimizer* opt)
+{
+    bool changed = false;
+    for (int i = 0; i + 1 < opt->count; ++i) {
+        Instruction* in = &opt->code[i];
+        Instruction* next = &opt->code[i + 1];
+        Value a;
+        Value b;
+        Value result;
+        if (opt->targeted[i + 1] || !constant_value(opt, in, &a)) {
+            continue;
+        }
+
+        // [constant][constant][operator]
+        if (i + 2 < opt->count && !opt->targeted[i + 2] && constant_value(opt, next, &b)) {
+            Instruction* third = &opt->code[i + 2];
+            if (fold_binary(third->op, a, b, &result) && load_constant(opt, in, result)) {
+                next->removed = third->removed = true;
+                changed = true;
+                i += 2;
+                continue;
+            }
+            if (fold_binary(compare_jump_condition(third->op), a, b, &result)) {
+                // Jump if the comparison is false, otherwise fall through
+                if (as_bool(result)) {
+                    in->removed = true;
+                } else {
+                    in->op = OP_JUMP;
+                    in->target = third->target;
+                }
+                next->removed = third->removed = true;
+                changed = true;
+                i += 2;
+                continue;
+            }
+        }
+
+        // [constant][operator]
+        switch (next->op) {
+        case OP_NEGATIVE:
+            if (is_number(a) && load_constant(opt, in, make_number(-as_number(a)))) {
+                next->removed = true;
+                changed = true;
+            }
+            break;
+        case OP_NOT:
+            if (load_constant(opt, in, op_not(a))) {
+                next->removed = true;
+                changed = true;
+            }
+            break;
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE:
+            // The value stays on the stack: only the jump is resolved
+            if (value_truthy(a) == (next->op == OP_JUMP_IF_TRUE)) {
+                next->op = OP_JUMP;
+            } else {
+                next->removed = true;
+            }
+            changed = true;
+            break;
+        }
+    }
+    return changed;
+}
+
+/**
+ * Remove unreachable instructions, jumps to the next instruction, values
+ * pushed then popped, and assignments of a local variable to itself
+ */
+static bool remove_dead_code(Optimizer* opt)
+{
+    bool changed = false;
+    bool reachable = true;
+    for (int i = 0; i < opt->count; ++i) {
+        Instruction* in = &opt->code[i];
+        Instruction* next = i + 1 < opt->count && !opt->targeted[i + 1] ? &opt->code[i + 1] : NULL;
+        if (opt->targeted[i]) {
+            reachable = true;
+        }
+        if (!reachable) {
+            in->removed = true;
+            changed = true;
+            continue;
+        }
+
+        switch (in->op) {
+        case OP_RETURN:
+            reachable = false;
+            break;
+        case OP_JUMP:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE:
+            if (in->target == i + 1) {
+                in->removed = true;
+                changed = true;
+            } else if (in->op == OP_JUMP) {
+                reachable = false;
+            }
+            break;
+        case OP_GET_LOCAL_2:
+            if (next != NULL && next->op == OP_POP) {
+                in->op = OP_GET_LOCAL;
+                next->removed = true;
+                changed = true;
+                ++i;
+            }
+            break;
+        default:
+            if (next != NULL && next->op == OP_POP && is_pure_push(in->op)) {
+                in->removed = next->removed = true;
+                changed = true;
+                ++i;
+            } else if (next != NULL && in->op == OP_GET_LOCAL && next->op == OP_SET_LOCAL_POP && next->a == in->a) {
+                in->removed = next->removed = true;
+                changed = true;
+                ++i;
+            }
+            break;
+        }
+    }
+    return changed;
+}
+
+/**
+ * Branch layout: thread jumps to jumps, return directly instead of jumping to
+ * a return, and merge branches ending with the same instruction
+ */
+static bool thread_jumps(Optimizer* opt)
+{
+    bool changed = false;
+    for (int i = 0; i < opt->count; ++i) {
+        Instruction* in = &opt->code[i];
+        if (!is_jump(in->op)) {
+            continue;
+        }
+        bool peek = in->op == OP_JUMP_IF_TRUE || in->op == OP_JUMP_IF_FALSE;
+        int target = in->target;
+        for (int hops = 0; hops < OPTIMIZER_MAX_HOPS; ++hops) {
+            const Instruction* destination = &opt->code[target];
+            // The same test on the same value has the same result
+            if (destination->op == OP_JUMP || (peek && destination->op == in->op)) {
+                target = destination->target;
+            } else {
+                break;
+            }
+        }
+        // The opposite test on the same value falls through
+        if (peek && opt->code[target].op != in->op && is_jump(opt->code[target].op)
+            && (opt->code[target].op == OP_JUMP_IF_TRUE || opt->code[target].op == OP_JUMP_IF_FALSE)) {
+            target++;
+        }
+        // Conditional jumps can only jump forward
+        if (target != in->target && (in->op == OP_JUMP || target > i)) {
+            in->target = target;
+            changed = true;
+        }
+        if (in->op == OP_JUMP && opt->code[in->target].op == OP_RETURN) {
+            in->op = OP_RETURN;
+            changed = true;
+        }
+    }
+
+    // [X][JUMP L][X][L:] -> [X][L:]: fall through into the same instruction
+    for (int i = 1; i + 2 < opt->count; ++i) {
+        Instruction* previous = &opt->code[i - 1];
+        const Instruction* in = &opt->code[i];
+        const Instruction* same = &opt->code[i + 1];
+        if (in->op == OP_JUMP && in->target == i + 2 && !opt->targeted[i] && !previous->removed
+            && !is_jump(previous->op) && previous->op == same->op && previous->a == same->a
+            && previous->b == same->b) {
+            previous->removed = opt->code[i].removed = true;
+            changed = true;
+            i += 2;
+        }
+    }
+    return changed;
+}
+
+/**
+ * [NOT][JUMP_IF_FALSE L][POP] ... L: [POP] -> [JUMP_IF_TRUE L][POP]: the
+ * tested value is popped on both paths, so the negation is not needed
+ */
+static bool invert_conditions(Optimizer* opt)
+{
+    bool changed = false;
+    for (int i = 0; i + 2 < opt->count; ++i) {
+        const Instruction* in = &opt->code[i];
+        Instruction* next = &opt->code[i + 1];
+        if (in->op != OP_NOT || opt->targeted[i + 1]
+            || (next->op != OP_JUMP_IF_FALSE && next->op != OP_JUMP_IF_TRUE)
+            || opt->code[i + 2].op != OP_POP || opt->code[next->target].op != OP_POP) {
+            continue;
+        }
+        // Jumps to the OP_NOT land on the inverted jump
+        opt->code[i].removed = true;
+        next->op = next->op == OP_JUMP_IF_FALSE ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE;
+        changed = true;
+        ++i;
+    }
+    return changed;
+}
+
+// ADD_IMM operand of a small integer constant
+static bool immediate_value(const Optimizer* opt, const Instruction* in, int* immediate)
+{
+    Value value;
+    if (!constant_value(opt, in, &value) || !op_is_immediate(value)) {
+        return false;
+    }
+    *immediate = (int8_t)as_number(value);
+    return true;
+}
+
+/**
+ * Compute the stack depth before each instruction, following the control flow
+ * @return depths, -1 for unreachable instructions (to be freed)
+ */
+static int* compute_depths(const Optimizer* opt)
+{
+    int* depths = malloc(sizeof(int) * opt->count);
+    int* pending = malloc(sizeof(int) * opt->count);
+    for (int i = 0; i < opt->count; ++i) {
+        depths[i] = -1;
+    }
+    int pending_count = 0;
+    if (opt->count > 0) {
+        depths[0] = opt->function->arity + 1;
+        pending[pending_count++] = 0;
+    }
+
+    while (pending_count > 0) {
+        int i = pending[--pending_count];
+        const Instruction* in = &opt->code[i];
+        // Stack effect only depends on the first operand
+        uint8_t ip[3] = { in->op, (uint8_t)in->a, 0 };
+        int depth = depths[i] + op_stack_effect(ip);
+        int successors[2] = { i + 1, is_jump(in->op) ? in->target : -1 };
+        if (in->op == OP_RETURN || in->op == OP_JUMP) {
+            successors[0] = -1;
+        }
+        for (int j = 0; j < 2; ++j) {
+            int next = successors[j];
+            if (next >= 0 && next < opt->count && depths[next] == -1) {
+                depths[next] = depth;
+                pending[pending_count++] = next;
+            }
+        }
+    }
+    free(pending);
+    return depths;
+}
+
+/**
+ * Fuse instructions into superinstructions, as the parser does, on the
+ * rewritten code. Additions quickened as OP_ADD_STR keep their specialized
+ * form instead of being fused with number fast paths.
+ */
+static bool select_superinstructions(Optimizer* opt)
+{
+    bool changed = false;
+    int* depths = compute_depths(opt);
+    for (int i = 0; i < opt->count; ++i) {
+        Instruction* in = &opt->code[i];
+        Instruction* next = i + 1 < opt->count && !opt->targeted[i + 1] ? &opt->code[i + 1] : NULL;
+        Instruction* third = next != NULL && i + 2 < opt->count && !opt->targeted[i + 2] ? &opt->code[i + 2] : NULL;
+        bool next_is_add = next != NULL && (next->op == OP_ADD || next->op == OP_ADD_NUM);
+        int immediate;
+        int fused = 0;
+
+        switch (in->op) {
+        case OP_GET_LOCAL:
+            if (third != NULL && next->op == OP_ADD_IMM && third->op == OP_SET_LOCAL_POP && third->a == in->a) {
+                // local = local + k
+                if ((int8_t)next->a == 1) {
+                    in->op = OP_INC_LOCAL;
+                    fused = 2;
+                } else {
+                    int index = add_constant(opt, make_number((int8_t)next->a));
+                    if (index >= 0 && index <= UINT8_MAX) {
+                        in->op = OP_ADD_LOCAL_CONST;
+                        in->b = index;
+                        fused = 2;
+                    }
+                }
+            } else if (next != NULL && next->op == OP_GET_LOCAL && next->a != depths[i]) {
+                // Not when the second load reads the value pushed by the
+                // first one (a new local): OP_ADD_LOCALS reads both locals
+                // before pushing
+                in->op = OP_GET_LOCAL_2;
+                in->b = next->a;
+                fused = 1;
+            } else if (next != NULL && next->op == OP_CONSTANT && next->a <= UINT8_MAX) {
+                in->op = OP_GET_LOCAL_CONSTANT;
+                in->b = next->a;
+                fused = 1;
+            }
+            break;
+        case OP_GET_LOCAL_2:
+            if (next_is_add) {
+                in->op = OP_ADD_LOCALS;
+                fused = 1;
+            }
+            break;
+        case OP_GET_LOCAL_CONSTANT:
+            if (next_is_add && third != NULL && third->op == OP_SET_LOCAL_POP && third->a == in->a) {
+                in->op = OP_ADD_LOCAL_CONST;
+                fused = 2;
+            }
+            break;
+        case OP_CONSTANT:
+        case OP_ZERO:
+        case OP_ONE:
+            if (next_is_add && immediate_value(opt, in, &immediate)) {
+                in->op = OP_ADD_IMM;
+                // Stored as an unsigned byte, like the encoded operand
+                in->a = (uint8_t)immediate;
+                fused = 1;
+            }
+            break;
+        case OP_SET_LOCAL:
+            if (next != NULL && next->op == OP_POP) {
+                in->op = OP_SET_LOCAL_POP;
+                fused = 1;
+            }
+            break;
+        case OP_SET_GLOBAL:
+            if (next != NULL && next->op == OP_POP && in->a <= UINT8_MAX) {
+                in->op = OP_SET_GLOBAL_POP;
+                fused = 1;
+            }
+            break;
+        default:
+            // [compare][JUMP_IF_FALSE L][POP] ... L: [POP]: the compare and
+            // branch pops the operands, and jumps after the POP
+            if (compare_jump_for(in->op) != OP_RETURN && third != NULL && next->op == OP_JUMP_IF_FALSE
+                && third->op == OP_POP && opt->code[next->target].op == OP_POP) {
+                in->op = compare_jump_for(in->op);
+                in->target = next->target + 1;
+                fused = 2;
+            }
+            break;
+        }
+
+        for (int j = 1; j <= fused; ++j) {
+            opt->code[i + j].removed = true;
+        }
+        if (fused > 0) {
+            changed = true;
+            i += fused;
+        }
+    }
+    free(depths);
+    return changed;
+}
+
+static bool run_pass(Optimizer* opt, Pass pass)
+{
+    count_targets(opt);
+    bool changed = pass(opt);
+    compact(opt);
+    return changed;
+}
+
+/**
+ * Run the passes in rounds, until a round changes nothing
+ * @return true if the code has been changed
+ */
+static bool run_passes(Optimizer* opt, const Pass* passes, int pass_count)
+{
+    bool optimized = false;
+    bool changed = true;
+    for (int round = 0; changed && round < OPTIMIZER_MAX_ROUNDS; ++round) {
+        changed = false;
+        for (int i = 0; i < pass_count; ++i) {
+            changed |= run_pass(opt, passes[i]);
+        }
+        optimized |= changed;
+    }
+    return optimized;
+}
+
+// Passes of the optimizer tier, with the runtime state
+static const Pass optimizer_passes[] = {
+    propagate_constants,
+    fold_constants,
+    remove_dead_code,
+    thread_jumps,
+    invert_conditions,
+    select_superinstructions,
+};
+
+// Passes of the peephole optimizer, only looking at the bytecode
+static const Pass peephole_passes[] = {
+    fold_constants,
+    remove_dead_code,
+    thread_jumps,
+    invert_conditions,
+    select_superinstructions,
+};
+
+// Public API
+//------------------------------------------------------------------------------
+
+bool optimizer_optimize(ObjectFunction* function)
+{
+    // Native code does not run the bytecode, and keeps pointers into it
+    if (function->baseline != NULL || function->native_code != NULL || function->chunk.count == 0) {
+        return false;
+    }
+
+    Optimizer opt = { 0 };
+    opt.function = function;
+    opt.targeted = malloc(sizeof(int) * function->chunk.count);
+    bool success = decode(&opt);
+
+    bool optimized = success
+        && run_passes(&opt, optimizer_passes, sizeof(optimizer_passes) / sizeof(Pass));
+
+    Chunk chunk;
+    chunk_init(&chunk);
+    if (success && optimized && encode(&opt, &chunk)) {
+        // Keep the previous bytecode for the frames running it. Constants are
+        // shared: the optimized bytecode only appends new ones.
+        Chunk* baseline = malloc(sizeof(Chunk));
+        *baseline = function->chunk;
+        value_array_init(&baseline->constants);
+        function->chunk.code = chunk.code;
+        function->chunk.count = chunk.count;
+        function->chunk.capacity = chunk.capacity;
+        function->chunk.lines = chunk.lines;
+        function->baseline = baseline;
+        // Frames started before still run the baseline
+        int max_stack = chunk_max_stack(&function->chunk, function->arity + 1);
+        if (max_stack > function->max_stack) {
+            function->max_stack = max_stack;
+        }
+#ifdef ASPIC_DEBUG
+        // Constants may now hold functions from globals: do not follow them
+        assert(verifier_check_function(function));
+#endif
+
+        if (dump_bytecode) {
+            char name[128];
+            snprintf(name, sizeof(name), "%s (optimized)",
+                function->name == NULL ? "__main__" : function->name->chars);
+            chunk_dump(&function->chunk, name);
+        }
+    } else {
+        chunk_free(&chunk);
+        optimized = false;
+    }
+
+    free(opt.code);
+    free(opt.targeted);
+    return optimized;
+}
+
+bool optimizer_peephole(ObjectFunction* function)
+{
+    if (function->chunk.count == 0) {
+        return false;
+    }
+
+    Optimizer opt = { 0 };
+    opt.function = function;
+    opt.targeted = malloc(sizeof(int) * function->chunk.count);
+    bool optimized = decode(&opt)
+        && run_passes(&opt, peephole_passes, sizeof(peephole_passes) / sizeof(Pass));
+
+    Chunk chunk;
+    chunk_init(&chunk);
+    if (optimized && encode(&opt, &chunk)) {
+        // Replace the code and the line numbers, and keep the constants
+        chunk.constants = function->chunk.constants;
+        value_array_init(&function->chunk.constants);
+        chunk_free(&function->chunk);
+        function->chunk = chunk;
+    } else {
+        chunk_free(&chunk);
+        optimized = false;
+    }
+
+    free(opt.code);
+    free(opt.targeted);
+    return optimized;
+}
+
+void optimizer_dump_bytecode(bool enabled)
+{
+    dump_bytecode = enabled;
+}
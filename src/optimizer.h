@@ -0,0 +1,51 @@
+#ifndef ASPIC_OPTIMIZER_H
+#define ASPIC_OPTIMIZER_H
+
+#include "object.h"
+
+/**
+ * Bytecode optimizer, second execution tier
+ *
+ * Functions count their calls and loop iterations (ObjectFunction.hotness).
+ * Once hot, the bytecode is decoded and rewritten with the runtime state
+ * available at that point:
+ * - read-only globals are propagated as constants, and constant expressions
+ *   folded
+ * - values pushed then popped, unreachable code and jumps to the next
+ *   instruction are removed
+ * - jumps to jumps are threaded, and branches sharing the same tail merged
+ * - conditional jumps on a negated value are inverted
+ * - superinstructions are selected again on the result, following the type
+ *   feedback of quickened instructions
+ *
+ * The optimized bytecode replaces function->chunk, and runs from the next
+ * call. Frames already running keep executing the previous bytecode, kept in
+ * function->baseline.
+ *
+ * The parser also runs the passes which do not depend on the runtime state
+ * as a peephole optimizer, on the bytecode of each function it compiles.
+ */
+
+#ifndef OPTIMIZER_THRESHOLD
+#define OPTIMIZER_THRESHOLD 1000
+#endif
+
+/**
+ * Optimize the bytecode of a function (once)
+ * @return true if the bytecode has been replaced
+ */
+bool optimizer_optimize(ObjectFunction* function);
+
+/**
+ * Rewrite the bytecode of a function compiled by the parser, before it runs:
+ * every pass except the propagation of globals
+ * @return true if the bytecode has been replaced
+ */
+bool optimizer_peephole(ObjectFunction* function);
+
+/**
+ * Print the bytecode of each optimized function to stdout
+ */
+void optimizer_dump_bytecode(bool enabled);
+
+#endif
@@ -1,12 +1,18 @@
 #include "parser.h"
 #include "chunk.h"
 #include "debug.h"
+#include "ir.h"
 #include "op_code.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "utils.h"
+#include "vm.h"
 
 #include <assert.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 typedef struct {
@@ -105,13 +111,14 @@ ParseRule rules[] = {
 };
 
 /*
- * Global variables are resolved at runtime. The identifiers and their values
- * are stored in the vm.globals hashmap.
+ * Global variables are resolved to slots at compile time. The values are
+ * stored in the vm.globals array, and vm.global_slots maps the identifiers to
+ * their slot index.
  * The parser emits OP_*_GLOBAL_* instructions, used by the VM to
  * create/update/read globals.
- * Those instructions take an operand, which is the index of the Value in the
- * chunk.constants array, representing the global's name as a string.
- * This string value is matched at runtime with keys in the vm.globals hashmap.
+ * Those instructions take an operand, which is the slot index in vm.globals.
+ * A slot is reserved the first time an identifier is used, but the variable
+ * is only defined at runtime, by its declaration.
  *
  * Local variables are resolved at compile time, which means there isn't any
  * instruction to declare a local. The values are stored directly on the VM stack.
@@ -145,11 +152,31 @@ typedef struct Compiler {
     Local locals[UINT8_MAX];
     int local_count;
     int scope_depth;
+
+    // Offset of the last emitted instruction, which may be fused with the
+    // next one into a superinstruction (-1 if none)
+    int last_instruction;
+    // Instructions cannot be fused across this offset, such as a jump target
+    int fusion_barrier;
+    // Constant appended to the chunk by the last call to emit_constant (-1 if
+    // none), dropped again if its load instruction is folded
+    int new_constant;
 } Compiler;
 
 Parser parser;
 Compiler* g_compiler = NULL;
 
+#ifdef ASPIC_DEBUG
+static bool dump_bytecode = true;
+#else
+static bool dump_bytecode = false;
+#endif
+
+static bool lazy_compilation = false;
+static bool repl_mode = false;
+// 0: none, 1: peephole optimizer, 2: IR passes then peephole optimizer
+static int optimization_level = 1;
+
 static Chunk* current_chunk()
 {
     return &g_compiler->function->chunk;
@@ -262,37 +289,410 @@ static void emit_byte(uint8_t byte)
     chunk_write(current_chunk(), byte, parser.previous.line);
 }
 
+/**
+ * Append the opcode of a new instruction to current chunk. Operands are then
+ * appended with emit_byte.
+ */
+static void emit_op(OpCode op)
+{
+    g_compiler->last_instruction = current_chunk()->count;
+    emit_byte(op);
+}
+
+/*
+ * Superinstructions
+ *
+ * Some sequences of instructions are very common in loops, such as
+ * OP_SET_LOCAL followed by OP_POP for an assignment statement. When emitting
+ * the second instruction of such a sequence, the parser rewrites the previous
+ * instruction into a superinstruction doing the work of both, so the VM pays
+ * a single dispatch for them. This is only valid if no jump lands between
+ * the two instructions.
+ */
+
+// Remove the last emitted instructions, from <offset> to the end
+static void remove_instructions(int offset)
+{
+    chunk_truncate(current_chunk(), offset);
+    g_compiler->last_instruction = -1;
+}
+
+// Get the last emitted instruction, if the next one can be fused with it
+// @return opcode, or -1 if the instructions cannot be fused
+static int fusable_instruction()
+{
+    if (g_compiler->last_instruction == -1
+        || g_compiler->fusion_barrier == current_chunk()->count) {
+        return -1;
+    }
+    return current_chunk()->code[g_compiler->last_instruction];
+}
+
+// Rewrite the last emitted instruction into a superinstruction
+static void fuse_instruction(OpCode superinstruction)
+{
+    current_chunk()->code[g_compiler->last_instruction] = superinstruction;
+}
+
+// Next instruction cannot be fused with the previous ones, because it is the
+// target of a jump or must be matched separately
+static void set_fusion_barrier()
+{
+    g_compiler->fusion_barrier = current_chunk()->count;
+}
+
+static void emit_pop()
+{
+    switch (fusable_instruction()) {
+    case OP_SET_LOCAL:
+        fuse_instruction(OP_SET_LOCAL_POP);
+        break;
+    case OP_SET_GLOBAL:
+        fuse_instruction(OP_SET_GLOBAL_POP);
+        break;
+    case OP_GET_LOCAL:
+        // Pushing a local variable then popping it has no effect
+        remove_instructions(g_compiler->last_instruction);
+        break;
+    default:
+        emit_op(OP_POP);
+        break;
+    }
+}
+
+static void emit_get_local(uint8_t slot)
+{
+    if (fusable_instruction() == OP_GET_LOCAL) {
+        // OP_GET_LOCAL a + OP_GET_LOCAL b
+        fuse_instruction(OP_GET_LOCAL_2);
+    } else {
+        emit_op(OP_GET_LOCAL);
+    }
+    emit_byte(slot);
+}
+
+static void emit_add()
+{
+    Chunk* chunk = current_chunk();
+    int last = g_compiler->last_instruction;
+    switch (fusable_instruction()) {
+    case OP_GET_LOCAL_2:
+        // OP_GET_LOCAL a + OP_GET_LOCAL b + OP_ADD
+        fuse_instruction(OP_ADD_LOCALS);
+        return;
+    case OP_ONE:
+        // OP_ONE + OP_ADD
+        fuse_instruction(OP_ADD_IMM);
+        emit_byte(1);
+        return;
+    case OP_CONSTANT: {
+        // OP_CONSTANT + OP_ADD, replace the constant index with its value
+        Value constant = chunk->constants.values[chunk->code[last + 1]];
+        if (op_is_immediate(constant)) {
+            fuse_instruction(OP_ADD_IMM);
+            chunk->code[last + 1] = (int8_t)as_number(constant);
+            return;
+        }
+        break;
+    }
+    }
+    emit_op(OP_ADD);
+}
+
+/**
+ * Emit the assignment of a local variable, with the value computed by the
+ * instructions emitted since offset <start>. When the variable is assigned to
+ * itself plus a constant, the instructions are replaced with an in-place
+ * update of the variable.
+ */
+static void emit_set_local(uint8_t slot, int start)
+{
+    Chunk* chunk = current_chunk();
+    const uint8_t* code = chunk->code + start;
+    bool increment = false;
+    int constant = -1;
+    if (chunk->count - start == 4 && code[0] == OP_GET_LOCAL && code[1] == slot
+        && code[2] == OP_ADD_IMM) {
+        // slot + immediate
+        increment = (int8_t)code[3] == 1;
+        if (!increment) {
+            constant = chunk_register_constant(chunk, make_number((int8_t)code[3]));
+        }
+    } else if (chunk->count - start == 4 && code[0] == OP_GET_LOCAL_CONSTANT
+        && code[1] == slot && code[3] == OP_ADD) {
+        // slot + constant
+        constant = code[2];
+    }
+
+    if (!increment && (constant == -1 || constant > UINT8_MAX)) {
+        emit_op(OP_SET_LOCAL);
+        emit_byte(slot);
+        return;
+    }
+
+    remove_instructions(start);
+    if (increment) {
+        emit_op(OP_INC_LOCAL);
+        emit_byte(slot);
+    } else {
+        emit_op(OP_ADD_LOCAL_CONST);
+        emit_byte(slot);
+        emit_byte(constant);
+    }
+    // Push the assigned value, which is the result of the assignment
+    // expression. Removed by emit_pop if unused.
+    emit_op(OP_GET_LOCAL);
+    emit_byte(slot);
+}
+
 static void emit_return()
 {
-    if (g_compiler->type != CHUNK_MAIN) {
-        // Implicit NULL return value for functions
-        emit_byte(OP_NULL);
+    if (g_compiler->type != CHUNK_MAIN || repl_mode) {
+        // Implicit NULL return value for functions, and for REPL lines
+        emit_op(OP_NULL);
     }
-    emit_byte(OP_RETURN);
+    emit_op(OP_RETURN);
 }
 
-static int emit_constant(Value constant)
+// Emit the load of the constant registered at index
+static void emit_constant_index(int constant_index)
 {
-    // Register the constant value in the chunk
     Chunk* chunk = current_chunk();
-    int constant_index = chunk_register_constant(chunk, constant);
+    if (constant_index <= UINT8_MAX && fusable_instruction() == OP_GET_LOCAL) {
+        // OP_GET_LOCAL + OP_CONSTANT
+        fuse_instruction(OP_GET_LOCAL_CONSTANT);
+        emit_byte(constant_index);
+        return;
+    }
 
     // Write load instruction + index
-    if (!chunk_write_constant(current_chunk(), constant_index, parser.previous.line)) {
+    g_compiler->last_instruction = chunk->count;
+    if (!chunk_write_constant(chunk, constant_index, parser.previous.line)) {
         error("Too many constants in one chunk");
     }
+}
+
+static int emit_constant(Value constant)
+{
+    // Register the constant value in the chunk
+    ValueArray* constants = &current_chunk()->constants;
+    int count = constants->count;
+    int constant_index = chunk_register_constant(current_chunk(), constant);
+    g_compiler->new_constant = constants->count > count ? constant_index : -1;
+    emit_constant_index(constant_index);
     return constant_index;
 }
 
+// Emit the load of a value, with a dedicated instruction for common values
+static void emit_value(Value value)
+{
+    if (is_number(value) && as_number(value) == 0 && !signbit(as_number(value))) {
+        emit_op(OP_ZERO);
+    } else if (is_number(value) && as_number(value) == 1) {
+        emit_op(OP_ONE);
+    } else if (is_bool(value)) {
+        emit_op(as_bool(value) ? OP_TRUE : OP_FALSE);
+    } else if (is_null(value)) {
+        emit_op(OP_NULL);
+    } else {
+        emit_constant(value);
+    }
+}
+
+// Emit the load of a new function
+static void emit_function(ObjectFunction* function)
+{
+    // A new function cannot be registered already: skip the lookup of
+    // chunk_register_constant, linear in the number of constants
+    ValueArray* constants = &current_chunk()->constants;
+    value_array_push(constants, make_function(function));
+    emit_constant_index(constants->count - 1);
+}
+
+/*
+ * Constant folding
+ *
+ * When both operands of an operator are literals, or expressions already
+ * folded, the parser evaluates the operator and loads its result instead. An
+ * operand is a constant if it is the last emitted instruction, and a constant
+ * load. The operators are evaluated with the functions of the VM
+ * (op_code.h): an operator failing at runtime, such as a division by 0, is
+ * not folded, and reports its error when the code runs.
+ */
+
+// Longest string built by folding a string repetition
+#define FOLD_STRING_MAX 256
+
+/**
+ * Get the value loaded by the last emitted instruction, if it is a constant
+ * @return offset of the instruction, or -1 if not a constant load
+ */
+static int last_constant(Value* value)
+{
+    const Chunk* chunk = current_chunk();
+    int offset = g_compiler->last_instruction;
+    const uint8_t* code = chunk->code + offset;
+    switch (fusable_instruction()) {
+    case OP_CONSTANT: *value = chunk->constants.values[code[1]]; break;
+    case OP_CONSTANT_16: *value = chunk->constants.values[code[1] << 8 | code[2]]; break;
+    case OP_GET_LOCAL_CONSTANT:
+        // OP_GET_LOCAL + OP_CONSTANT: the constant is the last operand
+        *value = chunk->constants.values[code[2]];
+        break;
+    case OP_ZERO: *value = make_number(0); break;
+    case OP_ONE: *value = make_number(1); break;
+    case OP_TRUE: *value = make_bool(true); break;
+    case OP_FALSE: *value = make_bool(false); break;
+    case OP_NULL: *value = make_null(); break;
+    default: return -1;
+    }
+    return offset;
+}
+
+/**
+ * Remove the constant load at offset, and the instructions after it
+ * @param new_constant: constant appended by the load, or -1
+ */
+static void remove_constant(int offset, int new_constant)
+{
+    Chunk* chunk = current_chunk();
+    const uint8_t* code = chunk->code + offset;
+    int index = -1;
+    switch (code[0]) {
+    case OP_CONSTANT: index = code[1]; break;
+    case OP_CONSTANT_16: index = code[1] << 8 | code[2]; break;
+    case OP_GET_LOCAL_CONSTANT: index = code[2]; break;
+    }
+    // The constant is only used by this instruction if it was appended last
+    if (index != -1 && index == new_constant && index == chunk->constants.count - 1) {
+        value_array_pop(&chunk->constants);
+    }
+
+    if (code[0] == OP_GET_LOCAL_CONSTANT) {
+        // Keep the OP_GET_LOCAL, the next constant load is fused again
+        chunk_truncate(chunk, offset + 2);
+        chunk->code[offset] = OP_GET_LOCAL;
+        g_compiler->last_instruction = offset;
+    } else {
+        remove_instructions(offset);
+    }
+}
+
+/**
+ * Check whether the code emitted from offset <start> is a single constant load
+ * @param value: set to the loaded value
+ */
+static bool constant_operand(int start, Value* value)
+{
+    int offset = last_constant(value);
+    if (offset == -1) {
+        return false;
+    }
+    // The constant may be fused with the OP_GET_LOCAL before the operand
+    return offset == start
+        || (current_chunk()->code[offset] == OP_GET_LOCAL_CONSTANT && offset + 2 == start);
+}
+
+// Repetition count of <string> * <number>, if the result is a short string
+static bool is_short_repetition(Value string, Value count)
+{
+    if (!is_string(string) || !is_number(count)) {
+        return false;
+    }
+    double n = as_number(count);
+    int length = ((const ObjectString*)as_object(string))->length;
+    return n >= 0 && n <= FOLD_STRING_MAX && n == (int)n && length * n <= FOLD_STRING_MAX;
+}
+
+// Number converted to an int without overflow
+static bool is_int_operand(Value value)
+{
+    return is_number(value) && fabs(as_number(value)) < INT_MAX;
+}
+
+/**
+ * Evaluate a binary operator on constant operands: numbers, booleans, null
+ * and strings
+ * @return false if the operator must be evaluated at runtime
+ */
+static bool fold_binary(TokenType type, Value a, Value b, Value* folded)
+{
+    Value result;
+    switch (type) {
+    case TOKEN_PLUS: result = op_add(b, a); break;
+    case TOKEN_MINUS: result = op_subtract(b, a); break;
+    case TOKEN_STAR:
+        // Do not fill the constants with long strings
+        if ((is_string(a) || is_string(b)) && !is_short_repetition(a, b) && !is_short_repetition(b, a)) {
+            return false;
+        }
+        result = op_multiply(b, a);
+        break;
+    case TOKEN_SLASH: result = op_divide(b, a); break;
+    case TOKEN_PERCENT:
+        // The VM converts the operands to int, and does not check for modulo 0
+        if (!is_int_operand(a) || !is_int_operand(b) || (int)as_number(b) == 0) {
+            return false;
+        }
+        result = op_modulo(b, a);
+        break;
+    case TOKEN_EQUAL_EQUAL: result = make_bool(value_equal(b, a)); break;
+    case TOKEN_BANG_EQUAL: result = make_bool(!value_equal(b, a)); break;
+    case TOKEN_GREATER: result = op_greater(b, a); break;
+    case TOKEN_GREATER_EQUAL: result = op_greater_equal(b, a); break;
+    // a < b is b > a
+    case TOKEN_LESS: result = op_greater(a, b); break;
+    case TOKEN_LESS_EQUAL: result = op_greater_equal(a, b); break;
+    default: return false;
+    }
+    if (is_error(result)) {
+        free((char*)as_error(result));
+        return false;
+    }
+    *folded = result;
+    return true;
+}
+
+/**
+ * Evaluate a unary operator on a constant operand
+ * @return false if the operator must be evaluated at runtime
+ */
+static bool fold_unary(TokenType type, Value value, Value* folded)
+{
+    Value result;
+    switch (type) {
+    case TOKEN_BANG: result = op_not(value); break;
+    case TOKEN_PLUS: result = op_positive(value); break;
+    case TOKEN_MINUS: result = op_negative(value); break;
+    default: return false;
+    }
+    if (is_error(result)) {
+        free((char*)as_error(result));
+        return false;
+    }
+    *folded = result;
+    return true;
+}
+
 static ObjectFunction* end_compiler()
 {
     emit_return();
     ObjectFunction* function = g_compiler->function;
-#ifdef ASPIC_DEBUG
-    if (!parser.errored) {
-        chunk_dump(current_chunk(), function->name ? function->name->chars : "__main__");
+    const char* name = function->name ? function->name->chars : "__main__";
+    if (dump_bytecode && !parser.errored) {
+        chunk_dump(current_chunk(), name);
     }
-#endif
+    if (!parser.errored && optimization_level > 0) {
+        bool optimized = optimization_level >= 2 && ir_optimize(function);
+        optimized = optimizer_peephole(function) || optimized;
+        if (optimized && dump_bytecode) {
+            // Print the rewritten bytecode after the parser output
+            char label[128];
+            snprintf(label, sizeof(label), "%s (-O%d)", name, optimization_level);
+            chunk_dump_code(current_chunk(), label);
+        }
+    }
+    function->max_stack = chunk_max_stack(current_chunk(), function->arity + 1);
     // Restore the previous instance as the current one
     g_compiler = g_compiler->previous;
     return function;
@@ -311,7 +711,7 @@ static void end_scope()
     // any variables declared at the scope depth we just left.
     // Discard them by simply decrementing the length of the local array.
     while (g_compiler->local_count > 0 && g_compiler->locals[g_compiler->local_count - 1].depth > g_compiler->scope_depth) {
-        emit_byte(OP_POP);
+        emit_pop();
         g_compiler->local_count--;
     }
 }
@@ -352,8 +752,14 @@ static void expression_statement()
 {
     expression();
     consume(TOKEN_SEMICOLON, "Expected ';' after expression");
-    // Discard the expression result
-    emit_byte(OP_POP);
+    if (repl_mode && g_compiler->type == CHUNK_MAIN && g_compiler->scope_depth == 0
+        && parser.current.type == TOKEN_EOF) {
+        // Last statement of a REPL line: its value is printed
+        emit_op(OP_RETURN);
+    } else {
+        // Discard the expression result
+        emit_pop();
+    }
 }
 
 static void add_local_variable(const Token* name)
@@ -374,6 +780,17 @@ static bool identifiers_equal(const Token* a, const Token* b)
     return a->length == b->length && memcmp(a->start, b->start, a->length) == 0;
 }
 
+// Get the vm.globals slot index of a global variable
+static int resolve_global(const Token* name)
+{
+    const ObjectString* identifier = string_new(name->start, name->length);
+    int slot = vm_resolve_global(identifier);
+    if (slot > UINT16_MAX) {
+        error("Cannot use more than UINT16_MAX global variables");
+    }
+    return slot;
+}
+
 static int parse_variable(const char* error_message)
 {
     consume(TOKEN_IDENTIFIER, error_message);
@@ -394,30 +811,25 @@ static int parse_variable(const char* error_message)
             }
         }
         add_local_variable(name);
-        // When in a local scope, no need to store the variable name in the
-        // chunk.constants array. Return a dummy index instead.
+        // When in a local scope, no need to resolve a global slot. Return a
+        // dummy index instead.
         return -1;
     }
 
-    // Register the identifer as a constant value in the chunk
-    Value identifier = make_string_from_buffer(parser.previous.start, parser.previous.length);
-    Chunk* chunk = current_chunk();
-    return chunk_register_constant(chunk, identifier);
+    return resolve_global(&parser.previous);
 }
 
 static void declare_global(int global_index, bool read_only)
 {
     // Declare global variable
     if (global_index <= UINT8_MAX) {
-        emit_byte(read_only ? OP_DECL_GLOBAL_CONST : OP_DECL_GLOBAL);
+        emit_op(read_only ? OP_DECL_GLOBAL_CONST : OP_DECL_GLOBAL);
         emit_byte(global_index);
     } else if (global_index <= UINT16_MAX) {
-        emit_byte(read_only ? OP_DECL_GLOBAL_CONST_16 : OP_DECL_GLOBAL_16);
+        emit_op(read_only ? OP_DECL_GLOBAL_CONST_16 : OP_DECL_GLOBAL_16);
         // Convert global index to a 2-bytes integer
         emit_byte((global_index >> 8) & 0xff);
         emit_byte(global_index & 0xff);
-    } else {
-        error("Cannot declare over UINT16_MAX constants");
     }
 }
 
@@ -428,7 +840,7 @@ static void var_declaration(bool read_only)
     if (match(TOKEN_EQUAL)) {
         expression();
     } else {
-        emit_byte(OP_NULL);
+        emit_op(OP_NULL);
     }
 
     consume(TOKEN_SEMICOLON, "Expected ';' after variable declaration");
@@ -445,24 +857,23 @@ static void var_declaration(bool read_only)
     }
 }
 
-static void compiler_init(Compiler* compiler, ChunkType type)
+/**
+ * Start compiling a function
+ * @param function: new function, or stub created by a lazy compilation
+ */
+static void compiler_init(Compiler* compiler, ChunkType type, ObjectFunction* function)
 {
     compiler->previous = g_compiler;
-    compiler->function = NULL;
+    compiler->function = function;
     compiler->type = type;
 
     compiler->local_count = 0;
     compiler->scope_depth = 0;
-    compiler->function = function_new();
+    compiler->last_instruction = -1;
+    compiler->new_constant = -1;
+    compiler->fusion_barrier = -1;
     g_compiler = compiler;
 
-    // compiler_init is called right after parsing the function name
-    // Extract the name from the previous token
-    if (type != CHUNK_MAIN) {
-        compiler->function->name = string_new(parser.previous.start,
-            parser.previous.length);
-    }
-
     // Claim an empty Local slot with empty name for internal use
     // Users cannot declare locals named "" so it won't collide
     Local* local = &g_compiler->locals[g_compiler->local_count++];
@@ -473,14 +884,71 @@ static void compiler_init(Compiler* compiler, ChunkType type)
 
 static void statement();
 static void block();
+static void function_body();
+
+/**
+ * Lazy compilation: skip the parameters and the body of a function, which are
+ * compiled on the first call (see parser_compile_lazy). Only the parameters
+ * are counted, and the braces matched.
+ */
+static void skip_function(ObjectFunction* function)
+{
+    function->lazy_source = parser.current.start;
+    function->lazy_line = parser.current.line;
+
+    consume(TOKEN_LEFT_PAREN, "Expected '(' after function name");
+    if (parser.current.type != TOKEN_RIGHT_PAREN) {
+        do {
+            function->arity++;
+            if (function->arity > UINT8_MAX) {
+                error_at_current("Function cannot have more than 255 parameters.");
+            }
+            consume(TOKEN_IDENTIFIER, "Expected parameter name");
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_PAREN, "Expected ')' after parameters");
+    consume(TOKEN_LEFT_BRACE, "Expected '{' before function body");
+
+    int depth = 1;
+    while (depth > 0 && parser.current.type != TOKEN_EOF) {
+        if (parser.current.type == TOKEN_LEFT_BRACE) {
+            depth++;
+        } else if (parser.current.type == TOKEN_RIGHT_BRACE) {
+            depth--;
+        }
+        advance();
+    }
+    if (depth > 0) {
+        error_at_current("Expect '}' after block.");
+    }
+}
 
 /**
  * Parse the function arguments and body
  */
 static void parse_function(ChunkType type)
 {
+    // parse_function is called right after parsing the function name
+    ObjectFunction* function = function_new();
+    function->name = string_new(parser.previous.start, parser.previous.length);
+    if (lazy_compilation) {
+        skip_function(function);
+        emit_function(function);
+        return;
+    }
+
     Compiler compiler;
-    compiler_init(&compiler, type);
+    compiler_init(&compiler, type, function);
+    function_body();
+    end_compiler();
+    emit_function(function);
+}
+
+/**
+ * Parse the parameters and the body of the function being compiled
+ */
+static void function_body()
+{
     begin_scope();
 
     consume(TOKEN_LEFT_PAREN, "Expected '(' after function name");
@@ -508,16 +976,13 @@ static void parse_function(ChunkType type)
     consume(TOKEN_RIGHT_PAREN, "Expected ')' after parameters");
     consume(TOKEN_LEFT_BRACE, "Expected '{' before function body");
     block();
-
-    ObjectFunction* function = end_compiler();
-    emit_constant(make_function(function));
 }
 
 static void function_declaration()
 {
     // Function declaration follows the same logic than variables: globals
     // when at top-level, locals when inside a scope.
-    uint8_t global = parse_variable("Expected function name");
+    int global = parse_variable("Expected function name");
 
     // If local
     if (g_compiler->scope_depth > 0) {
@@ -546,33 +1011,72 @@ static void patch_jump(int offset)
     uint8_t* code = current_chunk()->code;
     code[offset] = (jump >> 8) & 0xff;
     code[offset + 1] = jump & 0xff;
+    set_fusion_barrier();
 }
 
-static int emit_jump(uint8_t instruction)
+static int emit_jump(OpCode instruction)
 {
-    emit_byte(instruction);
+    emit_op(instruction);
     // Write a 2-bytes placeholder operand for the jump
     emit_byte(0xff);
     emit_byte(0xff);
     return current_chunk()->count - 2;
 }
 
+/**
+ * Emit a jump taken if the condition on top of the stack is false. When the
+ * condition is a comparison, it is fused with the jump into a single
+ * compare-and-branch instruction, which pops the operands.
+ * @param fused: set to true if the condition has been fused
+ * @return offset of the jump operand, to be patched with patch_condition_jump
+ */
+static int emit_condition_jump(bool* fused)
+{
+    OpCode jump;
+    switch (fusable_instruction()) {
+    case OP_LESS: jump = OP_JUMP_IF_NOT_LESS; break;
+    case OP_LESS_EQUAL: jump = OP_JUMP_IF_NOT_LESS_EQUAL; break;
+    case OP_GREATER: jump = OP_JUMP_IF_NOT_GREATER; break;
+    case OP_GREATER_EQUAL: jump = OP_JUMP_IF_NOT_GREATER_EQUAL; break;
+    case OP_EQUAL: jump = OP_JUMP_IF_NOT_EQUAL; break;
+    case OP_NOT_EQUAL: jump = OP_JUMP_IF_EQUAL; break;
+    default: {
+        *fused = false;
+        int offset = emit_jump(OP_JUMP_IF_FALSE);
+        // Condition is true, pop value
+        emit_op(OP_POP);
+        return offset;
+    }
+    }
+    *fused = true;
+    fuse_instruction(jump);
+    emit_byte(0xff);
+    emit_byte(0xff);
+    return current_chunk()->count - 2;
+}
+
+static void patch_condition_jump(int offset, bool fused)
+{
+    patch_jump(offset);
+    if (!fused) {
+        // Condition is false, pop value
+        emit_op(OP_POP);
+    }
+}
+
 static void if_statement()
 {
     consume(TOKEN_LEFT_PAREN, "Expected '(' after 'if'");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expected ')' after condition");
 
-    int thenJump = emit_jump(OP_JUMP_IF_FALSE);
-    // Condition is true, pop value
-    emit_byte(OP_POP);
+    bool fused;
+    int thenJump = emit_condition_jump(&fused);
     statement();
 
     int elseJump = emit_jump(OP_JUMP);
 
-    patch_jump(thenJump);
-    // Condition is false, pop value
-    emit_byte(OP_POP);
+    patch_condition_jump(thenJump, fused);
 
     // Optional else clause
     if (match(TOKEN_ELSE)) {
@@ -584,7 +1088,7 @@ static void if_statement()
 
 static void emit_jump_back(int offset)
 {
-    emit_byte(OP_JUMP_BACK);
+    emit_op(OP_JUMP_BACK);
 
     int jump = current_chunk()->count - offset + 2;
     if (jump > UINT16_MAX) {
@@ -598,17 +1102,17 @@ static void emit_jump_back(int offset)
 static void while_statement()
 {
     int start_loop = current_chunk()->count;
+    set_fusion_barrier();
     consume(TOKEN_LEFT_PAREN, "Expected '(' after 'while'");
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expected ')' after condition");
 
-    int end_loop = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    bool fused;
+    int end_loop = emit_condition_jump(&fused);
     statement();
     emit_jump_back(start_loop);
 
-    patch_jump(end_loop);
-    emit_byte(OP_POP);
+    patch_condition_jump(end_loop, fused);
 }
 
 static void return_statement()
@@ -622,7 +1126,12 @@ static void return_statement()
     } else {
         expression();
         consume(TOKEN_SEMICOLON, "Expected ';' after return expresson");
-        emit_byte(OP_RETURN);
+        if (fusable_instruction() == OP_CALL) {
+            // Tail call: OP_RETURN is only reached if the VM cannot reuse the
+            // frame (C function, native code)
+            fuse_instruction(OP_TAIL_CALL);
+        }
+        emit_op(OP_RETURN);
     }
 }
 
@@ -682,15 +1191,7 @@ static void rule_number(bool _assignable)
 {
     (void)_assignable;
     double value = strtod(parser.previous.start, NULL);
-    // Common values have dedicated op codes
-    if (value == 0) {
-        emit_byte(OP_ZERO);
-    } else if (value == 1) {
-        emit_byte(OP_ONE);
-    } else {
-        // Emit load instruction
-        emit_constant(make_number(value));
-    }
+    emit_value(make_number(value));
 }
 
 static void rule_string(bool _assignable)
@@ -706,19 +1207,34 @@ static void rule_binary_op(bool _assignable)
     TokenType type = parser.previous.type;
     const ParseRule* rule = &rules[type];
 
+    Value a;
+    int left = last_constant(&a);
+    int left_constant = g_compiler->new_constant;
+    int right_start = current_chunk()->count;
     parse_precedence((Precedence)(rule->precedence + 1));
+
+    // Both operands are constants: the right operand is a single constant load
+    Value b;
+    Value result;
+    if (left != -1 && constant_operand(right_start, &b) && fold_binary(type, a, b, &result)) {
+        remove_constant(g_compiler->last_instruction, g_compiler->new_constant);
+        remove_constant(left, left_constant);
+        emit_value(result);
+        return;
+    }
+
     switch (type) {
-    case TOKEN_PLUS: emit_byte(OP_ADD); break;
-    case TOKEN_MINUS: emit_byte(OP_SUBTRACT); break;
-    case TOKEN_STAR: emit_byte(OP_MULTIPLY); break;
-    case TOKEN_SLASH: emit_byte(OP_DIVIDE); break;
-    case TOKEN_PERCENT: emit_byte(OP_MODULO); break;
-    case TOKEN_BANG_EQUAL: emit_byte(OP_NOT_EQUAL); break;
-    case TOKEN_EQUAL_EQUAL: emit_byte(OP_EQUAL); break;
-    case TOKEN_GREATER: emit_byte(OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: emit_byte(OP_GREATER_EQUAL); break;
-    case TOKEN_LESS: emit_byte(OP_LESS); break;
-    case TOKEN_LESS_EQUAL: emit_byte(OP_LESS_EQUAL); break;
+    case TOKEN_PLUS: emit_add(); break;
+    case TOKEN_MINUS: emit_op(OP_SUBTRACT); break;
+    case TOKEN_STAR: emit_op(OP_MULTIPLY); break;
+    case TOKEN_SLASH: emit_op(OP_DIVIDE); break;
+    case TOKEN_PERCENT: emit_op(OP_MODULO); break;
+    case TOKEN_BANG_EQUAL: emit_op(OP_NOT_EQUAL); break;
+    case TOKEN_EQUAL_EQUAL: emit_op(OP_EQUAL); break;
+    case TOKEN_GREATER: emit_op(OP_GREATER); break;
+    case TOKEN_GREATER_EQUAL: emit_op(OP_GREATER_EQUAL); break;
+    case TOKEN_LESS: emit_op(OP_LESS); break;
+    case TOKEN_LESS_EQUAL: emit_op(OP_LESS_EQUAL); break;
     default:
         return; // Unreachable
     }
@@ -729,18 +1245,28 @@ static void rule_unary_op(bool _assignable)
     (void)_assignable;
     TokenType type = parser.previous.type;
     // Parse the operand
+    int start = current_chunk()->count;
     parse_precedence(PREC_UNARY);
 
+    // Operand is a single constant load
+    Value value;
+    Value result;
+    if (constant_operand(start, &value) && fold_unary(type, value, &result)) {
+        remove_constant(g_compiler->last_instruction, g_compiler->new_constant);
+        emit_value(result);
+        return;
+    }
+
     // Emit instruction for the unary operator
     switch (type) {
     case TOKEN_BANG:
-        emit_byte(OP_NOT);
+        emit_op(OP_NOT);
         break;
     case TOKEN_PLUS:
-        emit_byte(OP_POSITIVE);
+        emit_op(OP_POSITIVE);
         break;
     case TOKEN_MINUS:
-        emit_byte(OP_NEGATIVE);
+        emit_op(OP_NEGATIVE);
         break;
     default:
         return; // Unreachable
@@ -763,7 +1289,7 @@ static void rule_array_literal(bool _assignable)
         } while (match(TOKEN_COMMA));
     }
     consume(TOKEN_RIGHT_BRACKET, "Expected ']' after array expression");
-    emit_byte(OP_ARRAY);
+    emit_op(OP_ARRAY);
     emit_byte(item_count);
 }
 
@@ -772,9 +1298,9 @@ static void rule_literal(bool _assignable)
     (void)_assignable;
 
     switch (parser.previous.type) {
-    case TOKEN_FALSE: emit_byte(OP_FALSE); break;
-    case TOKEN_NULL: emit_byte(OP_NULL); break;
-    case TOKEN_TRUE: emit_byte(OP_TRUE); break;
+    case TOKEN_FALSE: emit_op(OP_FALSE); break;
+    case TOKEN_NULL: emit_op(OP_NULL); break;
+    case TOKEN_TRUE: emit_op(OP_TRUE); break;
     default:
         return; // Unreachable
     }
@@ -802,7 +1328,7 @@ static void rule_and(bool _assignable)
 {
     (void)_assignable;
     int end_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     parse_precedence(PREC_AND);
     patch_jump(end_jump);
 }
@@ -811,7 +1337,7 @@ static void rule_or(bool _assignable)
 {
     (void)_assignable;
     int end_jump = emit_jump(OP_JUMP_IF_TRUE);
-    emit_byte(OP_POP);
+    emit_op(OP_POP);
     parse_precedence(PREC_OR);
     patch_jump(end_jump);
 }
@@ -822,7 +1348,7 @@ static void rule_fn_call(bool _assignable)
     // Argument count of the function call is the operand to OP_CALL,
     // it is stored on a single byte
     uint8_t arg_count = argument_list();
-    emit_byte(OP_CALL);
+    emit_op(OP_CALL);
     emit_byte(arg_count);
 }
 
@@ -833,9 +1359,9 @@ static void rule_subscript(bool assignable)
     // Check if [] is followed by an assignment
     if (assignable && match(TOKEN_EQUAL)) {
         expression();
-        emit_byte(OP_SUBSCRIPT_SET);
+        emit_op(OP_SUBSCRIPT_SET);
     } else {
-        emit_byte(OP_SUBSCRIPT_GET);
+        emit_op(OP_SUBSCRIPT_GET);
     }
 }
 
@@ -877,45 +1403,68 @@ static void rule_variable(bool assignable)
             if (g_compiler->locals[arg].read_only) {
                 error("Cannot assign const local variable");
             } else {
+                int start = current_chunk()->count;
+                // Assigned value is matched by emit_set_local, and must not
+                // be fused with previous instructions
+                set_fusion_barrier();
                 expression();
-                emit_byte(OP_SET_LOCAL);
-                emit_byte(arg);
+                emit_set_local(arg, start);
             }
         } else {
-            emit_byte(OP_GET_LOCAL);
-            emit_byte(arg);
+            emit_get_local(arg);
         }
     } else {
         // GLOBAL VARIABLE
-        // Register the identifier name as a constant in the chunk
-        int constant_index = chunk_register_constant(
-            current_chunk(), make_string_from_buffer(token->start, token->length));
-        if (constant_index > UINT16_MAX) {
-            error("Cannot use more than UINT16_MAX constants");
-        }
+        // Resolve the identifier name to a slot in vm.globals
+        int slot = resolve_global(token);
         if (assignable && match(TOKEN_EQUAL)) {
             expression();
-            if (constant_index <= UINT8_MAX) {
-                emit_byte(OP_SET_GLOBAL);
-                emit_byte(constant_index);
-            } else if (constant_index <= UINT16_MAX) {
-                emit_byte(OP_SET_GLOBAL_16);
-                emit_byte((constant_index >> 8) & 0xff);
-                emit_byte(constant_index & 0xff);
+            if (slot <= UINT8_MAX) {
+                emit_op(OP_SET_GLOBAL);
+                emit_byte(slot);
+            } else if (slot <= UINT16_MAX) {
+                emit_op(OP_SET_GLOBAL_16);
+                emit_byte((slot >> 8) & 0xff);
+                emit_byte(slot & 0xff);
             }
         } else {
-            if (constant_index <= UINT8_MAX) {
-                emit_byte(OP_GET_GLOBAL);
-                emit_byte(constant_index);
-            } else if (constant_index <= UINT16_MAX) {
-                emit_byte(OP_GET_GLOBAL_16);
-                emit_byte((constant_index >> 8) & 0xff);
-                emit_byte(constant_index & 0xff);
+            if (slot <= UINT8_MAX) {
+                emit_op(OP_GET_GLOBAL);
+                emit_byte(slot);
+            } else if (slot <= UINT16_MAX) {
+                emit_op(OP_GET_GLOBAL_16);
+                emit_byte((slot >> 8) & 0xff);
+                emit_byte(slot & 0xff);
             }
         }
     }
 }
 
+void parser_dump_bytecode(bool enabled)
+{
+    dump_bytecode = enabled;
+}
+
+void parser_set_optimization(int level)
+{
+    optimization_level = level;
+}
+
+int parser_get_optimization(void)
+{
+    return optimization_level;
+}
+
+void parser_set_lazy(bool enabled)
+{
+    lazy_compilation = enabled;
+}
+
+void parser_set_repl(bool enabled)
+{
+    repl_mode = enabled;
+}
+
 // Parser entry point
 ObjectFunction* parser_compile(const char* source)
 {
@@ -925,7 +1474,7 @@ ObjectFunction* parser_compile(const char* source)
 
     scanner_init(source);
     Compiler compiler;
-    compiler_init(&compiler, CHUNK_MAIN);
+    compiler_init(&compiler, CHUNK_MAIN, function_new());
 
     advance();
 
@@ -936,3 +1485,22 @@ ObjectFunction* parser_compile(const char* source)
     ObjectFunction* function = end_compiler();
     return parser.errored ? NULL : function;
 }
+
+bool parser_compile_lazy(ObjectFunction* function, const char* source)
+{
+    parser.errored = false;
+    parser.panic_mode = false;
+    parser.source = source;
+
+    scanner_init_at(function->lazy_source, function->lazy_line);
+    function->lazy_source = NULL;
+    // Counted again with the parameters
+    function->arity = 0;
+    Compiler compiler;
+    compiler_init(&compiler, CHUNK_FUNCTION, function);
+
+    advance();
+    function_body();
+    end_compiler();
+    return !parser.errored;
+}
@@ -5,4 +5,38 @@
 
 ObjectFunction* parser_compile(const char* source);
 
+/**
+ * Compile the body of a function skipped by a lazy compilation
+ * @param source: source code of the program
+ * @return false on syntax error
+ */
+bool parser_compile_lazy(ObjectFunction* function, const char* source);
+
+/**
+ * Print the bytecode of each compiled function to stdout
+ */
+void parser_dump_bytecode(bool enabled);
+
+/**
+ * Optimization of the bytecode of each compiled function:
+ * - 0: none
+ * - 1: peephole optimizer (default)
+ * - 2: IR passes, then peephole optimizer
+ */
+void parser_set_optimization(int level);
+
+int parser_get_optimization(void);
+
+/**
+ * Lazy compilation: only compile the body of the functions on their first
+ * call. The source must outlive the compiled program.
+ */
+void parser_set_lazy(bool enabled);
+
+/**
+ * REPL mode: the main function returns the value of the last statement when
+ * it is an expression statement, null otherwise
+ */
+void parser_set_repl(bool enabled);
+
 #endif
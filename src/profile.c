@@ -0,0 +1,99 @@
+#include "profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Max number of distinct n-grams (open addressing hashtable)
+#define PROFILE_TABLE_SIZE (1 << 16)
+// Number of n-grams printed for each size
+#define PROFILE_TOP_COUNT 12
+
+typedef struct {
+    // n-gram size in the highest byte, then one opcode per byte.
+    // 0 for an empty entry.
+    uint64_t key;
+    size_t count;
+} NgramEntry;
+
+static NgramEntry ngrams[PROFILE_TABLE_SIZE];
+
+// Total number of executed instructions
+static size_t executed = 0;
+// Occurrences of n-grams not counted: the table was full
+static size_t dropped = 0;
+
+// Last executed opcodes, most recent in the lowest byte
+static uint32_t history = 0;
+static int history_length = 0;
+
+static void count_ngram(uint64_t key)
+{
+    // Fibonacci hashing
+    uint32_t index = (uint32_t)((key * 11400714819323198485llu) >> 48);
+    for (int probe = 0; probe < PROFILE_TABLE_SIZE; ++probe) {
+        NgramEntry* entry = &ngrams[index];
+        if (entry->key == key) {
+            entry->count++;
+            return;
+        }
+        if (entry->key == 0) {
+            entry->key = key;
+            entry->count = 1;
+            return;
+        }
+        index = (index + 1) % PROFILE_TABLE_SIZE;
+    }
+    dropped++;
+}
+
+void profile_record(uint8_t opcode)
+{
+    executed++;
+    history = history << 8 | opcode;
+    if (history_length < PROFILE_MAX_NGRAM) {
+        history_length++;
+    }
+
+    for (int n = 2; n <= history_length; ++n) {
+        uint32_t mask = n == 4 ? UINT32_MAX : (1u << (n * 8)) - 1;
+        count_ngram((uint64_t)n << 56 | (history & mask));
+    }
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+    size_t count_a = (*(const NgramEntry* const*)a)->count;
+    size_t count_b = (*(const NgramEntry* const*)b)->count;
+    return count_a < count_b ? 1 : count_a > count_b ? -1 : 0;
+}
+
+void profile_print()
+{
+    printf("== profile::instructions ==\n%zu\n", executed);
+    if (dropped > 0) {
+        // More distinct n-grams than PROFILE_TABLE_SIZE
+        printf("== profile::dropped ==\n%zu\n", dropped);
+    }
+
+    // Sort n-grams of each size by frequency
+    static const NgramEntry* sorted[PROFILE_TABLE_SIZE];
+    for (int n = 2; n <= PROFILE_MAX_NGRAM; ++n) {
+        int count = 0;
+        for (int i = 0; i < PROFILE_TABLE_SIZE; ++i) {
+            if (ngrams[i].key >> 56 == (uint64_t)n) {
+                sorted[count++] = &ngrams[i];
+            }
+        }
+        qsort(sorted, count, sizeof(NgramEntry*), compare_entries);
+
+        printf("== profile::%d-grams ==\n", n);
+        for (int i = 0; i < count && i < PROFILE_TOP_COUNT; ++i) {
+            printf("%12zu ", sorted[i]->count);
+            // Oldest opcode is in the highest byte
+            for (int j = n - 1; j >= 0; --j) {
+                printf(" %s", op2str((sorted[i]->key >> (j * 8)) & 0xff));
+            }
+            printf("\n");
+        }
+    }
+}
@@ -0,0 +1,27 @@
+#ifndef ASPIC_PROFILE_H
+#define ASPIC_PROFILE_H
+
+#include "op_code.h"
+
+/**
+ * Opcode profiler (make OPCODE_PROFILE=1)
+ *
+ * Count how many times each sequence of 2 to 4 consecutive instructions
+ * (n-gram) is executed by the VM, to find which instructions are worth
+ * being fused into superinstructions.
+ */
+
+#define PROFILE_MAX_NGRAM 4
+
+/**
+ * Record an instruction about to be executed
+ */
+void profile_record(uint8_t opcode);
+
+/**
+ * Print the number of executed instructions and the most frequent n-grams
+ * to stdout
+ */
+void profile_print();
+
+#endif
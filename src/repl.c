@@ -1,4 +1,5 @@
 #include "repl.h"
+#include "parser.h"
 #include "shared.h"
 #include "vm.h"
 
@@ -14,6 +15,9 @@ void repl()
            "  * strings: print list of interned strings\n"
            "  * globals: print list of global identifiers\n");
 
+    // Each line returns the value of its last expression statement
+    parser_set_repl(true);
+
     // Configure readline to insert tabs (instead of PATH completion)
     rl_bind_key('\t', rl_insert);
 
@@ -35,7 +39,7 @@ void repl()
         } else {
             if (vm_interpret(line) == VM_OK) {
                 Value value = vm_last_value();
-                if (value.type != TYPE_NULL) {
+                if (!is_null(value)) {
                     value_repr(value);
                     printf("\n");
                 }
@@ -140,10 +140,15 @@ static Token make_error_token(const char* message)
 }
 
 void scanner_init(const char* source)
+{
+    scanner_init_at(source, 1);
+}
+
+void scanner_init_at(const char* source, int line)
 {
     scanner.start = source;
     scanner.current = source;
-    scanner.line = 1;
+    scanner.line = line;
 }
 
 Token scan_string()
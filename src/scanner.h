@@ -68,6 +68,12 @@ typedef struct {
  */
 void scanner_init(const char* source);
 
+/**
+ * Ctor, starting from a position in the source code
+ * @param line: line number of the position
+ */
+void scanner_init_at(const char* source, int line);
+
 /**
  * Read next token from the scanner
  */
@@ -8,4 +8,13 @@
 
 #define ASPIC_VERSION_STRING "0.1"
 
+// Hints for branch prediction and code layout
+#ifdef __GNUC__
+#define ASPIC_UNLIKELY(condition) __builtin_expect(!!(condition), 0)
+#define ASPIC_COLD __attribute__((cold, noinline))
+#else
+#define ASPIC_UNLIKELY(condition) (condition)
+#define ASPIC_COLD
+#endif
+
 #endif
@@ -1,4 +1,5 @@
 #include "os.h"
+#include "gc.h"
 #include "object.h"
 #include "value_array.h"
 
@@ -31,19 +32,21 @@ Value aspic_os_ls(Value* argv, int argc)
     }
     const char* dirname = ".";
     if (argc == 1) {
-        dirname = ((ObjectString*)argv[0].as.object)->chars;
+        dirname = ((ObjectString*)as_object(argv[0]))->chars;
     }
     DIR* rep = opendir(dirname);
     if (rep == NULL) {
         return make_error("Cannot read %s", dirname);
     }
     Value result = make_array(NULL, 0);
-    ValueArray* array = &((ObjectArray*)result.as.object)->array;
+    ValueArray* array = &((ObjectArray*)as_object(result))->array;
     struct dirent* f = NULL;
     while ((f = readdir(rep)) != NULL) {
         // Ignore "." and ".."
         if (strcmp(f->d_name, ".") != 0 && strcmp(f->d_name, "..") != 0) {
-            value_array_push(array, make_string_from_cstr(f->d_name));
+            Value name = make_string_from_cstr(f->d_name);
+            gc_write_barrier(as_object(result), name);
+            value_array_push(array, name);
         }
     }
     if (closedir(rep) == -1) {
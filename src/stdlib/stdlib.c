@@ -1,4 +1,5 @@
 #include "stdlib.h"
+#include "gc.h"
 #include "object.h"
 
 #include <stdio.h>
@@ -36,12 +37,12 @@ Value aspic_int(Value* argv, int argc)
         return make_error("int() expects from 1 to 2 arguments, got %d", argc);
     }
 
-    if (argv[0].type == TYPE_OBJECT && argv[0].as.object->type == OBJECT_STRING) {
+    if (is_object(argv[0]) && as_object(argv[0])->type == OBJECT_STRING) {
         int base = 10;
         // 2nd argument: base
         if (argc == 2) {
-            if (argv[1].type == TYPE_NUMBER) {
-                int arg_base = (int)argv[1].as.number;
+            if (is_number(argv[1])) {
+                int arg_base = (int)as_number(argv[1]);
                 if (arg_base < 2 || arg_base > 36) {
                     return make_error("int() base argument must be in [2:36] range, got %d",
                         arg_base);
@@ -53,21 +54,21 @@ Value aspic_int(Value* argv, int argc)
             }
         }
         char* endptr = NULL;
-        int result = strtol(((ObjectString*)argv[0].as.object)->chars, &endptr, base);
+        int result = strtol(((ObjectString*)as_object(argv[0]))->chars, &endptr, base);
         if (*endptr != '\0') {
             return make_error("int() got invalid string literal '%s' for base %d",
-                ((ObjectString*)argv[0].as.object)->chars,
+                ((ObjectString*)as_object(argv[0]))->chars,
                 base);
         }
         return make_number(result);
     }
 
-    if (argv[0].type == TYPE_NUMBER) {
-        return make_number((int)argv[0].as.number);
+    if (is_number(argv[0])) {
+        return make_number((int)as_number(argv[0]));
     }
 
-    if (argv[0].type == TYPE_BOOL) {
-        return make_number((int)argv[0].as.boolean);
+    if (is_bool(argv[0])) {
+        return make_number((int)as_bool(argv[0]));
     }
 
     return make_error("int() argument must be a string or a number, got '%s'",
@@ -85,7 +86,7 @@ Value aspic_input(Value* argv, int argc)
 
     // If 1 string argument was provided, display it as prompt
     const char* prompt = argc == 1
-        ? ((ObjectString*)aspic_str(argv, argc).as.object)->chars
+        ? ((ObjectString*)as_object(aspic_str(argv, argc)))->chars
         : NULL;
     char* line = readline(prompt);
     if (line != NULL) {
@@ -103,8 +104,8 @@ Value aspic_len(Value* argv, int argc)
         return make_error("len() expects 1 argument, got %d", argc);
     }
 
-    if (argv[0].type == TYPE_OBJECT) {
-        const Object* object = argv[0].as.object;
+    if (is_object(argv[0])) {
+        const Object* object = as_object(argv[0]);
         if (object->type == OBJECT_STRING) {
             return make_number(((const ObjectString*)object)->length);
         }
@@ -120,11 +121,11 @@ Value aspic_pop(Value* argv, int argc)
     if (argc != 1) {
         return make_error("pop() expects 1 argument, got %d", argc);
     }
-    if (argv[0].type != TYPE_OBJECT && argv[0].as.object->type != OBJECT_ARRAY) {
+    if (!is_object(argv[0]) || as_object(argv[0])->type != OBJECT_ARRAY) {
         return make_error("pop() expects an array, got '%s'", value_type(argv[0]));
     }
 
-    return value_array_pop(&((ObjectArray*)argv[0].as.object)->array);
+    return value_array_pop(&((ObjectArray*)as_object(argv[0]))->array);
 }
 
 Value aspic_print(Value* argv, int argc)
@@ -144,11 +145,12 @@ Value aspic_push(Value* argv, int argc)
     if (argc != 2) {
         return make_error("push() expects 2 arguments, got %d", argc);
     }
-    if (argv[0].type != TYPE_OBJECT && argv[0].as.object->type != OBJECT_ARRAY) {
+    if (!is_object(argv[0]) || as_object(argv[0])->type != OBJECT_ARRAY) {
         return make_error("push() expects an array, got '%s'", value_type(argv[0]));
     }
 
-    value_array_push(&((ObjectArray*)argv[0].as.object)->array, argv[1]);
+    gc_write_barrier(as_object(argv[0]), argv[1]);
+    value_array_push(&((ObjectArray*)as_object(argv[0]))->array, argv[1]);
     return argv[0];
 }
 
@@ -158,21 +160,21 @@ Value aspic_str(Value* argv, int argc)
         return make_error("str() expects 1 argument, got %d", argc);
     }
 
-    switch (argv[0].type) {
+    switch (value_get_type(argv[0])) {
     case TYPE_CFUNC: {
         char buffer[64];
-        snprintf(buffer, sizeof buffer, "0x%zx", (size_t)argv[0].as.cfunc);
+        snprintf(buffer, sizeof buffer, "0x%zx", (size_t)as_cfunc(argv[0]));
         return make_string_from_cstr(buffer);
     }
 
     case TYPE_BOOL: {
-        const char* cstr = argv[0].as.boolean ? "true" : "false";
+        const char* cstr = as_bool(argv[0]) ? "true" : "false";
         return make_string_from_cstr(cstr);
     }
 
     case TYPE_NUMBER: {
         char buffer[64];
-        snprintf(buffer, sizeof buffer, "%g", argv[0].as.number);
+        snprintf(buffer, sizeof buffer, "%g", as_number(argv[0]));
         return make_string_from_cstr(buffer);
     }
 
@@ -180,18 +182,18 @@ Value aspic_str(Value* argv, int argc)
         return make_string_from_cstr("");
 
     case TYPE_OBJECT:
-        switch (argv[0].as.object->type) {
+        switch (as_object(argv[0])->type) {
         case OBJECT_ARRAY:
             return make_error("Cannot convert array to string");
         case OBJECT_FUNCTION:
-            return make_string(((ObjectFunction*)argv[0].as.object)->name);
+            return make_string(((ObjectFunction*)as_object(argv[0]))->name);
         case OBJECT_STRING:
             return argv[0];
         }
         break;
 
     case TYPE_ERROR:
-        return make_string_from_cstr(argv[0].as.error);
+        return make_string_from_cstr(as_error(argv[0]));
     }
     return make_null();
 }
@@ -160,6 +160,27 @@ bool stringset_delete(StringSet* set, const ObjectString* string)
     return true;
 }
 
+void stringset_forward(StringSet* set, const ObjectString* string, const ObjectString* forwarded)
+{
+    if (set->count == 0) {
+        return;
+    }
+
+    SetEntry* entry = find_entry(set->entries, set->capacity, string);
+    if (entry->string == NULL) {
+        return;
+    }
+
+    // Forwarded string has the same hash: entry stays at the same index
+    if (forwarded != NULL) {
+        entry->string = forwarded;
+    } else {
+        entry->string = NULL;
+        entry->tombstone = true;
+        set->count--;
+    }
+}
+
 void stringset_print(const StringSet* set)
 {
     for (size_t i = 0; i < set->capacity; ++i) {
@@ -49,6 +49,12 @@ const ObjectString* stringset_has_cstr(StringSet* set, const char* chars, size_t
  */
 bool stringset_delete(StringSet* set, const ObjectString* key);
 
+/**
+ * Replace a string moved by the garbage collector with its new address
+ * @param forwarded: new address, or NULL to delete the string
+ */
+void stringset_forward(StringSet* set, const ObjectString* string, const ObjectString* forwarded);
+
 /**
  * Print all strings to stdout
  */
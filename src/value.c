@@ -1,4 +1,5 @@
 #include "value.h"
+#include "gc.h"
 #include "object.h"
 #include "shared.h"
 #include "utils.h"
@@ -17,27 +18,10 @@ Value make_array(const Value* values, int count)
         memcpy(array->array.values, values, count * sizeof(Value));
     }
     array->array.count = count;
-    return (Value) { .type = TYPE_OBJECT, .as.object = (Object*)array };
-}
-
-Value make_number(double value)
-{
-    return (Value) { .type = TYPE_NUMBER, .as.number = value };
-}
-
-Value make_bool(bool value)
-{
-    return (Value) { .type = TYPE_BOOL, .as.boolean = value };
-}
-
-Value make_cfunction(CFuncPtr fn)
-{
-    return (Value) { .type = TYPE_CFUNC, .as.cfunc = fn };
-}
-
-Value make_null()
-{
-    return (Value) { .type = TYPE_NULL };
+    for (int i = 0; i < count; ++i) {
+        gc_write_barrier((Object*)array, values[i]);
+    }
+    return make_object((Object*)array);
 }
 
 Value make_error(const char* format, ...)
@@ -57,39 +41,33 @@ Value make_error(const char* format, ...)
     vsnprintf(buffer, size + 1, format, args);
     va_end(args);
 
-    return (Value) { .type = TYPE_ERROR, .as.error = buffer };
+    return make_error_value(buffer);
 }
 
 Value make_string(const ObjectString* string)
 {
-    return (Value) { .type = TYPE_OBJECT, .as.object = (Object*)string };
+    return make_object((Object*)string);
 }
 
 Value make_string_from_buffer(const char* chars, int length)
 {
-    return (Value) {
-        .type = TYPE_OBJECT,
-        .as.object = (Object*)string_new(chars, length)
-    };
+    return make_object((Object*)string_new(chars, length));
 }
 
 Value make_string_from_cstr(const char* str)
 {
-    return (Value) {
-        .type = TYPE_OBJECT,
-        .as.object = (Object*)string_new(str, strlen(str))
-    };
+    return make_object((Object*)string_new(str, strlen(str)));
 }
 
 Value make_function(ObjectFunction* fn)
 {
-    return (Value) { .type = TYPE_OBJECT, .as.object = (Object*)fn };
+    return make_object((Object*)fn);
 }
 
 ObjectString* to_string(Value value)
 {
-    return value.type == TYPE_OBJECT && value.as.object->type == OBJECT_STRING
-        ? (ObjectString*)value.as.object
+    return is_object(value) && as_object(value)->type == OBJECT_STRING
+        ? (ObjectString*)as_object(value)
         : NULL;
 }
 
@@ -107,17 +85,17 @@ ObjectString* to_string(Value value)
  */
 static void value_rprinter(Value value, const Object* objects[], int* size, int depth)
 {
-    switch (value.type) {
+    switch (value_get_type(value)) {
     case TYPE_CFUNC:
-        printf("<0x%zx()>", (size_t)value.as.cfunc);
+        printf("<0x%zx()>", (size_t)as_cfunc(value));
         break;
 
     case TYPE_BOOL:
-        printf(value.as.boolean ? "true" : "false");
+        printf(as_bool(value) ? "true" : "false");
         break;
 
     case TYPE_NUMBER:
-        printf("%g", value.as.number);
+        printf("%g", as_number(value));
         break;
 
     case TYPE_NULL:
@@ -125,13 +103,13 @@ static void value_rprinter(Value value, const Object* objects[], int* size, int
         break;
 
     case TYPE_ERROR:
-        printf("[RuntimeError] %s", value.as.error);
+        printf("[RuntimeError] %s", as_error(value));
         break;
 
     case TYPE_OBJECT:
-        switch (value.as.object->type) {
+        switch (as_object(value)->type) {
         case OBJECT_ARRAY: {
-            const ObjectArray* object = (ObjectArray*)value.as.object;
+            const ObjectArray* object = (ObjectArray*)as_object(value);
             // Find if object was already printed
             int i = 0;
             for (; i < *size; ++i) {
@@ -161,7 +139,7 @@ static void value_rprinter(Value value, const Object* objects[], int* size, int
         }
 
         case OBJECT_FUNCTION: {
-            const ObjectFunction* object = (ObjectFunction*)value.as.object;
+            const ObjectFunction* object = (ObjectFunction*)as_object(value);
             if (object->name == NULL) {
                 printf("__main__");
             } else {
@@ -172,10 +150,10 @@ static void value_rprinter(Value value, const Object* objects[], int* size, int
 
         case OBJECT_STRING:
             if (depth == 0) {
-                printf("%s", ((const ObjectString*)value.as.object)->chars);
+                printf("%s", ((const ObjectString*)as_object(value))->chars);
             } else {
                 // When nested inside collections, surround strings with quotes
-                printf("\"%s\"", ((const ObjectString*)value.as.object)->chars);
+                printf("\"%s\"", ((const ObjectString*)as_object(value))->chars);
             }
             break;
         }
@@ -206,7 +184,7 @@ void value_repr(Value value)
 
 const char* value_type(Value value)
 {
-    switch (value.type) {
+    switch (value_get_type(value)) {
     case TYPE_BOOL:
         return "bool";
     case TYPE_CFUNC:
@@ -218,7 +196,7 @@ const char* value_type(Value value)
     case TYPE_NUMBER:
         return "number";
     case TYPE_OBJECT:
-        switch (value.as.object->type) {
+        switch (as_object(value)->type) {
         case OBJECT_ARRAY:
             return "array";
         case OBJECT_FUNCTION:
@@ -232,17 +210,17 @@ const char* value_type(Value value)
 
 bool value_equal(Value b, Value a)
 {
-    if (a.type == b.type) {
-        switch (a.type) {
+    if (value_get_type(a) == value_get_type(b)) {
+        switch (value_get_type(a)) {
         case TYPE_BOOL:
-            return a.as.boolean == b.as.boolean;
+            return as_bool(a) == as_bool(b);
         case TYPE_NULL:
             // Two null values are always equal
             return true;
         case TYPE_NUMBER:
-            return a.as.number == b.as.number;
+            return as_number(a) == as_number(b);
         case TYPE_OBJECT:
-            return object_equal(a.as.object, b.as.object);
+            return object_equal(as_object(a), as_object(b));
         default:
             break; // Unreachable
         }
@@ -253,5 +231,5 @@ bool value_equal(Value b, Value a)
 bool value_truthy(Value value)
 {
     // Only false and null are false, everything else is truthy
-    return !(value.type == TYPE_NULL || (value.type == TYPE_BOOL && value.as.boolean == false));
+    return !(is_null(value) || (is_bool(value) && as_bool(value) == false));
 }
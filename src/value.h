@@ -3,6 +3,8 @@
 
 #include "shared.h"
 
+#include <string.h>
+
 typedef struct Object Object;
 typedef struct ObjectString ObjectString;
 typedef struct ObjectFunction ObjectFunction;
@@ -19,8 +21,88 @@ typedef enum {
 
 typedef struct Value (*CFuncPtr)(struct Value* argv, int args);
 
+#ifdef ASPIC_NAN_BOXING
+
+/*
+ * NaN boxing: a Value is a single 64 bits word.
+ *
+ * A double is a number unless all the bits of a quiet NaN (QNAN) are set:
+ * the remaining 51 bits of the NaN payload are used to store the other types.
+ * - null, false, true are singletons, stored in the lowest bits
+ * - pointers (object, cfunc, error) have the sign bit set. Pointers use at
+ *   most 48 bits, the 2 bits above are used as a tag for the pointer type.
+ */
+typedef struct Value {
+    uint64_t bits;
+} Value;
+
+#define NAN_QNAN ((uint64_t)0x7ffc000000000000)
+#define NAN_SIGN_BIT ((uint64_t)0x8000000000000000)
+#define NAN_POINTER_MASK ((uint64_t)0x0000ffffffffffff)
+#define NAN_TAG_MASK (NAN_SIGN_BIT | NAN_QNAN | ((uint64_t)3 << 48))
+
+#define NAN_NULL (NAN_QNAN | 1)
+#define NAN_FALSE (NAN_QNAN | 2)
+#define NAN_TRUE (NAN_QNAN | 3)
+
+#define NAN_TAG_OBJECT (NAN_SIGN_BIT | NAN_QNAN)
+#define NAN_TAG_CFUNC (NAN_SIGN_BIT | NAN_QNAN | ((uint64_t)1 << 48))
+#define NAN_TAG_ERROR (NAN_SIGN_BIT | NAN_QNAN | ((uint64_t)2 << 48))
+
+static inline bool is_number(Value value) { return (value.bits & NAN_QNAN) != NAN_QNAN; }
+static inline bool is_bool(Value value) { return (value.bits | 1) == NAN_TRUE; }
+static inline bool is_null(Value value) { return value.bits == NAN_NULL; }
+static inline bool is_error(Value value) { return (value.bits & NAN_TAG_MASK) == NAN_TAG_ERROR; }
+static inline bool is_object(Value value) { return (value.bits & NAN_TAG_MASK) == NAN_TAG_OBJECT; }
+static inline bool is_cfunc(Value value) { return (value.bits & NAN_TAG_MASK) == NAN_TAG_CFUNC; }
+
+static inline double as_number(Value value)
+{
+    double number;
+    memcpy(&number, &value.bits, sizeof(double));
+    return number;
+}
+
+static inline bool as_bool(Value value) { return value.bits == NAN_TRUE; }
+static inline const char* as_error(Value value) { return (const char*)(uintptr_t)(value.bits & NAN_POINTER_MASK); }
+static inline Object* as_object(Value value) { return (Object*)(uintptr_t)(value.bits & NAN_POINTER_MASK); }
+static inline CFuncPtr as_cfunc(Value value) { return (CFuncPtr)(uintptr_t)(value.bits & NAN_POINTER_MASK); }
+
+static inline ValueType value_get_type(Value value)
+{
+    if (is_number(value)) {
+        return TYPE_NUMBER;
+    }
+    switch (value.bits & NAN_TAG_MASK) {
+    case NAN_TAG_OBJECT: return TYPE_OBJECT;
+    case NAN_TAG_CFUNC: return TYPE_CFUNC;
+    case NAN_TAG_ERROR: return TYPE_ERROR;
+    default:
+        return is_null(value) ? TYPE_NULL : TYPE_BOOL;
+    }
+}
+
+static inline Value make_number(double value)
+{
+    Value result;
+    memcpy(&result.bits, &value, sizeof(double));
+    return result;
+}
+
+static inline Value make_bool(bool value) { return (Value) { value ? NAN_TRUE : NAN_FALSE }; }
+static inline Value make_null() { return (Value) { NAN_NULL }; }
+static inline Value make_cfunction(CFuncPtr fn) { return (Value) { NAN_TAG_CFUNC | (uint64_t)(uintptr_t)fn }; }
+static inline Value make_object(Object* object) { return (Value) { NAN_TAG_OBJECT | (uint64_t)(uintptr_t)object }; }
+static inline Value make_error_value(const char* message) { return (Value) { NAN_TAG_ERROR | (uint64_t)(uintptr_t)message }; }
+
+#else
+
+/*
+ * Tagged union: a Value is a ValueType tag, followed by the payload.
+ * Takes 16 bytes on 64 bits platforms.
+ */
 typedef union {
-    double number;     // TYPE_CFUNC
+    double number;     // TYPE_NUMBER
     bool boolean;      // TYPE_BOOL
     const char* error; // TYPE_ERROR
     Object* object;    // TYPE_OBJECT
@@ -32,16 +114,36 @@ typedef struct Value {
     ValueType type;
 } Value;
 
+static inline bool is_number(Value value) { return value.type == TYPE_NUMBER; }
+static inline bool is_bool(Value value) { return value.type == TYPE_BOOL; }
+static inline bool is_null(Value value) { return value.type == TYPE_NULL; }
+static inline bool is_error(Value value) { return value.type == TYPE_ERROR; }
+static inline bool is_object(Value value) { return value.type == TYPE_OBJECT; }
+static inline bool is_cfunc(Value value) { return value.type == TYPE_CFUNC; }
+
+static inline double as_number(Value value) { return value.as.number; }
+static inline bool as_bool(Value value) { return value.as.boolean; }
+static inline const char* as_error(Value value) { return value.as.error; }
+static inline Object* as_object(Value value) { return value.as.object; }
+static inline CFuncPtr as_cfunc(Value value) { return value.as.cfunc; }
+
+static inline ValueType value_get_type(Value value) { return value.type; }
+
+static inline Value make_number(double value) { return (Value) { .type = TYPE_NUMBER, .as.number = value }; }
+static inline Value make_bool(bool value) { return (Value) { .type = TYPE_BOOL, .as.boolean = value }; }
+static inline Value make_null() { return (Value) { .type = TYPE_NULL }; }
+static inline Value make_cfunction(CFuncPtr fn) { return (Value) { .type = TYPE_CFUNC, .as.cfunc = fn }; }
+static inline Value make_object(Object* object) { return (Value) { .type = TYPE_OBJECT, .as.object = object }; }
+static inline Value make_error_value(const char* message) { return (Value) { .type = TYPE_ERROR, .as.error = message }; }
+
+#endif
+
 Value make_array(const Value* values, int count);
 
 /**
  * Ctors functions for Value
  */
 
-Value make_bool(bool value);
-
-Value make_cfunction(CFuncPtr fn);
-
 /**
  * Build an error (TYPE_ERROR)
  * Error message is dynamically allocated
@@ -50,10 +152,6 @@ Value make_error(const char* format, ...);
 
 Value make_function(ObjectFunction* fn);
 
-Value make_null();
-
-Value make_number(double value);
-
 // Build a String, from an already created ObjectString
 Value make_string(const ObjectString* string);
 
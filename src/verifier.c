@@ -0,0 +1,281 @@
+#include "verifier.h"
+#include "vm.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+extern VM vm;
+
+typedef struct {
+    const ObjectFunction* function;
+    const Chunk* chunk;
+    // Stack depth before each instruction, -1 if not reached yet
+    int* depths;
+    // Offsets of the reached instructions left to visit
+    int* pending;
+    int pending_count;
+} Verifier;
+
+static bool fail(const Verifier* verifier, int offset, const char* format, ...)
+{
+    const ObjectFunction* function = verifier->function;
+    fprintf(stderr, "VerifyError in %s(), offset %d: ",
+        function->name == NULL ? "__main__" : function->name->chars,
+        offset);
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    return false;
+}
+
+// Number of values read from the top of the stack by an instruction
+static int stack_inputs(const uint8_t* ip)
+{
+    switch (ip[0]) {
+    case OP_RETURN:
+    case OP_POP:
+    case OP_JUMP_IF_TRUE:
+    case OP_JUMP_IF_FALSE:
+    case OP_DECL_GLOBAL:
+    case OP_DECL_GLOBAL_CONST:
+    case OP_DECL_GLOBAL_16:
+    case OP_DECL_GLOBAL_CONST_16:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_16:
+    case OP_SET_LOCAL:
+    case OP_NOT:
+    case OP_POSITIVE:
+    case OP_NEGATIVE:
+    case OP_SET_LOCAL_POP:
+    case OP_SET_GLOBAL_POP:
+    case OP_ADD_IMM:
+        return 1;
+    case OP_SUBSCRIPT_SET:
+        return 3;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        return ip[1] + 1;
+    case OP_ARRAY:
+        return ip[1];
+    default:
+        // Binary operators and compare and branch instructions pop 2 values,
+        // the others only push
+        return op_stack_effect(ip) < 0 ? 2 : 0;
+    }
+}
+
+// Check an operand indexing the constants
+static bool check_constant(const Verifier* verifier, int offset, int index)
+{
+    if (index >= verifier->chunk->constants.count) {
+        return fail(verifier, offset, "constant %d out of range", index);
+    }
+    return true;
+}
+
+// Check an operand indexing vm.globals
+static bool check_global(const Verifier* verifier, int offset, int slot)
+{
+    if (slot >= vm.global_count) {
+        return fail(verifier, offset, "global slot %d out of range", slot);
+    }
+    return true;
+}
+
+// Check an operand indexing the frame: only values below the stack top
+static bool check_local(const Verifier* verifier, int offset, int slot, int depth)
+{
+    if (slot >= depth) {
+        return fail(verifier, offset, "local slot %d above the stack depth %d", slot, depth);
+    }
+    return true;
+}
+
+// Check the operands of an instruction, with <depth> values on the stack
+static bool check_operands(const Verifier* verifier, int offset, int depth)
+{
+    const uint8_t* ip = verifier->chunk->code + offset;
+    switch (ip[0]) {
+    case OP_CONSTANT:
+        return check_constant(verifier, offset, ip[1]);
+    case OP_CONSTANT_16:
+        return check_constant(verifier, offset, ip[1] << 8 | ip[2]);
+    case OP_DECL_GLOBAL:
+    case OP_DECL_GLOBAL_CONST:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_POP:
+        return check_global(verifier, offset, ip[1]);
+    case OP_DECL_GLOBAL_16:
+    case OP_DECL_GLOBAL_CONST_16:
+    case OP_GET_GLOBAL_16:
+    case OP_SET_GLOBAL_16:
+        return check_global(verifier, offset, ip[1] << 8 | ip[2]);
+    case OP_GET_LOCAL:
+    case OP_INC_LOCAL:
+        return check_local(verifier, offset, ip[1], depth);
+    case OP_SET_LOCAL:
+    case OP_SET_LOCAL_POP:
+        // The assigned value is on top of the stack
+        return check_local(verifier, offset, ip[1], depth - 1);
+    case OP_GET_LOCAL_2:
+        // The second local is read after pushing the first one
+        return check_local(verifier, offset, ip[1], depth) && check_local(verifier, offset, ip[2], depth + 1);
+    case OP_ADD_LOCALS:
+        return check_local(verifier, offset, ip[1], depth) && check_local(verifier, offset, ip[2], depth);
+    case OP_GET_LOCAL_CONSTANT:
+    case OP_ADD_LOCAL_CONST:
+        return check_local(verifier, offset, ip[1], depth) && check_constant(verifier, offset, ip[2]);
+    default:
+        return true;
+    }
+}
+
+// Record the stack depth on entry of an instruction reached from <from>
+static bool reach(Verifier* verifier, int from, int offset, int depth)
+{
+    if (offset < 0 || offset >= verifier->chunk->count) {
+        return fail(verifier, from, "jump to %d, out of the chunk", offset);
+    }
+    if (verifier->depths[offset] == -1) {
+        verifier->depths[offset] = depth;
+        verifier->pending[verifier->pending_count++] = offset;
+    } else if (verifier->depths[offset] != depth) {
+        return fail(verifier, from, "stack depth %d at %d, %d on another path", depth, offset, verifier->depths[offset]);
+    }
+    return true;
+}
+
+// Follow the control flow from the first instruction
+static bool check_stack(Verifier* verifier, const bool* boundaries)
+{
+    const ObjectFunction* function = verifier->function;
+    const Chunk* chunk = verifier->chunk;
+    if (!reach(verifier, 0, 0, function->arity + 1)) {
+        return false;
+    }
+
+    while (verifier->pending_count > 0) {
+        int offset = verifier->pending[--verifier->pending_count];
+        const uint8_t* ip = chunk->code + offset;
+        int depth = verifier->depths[offset];
+        if (depth < stack_inputs(ip)) {
+            return fail(verifier, offset, "%s needs %d values, stack depth is %d", op2str(ip[0]), stack_inputs(ip), depth);
+        }
+        if (!check_operands(verifier, offset, depth)) {
+            return false;
+        }
+        int next = offset + op_length(ip[0]);
+        int next_depth = depth + op_stack_effect(ip);
+        if (next_depth > function->max_stack) {
+            return fail(verifier, offset, "stack depth %d above max_stack %d", next_depth, function->max_stack);
+        }
+
+        int target = -1;
+        bool falls_through = true;
+        switch (ip[0]) {
+        case OP_RETURN:
+            falls_through = false;
+            break;
+        case OP_JUMP:
+            target = next + (ip[1] << 8 | ip[2]);
+            falls_through = false;
+            break;
+        case OP_JUMP_BACK:
+            target = next - (ip[1] << 8 | ip[2]);
+            falls_through = false;
+            break;
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_EQUAL:
+            target = next + (ip[1] << 8 | ip[2]);
+            break;
+        }
+
+        if (target != -1) {
+            if (target < 0 || target >= chunk->count || !boundaries[target]) {
+                return fail(verifier, offset, "jump to %d, not an instruction", target);
+            }
+            if (!reach(verifier, offset, target, next_depth)) {
+                return false;
+            }
+        }
+        if (falls_through) {
+            if (next == chunk->count) {
+                return fail(verifier, offset, "runs past the end of the chunk");
+            }
+            if (!reach(verifier, offset, next, next_depth)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool verifier_check_function(const ObjectFunction* function)
+{
+    const Chunk* chunk = &function->chunk;
+    Verifier verifier;
+    verifier.function = function;
+    verifier.chunk = chunk;
+    verifier.pending_count = 0;
+    if (chunk->count == 0) {
+        return fail(&verifier, 0, "empty chunk");
+    }
+
+    // Decode the instructions: opcodes and instruction boundaries
+    bool* boundaries = calloc(chunk->count, sizeof(bool));
+    bool valid = true;
+    for (int offset = 0; valid && offset < chunk->count;) {
+        uint8_t op = chunk->code[offset];
+        // OP_JUMP_IF_EQUAL is the last OpCode
+        if (op > OP_JUMP_IF_EQUAL) {
+            valid = fail(&verifier, offset, "unknown opcode %d", op);
+        } else if (offset + op_length(op) > chunk->count) {
+            valid = fail(&verifier, offset, "%s truncated", op2str(op));
+        }
+        boundaries[offset] = true;
+        offset += op_length(op);
+    }
+
+    if (valid) {
+        verifier.depths = malloc(sizeof(int) * chunk->count);
+        verifier.pending = malloc(sizeof(int) * chunk->count);
+        for (int i = 0; i < chunk->count; ++i) {
+            verifier.depths[i] = -1;
+        }
+        valid = check_stack(&verifier, boundaries);
+        free(verifier.depths);
+        free(verifier.pending);
+    }
+    free(boundaries);
+    return valid;
+}
+
+bool verifier_check(const ObjectFunction* function)
+{
+    // Not compiled yet by the lazy parser: verified once compiled
+    if (function->lazy_source != NULL) {
+        return true;
+    }
+    if (!verifier_check_function(function)) {
+        return false;
+    }
+    const ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; ++i) {
+        Value constant = constants->values[i];
+        if (is_object(constant) && as_object(constant)->type == OBJECT_FUNCTION
+            && !verifier_check((const ObjectFunction*)as_object(constant))) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,36 @@
+#ifndef ASPIC_VERIFIER_H
+#define ASPIC_VERIFIER_H
+
+#include "object.h"
+
+/**
+ * Bytecode verifier
+ *
+ * vm_run trusts the bytecode: operands are not checked at runtime. This is
+ * safe for the output of the parser, but bytecode loaded from elsewhere must
+ * be verified first:
+ * - each instruction is a known opcode, with its operands inside the chunk
+ * - jumps land on an instruction boundary, inside the chunk
+ * - constant indexes are below constants.count, global slots below
+ *   vm.global_count
+ * - local slots are below the stack depth, and the stack depth is the same on
+ *   every path to an instruction, never negative, and never above max_stack
+ * - the bytecode cannot run past the end of the chunk
+ *
+ * Functions stored in the constants are verified as well.
+ */
+
+/**
+ * Verify the bytecode of a function, and of its nested functions. Errors are
+ * printed to stderr.
+ * @return true if the bytecode is valid
+ */
+bool verifier_check(const ObjectFunction* function);
+
+/**
+ * Verify the bytecode of a function only, not its nested functions
+ * @return true if the bytecode is valid
+ */
+bool verifier_check_function(const ObjectFunction* function);
+
+#endif
@@ -1,10 +1,14 @@
 #include "vm.h"
 #include "debug.h"
+#include "jit.h"
 #include "object.h"
+#include "optimizer.h"
 #include "parser.h"
+#include "profile.h"
 #include "shared.h"
 #include "utils.h"
 #include "value.h"
+#include "verifier.h"
 
 #include "stdlib/os.h"
 #include "stdlib/stdlib.h"
@@ -16,38 +20,61 @@
 // Global, unique instance
 VM vm;
 
-inline static Value vm_peek(int distance)
-{
-    return vm.stack_top[-1 - distance];
-}
-
-inline static uint8_t vm_read_byte(CallFrame* frame)
+static void vm_reset_stack()
 {
-    // Read next byte and move IP forward by 1
-    return *(frame->ip++);
+    vm.stack_top = vm.stack;
+    vm.frame_count = 0;
 }
 
-inline static uint16_t vm_read_16(CallFrame* frame)
+/**
+ * Make room for <frame_count> call frames, and for the stack window of a call
+ * to <function> starting at <slots>. The stacks are reallocated: pointers into
+ * vm.stack are fixed up in the frames, and vm.frames moves.
+ * @return false if a stack has reached its max size
+ */
+static ASPIC_COLD bool vm_grow_stacks(int frame_count, const Value* slots, const ObjectFunction* function)
 {
-    // Read next 2 bytes and move IP forward by 2
-    frame->ip += 2;
-    return frame->ip[-2] << 8 | frame->ip[-1];
-}
+    if (frame_count > vm.frame_capacity) {
+        if (frame_count > VM_FRAMES_MAX) {
+            return false;
+        }
+        vm.frame_capacity = vm.frame_capacity * 2 > VM_FRAMES_MAX ? VM_FRAMES_MAX : vm.frame_capacity * 2;
+        vm.frames = realloc_array(vm.frames, sizeof(CallFrame), vm.frame_capacity);
+    }
 
-inline static Value read_constant(CallFrame* frame)
-{
-    return frame->function->chunk.constants.values[*(frame->ip++)];
+    // +1: room for an error value, pushed by a failing instruction
+    int needed = (int)(slots - vm.stack) + function->max_stack + 1;
+    if (needed > vm.stack_capacity) {
+        if (needed > VM_STACK_MAX) {
+            return false;
+        }
+        int capacity = vm.stack_capacity;
+        while (capacity < needed) {
+            capacity = capacity * 2 > VM_STACK_MAX ? VM_STACK_MAX : capacity * 2;
+        }
+        // New buffer, to fix up pointers while the previous one is valid
+        Value* stack = realloc_array(NULL, sizeof(Value), capacity);
+        memcpy(stack, vm.stack, sizeof(Value) * (vm.stack_top - vm.stack));
+        for (int i = 0; i < vm.frame_count; ++i) {
+            vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+        }
+        vm.stack_top = stack + (vm.stack_top - vm.stack);
+        free(vm.stack);
+        vm.stack = stack;
+        vm.stack_capacity = capacity;
+    }
+    return true;
 }
 
-inline static Value read_constant_16(CallFrame* frame)
-{
-    return frame->function->chunk.constants.values[vm_read_16(frame)];
-}
+// Check if <frame_count> call frames fit in the stacks, and the stack window
+// of a call to <function> starting at <slots> (see vm_grow_stacks)
+#define VM_FRAME_FITS(frame_count, slots, function) \
+    ((frame_count) <= vm.frame_capacity && (slots) + (function)->max_stack < vm.stack + vm.stack_capacity)
 
-static void vm_reset_stack()
+// Check if a call fits in the stacks, growing them if needed
+static inline bool vm_reserve_frame(int frame_count, const Value* slots, const ObjectFunction* function)
 {
-    vm.stack_top = vm.stack;
-    vm.frame_count = 0;
+    return VM_FRAME_FITS(frame_count, slots, function) || vm_grow_stacks(frame_count, slots, function);
 }
 
 static void vm_push(Value value)
@@ -56,29 +83,28 @@ static void vm_push(Value value)
     ++vm.stack_top;
 }
 
-static Value vm_pop()
-{
-#ifdef ASPIC_DEBUG
-    if (vm.stack_top == vm.stack) {
-        fprintf(stderr, "[fatal] vm_pop: cannot pop empty stack");
-        exit(1);
-    }
-#endif
-    return *--vm.stack_top;
-}
-
 static void vm_register_fn(const char* name, CFuncPtr fn)
 {
-    hashtable_set(&vm.globals, string_new(name, strlen(name)), make_cfunction(fn), false);
+    int slot = vm_resolve_global(string_new(name, strlen(name)));
+    Global* global = &vm.globals[slot];
+    global->value = make_cfunction(fn);
+    global->defined = true;
 }
 
+// Frames printed at each end of a long stack trace
+#define VM_TRACE_FRAMES 16
+
 static void vm_report_error(const Value* value)
 {
     for (int i = 0; i < vm.frame_count; ++i) {
+        if (i == VM_TRACE_FRAMES && vm.frame_count > VM_TRACE_FRAMES * 2) {
+            fprintf(stderr, "  ... %d more calls\n", vm.frame_count - VM_TRACE_FRAMES * 2);
+            i = vm.frame_count - VM_TRACE_FRAMES;
+        }
         CallFrame* frame = &vm.frames[i];
         const ObjectFunction* function = frame->function;
 
-        const Chunk* chunk = &function->chunk;
+        const Chunk* chunk = function_chunk(function, frame->ip);
         // -1 because ip points to the next iteration byte
         const char* function_name = function->name == NULL ? "__main__" : function->name->chars;
         size_t offset = frame->ip - chunk->code - 1;
@@ -86,316 +112,1032 @@ static void vm_report_error(const Value* value)
         fprintf(stderr, "↳ at %s(), line %d:\n    ", function_name, line);
         print_line(stderr, vm.source, line);
     }
-    fprintf(stderr, "\n[RuntimeError] %s\n", value->as.error);
+    fprintf(stderr, "\n[RuntimeError] %s\n", as_error(*value));
 }
 
-// Declare a new global variable
-static void vm_decl_global(const ObjectString* name, bool read_only)
+void vm_runtime_error()
 {
-    if (!hashtable_set(&vm.globals, name, vm_pop(), read_only)) {
-        vm_push(make_error("Identifier '%s' has already been declared", name->chars));
+    vm_report_error(vm.stack_top - 1);
+    vm.stack_top--;
+}
+
+/*
+ * Runtime errors are rare: they are built by functions kept out of vm_run,
+ * so the instruction handlers stay small.
+ */
+
+static ASPIC_COLD Value vm_global_error(const char* format, const Global* global)
+{
+    return make_error(format, global->name->chars);
+}
+
+static ASPIC_COLD Value vm_call_error(Value callee, int argc)
+{
+    if (!is_object(callee) || as_object(callee)->type != OBJECT_FUNCTION) {
+        return make_error("Type '%s' is not callable", value_type(callee));
     }
+    const ObjectFunction* function = (const ObjectFunction*)as_object(callee);
+    if (argc != function->arity) {
+        return make_error("function %s() takes %d arguments, but got %d",
+            function->name->chars,
+            function->arity,
+            argc);
+    }
+    return make_error("Stack overflow");
 }
 
-// Push global variable value onto the stack
-static void vm_push_global_value(const ObjectString* name)
+/**
+ * Check if a function has native code, compiling it with the JIT once hot
+ */
+static inline bool vm_has_native(ObjectFunction* function)
 {
-    Value* value = hashtable_get(&vm.globals, name);
-    if (value) {
-        vm_push(*value);
-    } else {
-        vm_push(make_error("Identifier '%s' is not defined", name->chars));
+#ifdef ASPIC_JIT
+    return jit_ready(function);
+#else
+    return function->native_code != NULL;
+#endif
+}
+
+/**
+ * Count a call or a loop iteration, and optimize the bytecode once hot. The
+ * optimized bytecode is used by the next calls.
+ */
+static inline void vm_warm_up(ObjectFunction* function)
+{
+    if (ASPIC_UNLIKELY(++function->hotness == OPTIMIZER_THRESHOLD) && optimizer_optimize(function)) {
+        vm.stats.optimized++;
     }
 }
 
-// Update global variable value
-static void vm_update_global_value(const ObjectString* name)
+/**
+ * Compile a function skipped by the lazy parser, on its first call
+ * @return error, or null if success
+ */
+static Value vm_compile_lazy(ObjectFunction* function)
 {
-    HashtableLookup res = hashtable_update(&vm.globals, name, vm_peek(0));
-    if (res == HASHTABLE_MISS) {
-        vm_push(make_error("Cannot assign to undefined variable '%s'", name->chars));
+    // Objects created by the parser are old, as in a regular compilation, and
+    // the strings it finds in the pool must be old too
+    gc_collect_young();
+    bool nursery_enabled = vm.gc.nursery_enabled;
+    vm.gc.nursery_enabled = false;
+    bool compiled = parser_compile_lazy(function, vm.source);
+    vm.gc.nursery_enabled = nursery_enabled;
+    if (!compiled) {
+        return make_error("Cannot compile function %s()", function->name->chars);
     }
-    if (res == HASHTABLE_READ_ONLY) {
-        vm_push(make_error("Cannot assign to constant variable '%s'", name->chars));
+    // The function may already be marked: shade its new constants
+    const ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; ++i) {
+        gc_write_barrier(&function->object, constants->values[i]);
     }
+#ifdef ASPIC_DEBUG
+    assert(verifier_check(function));
+#endif
+    return make_null();
 }
 
+/**
+ * Run the native code of the given frame, until it returns
+ * @return status code, or VM_TAIL_CALL if the frame must now be interpreted
+ */
+static VmResult vm_run_native(CallFrame* frame)
+{
+    for (;;) {
+        NativeFunction native;
+        // Object pointer to function pointer conversion, not allowed by ISO C
+        memcpy(&native, &frame->function->native_code, sizeof(native));
+        VmResult result = native(frame);
+        if (result != VM_TAIL_CALL) {
+            return result;
+        }
+        // After a tail call, the frame runs the called function. The stacks
+        // may have moved.
+        frame = &vm.frames[vm.frame_count - 1];
+        if (!vm_has_native((ObjectFunction*)frame->function)) {
+            return VM_TAIL_CALL;
+        }
+    }
+}
+
+Value vm_decl_global(int slot, Value value, bool read_only)
+{
+    Global* global = &vm.globals[slot];
+    if (global->defined) {
+        return vm_global_error("Identifier '%s' has already been declared", global);
+    }
+    gc_write_barrier_globals(value);
+    global->value = value;
+    global->defined = true;
+    global->read_only = read_only;
+    return make_null();
+}
+
+Value vm_get_global(int slot)
+{
+    const Global* global = &vm.globals[slot];
+    if (ASPIC_UNLIKELY(!global->defined)) {
+        return vm_global_error("Identifier '%s' is not defined", global);
+    }
+    return global->value;
+}
+
+Value vm_set_global(int slot, Value value)
+{
+    Global* global = &vm.globals[slot];
+    if (!global->defined) {
+        return vm_global_error("Cannot assign to undefined variable '%s'", global);
+    }
+    if (global->read_only) {
+        return vm_global_error("Cannot assign to constant variable '%s'", global);
+    }
+    gc_write_barrier_globals(value);
+    global->value = value;
+    return make_null();
+}
+
+#ifdef ASPIC_DEBUG
+static void vm_debug_instruction(const ObjectFunction* function, const uint8_t* ip)
+{
+    // Frames started before the optimization run the baseline bytecode, which
+    // uses the constants of the function
+    Chunk chunk = *function_chunk(function, ip + 1);
+    chunk.constants = function->chunk.constants;
+    instruction_dump(&chunk, (int)(ip - chunk.code));
+}
+
+static void vm_debug_stack(const Value* stack_top)
+{
+    printf("        [");
+    for (const Value* slot = vm.stack; slot < stack_top; ++slot) {
+        if (slot != vm.stack) {
+            printf(", ");
+        }
+        value_repr(*slot);
+    }
+    printf("]\n");
+}
+#endif
+
+/*
+ * Instruction dispatch
+ *
+ * The portable implementation is a switch statement on the OpCode: every
+ * instruction goes through the same indirect jump, which the CPU struggles
+ * to predict.
+ *
+ * When ASPIC_COMPUTED_GOTO is defined (make COMPUTED_GOTO=1), the VM uses
+ * direct threading instead: the address of each instruction handler is stored
+ * in a table indexed by OpCode, and each handler jumps directly to the handler
+ * of the next instruction. Each opcode then has its own indirect jump, with
+ * its own branch prediction history.
+ * This relies on the "labels as values" extension, supported by gcc and clang.
+ */
+#if defined(ASPIC_COMPUTED_GOTO) && !defined(__GNUC__)
+#undef ASPIC_COMPUTED_GOTO
+#endif
+
+/*
+ * Interpreter state
+ *
+ * vm_run caches the instruction pointer, the slots of the current frame and
+ * the stack top in local variables (ip, slots, sp), which the compiler keeps
+ * in machine registers. They are written back to the CallFrame and to
+ * vm.stack_top only when another function needs them: calls, returns,
+ * garbage collections and error reporting.
+ */
+
+// Read next byte and move IP forward by 1
+#define VM_READ_BYTE() (*ip++)
+// Read next 2 bytes and move IP forward by 2
+#define VM_READ_16() (ip += 2, (uint16_t)(ip[-2] << 8 | ip[-1]))
+#define VM_READ_CONSTANT() (constants[VM_READ_BYTE()])
+#define VM_READ_CONSTANT_16() (constants[VM_READ_16()])
+
+// Pushes are not checked: calls reserve the max stack depth of the function
+// (and room for an error value)
+#ifdef ASPIC_DEBUG
+#define VM_PUSH(value) (assert(sp - slots <= frame->function->max_stack), *sp++ = (value))
+#define VM_POP() (assert(sp > vm.stack), *--sp)
+#else
+#define VM_PUSH(value) (*sp++ = (value))
+#define VM_POP() (*--sp)
+#endif
+#define VM_PEEK(distance) (sp[-1 - (distance)])
+
+// Load the state of the current frame, after a call or a return
+#define VM_LOAD_FRAME()                                      \
+    do {                                                     \
+        ip = frame->ip;                                      \
+        slots = frame->slots;                                \
+        constants = frame->function->chunk.constants.values; \
+    } while (0)
+
+#ifdef ASPIC_DEBUG
+#define VM_TRACE_INSTRUCTION() vm_debug_instruction(frame->function, ip)
+#define VM_TRACE_STACK() vm_debug_stack(sp)
+#else
+#define VM_TRACE_INSTRUCTION()
+#define VM_TRACE_STACK()
+#endif
+
+#ifdef ASPIC_OPCODE_PROFILE
+#define VM_PROFILE_INSTRUCTION() profile_record(*ip)
+#else
+#define VM_PROFILE_INSTRUCTION()
+#endif
+
+// Raise a runtime error: push the error value and report it
+#define VM_THROW(error)     \
+    do {                    \
+        VM_PUSH(error);     \
+        goto runtime_error; \
+    } while (0)
+
+// Check if an error has been pushed by the current instruction.
+// Only instructions which can fail need to call it, before VM_NEXT().
+#define VM_CHECK_ERROR()                    \
+    if (ASPIC_UNLIKELY(is_error(sp[-1]))) { \
+        goto runtime_error;                 \
+    }
+
+// Raise the error returned by a function returning null on success
+#define VM_CHECK_RESULT(result)                  \
+    do {                                         \
+        Value _result = (result);                \
+        if (ASPIC_UNLIKELY(is_error(_result))) { \
+            VM_THROW(_result);                   \
+        }                                        \
+    } while (0)
+
+// Check if the current instruction can be rewritten: not in a read-only
+// mapped image
+#define VM_WRITABLE_CODE() ((uintptr_t)(ip - 1) - (uintptr_t)vm.image >= vm.image_size)
+
+// Rewrite the current instruction (which has no operand) into a specialized
+// form, once the operand types have been observed
+#define VM_QUICKEN(op)            \
+    do {                          \
+        if (VM_WRITABLE_CODE()) { \
+            ip[-1] = (op);        \
+            vm.stats.quickened++; \
+        }                         \
+    } while (0)
+
+// Guard of a specialized instruction has failed: rewrite the current
+// instruction back into its generic form, and execute it. Images contain no
+// specialized instruction.
+#define VM_DEOPTIMIZE(op)       \
+    do {                        \
+        ip[-1] = (op);          \
+        vm.stats.deoptimized++; \
+        ip--;                   \
+        VM_DISPATCH();          \
+    } while (0)
+
+// Generic binary operator: replace the two operands with the result of
+// function(b, a), and check for error
+#define VM_BINARY_OP(function)             \
+    do {                                   \
+        sp[-2] = function(sp[-1], sp[-2]); \
+        sp--;                              \
+        VM_CHECK_ERROR();                  \
+    } while (0)
+
+// Specialized binary operator on two numbers
+#define VM_BINARY_NUMBER_OP(generic_op, make_value, operator)    \
+    do {                                                         \
+        Value b = sp[-1];                                        \
+        Value a = sp[-2];                                        \
+        if (!is_number(a) || !is_number(b)) {                    \
+            VM_DEOPTIMIZE(generic_op);                           \
+        }                                                        \
+        sp[-2] = make_value(as_number(a) operator as_number(b)); \
+        sp--;                                                    \
+        VM_NEXT();                                               \
+    } while (0)
+
+// Pop two operands a and b, and jump if (a operator b) is false. Operands
+// which are not both numbers are compared with generic_op.
+#define VM_COMPARE_AND_JUMP(operator, generic_op)        \
+    do {                                                 \
+        uint16_t offset = VM_READ_16();                  \
+        Value b = sp[-1];                                \
+        Value a = sp[-2];                                \
+        bool result;                                     \
+        if (is_number(a) && is_number(b)) {              \
+            result = as_number(a) operator as_number(b); \
+        } else {                                         \
+            Value value = generic_op;                    \
+            if (is_error(value)) {                       \
+                sp[-2] = value;                          \
+                sp--;                                    \
+                goto runtime_error;                      \
+            }                                            \
+            result = as_bool(value);                     \
+        }                                                \
+        sp -= 2;                                         \
+        if (!result) {                                   \
+            ip += offset;                                \
+        }                                                \
+        VM_NEXT();                                       \
+    } while (0)
+
+// Both operands on top of the stack are numbers
+#define VM_NUMBER_OPERANDS() (is_number(sp[-1]) && is_number(sp[-2]))
+
+// Garbage collection safepoint, for instructions which can allocate objects.
+// Must be called once the instruction result is pushed on the stack.
+#define VM_GC_SAFEPOINT()      \
+    if (gc_should_collect()) { \
+        vm.stack_top = sp;     \
+        gc_collect();          \
+    }
+
+#ifdef ASPIC_COMPUTED_GOTO
+#define VM_LOOP() VM_DISPATCH();
+#define VM_DISPATCH()                         \
+    do {                                      \
+        VM_TRACE_INSTRUCTION();               \
+        VM_PROFILE_INSTRUCTION();             \
+        goto* dispatch_table[VM_READ_BYTE()]; \
+    } while (0)
+#define VM_CASE(op) label_##op
+#else
+#define VM_LOOP()             \
+    dispatch:                 \
+    VM_TRACE_INSTRUCTION();   \
+    VM_PROFILE_INSTRUCTION(); \
+    switch (VM_READ_BYTE())
+#define VM_DISPATCH() goto dispatch
+#define VM_CASE(op) case op
+#endif
+
+// End of an instruction handler: jump to the next instruction
+#define VM_NEXT()         \
+    do {                  \
+        VM_TRACE_STACK(); \
+        VM_DISPATCH();    \
+    } while (0)
+
+#ifdef ASPIC_COMPUTED_GOTO
+// Labels as values are not ISO C
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+/**
+ * Run the bytecode of the given frame, until it returns
+ */
 static VmResult vm_run(CallFrame* frame)
 {
 #ifdef ASPIC_DEBUG
     printf("== vm::run ==\n");
 #endif
-    for (;;) {
-#ifdef ASPIC_DEBUG
-        instruction_dump(
-            &frame->function->chunk,
-            (int)(frame->ip - frame->function->chunk.code));
+#ifdef ASPIC_COMPUTED_GOTO
+    // IMPORTANT: keep synced with OpCode enum
+    static void* dispatch_table[] = {
+        [OP_RETURN] = &&label_OP_RETURN,
+        [OP_POP] = &&label_OP_POP,
+        [OP_JUMP] = &&label_OP_JUMP,
+        [OP_JUMP_IF_TRUE] = &&label_OP_JUMP_IF_TRUE,
+        [OP_JUMP_IF_FALSE] = &&label_OP_JUMP_IF_FALSE,
+        [OP_JUMP_BACK] = &&label_OP_JUMP_BACK,
+        [OP_DECL_GLOBAL] = &&label_OP_DECL_GLOBAL,
+        [OP_DECL_GLOBAL_CONST] = &&label_OP_DECL_GLOBAL_CONST,
+        [OP_GET_GLOBAL] = &&label_OP_GET_GLOBAL,
+        [OP_SET_GLOBAL] = &&label_OP_SET_GLOBAL,
+        [OP_DECL_GLOBAL_16] = &&label_OP_DECL_GLOBAL_16,
+        [OP_DECL_GLOBAL_CONST_16] = &&label_OP_DECL_GLOBAL_CONST_16,
+        [OP_GET_GLOBAL_16] = &&label_OP_GET_GLOBAL_16,
+        [OP_SET_GLOBAL_16] = &&label_OP_SET_GLOBAL_16,
+        [OP_GET_LOCAL] = &&label_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&label_OP_SET_LOCAL,
+        [OP_CONSTANT] = &&label_OP_CONSTANT,
+        [OP_CONSTANT_16] = &&label_OP_CONSTANT_16,
+        [OP_ZERO] = &&label_OP_ZERO,
+        [OP_ONE] = &&label_OP_ONE,
+        [OP_TRUE] = &&label_OP_TRUE,
+        [OP_FALSE] = &&label_OP_FALSE,
+        [OP_NULL] = &&label_OP_NULL,
+        [OP_NOT] = &&label_OP_NOT,
+        [OP_POSITIVE] = &&label_OP_POSITIVE,
+        [OP_NEGATIVE] = &&label_OP_NEGATIVE,
+        [OP_ADD] = &&label_OP_ADD,
+        [OP_SUBTRACT] = &&label_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&label_OP_MULTIPLY,
+        [OP_DIVIDE] = &&label_OP_DIVIDE,
+        [OP_MODULO] = &&label_OP_MODULO,
+        [OP_EQUAL] = &&label_OP_EQUAL,
+        [OP_NOT_EQUAL] = &&label_OP_NOT_EQUAL,
+        [OP_GREATER] = &&label_OP_GREATER,
+        [OP_GREATER_EQUAL] = &&label_OP_GREATER_EQUAL,
+        [OP_LESS] = &&label_OP_LESS,
+        [OP_LESS_EQUAL] = &&label_OP_LESS_EQUAL,
+        [OP_SUBSCRIPT_GET] = &&label_OP_SUBSCRIPT_GET,
+        [OP_SUBSCRIPT_SET] = &&label_OP_SUBSCRIPT_SET,
+        [OP_CALL] = &&label_OP_CALL,
+        [OP_TAIL_CALL] = &&label_OP_TAIL_CALL,
+        [OP_ARRAY] = &&label_OP_ARRAY,
+        [OP_ADD_NUM] = &&label_OP_ADD_NUM,
+        [OP_ADD_STR] = &&label_OP_ADD_STR,
+        [OP_SUBTRACT_NUM] = &&label_OP_SUBTRACT_NUM,
+        [OP_MULTIPLY_NUM] = &&label_OP_MULTIPLY_NUM,
+        [OP_DIVIDE_NUM] = &&label_OP_DIVIDE_NUM,
+        [OP_GREATER_NUM] = &&label_OP_GREATER_NUM,
+        [OP_GREATER_EQUAL_NUM] = &&label_OP_GREATER_EQUAL_NUM,
+        [OP_LESS_NUM] = &&label_OP_LESS_NUM,
+        [OP_LESS_EQUAL_NUM] = &&label_OP_LESS_EQUAL_NUM,
+        [OP_GET_LOCAL_2] = &&label_OP_GET_LOCAL_2,
+        [OP_GET_LOCAL_CONSTANT] = &&label_OP_GET_LOCAL_CONSTANT,
+        [OP_ADD_LOCALS] = &&label_OP_ADD_LOCALS,
+        [OP_SET_LOCAL_POP] = &&label_OP_SET_LOCAL_POP,
+        [OP_SET_GLOBAL_POP] = &&label_OP_SET_GLOBAL_POP,
+        [OP_ADD_IMM] = &&label_OP_ADD_IMM,
+        [OP_INC_LOCAL] = &&label_OP_INC_LOCAL,
+        [OP_ADD_LOCAL_CONST] = &&label_OP_ADD_LOCAL_CONST,
+        [OP_JUMP_IF_NOT_LESS] = &&label_OP_JUMP_IF_NOT_LESS,
+        [OP_JUMP_IF_NOT_LESS_EQUAL] = &&label_OP_JUMP_IF_NOT_LESS_EQUAL,
+        [OP_JUMP_IF_NOT_GREATER] = &&label_OP_JUMP_IF_NOT_GREATER,
+        [OP_JUMP_IF_NOT_GREATER_EQUAL] = &&label_OP_JUMP_IF_NOT_GREATER_EQUAL,
+        [OP_JUMP_IF_NOT_EQUAL] = &&label_OP_JUMP_IF_NOT_EQUAL,
+        [OP_JUMP_IF_EQUAL] = &&label_OP_JUMP_IF_EQUAL,
+    };
 #endif
-        // Read next byte
-        uint8_t instruction = vm_read_byte(frame);
-        switch (instruction) {
-        case OP_RETURN: {
-            Value result = vm_pop();
-            // Function has ended: discard the CallFrame and reset stack head
-            // at the beginning of the CallFrame
-            --vm.frame_count;
-            vm.stack_top = frame->slots;
-            vm_push(result);
-            // Returning from __main__: exit
-            if (vm.frame_count == 0) {
-                return VM_OK;
-            }
-            // Update the current frame pointer
-            frame = &vm.frames[vm.frame_count - 1];
-            break;
+
+    // Interpreter state, see VM_LOAD_FRAME
+    uint8_t* ip;
+    Value* slots;
+    const Value* constants;
+    Value* sp = vm.stack_top;
+    VM_LOAD_FRAME();
+    // Frame count once the entry frame has returned
+    const int exit_frame_count = vm.frame_count - 1;
+
+    VM_LOOP()
+    {
+    VM_CASE(OP_RETURN): {
+        Value result = VM_POP();
+        // Function has ended: discard the CallFrame and reset stack head
+        // at the beginning of the CallFrame
+        --vm.frame_count;
+        sp = slots;
+        VM_PUSH(result);
+        // Returning from the entry frame: exit
+        if (vm.frame_count == exit_frame_count) {
+            vm.stack_top = sp;
+            return VM_OK;
+        }
+        // Resume the caller
+        frame = &vm.frames[vm.frame_count - 1];
+        VM_LOAD_FRAME();
+        VM_NEXT();
+    }
+
+    VM_CASE(OP_POP):
+        sp--;
+        VM_NEXT();
+
+    // Jumps
+    VM_CASE(OP_JUMP): {
+        uint16_t offset = VM_READ_16();
+        ip += offset;
+        VM_NEXT();
+    }
+    VM_CASE(OP_JUMP_IF_TRUE): {
+        uint16_t offset = VM_READ_16();
+        if (value_truthy(VM_PEEK(0))) {
+            ip += offset;
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_JUMP_IF_FALSE): {
+        uint16_t offset = VM_READ_16();
+        if (!value_truthy(VM_PEEK(0))) {
+            ip += offset;
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_JUMP_BACK): {
+        uint16_t offset = VM_READ_16();
+        ip -= offset;
+        // Constants may be added by the optimizer
+        vm_warm_up((ObjectFunction*)frame->function);
+        constants = frame->function->chunk.constants.values;
+        VM_NEXT();
+    }
+
+    // Global variables
+    VM_CASE(OP_DECL_GLOBAL):
+        VM_CHECK_RESULT(vm_decl_global(VM_READ_BYTE(), VM_PEEK(0), false));
+        sp--;
+        VM_NEXT();
+    VM_CASE(OP_DECL_GLOBAL_CONST):
+        VM_CHECK_RESULT(vm_decl_global(VM_READ_BYTE(), VM_PEEK(0), true));
+        sp--;
+        VM_NEXT();
+    VM_CASE(OP_GET_GLOBAL):
+        VM_PUSH(vm_get_global(VM_READ_BYTE()));
+        VM_CHECK_ERROR();
+        VM_NEXT();
+    VM_CASE(OP_SET_GLOBAL):
+        VM_CHECK_RESULT(vm_set_global(VM_READ_BYTE(), VM_PEEK(0)));
+        VM_NEXT();
+    VM_CASE(OP_DECL_GLOBAL_16):
+        VM_CHECK_RESULT(vm_decl_global(VM_READ_16(), VM_PEEK(0), false));
+        sp--;
+        VM_NEXT();
+    VM_CASE(OP_DECL_GLOBAL_CONST_16):
+        VM_CHECK_RESULT(vm_decl_global(VM_READ_16(), VM_PEEK(0), true));
+        sp--;
+        VM_NEXT();
+    VM_CASE(OP_GET_GLOBAL_16):
+        VM_PUSH(vm_get_global(VM_READ_16()));
+        VM_CHECK_ERROR();
+        VM_NEXT();
+    VM_CASE(OP_SET_GLOBAL_16):
+        VM_CHECK_RESULT(vm_set_global(VM_READ_16(), VM_PEEK(0)));
+        VM_NEXT();
+
+    // Local variables
+    VM_CASE(OP_GET_LOCAL):
+        VM_PUSH(slots[VM_READ_BYTE()]);
+        VM_NEXT();
+    VM_CASE(OP_SET_LOCAL):
+        slots[VM_READ_BYTE()] = VM_PEEK(0);
+        VM_NEXT();
+
+    // Literals
+    VM_CASE(OP_CONSTANT):
+        VM_PUSH(VM_READ_CONSTANT());
+        VM_NEXT();
+    VM_CASE(OP_CONSTANT_16):
+        VM_PUSH(VM_READ_CONSTANT_16());
+        VM_NEXT();
+
+    // Predefined literals
+    VM_CASE(OP_ZERO):
+        VM_PUSH(make_number(0));
+        VM_NEXT();
+    VM_CASE(OP_ONE):
+        VM_PUSH(make_number(1));
+        VM_NEXT();
+    VM_CASE(OP_TRUE):
+        VM_PUSH(make_bool(true));
+        VM_NEXT();
+    VM_CASE(OP_FALSE):
+        VM_PUSH(make_bool(false));
+        VM_NEXT();
+    VM_CASE(OP_NULL):
+        VM_PUSH(make_null());
+        VM_NEXT();
+
+    // Unary operators
+    VM_CASE(OP_NOT):
+        sp[-1] = op_not(sp[-1]);
+        VM_NEXT();
+    VM_CASE(OP_POSITIVE):
+        sp[-1] = op_positive(sp[-1]);
+        VM_CHECK_ERROR();
+        VM_NEXT();
+    VM_CASE(OP_NEGATIVE):
+        sp[-1] = op_negative(sp[-1]);
+        VM_CHECK_ERROR();
+        VM_NEXT();
+
+    // Binary operators
+    VM_CASE(OP_ADD):
+        if (VM_NUMBER_OPERANDS()) {
+            VM_QUICKEN(OP_ADD_NUM);
+        } else if (is_string(sp[-1]) && is_string(sp[-2])) {
+            VM_QUICKEN(OP_ADD_STR);
+        }
+        VM_BINARY_OP(op_add);
+        VM_GC_SAFEPOINT();
+        VM_NEXT();
+    VM_CASE(OP_SUBTRACT):
+        if (VM_NUMBER_OPERANDS()) {
+            VM_QUICKEN(OP_SUBTRACT_NUM);
+        }
+        VM_BINARY_OP(op_subtract);
+        VM_NEXT();
+    VM_CASE(OP_MULTIPLY):
+        if (VM_NUMBER_OPERANDS()) {
+            VM_QUICKEN(OP_MULTIPLY_NUM);
+        }
+        VM_BINARY_OP(op_multiply);
+        VM_GC_SAFEPOINT();
+        VM_NEXT();
+    VM_CASE(OP_DIVIDE):
+        if (VM_NUMBER_OPERANDS()) {
+            VM_QUICKEN(OP_DIVIDE_NUM);
+        }
+        VM_BINARY_OP(op_divide);
+        VM_NEXT();
+    VM_CASE(OP_MODULO):
+        VM_BINARY_OP(op_modulo);
+        VM_NEXT();
+
+    // Comparators
+    VM_CASE(OP_EQUAL):
+        sp[-2] = make_bool(value_equal(sp[-1], sp[-2]));
+        sp--;
+        VM_NEXT();
+    VM_CASE(OP_NOT_EQUAL):
+        sp[-2] = make_bool(!value_equal(sp[-1], sp[-2]));
+        sp--;
+        VM_NEXT();
+    VM_CASE(OP_GREATER):
+        if (VM_NUMBER_OPERANDS()) {
+            VM_QUICKEN(OP_GREATER_NUM);
+        }
+        VM_BINARY_OP(op_greater);
+        VM_NEXT();
+    VM_CASE(OP_GREATER_EQUAL):
+        if (VM_NUMBER_OPERANDS()) {
+            VM_QUICKEN(OP_GREATER_EQUAL_NUM);
         }
+        VM_BINARY_OP(op_greater_equal);
+        VM_NEXT();
+    VM_CASE(OP_LESS):
+        if (VM_NUMBER_OPERANDS()) {
+            VM_QUICKEN(OP_LESS_NUM);
+        }
+        // a < b is b > a
+        sp[-2] = op_greater(sp[-2], sp[-1]);
+        sp--;
+        VM_CHECK_ERROR();
+        VM_NEXT();
+    VM_CASE(OP_LESS_EQUAL):
+        if (VM_NUMBER_OPERANDS()) {
+            VM_QUICKEN(OP_LESS_EQUAL_NUM);
+        }
+        // a <= b is b >= a
+        sp[-2] = op_greater_equal(sp[-2], sp[-1]);
+        sp--;
+        VM_CHECK_ERROR();
+        VM_NEXT();
 
-        case OP_POP:
-            vm_pop();
-            break;
+    // Subscript operator
+    VM_CASE(OP_SUBSCRIPT_GET):
+        sp[-2] = op_subscript_get(sp[-2], sp[-1]);
+        sp--;
+        VM_CHECK_ERROR();
+        VM_GC_SAFEPOINT();
+        VM_NEXT();
+    VM_CASE(OP_SUBSCRIPT_SET): {
+        Value value = sp[-1];
+        Value collection = sp[-3];
+        sp[-3] = op_subscript_set(collection, sp[-2], value);
+        sp -= 2;
+        VM_CHECK_ERROR();
+        gc_write_barrier(as_object(collection), value);
+        VM_NEXT();
+    }
 
-        // Jumps
-        case OP_JUMP:
-            frame->ip += vm_read_16(frame);
-            break;
-        case OP_JUMP_IF_TRUE: {
-            uint16_t offset = vm_read_16(frame);
-            if (value_truthy(vm_peek(0))) {
-                frame->ip += offset;
+    // Function call
+    VM_CASE(OP_TAIL_CALL): {
+        vm.stack_top = sp;
+        ObjectFunction* function = vm_tail_call(ip[0]);
+        if (function != NULL) {
+            sp = vm.stack_top;
+            if (vm_has_native(function) && vm_run_native(frame) == VM_RUNTIME_ERROR) {
+                return VM_RUNTIME_ERROR;
+            }
+            // Same as OP_CALL, except the native code may have returned from
+            // the entry frame
+            sp = vm.stack_top;
+            if (vm.frame_count == exit_frame_count) {
+                return VM_OK;
             }
-            break;
+            frame = &vm.frames[vm.frame_count - 1];
+            VM_LOAD_FRAME();
+            VM_NEXT();
+        }
+        // Other callees: regular call, then OP_RETURN
+        goto call;
+    }
+    VM_CASE(OP_CALL):
+    call: {
+        uint8_t argc = VM_READ_BYTE();
+        Value callee = sp[-(argc + 1)];
+        if (is_cfunc(callee)) {
+            // Call c function pointer, which may read the VM stack
+            vm.stack_top = sp;
+            Value result = as_cfunc(callee)(sp - argc, argc);
+            // Pop callee + arguments, then push call result
+            sp -= (argc + 1);
+            VM_PUSH(result);
+            VM_CHECK_ERROR();
+            VM_GC_SAFEPOINT();
+            VM_NEXT();
         }
-        case OP_JUMP_IF_FALSE: {
-            uint16_t offset = vm_read_16(frame);
-            if (!value_truthy(vm_peek(0))) {
-                frame->ip += offset;
+        if (ASPIC_UNLIKELY(!is_object(callee) || as_object(callee)->type != OBJECT_FUNCTION)) {
+            VM_THROW(vm_call_error(callee, argc));
+        }
+        ObjectFunction* function = (ObjectFunction*)as_object(callee);
+        if (ASPIC_UNLIKELY(argc != function->arity)) {
+            VM_THROW(vm_call_error(callee, argc));
+        }
+        if (ASPIC_UNLIKELY(function->lazy_source != NULL)) {
+            // Compilation empties the nursery: roots are the stack
+            vm.stack_top = sp;
+            VM_CHECK_RESULT(vm_compile_lazy(function));
+        }
+        vm_warm_up(function);
+        if (ASPIC_UNLIKELY(!VM_FRAME_FITS(vm.frame_count + 1, sp - (argc + 1), function))) {
+            vm.stack_top = sp;
+            bool grown = vm_grow_stacks(vm.frame_count + 1, sp - (argc + 1), function);
+            // Reload the interpreter state from the moved stacks
+            sp = vm.stack_top;
+            frame = &vm.frames[vm.frame_count - 1];
+            slots = frame->slots;
+            if (!grown) {
+                VM_THROW(vm_call_error(callee, argc));
             }
-            break;
-        }
-        case OP_JUMP_BACK:
-            frame->ip -= vm_read_16(frame);
-            break;
-
-        // Global variables
-        case OP_DECL_GLOBAL:
-            vm_decl_global((ObjectString*)read_constant(frame).as.object, false);
-            break;
-        case OP_DECL_GLOBAL_CONST:
-            vm_decl_global((ObjectString*)read_constant(frame).as.object, true);
-            break;
-        case OP_GET_GLOBAL:
-            vm_push_global_value((ObjectString*)read_constant(frame).as.object);
-            break;
-        case OP_SET_GLOBAL:
-            vm_update_global_value((ObjectString*)read_constant(frame).as.object);
-            break;
-        case OP_DECL_GLOBAL_16:
-            vm_decl_global((ObjectString*)read_constant_16(frame).as.object, false);
-            break;
-        case OP_DECL_GLOBAL_CONST_16:
-            vm_decl_global((ObjectString*)read_constant_16(frame).as.object, true);
-            break;
-        case OP_GET_GLOBAL_16:
-            vm_push_global_value((ObjectString*)read_constant_16(frame).as.object);
-            break;
-        case OP_SET_GLOBAL_16:
-            vm_update_global_value((ObjectString*)read_constant_16(frame).as.object);
-            break;
-
-        // Local variables
-        case OP_GET_LOCAL:
-            vm_push(frame->slots[vm_read_byte(frame)]);
-            break;
-        case OP_SET_LOCAL: {
-            uint8_t slot = vm_read_byte(frame);
-            frame->slots[slot] = vm_peek(0);
-            break;
-        }
-
-        // Literals
-        case OP_CONSTANT:
-            vm_push(read_constant(frame));
-            break;
-        case OP_CONSTANT_16:
-            vm_push(read_constant_16(frame));
-            break;
-
-        // Predefined literals
-        case OP_ZERO:
-            vm_push(make_number(0));
-            break;
-        case OP_ONE:
-            vm_push(make_number(1));
-            break;
-        case OP_TRUE:
-            vm_push(make_bool(true));
-            break;
-        case OP_FALSE:
-            vm_push(make_bool(false));
-            break;
-        case OP_NULL:
-            vm_push(make_null());
-            break;
-
-        // Unary operators
-        case OP_NOT:
-            vm_push(op_not(vm_pop()));
-            break;
-        case OP_POSITIVE:
-            vm_push(op_positive(vm_pop()));
-            break;
-        case OP_NEGATIVE:
-            vm_push(op_negative(vm_pop()));
-            break;
-
-        // Binary operators
-        case OP_ADD: {
-            Value v = vm_pop();
-            vm_push(op_add(v, vm_pop()));
-            break;
-        }
-        case OP_SUBTRACT: {
-            Value v = vm_pop();
-            vm_push(op_subtract(v, vm_pop()));
-            break;
-        }
-        case OP_MULTIPLY: {
-            Value v = vm_pop();
-            vm_push(op_multiply(v, vm_pop()));
-            break;
-        }
-        case OP_DIVIDE: {
-            Value v = vm_pop();
-            vm_push(op_divide(v, vm_pop()));
-            break;
-        }
-        case OP_MODULO: {
-            Value v = vm_pop();
-            vm_push(op_modulo(v, vm_pop()));
-            break;
-        }
-
-        // Comparators
-        case OP_EQUAL:
-            vm_push(make_bool(value_equal(vm_pop(), vm_pop())));
-            break;
-        case OP_NOT_EQUAL:
-            vm_push(make_bool(!value_equal(vm_pop(), vm_pop())));
-            break;
-        case OP_GREATER: {
-            Value v = vm_pop();
-            vm_push(op_greater(v, vm_pop()));
-            break;
-        }
-        case OP_GREATER_EQUAL: {
-            Value v = vm_pop();
-            vm_push(op_greater_equal(v, vm_pop()));
-            break;
-        }
-        case OP_LESS: {
-            Value v = vm_pop();
-            vm_push(op_greater(vm_pop(), v));
-            break;
-        }
-        case OP_LESS_EQUAL: {
-            Value v = vm_pop();
-            vm_push(op_greater_equal(vm_pop(), v));
-            break;
-        }
-
-        // Subscript operator
-        case OP_SUBSCRIPT_GET: {
-            Value index = vm_pop();
-            vm_push(op_subscript_get(vm_pop(), index));
-            break;
-        }
-        case OP_SUBSCRIPT_SET: {
-            Value value = vm_pop();
-            Value index = vm_pop();
-            vm_push(op_subscript_set(vm_pop(), index, value));
-            break;
-        }
-
-        // Function call
-        case OP_CALL: {
-            uint8_t argc = vm_read_byte(frame);
-            Value fn = vm.stack_top[-(argc + 1)];
-            if (fn.type == TYPE_CFUNC) {
-                // Call c function pointer
-                Value result = fn.as.cfunc(vm.stack_top - argc, argc);
-                // Pop callee + arguments, then push call result
-                vm.stack_top -= (argc + 1);
-                vm_push(result);
-            } else if (fn.type == TYPE_OBJECT && fn.as.object->type == OBJECT_FUNCTION) {
-                ObjectFunction* function = (ObjectFunction*)fn.as.object;
-
-                if (argc != function->arity) {
-                    vm_push(make_error("function %s() takes %d arguments, but got %d",
-                        function->name->chars,
-                        function->arity,
-                        argc));
-                } else if (vm.frame_count == VM_FRAMES_MAX) {
-                    vm_push(make_error("Stack overflow"));
-                } else {
-                    // Initialize a new CallFrame for the called function
-                    frame = &vm.frames[vm.frame_count++];
-                    frame->function = function;
-                    frame->ip = function->chunk.code;
-                    // Pop call + arguments
-                    frame->slots = vm.stack_top - (argc + 1);
-                }
-            } else {
-                // The first operand is not a function
-                vm_push(make_error("Type '%s' is not callable", value_type(fn)));
+        }
+        // Save the caller instruction pointer, for the return and the
+        // stack trace
+        frame->ip = ip;
+        // Initialize a new CallFrame for the called function
+        frame = &vm.frames[vm.frame_count++];
+        frame->function = function;
+        frame->ip = function->chunk.code;
+        frame->slots = sp - (argc + 1);
+        if (vm_has_native(function)) {
+            // Run the native code, until the function returns
+            vm.stack_top = sp;
+            if (vm_run_native(frame) == VM_RUNTIME_ERROR) {
+                return VM_RUNTIME_ERROR;
             }
-            break;
+            // Caller frame, or the same frame after a tail call to a function
+            // without native code
+            sp = vm.stack_top;
+            frame = &vm.frames[vm.frame_count - 1];
         }
+        VM_LOAD_FRAME();
+        VM_NEXT();
+    }
 
-        // Array expression
-        case OP_ARRAY: {
-            uint8_t item_count = vm_read_byte(frame);
-            Value array = make_array(vm.stack_top - item_count, item_count);
-            // Pop items, then push array
-            vm.stack_top -= item_count;
-            vm_push(array);
-            break;
+    // Array expression
+    VM_CASE(OP_ARRAY): {
+        uint8_t item_count = VM_READ_BYTE();
+        Value array = make_array(sp - item_count, item_count);
+        // Pop items, then push array
+        sp -= item_count;
+        VM_PUSH(array);
+        VM_GC_SAFEPOINT();
+        VM_NEXT();
+    }
+
+    // Quickened instructions
+    VM_CASE(OP_ADD_NUM):
+        VM_BINARY_NUMBER_OP(OP_ADD, make_number, +);
+    VM_CASE(OP_ADD_STR): {
+        Value b = sp[-1];
+        Value a = sp[-2];
+        if (!is_string(a) || !is_string(b)) {
+            VM_DEOPTIMIZE(OP_ADD);
+        }
+        sp[-2] = make_string(
+            string_concat((const ObjectString*)as_object(a), (const ObjectString*)as_object(b)));
+        sp--;
+        VM_GC_SAFEPOINT();
+        VM_NEXT();
+    }
+    VM_CASE(OP_SUBTRACT_NUM):
+        VM_BINARY_NUMBER_OP(OP_SUBTRACT, make_number, -);
+    VM_CASE(OP_MULTIPLY_NUM):
+        VM_BINARY_NUMBER_OP(OP_MULTIPLY, make_number, *);
+    VM_CASE(OP_DIVIDE_NUM):
+        // Division by zero is reported by the generic instruction
+        if (is_number(sp[-1]) && as_number(sp[-1]) == 0) {
+            VM_DEOPTIMIZE(OP_DIVIDE);
         }
+        VM_BINARY_NUMBER_OP(OP_DIVIDE, make_number, /);
+    VM_CASE(OP_GREATER_NUM):
+        VM_BINARY_NUMBER_OP(OP_GREATER, make_bool, >);
+    VM_CASE(OP_GREATER_EQUAL_NUM):
+        VM_BINARY_NUMBER_OP(OP_GREATER_EQUAL, make_bool, >=);
+    VM_CASE(OP_LESS_NUM):
+        VM_BINARY_NUMBER_OP(OP_LESS, make_bool, <);
+    VM_CASE(OP_LESS_EQUAL_NUM):
+        VM_BINARY_NUMBER_OP(OP_LESS_EQUAL, make_bool, <=);
 
-        default:
-            assert(false); // Unreachable
-            break;
+    // Superinstructions
+    VM_CASE(OP_GET_LOCAL_2):
+        sp[0] = slots[ip[0]];
+        sp[1] = slots[ip[1]];
+        sp += 2;
+        ip += 2;
+        VM_NEXT();
+    VM_CASE(OP_GET_LOCAL_CONSTANT):
+        sp[0] = slots[ip[0]];
+        sp[1] = constants[ip[1]];
+        sp += 2;
+        ip += 2;
+        VM_NEXT();
+    VM_CASE(OP_ADD_LOCALS): {
+        Value a = slots[ip[0]];
+        Value b = slots[ip[1]];
+        ip += 2;
+        if (is_number(a) && is_number(b)) {
+            VM_PUSH(make_number(as_number(a) + as_number(b)));
+            VM_NEXT();
         }
-#ifdef ASPIC_DEBUG
-        printf("        [");
-        for (const Value* slot = vm.stack; slot < vm.stack_top; ++slot) {
-            if (slot != vm.stack) {
-                printf(", ");
-            }
-            value_repr(*slot);
+        VM_PUSH(op_add(b, a));
+        VM_CHECK_ERROR();
+        VM_GC_SAFEPOINT();
+        VM_NEXT();
+    }
+    VM_CASE(OP_SET_LOCAL_POP):
+        slots[VM_READ_BYTE()] = VM_POP();
+        VM_NEXT();
+    VM_CASE(OP_SET_GLOBAL_POP):
+        VM_CHECK_RESULT(vm_set_global(VM_READ_BYTE(), VM_PEEK(0)));
+        sp--;
+        VM_NEXT();
+    VM_CASE(OP_ADD_IMM): {
+        Value immediate = make_number((int8_t)VM_READ_BYTE());
+        Value a = sp[-1];
+        if (is_number(a)) {
+            sp[-1] = make_number(as_number(a) + as_number(immediate));
+            VM_NEXT();
         }
-        printf("]\n");
+        sp[-1] = op_add(immediate, a);
+        VM_CHECK_ERROR();
+        VM_NEXT();
+    }
+    VM_CASE(OP_INC_LOCAL): {
+        Value* local = &slots[VM_READ_BYTE()];
+        if (is_number(*local)) {
+            *local = make_number(as_number(*local) + 1);
+            VM_NEXT();
+        }
+        VM_PUSH(op_add(make_number(1), *local));
+        VM_CHECK_ERROR();
+        *local = VM_POP();
+        VM_NEXT();
+    }
+    VM_CASE(OP_ADD_LOCAL_CONST): {
+        Value* local = &slots[VM_READ_BYTE()];
+        Value constant = VM_READ_CONSTANT();
+        if (is_number(*local) && is_number(constant)) {
+            *local = make_number(as_number(*local) + as_number(constant));
+            VM_NEXT();
+        }
+        VM_PUSH(op_add(constant, *local));
+        VM_CHECK_ERROR();
+        *local = VM_POP();
+        VM_GC_SAFEPOINT();
+        VM_NEXT();
+    }
+
+    // Compare and branch
+    VM_CASE(OP_JUMP_IF_NOT_LESS):
+        VM_COMPARE_AND_JUMP(<, op_greater(a, b));
+    VM_CASE(OP_JUMP_IF_NOT_LESS_EQUAL):
+        VM_COMPARE_AND_JUMP(<=, op_greater_equal(a, b));
+    VM_CASE(OP_JUMP_IF_NOT_GREATER):
+        VM_COMPARE_AND_JUMP(>, op_greater(b, a));
+    VM_CASE(OP_JUMP_IF_NOT_GREATER_EQUAL):
+        VM_COMPARE_AND_JUMP(>=, op_greater_equal(b, a));
+    VM_CASE(OP_JUMP_IF_NOT_EQUAL): {
+        uint16_t offset = VM_READ_16();
+        sp -= 2;
+        if (!value_equal(sp[0], sp[1])) {
+            ip += offset;
+        }
+        VM_NEXT();
+    }
+    VM_CASE(OP_JUMP_IF_EQUAL): {
+        uint16_t offset = VM_READ_16();
+        sp -= 2;
+        if (value_equal(sp[0], sp[1])) {
+            ip += offset;
+        }
+        VM_NEXT();
+    }
+
+#ifndef ASPIC_COMPUTED_GOTO
+    default:
+        assert(false); // Unreachable
+        return VM_RUNTIME_ERROR;
+#endif
+    }
+
+runtime_error:
+    // Write back the interpreter state for the stack trace
+    frame->ip = ip;
+    vm.stack_top = sp;
+    vm_runtime_error();
+    return VM_RUNTIME_ERROR;
+}
+
+#ifdef ASPIC_COMPUTED_GOTO
+#pragma GCC diagnostic pop
 #endif
 
-        // Check if an error has been pushed in this iteration
-        if (vm.stack_top[-1].type == TYPE_ERROR) {
-            vm_report_error(vm.stack_top - 1);
-            vm_pop();
+VmResult vm_call(int argc)
+{
+    Value callee = vm.stack_top[-(argc + 1)];
+    if (is_cfunc(callee)) {
+        Value result = as_cfunc(callee)(vm.stack_top - argc, argc);
+        // Pop callee + arguments, then push call result
+        vm.stack_top -= (argc + 1);
+        vm_push(result);
+        if (is_error(result)) {
+            vm_runtime_error();
             return VM_RUNTIME_ERROR;
         }
+        if (gc_should_collect()) {
+            gc_collect();
+        }
+        return VM_OK;
     }
-    return VM_RUNTIME_ERROR;
+
+    if (!is_object(callee) || as_object(callee)->type != OBJECT_FUNCTION
+        || argc != ((ObjectFunction*)as_object(callee))->arity) {
+        vm_push(vm_call_error(callee, argc));
+        vm_runtime_error();
+        return VM_RUNTIME_ERROR;
+    }
+
+    ObjectFunction* function = (ObjectFunction*)as_object(callee);
+    if (function->lazy_source != NULL) {
+        Value error = vm_compile_lazy(function);
+        if (is_error(error)) {
+            vm_push(error);
+            vm_runtime_error();
+            return VM_RUNTIME_ERROR;
+        }
+    }
+    vm_warm_up(function);
+    if (!vm_reserve_frame(vm.frame_count + 1, vm.stack_top - (argc + 1), function)) {
+        vm_push(vm_call_error(callee, argc));
+        vm_runtime_error();
+        return VM_RUNTIME_ERROR;
+    }
+    CallFrame* frame = &vm.frames[vm.frame_count++];
+    frame->function = function;
+    frame->ip = function->chunk.code;
+    frame->slots = vm.stack_top - (argc + 1);
+    if (vm_has_native(function)) {
+        VmResult result = vm_run_native(frame);
+        if (result != VM_TAIL_CALL) {
+            return result;
+        }
+        // The stacks may have moved
+        frame = &vm.frames[vm.frame_count - 1];
+    }
+    return vm_run(frame);
+}
+
+ObjectFunction* vm_tail_call(int argc)
+{
+    Value callee = vm.stack_top[-(argc + 1)];
+    if (!is_object(callee) || as_object(callee)->type != OBJECT_FUNCTION) {
+        return NULL;
+    }
+    ObjectFunction* function = (ObjectFunction*)as_object(callee);
+    // Not compiled yet: use a regular call
+    if (argc != function->arity || function->lazy_source != NULL) {
+        return NULL;
+    }
+    vm_warm_up(function);
+    if (!vm_reserve_frame(vm.frame_count, vm.frames[vm.frame_count - 1].slots, function)) {
+        return NULL;
+    }
+    // Move the callee and the arguments at the beginning of the frame
+    CallFrame* frame = &vm.frames[vm.frame_count - 1];
+    memmove(frame->slots, vm.stack_top - (argc + 1), sizeof(Value) * (argc + 1));
+    vm.stack_top = frame->slots + argc + 1;
+    frame->function = function;
+    frame->ip = function->chunk.code;
+    return function;
 }
 
 void vm_init()
 {
+    // Growable stacks: the initial size fits the main function
+    vm.stack = realloc_array(NULL, sizeof(Value), VM_STACK_INITIAL);
+    vm.stack_capacity = VM_STACK_INITIAL;
+    vm.frames = realloc_array(NULL, sizeof(CallFrame), VM_FRAMES_INITIAL);
+    vm.frame_capacity = VM_FRAMES_INITIAL;
     vm_reset_stack();
     vm.objects_head = NULL;
     vm.source = NULL;
+    vm.image = NULL;
+    vm.image_size = 0;
+    vm.stats.quickened = vm.stats.deoptimized = vm.stats.optimized = 0;
+
+    gc_init(&vm.gc);
 
     stringset_init(&vm.string_pool);
 
     // Global variables
-    hashtable_init(&vm.globals);
+    vm.globals = NULL;
+    vm.global_count = vm.global_capacity = 0;
+    hashtable_init(&vm.global_slots);
 
     // Standard functions
     vm_register_fn("assert", aspic_assert);
@@ -415,10 +1157,14 @@ void vm_init()
 
 void vm_free()
 {
-    hashtable_free(&vm.globals);
+    free(vm.stack);
+    free(vm.frames);
+    free(vm.globals);
+    hashtable_free(&vm.global_slots);
     stringset_free(&vm.string_pool);
+    gc_free(&vm.gc);
 
-    // Loop on <objects_head> linked list and free every object
+    // Loop on <objects_head> linked list and free every old object
     Object* object = vm.objects_head;
     while (object != NULL) {
         Object* next = object->next;
@@ -436,7 +1182,12 @@ void vm_register_object(Object* object)
 
 const ObjectString* vm_find_string(const char* buffer, int length, uint32_t hash)
 {
-    return stringset_has_cstr(&vm.string_pool, buffer, length, hash);
+    const ObjectString* string = stringset_has_cstr(&vm.string_pool, buffer, length, hash);
+    if (string != NULL) {
+        // String may be unreachable, and not swept yet
+        gc_keep_alive((Object*)string);
+    }
+    return string;
 }
 
 ObjectString* vm_intern_string(ObjectString* string)
@@ -446,6 +1197,47 @@ ObjectString* vm_intern_string(ObjectString* string)
     return string;
 }
 
+int vm_resolve_global(const ObjectString* name)
+{
+    Value* slot = hashtable_get(&vm.global_slots, name);
+    if (slot != NULL) {
+        return as_number(*slot);
+    }
+
+    // Reserve a new slot: the variable is not defined until declared
+    if (vm.global_capacity < vm.global_count + 1) {
+        vm.global_capacity = vm.global_capacity < 64 ? 64 : vm.global_capacity * 2;
+        vm.globals = realloc_array(vm.globals, sizeof(Global), vm.global_capacity);
+    }
+    Global* global = &vm.globals[vm.global_count];
+    global->name = name;
+    global->value = make_null();
+    global->defined = false;
+    global->read_only = false;
+    hashtable_set(&vm.global_slots, name, make_number(vm.global_count), true);
+    return vm.global_count++;
+}
+
+const ObjectString* vm_global_name(int slot)
+{
+    return vm.globals[slot].name;
+}
+
+void vm_print_stats()
+{
+    printf("== vm::stats ==\n");
+    printf("quickened instructions: %zu\n", vm.stats.quickened);
+    printf("deoptimized instructions: %zu\n", vm.stats.deoptimized);
+    printf("optimized functions: %zu\n", vm.stats.optimized);
+    gc_print_stats();
+#ifdef ASPIC_JIT
+    jit_print_stats();
+#endif
+#ifdef ASPIC_OPCODE_PROFILE
+    profile_print();
+#endif
+}
+
 void vm_debug_strings()
 {
     printf("=== vm::strings ===\n");
@@ -455,20 +1247,45 @@ void vm_debug_strings()
 void vm_debug_globals()
 {
     printf("=== vm::globals ===\n");
-    hashtable_print(&vm.globals);
+    for (int i = 0; i < vm.global_count; ++i) {
+        const Global* global = &vm.globals[i];
+        if (global->defined) {
+            printf("%s %-16s = ", global->read_only ? "RO" : "RW", global->name->chars);
+            value_repr(global->value);
+            printf(" [%s]\n", value_type(global->value));
+        }
+    }
 }
 
 VmResult vm_interpret(const char* source)
+{
+    ObjectFunction* function = vm_compile(source);
+    if (function == NULL) {
+        return VM_COMPILE_ERROR;
+    }
+    return vm_execute(function);
+}
+
+ObjectFunction* vm_compile(const char* source)
 {
     vm_reset_stack();
     vm.source = source;
-
-    // Get top-level main function
     ObjectFunction* function = parser_compile(source);
-    if (function == NULL) {
-        return VM_COMPILE_ERROR;
+#ifdef ASPIC_DEBUG
+    if (function != NULL && !verifier_check(function)) {
+        return NULL;
     }
+#endif
+    return function;
+}
 
+VmResult vm_execute(ObjectFunction* function)
+{
+    if (!vm_reserve_frame(vm.frame_count + 1, vm.stack_top, function)) {
+        vm_push(make_error("Stack overflow"));
+        vm_runtime_error();
+        return VM_RUNTIME_ERROR;
+    }
     vm_push(make_function(function));
 
     CallFrame* frame = &vm.frames[vm.frame_count++];
@@ -478,10 +1295,30 @@ VmResult vm_interpret(const char* source)
     // Set up stack window at the bottom of VM stack
     frame->slots = vm.stack;
 
-    return vm_run(frame);
+    // Objects allocated by the program are young, until promoted
+    vm.gc.nursery_enabled = true;
+    VmResult result = VM_TAIL_CALL;
+    if (vm_has_native(function)) {
+        result = vm_run_native(frame);
+    }
+    // Interpret the function, or the function called by the native code
+    if (result == VM_TAIL_CALL) {
+        result = vm_run(&vm.frames[vm.frame_count - 1]);
+    }
+    vm.gc.nursery_enabled = false;
+    // The next compilation (REPL line) must not find young strings in the
+    // pool: promote the reachable young objects
+    gc_collect_young();
+    return result;
+}
+
+void vm_set_native(ObjectFunction* function, NativeFunction native)
+{
+    // Function pointer to object pointer conversion, not allowed by ISO C
+    memcpy(&function->native_code, &native, sizeof(native));
 }
 
 Value vm_last_value()
 {
-    return *vm.stack_top;
+    return vm.stack_top[-1];
 }
@@ -2,12 +2,31 @@
 #define ASPIC_VM_H
 
 #include "chunk.h"
+#include "gc.h"
 #include "hashtable.h"
 #include "stringset.h"
 #include "value.h"
 
-#define VM_FRAMES_MAX 64
+// Initial and max number of call frames
+#ifndef VM_FRAMES_INITIAL
+#define VM_FRAMES_INITIAL 16
+#endif
+#ifndef VM_FRAMES_MAX
+#define VM_FRAMES_MAX 10000
+#endif
+
+// Initial and max number of values in the stack. Each call reserves the max
+// stack depth of the function (ObjectFunction.max_stack).
+#ifndef VM_STACK_INITIAL
+#define VM_STACK_INITIAL 1024
+#endif
+#ifndef VM_STACK_MAX
 #define VM_STACK_MAX (VM_FRAMES_MAX * UINT8_MAX)
+#endif
+
+#if VM_FRAMES_INITIAL < 1 || VM_STACK_INITIAL < 2
+#error "Initial stacks must fit the main function"
+#endif
 
 /**
  * CallFrame represents an ongoing function call
@@ -15,40 +34,85 @@
 typedef struct {
     // The function being called
     const ObjectFunction* function;
-    // Points into the vm.stack at the first slot the function can use
+    // Points into the vm.stack at the first slot the function can use.
+    // Fixed up when the stack is reallocated.
     Value* slots;
     // Instruction pointer: points to the bytecode array (chunk.code)
     uint8_t* ip;
 } CallFrame;
 
+/**
+ * Global variable, stored in a slot of vm.globals
+ */
+typedef struct {
+    const ObjectString* name;
+    Value value;
+    // Slots are reserved by the parser, before the variable is declared
+    bool defined;
+    bool read_only;
+} Global;
+
 typedef struct {
-    // Main stack
-    Value stack[VM_STACK_MAX];
+    // Instructions rewritten into a specialized form
+    size_t quickened;
+    // Specialized instructions rewritten back into the generic form
+    size_t deoptimized;
+    // Functions recompiled by the optimizer
+    size_t optimized;
+} VmStats;
+
+typedef struct {
+    // Main stack, reallocated when a call needs more room (see
+    // vm_grow_stacks): pointers into it must be reloaded after a call
+    Value* stack;
     Value* stack_top;
+    int stack_capacity;
 
-    // CallFrame stack (ongoing function calls)
-    CallFrame frames[VM_FRAMES_MAX];
+    // CallFrame stack (ongoing function calls), reallocated like the main
+    // stack: CallFrame pointers must be reloaded after a call
+    CallFrame* frames;
     int frame_count;
+    int frame_capacity;
 
     // Linked list of allocated objects
     Object* objects_head;
 
+    // Garbage collector state
+    Gc gc;
+
     // Set of all strings
     StringSet string_pool;
 
-    // Hashtable of global variables
-    Hashtable globals;
+    // Global variables, indexed by the slots resolved by the parser
+    Global* globals;
+    int global_count;
+    int global_capacity;
+    // Map global variable names to their slot index
+    Hashtable global_slots;
 
     // Keep a reference to source code for printing lines in stacktrace
     const char* source;
+
+    // Bytecode image mapped read-only (see image.h), or NULL: its code is
+    // never rewritten by quickening
+    const uint8_t* image;
+    size_t image_size;
+
+    VmStats stats;
 } VM;
 
 typedef enum {
     VM_OK,
     VM_COMPILE_ERROR,
     VM_RUNTIME_ERROR,
+    // Native code replaced its frame with a tail call (see vm_tail_call)
+    VM_TAIL_CALL,
 } VmResult;
 
+// Function compiled into native code (see jit.h and aot.h): run the function
+// of the frame until it returns
+typedef VmResult (*NativeFunction)(CallFrame* frame);
+
 // Ctor
 void vm_init();
 
@@ -62,6 +126,23 @@ void vm_free();
  */
 VmResult vm_interpret(const char* source);
 
+/**
+ * Compile source code into the top-level main function
+ * @return main function, or NULL on syntax error
+ */
+ObjectFunction* vm_compile(const char* source);
+
+/**
+ * Execute a top-level main function returned by vm_compile()
+ * @return status code
+ */
+VmResult vm_execute(ObjectFunction* function);
+
+/**
+ * Attach native code to a function: calls run it instead of the bytecode
+ */
+void vm_set_native(ObjectFunction* function, NativeFunction native);
+
 /**
  * Register a dynamically allocated object, to be tracked by the GC
  */
@@ -78,6 +159,58 @@ const ObjectString* vm_find_string(const char* buffer, int length, uint32_t hash
  */
 ObjectString* vm_intern_string(ObjectString* string);
 
+/**
+ * Get the slot index of a global variable, reserving a new slot on first use
+ */
+int vm_resolve_global(const ObjectString* name);
+
+/**
+ * Get the name of the global variable stored at slot index
+ */
+const ObjectString* vm_global_name(int slot);
+
+/**
+ * Declare a new global variable
+ * @return error, or null if success
+ */
+Value vm_decl_global(int slot, Value value, bool read_only);
+
+/**
+ * Get the value of a global variable
+ * @return value, or error if the variable is not defined
+ */
+Value vm_get_global(int slot);
+
+/**
+ * Update the value of a global variable
+ * @return error, or null if success
+ */
+Value vm_set_global(int slot, Value value);
+
+/**
+ * Call the callee below the <argc> arguments on top of the stack, and run it
+ * until it returns: callee and arguments are replaced with the result.
+ * Used by native code, which calls functions through the C stack. The stacks
+ * may be reallocated: reload the frame (top of vm.frames) and its slots.
+ * @return status code. Runtime errors are already reported.
+ */
+VmResult vm_call(int argc);
+
+/**
+ * Replace the current frame with a call to the callee below the <argc>
+ * arguments on top of the stack. Native code then returns VM_TAIL_CALL, to let
+ * its caller run the frame.
+ * @return called function, or NULL if the callee is not a function accepting
+ * <argc> arguments: use a regular call instead
+ */
+ObjectFunction* vm_tail_call(int argc);
+
+/**
+ * Report the runtime error on top of the stack (with the stack trace of the
+ * call frames), then pop it
+ */
+void vm_runtime_error();
+
 /**
  * Print all interned strings to stdout
  */
@@ -89,7 +222,13 @@ void vm_debug_strings();
 void vm_debug_globals();
 
 /**
- * Get last value pushed to the stack. Useful for REPL.
+ * Print VM and garbage collector statistics to stdout
+ */
+void vm_print_stats();
+
+/**
+ * Get the value returned by the last executed main function (see
+ * parser_set_repl). Useful for REPL.
  */
 Value vm_last_value();
 